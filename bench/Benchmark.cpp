@@ -0,0 +1,814 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+
+
+// Microbenchmarks for the code that runs once per packet or per line.
+//
+// The inputs are generated in a temporary folder when the program starts:
+// MPEG 2 video in program and transport streams and H.264 video in a
+// transport stream, encoded with libavcodec and muxed with libavformat,
+// plus LPCM packets and input files split into many segments.
+//
+// Usage: d2vwitch-bench [--repetitions <number>] [case name ...]
+//
+// Only the cases whose names contain one of the given names are run.
+// The results are printed as tab-separated columns, one line per case,
+// always in the same order. Lines starting with '#' are comments.
+
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <QDir>
+#include <QTemporaryDir>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+}
+
+#include "../src/Audio.h"
+#include "../src/Bullshit.h"
+#include "../src/D2V.h"
+#include "../src/FakeFile.h"
+#include "../src/FFMPEG.h"
+#include "../src/LPCM.h"
+#include "../src/MPEGParser.h"
+
+#include "Corpus.h"
+
+
+#define DEFAULT_REPETITIONS 5
+
+#define VIDEO_FRAMES 250
+
+#define SEGMENT_COUNT 64
+#define SEGMENT_SIZE (256 * 1024)
+#define SEGMENT_READ_SIZE (128 * 2048)
+#define RANDOM_SEEKS 100000
+
+#define DATA_LINES 100000
+#define PICTURES_PER_LINE 12
+
+#define LPCM_PACKETS 4000
+
+
+// Calls the private parts of D2V. It's a friend.
+class D2VBenchmark {
+public:
+    static bool handleVideoPacket(D2V &d2v, AVPacket *packet) {
+        return d2v.handleVideoPacket(packet);
+    }
+
+    static bool handleAudioPacket(D2V &d2v, AVPacket *packet, std::string &error) {
+        return d2v.handleAudioPacket(packet, error);
+    }
+
+    static bool printDataLines(D2V &d2v, int count) {
+        D2V::DataLine line;
+        line.info = D2V::INFO_BIT11 | D2V::INFO_STARTS_NEW_GOP;
+        line.matrix = AVCOL_SPC_BT470BG;
+        line.position = 123456789;
+
+        for (int i = 0; i < PICTURES_PER_LINE; i++) {
+            D2V::Picture picture = { 0, AV_PICTURE_STRUCTURE_FRAME, (uint8_t)(i ? D2V::FLAGS_B_PICTURE : D2V::FLAGS_I_PICTURE | D2V::FLAGS_DECODABLE_WITHOUT_PREVIOUS_GOP) };
+            line.pictures.push_back(picture);
+        }
+
+        for (int i = 0; i < count; i++) {
+            line.position += 150000;
+
+            if (!d2v.printDataLine(line))
+                return false;
+        }
+
+        return true;
+    }
+};
+
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+
+struct Result {
+    std::string name;
+
+    // Per repetition.
+    int64_t bytes;
+    int64_t items;
+
+    std::vector<double> seconds;
+};
+
+
+struct Options {
+    int repetitions;
+    std::vector<std::string> filters;
+
+    Options()
+        : repetitions(DEFAULT_REPETITIONS)
+        , filters{ }
+    { }
+
+    bool wants(const std::string &name) const {
+        if (!filters.size())
+            return true;
+
+        for (size_t i = 0; i < filters.size(); i++)
+            if (name.find(filters[i]) != std::string::npos)
+                return true;
+
+        return false;
+    }
+};
+
+
+void printSkipped(const std::string &name, const std::string &reason) {
+    printf("# skipped %s: %s\n", name.c_str(), reason.c_str());
+    fflush(stdout);
+}
+
+
+void printResult(Result &result) {
+    std::sort(result.seconds.begin(), result.seconds.end());
+
+    double best = result.seconds.front();
+    double median = result.seconds[result.seconds.size() / 2];
+
+    printf("%s\t%" PRId64 "\t%" PRId64 "\t%.3f\t%.3f\t%.1f\t%.0f\n",
+           result.name.c_str(),
+           result.bytes,
+           result.items,
+           best * 1000,
+           median * 1000,
+           result.bytes / best / 1000000,
+           result.items / best);
+    fflush(stdout);
+}
+
+
+// run does one repetition and returns false if it failed, with a message in error.
+// prepare, if not null, is called before every repetition, without timing it.
+bool runCase(const Options &options, const std::string &name, int64_t bytes, int64_t items, std::function<bool (std::string &)> prepare, std::function<bool (std::string &)> run) {
+    if (!options.wants(name))
+        return true;
+
+    Result result = { name, bytes, items, { } };
+
+    for (int i = 0; i < options.repetitions; i++) {
+        std::string error;
+
+        if (prepare && !prepare(error)) {
+            printSkipped(name, error);
+            return false;
+        }
+
+        Clock::time_point start = Clock::now();
+
+        bool okay = run(error);
+
+        Clock::time_point end = Clock::now();
+
+        if (!okay) {
+            printSkipped(name, error);
+            return false;
+        }
+
+        result.seconds.push_back(std::chrono::duration<double>(end - start).count());
+    }
+
+    printResult(result);
+
+    return true;
+}
+
+
+// The video packets of path, as av_read_frame returns them.
+struct VideoInput {
+    FakeFile fake_file;
+    FFMPEG f;
+    AVStream *video_stream;
+    std::vector<AVPacket *> packets;
+    int64_t bytes;
+
+    VideoInput()
+        : fake_file{ }
+        , f{ }
+        , video_stream(nullptr)
+        , packets{ }
+        , bytes(0)
+    { }
+
+    ~VideoInput() {
+        for (size_t i = 0; i < packets.size(); i++)
+            av_packet_free(&packets[i]);
+
+        f.cleanup();
+        fake_file.close();
+    }
+
+    bool read(const std::string &path, std::string &error) {
+        fake_file.push_back(path);
+
+        if (!fake_file.open()) {
+            error = fake_file.getError();
+            return false;
+        }
+
+        if (!f.initFormat(fake_file)) {
+            error = f.getError();
+            return false;
+        }
+
+        video_stream = f.selectFirstVideoStream();
+        if (!video_stream) {
+            error = "no video track in '" + path + "'";
+            return false;
+        }
+
+        AVPacket packet;
+        av_init_packet(&packet);
+
+        while (av_read_frame(f.fctx, &packet) == 0) {
+            if (packet.stream_index == video_stream->index) {
+                AVPacket *copy = av_packet_clone(&packet);
+                if (!copy) {
+                    av_packet_unref(&packet);
+                    error = "out of memory";
+                    return false;
+                }
+
+                packets.push_back(copy);
+                bytes += packet.size;
+            }
+
+            av_packet_unref(&packet);
+        }
+
+        if (!packets.size()) {
+            error = "no video packets in '" + path + "'";
+            return false;
+        }
+
+        return true;
+    }
+};
+
+
+void benchmarkMPEG12Parser(const Options &options, const std::string &name, const std::string &path) {
+    if (!options.wants(name))
+        return;
+
+    VideoInput input;
+    std::string error;
+
+    if (!input.read(path, error)) {
+        printSkipped(name, error);
+        return;
+    }
+
+    runCase(options, name, input.bytes, input.packets.size(),
+            [&input] (std::string &prepare_error) {
+                if (!input.f.initVideoCodec(input.video_stream->index)) {
+                    prepare_error = input.f.getError();
+                    return false;
+                }
+                return true;
+            },
+            [&input] (std::string &) {
+                for (size_t i = 0; i < input.packets.size(); i++)
+                    d2vWitchParseMPEG12Data(input.f.parser, input.f.avctx, input.packets[i]->data, input.packets[i]->size);
+                return true;
+            });
+}
+
+
+void benchmarkVideoPackets(const Options &options, const std::string &name, const std::string &path) {
+    if (!options.wants(name))
+        return;
+
+    VideoInput input;
+    std::string error;
+
+    if (!input.read(path, error)) {
+        printSkipped(name, error);
+        return;
+    }
+
+    // A new one for every repetition, so the lines don't pile up.
+    std::unique_ptr<D2V> d2v;
+
+    runCase(options, name, input.bytes, input.packets.size(),
+            [&input, &d2v] (std::string &prepare_error) {
+                // Also resets the parser.
+                if (!input.f.initVideoCodec(input.video_stream->index)) {
+                    prepare_error = input.f.getError();
+                    return false;
+                }
+
+                d2v.reset(new D2V("bench.d2v", nullptr, AudioFilesMap(), &input.fake_file, &input.f, input.video_stream, 0, D2V::ColourRangeLimited, false, nullptr, nullptr, nullptr, nullptr));
+                return true;
+            },
+            [&input, &d2v] (std::string &run_error) {
+                for (size_t i = 0; i < input.packets.size(); i++) {
+                    // handleVideoPacket moves data and size along.
+                    AVPacket packet = *input.packets[i];
+
+                    if (!D2VBenchmark::handleVideoPacket(*d2v, &packet)) {
+                        run_error = d2v->getError();
+                        return false;
+                    }
+                }
+                return true;
+            });
+}
+
+
+bool writeSegments(const std::vector<std::string> &paths, std::string &error) {
+    Noise noise;
+    std::vector<uint8_t> data(SEGMENT_SIZE);
+
+    for (size_t i = 0; i < paths.size(); i++) {
+        for (size_t j = 0; j < data.size(); j++)
+            data[j] = (uint8_t)noise.next();
+
+        FILE *file = openFile(paths[i].c_str(), "wb");
+        if (!file) {
+            error = "can't create '" + paths[i] + "': " + strerror(errno);
+            return false;
+        }
+
+        bool okay = fwrite(data.data(), 1, data.size(), file) == data.size();
+
+        if (fclose(file) || !okay) {
+            error = "can't write '" + paths[i] + "'";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void benchmarkFakeFile(const Options &options, const std::vector<std::string> &segments) {
+    FakeFile fake_file;
+    for (size_t i = 0; i < segments.size(); i++)
+        fake_file.push_back(segments[i]);
+
+    if (!fake_file.open()) {
+        printSkipped("fakefile", fake_file.getError());
+        return;
+    }
+
+    int64_t total_size = fake_file.getTotalSize();
+
+    std::vector<uint8_t> buffer(SEGMENT_READ_SIZE);
+
+    runCase(options, "fakefile-read/" + std::to_string(segments.size()) + "-segments", total_size, (total_size + SEGMENT_READ_SIZE - 1) / SEGMENT_READ_SIZE,
+            nullptr,
+            [&fake_file, &buffer, total_size] (std::string &error) {
+                FakeFile::seek(&fake_file, 0, SEEK_SET);
+
+                int64_t bytes_read = 0;
+                int ret;
+                while ((ret = FakeFile::readPacket(&fake_file, buffer.data(), buffer.size())) > 0)
+                    bytes_read += ret;
+
+                if (bytes_read != total_size) {
+                    error = "read " + std::to_string(bytes_read) + " bytes instead of " + std::to_string(total_size);
+                    return false;
+                }
+                return true;
+            });
+
+    // Like libavformat when it probes and resyncs: a seek, then a small read.
+    std::vector<int64_t> positions(RANDOM_SEEKS);
+    Noise noise;
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] = ((int64_t)noise.next() << 8 | (noise.next() & 255)) % (total_size - 188);
+
+    runCase(options, "fakefile-seek/" + std::to_string(segments.size()) + "-segments", (int64_t)positions.size() * 188, positions.size(),
+            nullptr,
+            [&fake_file, &buffer, &positions] (std::string &error) {
+                for (size_t i = 0; i < positions.size(); i++) {
+                    if (FakeFile::seek(&fake_file, positions[i], SEEK_SET) != positions[i] ||
+                        FakeFile::readPacket(&fake_file, buffer.data(), 188) != 188) {
+                        error = "seeking to " + std::to_string(positions[i]) + " failed";
+                        return false;
+                    }
+                }
+                return true;
+            });
+
+    fake_file.close();
+}
+
+
+void benchmarkDataLines(const Options &options, const std::string &path) {
+    std::string name = "printDataLine/" + std::to_string(PICTURES_PER_LINE) + "-pictures";
+
+    FILE *d2v_file = nullptr;
+    std::unique_ptr<D2V> d2v;
+
+    // The size of what one repetition writes.
+    int64_t bytes = 0;
+
+    auto prepare = [&path, &d2v_file, &d2v] (std::string &error) {
+        if (d2v_file)
+            fclose(d2v_file);
+
+        d2v_file = openFile(path.c_str(), "wb");
+        if (!d2v_file) {
+            error = "can't create '" + path + "': " + strerror(errno);
+            return false;
+        }
+
+        d2v.reset(new D2V(path, d2v_file, AudioFilesMap(), nullptr, nullptr, nullptr, 0, D2V::ColourRangeLimited, false, nullptr, nullptr, nullptr, nullptr));
+        return true;
+    };
+
+    auto run = [&d2v, &d2v_file] (std::string &error) {
+        if (!D2VBenchmark::printDataLines(*d2v, DATA_LINES)) {
+            error = d2v->getError();
+            return false;
+        }
+
+        // Part of the work, with a real d2v file.
+        if (fflush(d2v_file)) {
+            error = "fflush() failed";
+            return false;
+        }
+        return true;
+    };
+
+    if (!options.wants(name))
+        return;
+
+    // Once, to find out the size.
+    std::string error;
+    if (!prepare(error) || !run(error)) {
+        if (d2v_file)
+            fclose(d2v_file);
+        printSkipped(name, error);
+        return;
+    }
+    bytes = ftello(d2v_file);
+
+    runCase(options, name, bytes, DATA_LINES, prepare, run);
+
+    if (d2v_file)
+        fclose(d2v_file);
+}
+
+
+struct LPCMFormat {
+    const char *name;
+    int channels;
+    int bits;
+    int sample_rate;
+};
+
+
+// Packets like the ones in DVDs: the three byte LPCM header, then as many
+// whole blocks of samples as fit in about 2000 bytes.
+std::vector<std::vector<uint8_t>> makeLPCMPackets(const LPCMFormat &format) {
+    int rate_code = 0;
+    if (format.sample_rate == 96000)
+        rate_code = 1;
+
+    // Same block sizes as pcm_dvd_decode_frame, which are whole groups
+    // of samples for the 20 and 24 bit samples.
+    int block_size = format.channels * 2;
+    if (format.bits != 16) {
+        if (format.channels == 1 || format.channels == 2 || format.channels == 4)
+            block_size = 4 * format.bits / 8;
+        else if (format.channels == 8)
+            block_size = 8 * format.bits / 8;
+        else
+            block_size = 4 * format.channels * format.bits / 8;
+    }
+
+    int payload_size = 2000 / block_size * block_size;
+
+    std::vector<std::vector<uint8_t>> packets(LPCM_PACKETS);
+    Noise noise;
+
+    for (size_t i = 0; i < packets.size(); i++) {
+        std::vector<uint8_t> &packet = packets[i];
+        packet.resize(3 + payload_size + AV_INPUT_BUFFER_PADDING_SIZE);
+
+        packet[0] = (uint8_t)(i & 0x1f);
+        packet[1] = (uint8_t)(((format.bits - 16) / 4) << 6 | rate_code << 4 | (format.channels - 1));
+        packet[2] = 0x80;
+
+        for (int j = 0; j < payload_size; j++)
+            packet[3 + j] = (uint8_t)noise.next();
+
+        packet.resize(3 + payload_size);
+    }
+
+    return packets;
+}
+
+
+void setLPCMParameters(AVCodecParameters *par, const LPCMFormat &format) {
+    par->codec_type = AVMEDIA_TYPE_AUDIO;
+    par->codec_id = AV_CODEC_ID_PCM_DVD;
+    par->format = format.bits == 16 ? AV_SAMPLE_FMT_S16 : AV_SAMPLE_FMT_S32;
+    par->channels = format.channels;
+    par->channel_layout = av_get_default_channel_layout(format.channels);
+    par->sample_rate = format.sample_rate;
+    par->bits_per_coded_sample = format.bits;
+    par->bits_per_raw_sample = format.bits;
+}
+
+
+void benchmarkLPCM(const Options &options, const LPCMFormat &format, const std::string &w64_path) {
+    std::vector<std::vector<uint8_t>> packets = makeLPCMPackets(format);
+
+    int64_t bytes = 0;
+    for (size_t i = 0; i < packets.size(); i++)
+        bytes += packets[i].size();
+
+    std::string suffix = std::string("/pcm-dvd-") + format.name;
+
+    LPCMUnpacker unpacker;
+    std::vector<uint8_t> samples;
+
+    runCase(options, "lpcm-unpack" + suffix, bytes, packets.size(),
+            [&unpacker] (std::string &) {
+                unpacker = LPCMUnpacker(AV_CODEC_ID_PCM_DVD);
+                return true;
+            },
+            [&unpacker, &samples, &packets] (std::string &error) {
+                for (size_t i = 0; i < packets.size(); i++) {
+                    if (!unpacker.unpack(packets[i].data(), packets[i].size(), samples)) {
+                        error = "the unpacker rejected packet " + std::to_string(i);
+                        return false;
+                    }
+                }
+                return true;
+            });
+
+
+    // What the unpacker replaced, for comparison.
+    std::string name = "lpcm-lavc" + suffix;
+
+    if (options.wants(name)) {
+        FFMPEG f;
+        f.fctx = avformat_alloc_context();
+
+        AVStream *stream = f.fctx ? avformat_new_stream(f.fctx, nullptr) : nullptr;
+        if (stream) {
+            setLPCMParameters(stream->codecpar, format);
+
+            if (f.initAudioCodec(stream->index)) {
+                AVCodecContext *codec = f.audio_ctx.at(stream->index);
+                AVFrame *frame = av_frame_alloc();
+
+                runCase(options, name, bytes, packets.size(),
+                        nullptr,
+                        [codec, frame, &packets] (std::string &error) {
+                            AVPacket packet;
+
+                            for (size_t i = 0; i < packets.size(); i++) {
+                                av_init_packet(&packet);
+                                packet.data = packets[i].data();
+                                packet.size = packets[i].size();
+
+                                if (avcodec_send_packet(codec, &packet) < 0) {
+                                    error = "avcodec_send_packet() failed";
+                                    return false;
+                                }
+
+                                while (avcodec_receive_frame(codec, frame) >= 0)
+                                    av_frame_unref(frame);
+                            }
+                            return true;
+                        });
+
+                av_frame_free(&frame);
+            } else {
+                printSkipped(name, f.getError());
+            }
+        } else {
+            printSkipped(name, "out of memory");
+        }
+
+        f.cleanup();
+    }
+
+
+    // The whole path through D2V, including the checks against libavcodec
+    // at the start of every stream and the writing of the Wave64 file.
+    name = "handleAudioPacket" + suffix;
+
+    if (options.wants(name)) {
+        FFMPEG f;
+        f.fctx = avformat_alloc_context();
+
+        AVStream *stream = f.fctx ? avformat_new_stream(f.fctx, nullptr) : nullptr;
+        if (!stream) {
+            printSkipped(name, "out of memory");
+            f.cleanup();
+            return;
+        }
+
+        setLPCMParameters(stream->codecpar, format);
+        stream->time_base = { 1, 90000 };
+
+        if (!f.initAudioCodec(stream->index)) {
+            printSkipped(name, f.getError());
+            f.cleanup();
+            return;
+        }
+
+        AudioFilesMap audio_files;
+        std::unique_ptr<D2V> d2v;
+
+        runCase(options, name, bytes, packets.size(),
+                [&f, &audio_files, &d2v, stream, &w64_path] (std::string &error) {
+                    closeAudioFiles(audio_files, f.fctx);
+                    audio_files.clear();
+
+                    AVFormatContext *w64_ctx = openWave64(w64_path, stream->codecpar, error);
+                    if (!w64_ctx)
+                        return false;
+
+                    audio_files.insert({ stream->index, w64_ctx });
+
+                    d2v.reset(new D2V("bench.d2v", nullptr, audio_files, nullptr, &f, nullptr, 0, D2V::ColourRangeLimited, false, nullptr, nullptr, nullptr, nullptr));
+                    return true;
+                },
+                [&d2v, &packets, stream] (std::string &error) {
+                    AVPacket packet;
+
+                    for (size_t i = 0; i < packets.size(); i++) {
+                        av_init_packet(&packet);
+                        packet.data = packets[i].data();
+                        packet.size = packets[i].size();
+                        packet.stream_index = stream->index;
+                        packet.pos = (int64_t)i * 2048;
+
+                        if (!D2VBenchmark::handleAudioPacket(*d2v, &packet, error))
+                            return false;
+                    }
+                    return true;
+                });
+
+        closeAudioFiles(audio_files, f.fctx);
+
+        f.cleanup();
+    }
+}
+
+
+std::string temporaryFile(const QTemporaryDir &folder, const std::string &name) {
+    return folder.path().toStdString() + "/" + name;
+}
+
+
+bool parseArguments(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if (arg == "--repetitions") {
+            if (i == argc - 1) {
+                fprintf(stderr, "--repetitions requires a number.\n");
+                return false;
+            }
+
+            options.repetitions = atoi(argv[i + 1]);
+            i++;
+
+            if (options.repetitions < 1) {
+                fprintf(stderr, "The number of repetitions must be a positive integer, not '%s'.\n", argv[i]);
+                return false;
+            }
+        } else if (arg == "--help") {
+            printf("Usage: %s [--repetitions <number>] [case name ...]\n", argv[0]);
+            return false;
+        } else {
+            options.filters.push_back(arg);
+        }
+    }
+
+    return true;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseArguments(argc, argv, options))
+        return 1;
+
+    av_log_set_level(AV_LOG_PANIC);
+
+    QTemporaryDir folder(QDir::tempPath() + "/d2vwitch-bench-XXXXXX");
+    if (!folder.isValid()) {
+        fprintf(stderr, "Failed to create a temporary folder.\n");
+        return 1;
+    }
+
+    std::string error;
+
+    printf("# d2vwitch-bench %s, libavcodec %u.%u.%u, libavformat %u.%u.%u, %d repetitions\n",
+           PACKAGE_VERSION,
+           avcodec_version() >> 16, avcodec_version() >> 8 & 0xff, avcodec_version() & 0xff,
+           avformat_version() >> 16, avformat_version() >> 8 & 0xff, avformat_version() & 0xff,
+           options.repetitions);
+    printf("case\tbytes\titems\tbest_ms\tmedian_ms\tbest_mb_per_s\tbest_items_per_s\n");
+    fflush(stdout);
+
+
+    struct {
+        const char *name;
+        const char *format;
+        AVCodecID codec;
+        bool mpeg12;
+    } videos[] = {
+        { "mpeg2-ps", "vob", AV_CODEC_ID_MPEG2VIDEO, true },
+        { "mpeg2-ts", "mpegts", AV_CODEC_ID_MPEG2VIDEO, true },
+        { "h264-ts", "mpegts", AV_CODEC_ID_H264, false },
+    };
+
+    for (size_t i = 0; i < sizeof(videos) / sizeof(videos[0]); i++) {
+        std::string parse_name = std::string("parseMPEG12/") + videos[i].name;
+        std::string handle_name = std::string("handleVideoPacket/") + videos[i].name;
+
+        if (!options.wants(handle_name) && !(videos[i].mpeg12 && options.wants(parse_name)))
+            continue;
+
+        std::string path = temporaryFile(folder, std::string(videos[i].name) + (videos[i].format == std::string("vob") ? ".mpg" : ".ts"));
+
+        if (!generateCorpusFile(path, videos[i].format, videos[i].codec, std::vector<AVCodecID>(), VIDEO_FRAMES, error)) {
+            printSkipped(handle_name, error);
+            continue;
+        }
+
+        if (videos[i].mpeg12)
+            benchmarkMPEG12Parser(options, parse_name, path);
+
+        benchmarkVideoPackets(options, handle_name, path);
+    }
+
+
+    if (options.wants("fakefile")) {
+        std::vector<std::string> segments;
+        for (int i = 0; i < SEGMENT_COUNT; i++)
+            segments.push_back(temporaryFile(folder, "segment" + std::to_string(i) + ".bin"));
+
+        if (writeSegments(segments, error))
+            benchmarkFakeFile(options, segments);
+        else
+            printSkipped("fakefile", error);
+    }
+
+
+    benchmarkDataLines(options, temporaryFile(folder, "lines.d2v"));
+
+
+    LPCMFormat lpcm_formats[] = {
+        { "2ch-16bit-48khz", 2, 16, 48000 },
+        { "8ch-24bit-96khz", 8, 24, 96000 },
+    };
+
+    for (size_t i = 0; i < sizeof(lpcm_formats) / sizeof(lpcm_formats[0]); i++)
+        benchmarkLPCM(options, lpcm_formats[i], temporaryFile(folder, std::string("lpcm-") + lpcm_formats[i].name + ".w64"));
+
+    return 0;
+}
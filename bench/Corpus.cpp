@@ -0,0 +1,362 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+
+
+#include <cmath>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/opt.h>
+}
+
+#include "Corpus.h"
+
+
+std::string avError(int ret) {
+    char text[AV_ERROR_MAX_STRING_SIZE] = { 0 };
+    av_strerror(ret, text, AV_ERROR_MAX_STRING_SIZE);
+    return text;
+}
+
+
+namespace {
+
+struct OutputStream {
+    AVCodecContext *encoder;
+    AVStream *stream;
+    AVFrame *frame;
+
+    // In encoder->time_base.
+    int64_t next_pts;
+    int64_t end_pts;
+};
+
+
+void freeOutputStreams(std::vector<OutputStream> &outputs) {
+    for (size_t i = 0; i < outputs.size(); i++) {
+        avcodec_free_context(&outputs[i].encoder);
+        av_frame_free(&outputs[i].frame);
+    }
+
+    outputs.clear();
+}
+
+
+// Gradients that move, with some noise, so the encoders have to work a
+// little and the packets are not tiny.
+void drawFrame(AVFrame *frame, int number, Noise &noise) {
+    for (int y = 0; y < frame->height; y++) {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+
+        for (int x = 0; x < frame->width; x++)
+            row[x] = (uint8_t)(x + y * 2 + number * 3 + (noise.next() & 15));
+    }
+
+    for (int plane = 1; plane < 3; plane++) {
+        for (int y = 0; y < frame->height / 2; y++) {
+            uint8_t *row = frame->data[plane] + y * frame->linesize[plane];
+
+            for (int x = 0; x < frame->width / 2; x++)
+                row[x] = (uint8_t)(128 + ((x * plane + y + number) & 63) - 32);
+        }
+    }
+}
+
+
+bool isSupportedSampleFormat(AVSampleFormat format) {
+    return format == AV_SAMPLE_FMT_S16 ||
+           format == AV_SAMPLE_FMT_S16P ||
+           format == AV_SAMPLE_FMT_S32 ||
+           format == AV_SAMPLE_FMT_S32P ||
+           format == AV_SAMPLE_FMT_FLT ||
+           format == AV_SAMPLE_FMT_FLTP;
+}
+
+
+// A different tone in each track and channel.
+void fillAudioFrame(AVFrame *frame, int64_t first_sample, int track) {
+    AVSampleFormat format = (AVSampleFormat)frame->format;
+    bool planar = av_sample_fmt_is_planar(format);
+    int channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+
+    const double pi = 3.14159265358979323846;
+
+    for (int i = 0; i < frame->nb_samples; i++) {
+        for (int c = 0; c < channels; c++) {
+            double frequency = 220.0 * (track + 1) + 110.0 * c;
+            double value = 0.5 * sin(2 * pi * frequency * (first_sample + i) / CORPUS_SAMPLE_RATE);
+
+            int plane = planar ? c : 0;
+            int index = planar ? i : i * channels + c;
+
+            if (format == AV_SAMPLE_FMT_S16 || format == AV_SAMPLE_FMT_S16P)
+                ((int16_t *)frame->data[plane])[index] = (int16_t)(value * INT16_MAX);
+            else if (format == AV_SAMPLE_FMT_S32 || format == AV_SAMPLE_FMT_S32P)
+                ((int32_t *)frame->data[plane])[index] = (int32_t)(value * INT32_MAX);
+            else
+                ((float *)frame->data[plane])[index] = (float)value;
+        }
+    }
+}
+
+
+bool openEncoder(AVFormatContext *mux_ctx, AVCodecID codec_id, int frames, OutputStream &output, std::string &error) {
+    output = { nullptr, nullptr, nullptr, 0, 0 };
+
+    const AVCodec *codec = avcodec_find_encoder(codec_id);
+    if (!codec) {
+        error = std::string("no encoder for ") + avcodec_get_name(codec_id);
+        return false;
+    }
+
+    output.encoder = avcodec_alloc_context3(codec);
+    output.frame = av_frame_alloc();
+    if (!output.encoder || !output.frame) {
+        error = "out of memory";
+        return false;
+    }
+
+    AVCodecContext *encoder = output.encoder;
+
+    if (codec->type == AVMEDIA_TYPE_VIDEO) {
+        encoder->width = CORPUS_WIDTH;
+        encoder->height = CORPUS_HEIGHT;
+        encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+        encoder->time_base = { 1, CORPUS_FRAME_RATE };
+        encoder->framerate = { CORPUS_FRAME_RATE, 1 };
+        encoder->gop_size = 12;
+        encoder->max_b_frames = 2;
+        encoder->bit_rate = 6000000;
+
+        if (codec_id == AV_CODEC_ID_H264)
+            av_opt_set(encoder->priv_data, "preset", "veryfast", 0);
+
+        output.end_pts = frames;
+    } else {
+        encoder->sample_fmt = AV_SAMPLE_FMT_NONE;
+        for (const AVSampleFormat *format = codec->sample_fmts; format && *format != AV_SAMPLE_FMT_NONE; format++) {
+            if (isSupportedSampleFormat(*format)) {
+                encoder->sample_fmt = *format;
+                break;
+            }
+        }
+
+        if (encoder->sample_fmt == AV_SAMPLE_FMT_NONE) {
+            error = std::string("no usable sample format for ") + codec->name;
+            return false;
+        }
+
+        encoder->sample_rate = CORPUS_SAMPLE_RATE;
+        encoder->channel_layout = AV_CH_LAYOUT_STEREO;
+        encoder->channels = 2;
+        encoder->time_base = { 1, CORPUS_SAMPLE_RATE };
+        encoder->bit_rate = 192000;
+
+        output.end_pts = (int64_t)frames * CORPUS_SAMPLE_RATE / CORPUS_FRAME_RATE;
+    }
+
+    if (mux_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+        encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    int ret = avcodec_open2(encoder, codec, nullptr);
+    if (ret < 0) {
+        error = std::string("can't open the encoder ") + codec->name + ": " + avError(ret);
+        return false;
+    }
+
+    output.stream = avformat_new_stream(mux_ctx, nullptr);
+    if (!output.stream || avcodec_parameters_from_context(output.stream->codecpar, encoder) < 0) {
+        error = "can't add a stream to the muxer";
+        return false;
+    }
+    output.stream->time_base = encoder->time_base;
+
+    AVFrame *frame = output.frame;
+
+    if (codec->type == AVMEDIA_TYPE_VIDEO) {
+        frame->width = encoder->width;
+        frame->height = encoder->height;
+        frame->format = encoder->pix_fmt;
+    } else {
+        frame->format = encoder->sample_fmt;
+        frame->channel_layout = encoder->channel_layout;
+        frame->sample_rate = encoder->sample_rate;
+        frame->nb_samples = encoder->frame_size > 0 ? encoder->frame_size : 1152;
+    }
+
+    ret = av_frame_get_buffer(frame, 32);
+    if (ret < 0) {
+        error = "can't allocate a frame: " + avError(ret);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool writePackets(AVFormatContext *mux_ctx, OutputStream &output, AVPacket *packet, std::string &error) {
+    int ret;
+
+    while ((ret = avcodec_receive_packet(output.encoder, packet)) >= 0) {
+        av_packet_rescale_ts(packet, output.encoder->time_base, output.stream->time_base);
+        packet->stream_index = output.stream->index;
+
+        ret = av_interleaved_write_frame(mux_ctx, packet);
+        av_packet_unref(packet);
+
+        if (ret < 0) {
+            error = "av_interleaved_write_frame() failed: " + avError(ret);
+            return false;
+        }
+    }
+
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        error = std::string("can't encode with ") + output.encoder->codec->name + ": " + avError(ret);
+        return false;
+    }
+
+    return true;
+}
+
+
+// The output whose next frame comes first, or -1 if all of them are done.
+int nextOutput(const std::vector<OutputStream> &outputs) {
+    int next = -1;
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+        const OutputStream &output = outputs[i];
+
+        if (output.next_pts >= output.end_pts)
+            continue;
+
+        if (next == -1 ||
+            av_compare_ts(output.next_pts, output.encoder->time_base, outputs[next].next_pts, outputs[next].encoder->time_base) < 0)
+            next = i;
+    }
+
+    return next;
+}
+
+} // namespace
+
+
+bool generateCorpusFile(const std::string &path, const char *format_name, AVCodecID video_codec, const std::vector<AVCodecID> &audio_codecs, int frames, std::string &error) {
+    AVFormatContext *mux_ctx = nullptr;
+
+    int ret = avformat_alloc_output_context2(&mux_ctx, nullptr, format_name, path.c_str());
+    if (ret < 0) {
+        error = std::string("can't create the ") + format_name + " muxer: " + avError(ret);
+        return false;
+    }
+
+    std::vector<OutputStream> outputs(1 + audio_codecs.size());
+
+    for (size_t i = 0; i < outputs.size(); i++) {
+        if (!openEncoder(mux_ctx, i ? audio_codecs[i - 1] : video_codec, frames, outputs[i], error)) {
+            freeOutputStreams(outputs);
+            avformat_free_context(mux_ctx);
+            return false;
+        }
+    }
+
+    ret = avio_open(&mux_ctx->pb, path.c_str(), AVIO_FLAG_WRITE);
+    if (ret >= 0)
+        ret = avformat_write_header(mux_ctx, nullptr);
+    if (ret < 0) {
+        error = "can't write '" + path + "': " + avError(ret);
+
+        avio_closep(&mux_ctx->pb);
+        freeOutputStreams(outputs);
+        avformat_free_context(mux_ctx);
+        return false;
+    }
+
+    AVPacket *packet = av_packet_alloc();
+
+    bool okay = packet;
+    if (!okay)
+        error = "out of memory";
+
+    Noise noise;
+
+    int next;
+    while (okay && (next = nextOutput(outputs)) >= 0) {
+        OutputStream &output = outputs[next];
+
+        ret = av_frame_make_writable(output.frame);
+        if (ret < 0) {
+            error = "can't write to a frame: " + avError(ret);
+            okay = false;
+            break;
+        }
+
+        if (next == 0) {
+            drawFrame(output.frame, (int)output.next_pts, noise);
+        } else {
+            // The last frame may go a little past the end. Not every
+            // encoder takes a shorter one.
+            fillAudioFrame(output.frame, output.next_pts, next - 1);
+        }
+
+        output.frame->pts = output.next_pts;
+        output.next_pts += next == 0 ? 1 : output.frame->nb_samples;
+
+        ret = avcodec_send_frame(output.encoder, output.frame);
+        if (ret < 0) {
+            error = std::string("can't encode with ") + output.encoder->codec->name + ": " + avError(ret);
+            okay = false;
+            break;
+        }
+
+        okay = writePackets(mux_ctx, output, packet, error);
+    }
+
+    // Drain the encoders.
+    for (size_t i = 0; okay && i < outputs.size(); i++) {
+        ret = avcodec_send_frame(outputs[i].encoder, nullptr);
+        if (ret < 0) {
+            error = std::string("can't encode with ") + outputs[i].encoder->codec->name + ": " + avError(ret);
+            okay = false;
+            break;
+        }
+
+        okay = writePackets(mux_ctx, outputs[i], packet, error);
+    }
+
+    if (okay) {
+        ret = av_write_trailer(mux_ctx);
+        if (ret < 0) {
+            error = "can't finish '" + path + "': " + avError(ret);
+            okay = false;
+        }
+    }
+
+    av_packet_free(&packet);
+    avio_closep(&mux_ctx->pb);
+    freeOutputStreams(outputs);
+    avformat_free_context(mux_ctx);
+
+    return okay;
+}
@@ -0,0 +1,71 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+
+
+#ifndef D2V_WITCH_CORPUS_H
+#define D2V_WITCH_CORPUS_H
+
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+
+// Synthetic inputs for the benchmarks, encoded with libavcodec and muxed
+// with libavformat. The same libraries always produce the same bytes.
+
+
+#define CORPUS_WIDTH 720
+#define CORPUS_HEIGHT 576
+#define CORPUS_FRAME_RATE 25
+#define CORPUS_SAMPLE_RATE 48000
+
+
+// Not random at all, so that every run gets the same inputs.
+struct Noise {
+    uint32_t state;
+
+    Noise()
+        : state(12345)
+    { }
+
+    uint32_t next() {
+        state = state * 1664525 + 1013904223;
+        return state >> 8;
+    }
+};
+
+
+// Encodes frames synthetic frames with video_codec, and as much stereo
+// audio with each of audio_codecs, and muxes them into path using the
+// muxer format_name.
+bool generateCorpusFile(const std::string &path, const char *format_name, AVCodecID video_codec, const std::vector<AVCodecID> &audio_codecs, int frames, std::string &error);
+
+std::string avError(int ret);
+
+
+#endif // D2V_WITCH_CORPUS_H
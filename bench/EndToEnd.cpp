@@ -0,0 +1,605 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+
+
+// Runs the whole d2vwitch program on a small corpus and checks that every
+// mode produces the same files.
+//
+// The corpus is generated in a temporary folder: MPEG 2 video as an
+// elementary stream, in program streams with MP2, AC3, or LPCM audio, and
+// in a transport stream. H.264 is left out because d2vwitch refuses it.
+// Every file is indexed with all its audio tracks in several modes. The files
+// written in each mode must be byte-identical to the ones written in the
+// reference mode, which uses no extra threads. With --goldens, the files
+// of the reference modes must also match the ones stored in that folder
+// by an earlier run with --update-goldens. Goldens that are missing, or
+// that were made with other versions of libavcodec and libavformat or
+// another number of frames, count as a failure.
+//
+// Except on Windows, the files are also indexed by a d2vwitch --serve
+// started for the whole run, through d2vwitch --client. The second time
+// the server finds the input in its cache of probed files.
+//
+// Usage: d2vwitch-endtoend [--frames <number>] [--goldens <folder>]
+//                          [--update-goldens] <path of d2vwitch>
+//
+// One tab-separated line is printed per run, with the speed in MB/s and
+// frames/s. Lines starting with '#' are comments. The exit code is 1 if
+// any run failed or wrote different files.
+
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QProcess>
+#include <QTemporaryDir>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "Corpus.h"
+
+
+#define DEFAULT_FRAMES 250
+
+#define VERSIONS_FILE "versions.txt"
+
+#define SERVER_SOCKET "server.socket"
+
+// How long to wait for the server to start listening.
+#define SERVER_START_SECONDS 10
+
+
+namespace {
+
+struct CorpusEntry {
+    const char *name;
+    const char *extension;
+    const char *format;
+    AVCodecID video_codec;
+    std::vector<AVCodecID> audio_codecs;
+};
+
+
+struct Mode {
+    const char *name;
+
+    // The mode whose files this one must match, or null if this is a
+    // reference mode.
+    const char *reference;
+
+    std::vector<std::string> arguments;
+
+    bool demuxes;
+
+    // Sent to the server instead of running d2vwitch with the arguments.
+    bool served;
+};
+
+
+struct Options {
+    int frames;
+    std::string d2vwitch;
+    std::string goldens;
+    bool update_goldens;
+
+    Options()
+        : frames(DEFAULT_FRAMES)
+        , d2vwitch{ }
+        , goldens{ }
+        , update_goldens(false)
+    { }
+};
+
+
+std::string librariesStamp(int frames) {
+    unsigned lavc = avcodec_version();
+    unsigned lavf = avformat_version();
+
+    char stamp[200] = { 0 };
+    snprintf(stamp, sizeof(stamp), "frames=%d libavcodec=%u.%u.%u libavformat=%u.%u.%u\n",
+             frames,
+             lavc >> 16, lavc >> 8 & 0xff, lavc & 0xff,
+             lavf >> 16, lavf >> 8 & 0xff, lavf & 0xff);
+
+    return stamp;
+}
+
+
+QStringList listFiles(const QString &folder) {
+    return QDir(folder).entryList(QDir::Files, QDir::Name);
+}
+
+
+// Returns an empty string if the two folders contain the same files with
+// the same contents, otherwise what's wrong.
+std::string compareFolders(const QString &folder, const QString &expected_folder) {
+    QStringList files = listFiles(folder);
+    QStringList expected_files = listFiles(expected_folder);
+
+    for (int i = 0; i < expected_files.size(); i++)
+        if (!files.contains(expected_files[i]))
+            return "missing " + expected_files[i].toStdString();
+
+    for (int i = 0; i < files.size(); i++) {
+        if (!expected_files.contains(files[i]))
+            return "unexpected " + files[i].toStdString();
+
+        QFile file(folder + "/" + files[i]);
+        QFile expected_file(expected_folder + "/" + files[i]);
+
+        if (!file.open(QIODevice::ReadOnly) || !expected_file.open(QIODevice::ReadOnly))
+            return "can't read " + files[i].toStdString();
+
+        if (file.readAll() != expected_file.readAll())
+            return "different " + files[i].toStdString();
+    }
+
+    return std::string();
+}
+
+
+bool copyFolder(const QString &source, const QString &destination, std::string &error) {
+    QDir destination_dir(destination);
+
+    if (destination_dir.exists() && !destination_dir.removeRecursively()) {
+        error = "can't remove '" + destination.toStdString() + "'";
+        return false;
+    }
+
+    if (!QDir().mkpath(destination)) {
+        error = "can't create '" + destination.toStdString() + "'";
+        return false;
+    }
+
+    QStringList files = listFiles(source);
+
+    for (int i = 0; i < files.size(); i++) {
+        if (!QFile::copy(source + "/" + files[i], destination + "/" + files[i])) {
+            error = "can't copy '" + files[i].toStdString() + "' to '" + destination.toStdString() + "'";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// The number of frames in the summary that --progress-format json prints
+// at the end, or in the server's reply when the job is done, or -1.
+int64_t findVideoFrames(const QByteArray &json_lines, const char *final_event) {
+    const char *key = "\"video_frames\":";
+
+    int summary = json_lines.lastIndexOf(final_event);
+    if (summary < 0)
+        return -1;
+
+    int position = json_lines.indexOf(key, summary);
+    if (position < 0)
+        return -1;
+
+    return atoll(json_lines.constData() + position + strlen(key));
+}
+
+
+std::string lastLine(const QByteArray &text) {
+    QList<QByteArray> lines = text.trimmed().split('\n');
+    return lines.size() ? lines.back().trimmed().toStdString() : std::string();
+}
+
+
+void printRun(const CorpusEntry &entry, const Mode &mode, int64_t bytes, int64_t frames, double seconds, const std::string &result) {
+    printf("%s\t%s\t%lld\t%lld\t%.3f\t%.1f\t%.1f\t%s\n",
+           entry.name,
+           mode.name,
+           (long long)bytes,
+           (long long)frames,
+           seconds,
+           bytes / seconds / 1000000,
+           frames / seconds,
+           result.c_str());
+    fflush(stdout);
+}
+
+
+// Sends the lines to the server and waits until it has answered them all.
+bool runClient(const Options &options, const QString &socket_path, const QByteArray &lines, QByteArray &replies, std::string &error) {
+    QProcess process;
+
+    process.start(QString::fromStdString(options.d2vwitch), QStringList() << "--client" << socket_path);
+    process.write(lines);
+    process.closeWriteChannel();
+
+    bool finished = process.waitForFinished(-1);
+
+    replies = process.readAllStandardOutput();
+
+    if (!finished) {
+        error = process.errorString().toStdString();
+        return false;
+    }
+
+    if (process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        error = lastLine(process.readAllStandardError()) + " " + lastLine(replies);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool startServer(const Options &options, QProcess &server, const QString &socket_path) {
+    server.start(QString::fromStdString(options.d2vwitch), QStringList() << "--serve" << socket_path << "--serve-workers" << "2");
+
+    for (int i = 0; i < SERVER_START_SECONDS * 10; i++) {
+        if (QFileInfo::exists(socket_path))
+            return true;
+
+        if (server.waitForFinished(100))
+            break;
+    }
+
+    printf("# server not started: %s\n", lastLine(server.readAllStandardError()).c_str());
+    fflush(stdout);
+
+    return false;
+}
+
+
+void stopServer(const Options &options, QProcess &server, const QString &socket_path) {
+    QByteArray replies;
+    std::string error;
+    if (!runClient(options, socket_path, "{\"command\":\"shutdown\"}\n", replies, error))
+        printf("# server not stopped: %s\n", error.c_str());
+
+    server.waitForFinished(-1);
+}
+
+
+// Returns false if d2vwitch failed or wrote the wrong files.
+bool runMode(const Options &options, const QString &work_path, const QString &input_path, const CorpusEntry &entry, const Mode &mode) {
+    QString output_path = work_path + "/" + entry.name + "/" + mode.name;
+
+    if (!QDir().mkpath(output_path)) {
+        printf("# FAILED %s %s: can't create '%s'\n", entry.name, mode.name, output_path.toStdString().c_str());
+        return false;
+    }
+
+    QString d2v_path = output_path + "/" + entry.name + ".d2v";
+
+    QStringList arguments;
+    arguments << "--progress-format" << "json";
+    arguments << "--audio-ids" << "all";
+    arguments << "--relative-paths" << "yes";
+    arguments << "--single-input";
+    arguments << "--output" << d2v_path;
+
+    for (size_t i = 0; i < mode.arguments.size(); i++)
+        arguments << QString::fromStdString(mode.arguments[i]);
+
+    if (mode.demuxes) {
+        // Two ranges, so that two jobs can run at once.
+        int frames = options.frames;
+        std::string ranges = "0-" + std::to_string(frames / 4) + "," + std::to_string(frames / 2) + "-" + std::to_string(frames * 3 / 4);
+
+        arguments << "--demux-ranges" << QString::fromStdString(ranges);
+        arguments << "--index-demuxed";
+    }
+
+    arguments << input_path;
+
+    int64_t bytes = QFileInfo(input_path).size();
+
+    if (mode.served) {
+        QJsonObject request;
+        request["command"] = "index";
+        request["inputs"] = QJsonArray() << input_path;
+        request["output"] = d2v_path;
+        request["audio_ids"] = "all";
+        request["relative_paths"] = true;
+
+        for (size_t i = 0; i < mode.arguments.size(); i++) {
+            if (mode.arguments[i] == "--pipelined")
+                request["pipelined"] = true;
+            else if (mode.arguments[i] == "--no-audio-threads")
+                request["audio_threads"] = false;
+        }
+
+        QByteArray replies;
+        std::string error;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        bool finished = runClient(options, work_path + "/" + SERVER_SOCKET, QJsonDocument(request).toJson(QJsonDocument::Compact) + "\n", replies, error);
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        int64_t frames = findVideoFrames(replies, "\"event\":\"done\"");
+
+        if (!finished) {
+            printRun(entry, mode, bytes, frames, seconds, "FAILED: " + error);
+            return false;
+        }
+
+        std::string difference = compareFolders(output_path, work_path + "/" + entry.name + "/" + mode.reference);
+
+        printRun(entry, mode, bytes, frames, seconds, difference.size() ? "DIFFERENT: " + difference : "identical");
+
+        return difference.empty();
+    }
+
+    QProcess process;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    process.start(QString::fromStdString(options.d2vwitch), arguments);
+    bool finished = process.waitForFinished(-1);
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    QByteArray json_lines = process.readAllStandardError();
+
+    int64_t frames = findVideoFrames(json_lines, "\"event\":\"summary\"");
+
+    if (!finished || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+        std::string reason = lastLine(json_lines);
+        if (!finished)
+            reason = process.errorString().toStdString();
+
+        printRun(entry, mode, bytes, frames, seconds, "FAILED: " + reason);
+        return false;
+    }
+
+    if (!mode.reference) {
+        printRun(entry, mode, bytes, frames, seconds, "reference");
+        return true;
+    }
+
+    std::string difference = compareFolders(output_path, work_path + "/" + entry.name + "/" + mode.reference);
+
+    printRun(entry, mode, bytes, frames, seconds, difference.size() ? "DIFFERENT: " + difference : "identical");
+
+    return difference.empty();
+}
+
+
+// Compares the files of the reference modes with the golden ones, or
+// replaces the golden ones.
+bool checkGoldens(const Options &options, const QString &work_path, const CorpusEntry &entry, const std::vector<Mode> &modes, bool goldens_usable) {
+    bool okay = true;
+
+    for (size_t i = 0; i < modes.size(); i++) {
+        if (modes[i].reference)
+            continue;
+
+        QString output_path = work_path + "/" + entry.name + "/" + modes[i].name;
+        QString golden_path = QString::fromStdString(options.goldens) + "/" + entry.name + "/" + modes[i].name;
+
+        if (options.update_goldens) {
+            std::string error;
+            if (!copyFolder(output_path, golden_path, error)) {
+                printf("# FAILED goldens %s %s: %s\n", entry.name, modes[i].name, error.c_str());
+                okay = false;
+            } else {
+                printf("# goldens %s %s: saved\n", entry.name, modes[i].name);
+            }
+        } else if (goldens_usable) {
+            if (!QDir(golden_path).exists()) {
+                printf("# FAILED goldens %s %s: none saved\n", entry.name, modes[i].name);
+                okay = false;
+                continue;
+            }
+
+            std::string difference = compareFolders(output_path, golden_path);
+            if (difference.size()) {
+                printf("# FAILED goldens %s %s: %s\n", entry.name, modes[i].name, difference.c_str());
+                okay = false;
+            } else {
+                printf("# goldens %s %s: identical\n", entry.name, modes[i].name);
+            }
+        }
+    }
+
+    fflush(stdout);
+
+    return okay;
+}
+
+
+bool parseArguments(int argc, char **argv, Options &options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg(argv[i]);
+
+        if (arg == "--frames" || arg == "--goldens") {
+            if (i == argc - 1) {
+                fprintf(stderr, "%s requires a value.\n", arg.c_str());
+                return false;
+            }
+
+            if (arg == "--frames")
+                options.frames = atoi(argv[i + 1]);
+            else
+                options.goldens = argv[i + 1];
+            i++;
+        } else if (arg == "--update-goldens") {
+            options.update_goldens = true;
+        } else if (arg == "--help" || (arg.size() > 1 && arg[0] == '-') || options.d2vwitch.size()) {
+            printf("Usage: %s [--frames <number>] [--goldens <folder>] [--update-goldens] <path of d2vwitch>\n", argv[0]);
+            return false;
+        } else {
+            options.d2vwitch = QFileInfo(QString::fromStdString(arg)).absoluteFilePath().toStdString();
+        }
+    }
+
+    if (options.d2vwitch.empty()) {
+        fprintf(stderr, "The path of d2vwitch is required.\n");
+        return false;
+    }
+
+    if (options.frames < 8) {
+        fprintf(stderr, "The number of frames must be at least 8.\n");
+        return false;
+    }
+
+    if (options.update_goldens && options.goldens.empty()) {
+        fprintf(stderr, "--update-goldens requires --goldens.\n");
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace
+
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseArguments(argc, argv, options))
+        return 1;
+
+    av_log_set_level(AV_LOG_PANIC);
+
+    QTemporaryDir folder(QDir::tempPath() + "/d2vwitch-endtoend-XXXXXX");
+    if (!folder.isValid()) {
+        fprintf(stderr, "Failed to create a temporary folder.\n");
+        return 1;
+    }
+
+    QString corpus_path = folder.path() + "/corpus";
+    if (!QDir().mkpath(corpus_path)) {
+        fprintf(stderr, "Failed to create '%s'.\n", corpus_path.toStdString().c_str());
+        return 1;
+    }
+
+
+    std::string stamp = librariesStamp(options.frames);
+
+    // The goldens are only comparable when they come from the same corpus.
+    bool goldens_usable = false;
+
+    if (options.goldens.size()) {
+        QString versions_path = QString::fromStdString(options.goldens) + "/" + VERSIONS_FILE;
+
+        if (options.update_goldens) {
+            QFile versions(versions_path);
+            if (!QDir().mkpath(QString::fromStdString(options.goldens)) ||
+                !versions.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+                versions.write(stamp.c_str()) != (qint64)stamp.size()) {
+                fprintf(stderr, "Failed to write '%s'.\n", versions_path.toStdString().c_str());
+                return 1;
+            }
+        } else {
+            QFile versions(versions_path);
+            if (versions.open(QIODevice::ReadOnly) && versions.readAll() == QByteArray(stamp.c_str())) {
+                goldens_usable = true;
+            } else {
+                printf("# FAILED goldens in '%s' were not made with %s", options.goldens.c_str(), stamp.c_str());
+                printf("# run d2vwitch-endtoend again with --update-goldens to save new ones\n");
+            }
+        }
+    }
+
+
+    printf("# d2vwitch-endtoend %s, %s", PACKAGE_VERSION, stamp.c_str());
+    printf("input\tmode\tbytes\tframes\tseconds\tmb_per_s\tframes_per_s\tresult\n");
+    fflush(stdout);
+
+    std::vector<CorpusEntry> corpus = {
+        { "mpeg2-es", "m2v", "mpeg2video", AV_CODEC_ID_MPEG2VIDEO, { } },
+        { "mpeg2-ps", "mpg", "vob", AV_CODEC_ID_MPEG2VIDEO, { AV_CODEC_ID_MP2, AV_CODEC_ID_AC3 } },
+        { "mpeg2-ps-lpcm", "mpg", "vob", AV_CODEC_ID_MPEG2VIDEO, { AV_CODEC_ID_PCM_DVD } },
+        { "mpeg2-ts", "ts", "mpegts", AV_CODEC_ID_MPEG2VIDEO, { AV_CODEC_ID_AC3, AV_CODEC_ID_MP2 } },
+    };
+
+    std::vector<Mode> modes = {
+        { "reference", nullptr, { "--no-audio-threads" }, false, false },
+        { "audio-threads", "reference", { }, false, false },
+        { "pipelined", "reference", { "--pipelined" }, false, false },
+        { "pipelined-no-audio-threads", "reference", { "--pipelined", "--no-audio-threads" }, false, false },
+        { "demux-jobs-1", nullptr, { "--demux-jobs", "1", "--no-audio-threads" }, true, false },
+        { "demux-jobs-2", "demux-jobs-1", { "--demux-jobs", "2", "--pipelined" }, true, false },
+    };
+
+    // Still runs every mode, but the comparison with the goldens failed.
+    bool okay = options.goldens.empty() || options.update_goldens || goldens_usable;
+
+#ifndef _WIN32
+    QString socket_path = folder.path() + "/" + SERVER_SOCKET;
+
+    QProcess server;
+
+    bool serving = startServer(options, server, socket_path);
+    if (serving) {
+        modes.push_back({ "served", "reference", { "--pipelined" }, false, true });
+        modes.push_back({ "served-cached", "reference", { }, false, true });
+    } else {
+        okay = false;
+    }
+#endif
+
+    for (size_t i = 0; i < corpus.size(); i++) {
+        const CorpusEntry &entry = corpus[i];
+
+        QString input_path = corpus_path + "/" + entry.name + "." + entry.extension;
+
+        std::string error;
+        if (!generateCorpusFile(input_path.toStdString(), entry.format, entry.video_codec, entry.audio_codecs, options.frames, error)) {
+            printf("# skipped %s: %s\n", entry.name, error.c_str());
+            fflush(stdout);
+            continue;
+        }
+
+        bool entry_okay = true;
+
+        for (size_t j = 0; j < modes.size(); j++) {
+            if (!runMode(options, folder.path(), input_path, entry, modes[j]))
+                entry_okay = false;
+        }
+
+        // Goldens from failed runs would be useless.
+        if (entry_okay && options.goldens.size() && !checkGoldens(options, folder.path(), entry, modes, goldens_usable))
+            entry_okay = false;
+
+        if (!entry_okay)
+            okay = false;
+    }
+
+#ifndef _WIN32
+    if (serving)
+        stopServer(options, server, socket_path);
+#endif
+
+    return okay ? 0 : 1;
+}
@@ -27,6 +27,7 @@ extern "C" {
 #include "Audio.h"
 #include "FFMPEG.h"
 #include "MPEGParser.h"
+#include "Trace.h"
 
 
 AVFormatContext *openWave64(const std::string &path, const AVCodecParameters *in_par, std::string &error) {
@@ -164,6 +165,8 @@ int64_t getChannelLayout(AVCodecParameters *avpar) {
 
 
 bool calculateAudioDelays(FakeFile &fake_file, int video_stream_id, AudioDelayMap &audio_delay_map, int64_t *first_video_keyframe_pos, std::string &error) {
+    TRACE_SPAN("calculateAudioDelays");
+
     const char *error_prefix = "Failed to calculate audio delays: ";
 
     int64_t original_position = fake_file.getCurrentPosition();
@@ -37,6 +37,17 @@ typedef std::unordered_map<int, void *> AudioFilesMap;
 // Key: audio stream id. Value: delay in milliseconds.
 typedef std::unordered_map<int, int64_t> AudioDelayMap;
 
+// Where the last packet written to an audio file started in the input,
+// and how big the file was before it. That packet may have been cut
+// short by the end of the input, so appending starts again from it.
+struct AudioResumePoint {
+    int64_t position;
+    int64_t file_size;
+};
+
+// Key: audio stream id.
+typedef std::unordered_map<int, AudioResumePoint> AudioResumeMap;
+
 
 AVFormatContext *openWave64(const std::string &path, const AVCodecParameters *in_par, std::string &error);
 
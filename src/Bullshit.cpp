@@ -22,6 +22,14 @@ SOFTWARE.
 #include <dirent.h>
 #endif
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <algorithm>
 #include <cerrno>
 #include <climits>
 #include <cstdlib>
@@ -32,6 +40,9 @@ SOFTWARE.
 
 
 #ifdef _WIN32
+#include <direct.h>
+#include <fcntl.h>
+#include <io.h>
 #include <windows.h>
 
 struct UTF16 {
@@ -79,6 +90,29 @@ void makeAbsolute(std::string &path, std::string &error) {
 }
 
 
+// For files that may not exist yet, which realpath() refuses. A relative
+// path is only joined with the current directory.
+void makeOutputPathAbsolute(std::string &path, std::string &error) {
+#ifdef _WIN32
+    makeAbsolute(path, error);
+#else
+    if (path.size() && path[0] == '/') {
+        error.clear();
+        return;
+    }
+
+    std::vector<char> buffer(PATH_MAX);
+
+    if (getcwd(buffer.data(), buffer.size())) {
+        error.clear();
+        path = std::string(buffer.data()) + "/" + path;
+    } else {
+        error = strerror(errno);
+    }
+#endif
+}
+
+
 FILE *openFile(const char *path, const char *mode) {
 #ifdef _WIN32
     UTF16 utf16;
@@ -88,3 +122,351 @@ FILE *openFile(const char *path, const char *mode) {
     return fopen(path, mode);
 #endif
 }
+
+
+// "-" (standard output) or "fd:N" (an inherited file descriptor).
+bool isStreamName(const std::string &name) {
+    return name == "-" || name.compare(0, 3, "fd:") == 0;
+}
+
+
+// Like openFile(path, "wb"), but also understands the names accepted by isStreamName.
+FILE *openOutputFile(const std::string &name) {
+    if (name == "-")
+        return stdout;
+
+    if (name.compare(0, 3, "fd:") == 0) {
+        char *end = nullptr;
+        errno = 0;
+        long fd = strtol(name.c_str() + 3, &end, 10);
+        if (errno || end == name.c_str() + 3 || *end || fd < 0 || fd > INT_MAX) {
+            errno = EBADF;
+            return nullptr;
+        }
+
+#ifdef _WIN32
+        if (_setmode((int)fd, _O_BINARY) == -1)
+            return nullptr;
+
+        return _fdopen((int)fd, "wb");
+#else
+        return fdopen((int)fd, "wb");
+#endif
+    }
+
+    return openFile(name.c_str(), "wb");
+}
+
+
+// Overwrites the destination if it exists. On the same filesystem this is atomic.
+bool replaceFile(const char *source, const char *destination) {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    return MoveFileExW(utf16.from_bytes(source).c_str(), utf16.from_bytes(destination).c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    return !rename(source, destination);
+#endif
+}
+
+
+bool removeFile(const char *path) {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    return !_wremove(utf16.from_bytes(path).c_str());
+#else
+    return !remove(path);
+#endif
+}
+
+
+// Reads one line without the line terminator. Returns false at the end of the file.
+bool readLine(FILE *file, std::string &line) {
+    line.clear();
+
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c == '\n')
+            return true;
+
+        if (c != '\r')
+            line += (char)c;
+    }
+
+    return line.size() > 0;
+}
+
+
+#ifdef _WIN32
+static bool isSeparator(char c) {
+    return c == '/' || c == '\\';
+}
+#else
+static bool isSeparator(char c) {
+    return c == '/';
+}
+#endif
+
+
+static bool isAbsolutePath(const std::string &path) {
+#ifdef _WIN32
+    // "C:\..." or "\\server\...".
+    if (path.size() >= 3 && path[1] == ':' && isSeparator(path[2]))
+        return true;
+
+    return path.size() >= 2 && isSeparator(path[0]) && isSeparator(path[1]);
+#else
+    return path.size() && path[0] == '/';
+#endif
+}
+
+
+static std::string getCurrentFolder() {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    std::vector<wchar_t> buffer(_MAX_PATH);
+
+    if (!_wgetcwd(buffer.data(), _MAX_PATH))
+        return std::string();
+
+    return utf16.to_bytes(buffer.data());
+#else
+    std::vector<char> buffer(PATH_MAX);
+
+    if (!getcwd(buffer.data(), buffer.size()))
+        return std::string();
+
+    return buffer.data();
+#endif
+}
+
+
+// Splits an absolute path into its root ("/", "C:/", or "//" followed by
+// the server's name) and the rest of its components, like QDir::cleanPath:
+// empty and "." components are dropped and ".." removes the previous one.
+static void splitPath(const std::string &path, std::string &root, std::vector<std::string> &components) {
+    size_t start;
+
+#ifdef _WIN32
+    if (path[1] == ':') {
+        root = path.substr(0, 2) + "/";
+        start = 3;
+    } else {
+        root = "//";
+        start = 2;
+    }
+#else
+    root = "/";
+    start = 1;
+#endif
+
+    components.clear();
+
+    while (start < path.size()) {
+        size_t end = start;
+        while (end < path.size() && !isSeparator(path[end]))
+            end++;
+
+        std::string component = path.substr(start, end - start);
+
+        if (component == "..") {
+            if (components.size())
+                components.pop_back();
+        } else if (component.size() && component != ".") {
+            components.push_back(component);
+        }
+
+        start = end + 1;
+    }
+}
+
+
+static bool isSameComponent(const std::string &a, const std::string &b) {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    return !_wcsicmp(utf16.from_bytes(a).c_str(), utf16.from_bytes(b).c_str());
+#else
+    return a == b;
+#endif
+}
+
+
+// The path of a file relative to a folder, with '/' as the separator, like
+// QDir(folder).relativeFilePath(QDir::cleanPath(path)). Relative arguments
+// are taken relative to the current folder. If the two have different
+// roots, path is returned cleaned up but still absolute.
+std::string relativePath(const std::string &path, const std::string &folder) {
+    std::string absolute_path = path;
+    std::string absolute_folder = folder;
+
+    if (!isAbsolutePath(absolute_path))
+        absolute_path = getCurrentFolder() + "/" + absolute_path;
+    if (!isAbsolutePath(absolute_folder))
+        absolute_folder = getCurrentFolder() + "/" + absolute_folder;
+
+    std::string path_root, folder_root;
+    std::vector<std::string> path_components, folder_components;
+
+    splitPath(absolute_path, path_root, path_components);
+    splitPath(absolute_folder, folder_root, folder_components);
+
+    std::string relative;
+    std::vector<std::string> relative_components;
+
+    if (isSameComponent(path_root, folder_root)) {
+        size_t common = 0;
+        while (common < path_components.size() &&
+               common < folder_components.size() &&
+               isSameComponent(path_components[common], folder_components[common]))
+            common++;
+
+        relative_components.assign(folder_components.size() - common, "..");
+        relative_components.insert(relative_components.end(), path_components.begin() + common, path_components.end());
+
+        if (!relative_components.size())
+            return ".";
+    } else {
+        relative = path_root;
+        relative_components = path_components;
+    }
+
+    for (size_t i = 0; i < relative_components.size(); i++)
+        relative += (i ? "/" : "") + relative_components[i];
+
+    return relative;
+}
+
+
+// The folder part of path, without the separator. "." if there is none.
+std::string getFolderName(const std::string &path) {
+    size_t last_separator = path.size();
+    while (last_separator > 0 && !isSeparator(path[last_separator - 1]))
+        last_separator--;
+
+    if (last_separator == 0)
+        return ".";
+
+    // Keep the separator of a root folder.
+    if (last_separator == 1)
+        return path.substr(0, 1);
+#ifdef _WIN32
+    if (last_separator == 3 && path[1] == ':')
+        return path.substr(0, 3);
+#endif
+
+    return path.substr(0, last_separator - 1);
+}
+
+
+// Seconds since the epoch, or -1 if the file doesn't exist or something.
+int64_t getModificationTime(const char *path) {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    struct _stat64 info;
+    if (_wstat64(utf16.from_bytes(path).c_str(), &info))
+        return -1;
+#else
+    struct stat info;
+    if (stat(path, &info))
+        return -1;
+#endif
+
+    return info.st_mtime;
+}
+
+
+// In bytes, or -1 if the file doesn't exist or something.
+int64_t getFileSize(const char *path) {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    struct _stat64 info;
+    if (_wstat64(utf16.from_bytes(path).c_str(), &info))
+        return -1;
+#else
+    struct stat info;
+    if (stat(path, &info))
+        return -1;
+#endif
+
+    return info.st_size;
+}
+
+
+// Cuts the file back to size bytes.
+bool truncateFile(const char *path, int64_t size) {
+#ifdef _WIN32
+    UTF16 utf16;
+
+    int fd = _wopen(utf16.from_bytes(path).c_str(), _O_WRONLY | _O_BINARY);
+    if (fd < 0)
+        return false;
+
+    bool okay = !_chsize_s(fd, size);
+
+    _close(fd);
+
+    return okay;
+#else
+    return !truncate(path, size);
+#endif
+}
+
+
+// Copies size bytes starting at offset in source to the current position
+// in destination. The position in source is not preserved.
+bool copyFileRange(FILE *source, int64_t offset, int64_t size, FILE *destination) {
+#ifdef HAVE_COPY_FILE_RANGE
+    // Let the kernel move the data without copying it through userspace.
+    if (fflush(destination))
+        return false;
+
+    loff_t offset_in = offset;
+
+    while (size > 0) {
+        ssize_t copied = copy_file_range(fileno(source), &offset_in, fileno(destination), NULL, (size_t)std::min<int64_t>(size, 1 << 30), 0);
+        if (copied > 0) {
+            size -= copied;
+            continue;
+        }
+
+        if (copied == 0)
+            return false;
+
+        // Old kernel, different filesystems, or some special file.
+        if (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+            break;
+
+        if (errno != EINTR)
+            return false;
+    }
+
+    offset = offset_in;
+
+    if (size == 0)
+        return true;
+#endif
+
+    if (fseeko(source, offset, SEEK_SET))
+        return false;
+
+    std::vector<uint8_t> buffer((size_t)std::min<int64_t>(size, 4 * 1024 * 1024));
+
+    while (size > 0) {
+        size_t chunk = (size_t)std::min<int64_t>(size, buffer.size());
+
+        if (fread(buffer.data(), 1, chunk, source) != chunk)
+            return false;
+
+        if (fwrite(buffer.data(), 1, chunk, destination) != chunk)
+            return false;
+
+        size -= chunk;
+    }
+
+    return true;
+}
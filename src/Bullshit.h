@@ -21,6 +21,7 @@ SOFTWARE.
 #ifndef D2V_WITCH_BULLSHIT_H
 #define D2V_WITCH_BULLSHIT_H
 
+#include <cstdint>
 #include <cstdio>
 #include <string>
 
@@ -37,7 +38,31 @@ SOFTWARE.
 
 void makeAbsolute(std::string &path, std::string &error);
 
+void makeOutputPathAbsolute(std::string &path, std::string &error);
+
 FILE *openFile(const char *path, const char *mode);
 
+bool isStreamName(const std::string &name);
+
+FILE *openOutputFile(const std::string &name);
+
+bool replaceFile(const char *source, const char *destination);
+
+bool removeFile(const char *path);
+
+bool readLine(FILE *file, std::string &line);
+
+std::string relativePath(const std::string &path, const std::string &folder);
+
+std::string getFolderName(const std::string &path);
+
+int64_t getModificationTime(const char *path);
+
+int64_t getFileSize(const char *path);
+
+bool truncateFile(const char *path, int64_t size);
+
+bool copyFileRange(FILE *source, int64_t offset, int64_t size, FILE *destination);
+
 #endif // D2V_WITCH_BULLSHIT_H
 
@@ -20,11 +20,14 @@ SOFTWARE.
 
 #include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <cinttypes>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
 #include <unordered_set>
 
-#include <QDir>
-
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
@@ -34,6 +37,10 @@ extern "C" {
 #include "Audio.h"
 #include "Bullshit.h"
 #include "D2V.h"
+#include "FrameIndex.h"
+#include "LPCM.h"
+#include "SPSCQueue.h"
+#include "Trace.h"
 
 
 void D2V::clearDataLine() {
@@ -82,11 +89,10 @@ bool D2V::printHeader() {
     header += std::to_string(fake_file->size()) + "\n";
 
     if (use_relative_paths) {
-        // Maybe replace the Qt stuff with std::filesystem.
-        QDir d2v_dir = QFileInfo(QString::fromStdString(d2v_file_name)).dir();
+        std::string d2v_folder = getFolderName(d2v_file_name);
 
         for (auto it = fake_file->cbegin(); it != fake_file->cend(); it++)
-            header += d2v_dir.relativeFilePath(QDir::cleanPath(QString::fromStdString(it->name))).toStdString() + "\n";
+            header += relativePath(it->name, d2v_folder) + "\n";
     } else {
         for (auto it = fake_file->cbegin(); it != fake_file->cend(); it++)
             header += it->name + "\n";
@@ -103,9 +109,7 @@ bool D2V::printHeader() {
 }
 
 
-bool D2V::printSettings() {
-    int stream_type = getStreamType(f->fctx->iformat->name);
-
+bool D2V::printSettings(int stream_type) {
     int video_id = video_stream->id;
     int audio_id = 0;
     int64_t ts_packetsize = 0;
@@ -189,6 +193,8 @@ bool D2V::printSettings() {
 
 
 bool D2V::printDataLine(const D2V::DataLine &data_line) {
+    TRACE_SPAN("printDataLine");
+
     if (fprintf(d2v_file, "\n%x %d %d %" PRId64 " %d %d %d",
                 data_line.info,
                 data_line.matrix,
@@ -213,16 +219,26 @@ bool D2V::printDataLine(const D2V::DataLine &data_line) {
 
 
 bool D2V::handleVideoPacket(AVPacket *packet) {
+    TRACE_SPAN("handleVideoPacket");
+
     Picture picture = { 0, AV_PICTURE_STRUCTURE_UNKNOWN, 0 };
 
-    AVCodecID codec_id = f->fctx->streams[packet->stream_index]->codecpar->codec_id;
+    AVCodecID codec_id = video_stream->codecpar->codec_id;
+
+    AVCodecParserContext *parser = f->parser;
+    AVCodecContext *avctx = f->avctx;
+
+    if (extra_video) {
+        parser = f->extra_parsers.at(video_stream->index);
+        avctx = f->extra_video_ctx.at(video_stream->index);
+    }
 
     if (codec_id == AV_CODEC_ID_H264) {
         uint8_t *output_buffer; /// free this?
         int output_buffer_size;
 
         while (packet->size) {
-            int parsed_bytes = av_parser_parse2(f->parser, f->avctx, &output_buffer, &output_buffer_size,
+            int parsed_bytes = av_parser_parse2(parser, avctx, &output_buffer, &output_buffer_size,
                                                 packet->data, packet->size,
                                                 packet->pts, packet->dts, packet->pos);
 
@@ -230,22 +246,42 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
             packet->size -= parsed_bytes;
         }
     } else {
-        d2vWitchParseMPEG12Data(f->parser, f->avctx, packet->data, packet->size);
+        d2vWitchParseMPEG12Data(parser, avctx, packet->data, packet->size);
     }
 
-    if (f->parser->width <= 0 || f->parser->height <= 0) {
-        if (log_message)
-            log_message("Skipping frame with invalid dimensions " + std::to_string(f->parser->width) + "x" + std::to_string(f->parser->height) + ".", log_data);
+    if (parser->width <= 0 || parser->height <= 0) {
+        // This can happen for every packet of a broken stream, so the
+        // message is only built once.
+        if (++stats.invalid_dimensions_skipped == 1 && log_message)
+            log_message("Skipping frame with invalid dimensions " + std::to_string(parser->width) + "x" + std::to_string(parser->height) + ".", log_data);
 
         return true;
     }
 
-    bool first_gop = lines.size() == 0;
+    if (finding_audio_delays && !second_video_keyframe_found) {
+        if (parser->key_frame) {
+            // Unless limitEarlyAudio found it already.
+            if (first_video_pts == AV_NOPTS_VALUE && !first_video_keyframe_claimed.value.exchange(true)) {
+                first_video_pts = packet->pts;
+                first_video_keyframe_pos = packet->pos;
+
+                // The audio threads can start writing now.
+                first_video_keyframe_found.value = true;
+            } else {
+                second_video_keyframe_found = true;
+            }
+        } else if (first_video_pts != AV_NOPTS_VALUE) {
+            if (packet->pts < first_video_pts && packet->pts != AV_NOPTS_VALUE)
+                first_video_pts = packet->pts;
+        }
+    }
+
+    bool first_gop = lines.size() == first_new_line;
     bool first_picture = line.pictures.size() == 0;
 
     if (first_gop &&
         first_picture &&
-        !f->parser->key_frame) {
+        !parser->key_frame) {
         if (log_message)
             log_message("Skipping leading non-keyframe.", log_data);
 
@@ -254,10 +290,10 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
 
     bool mpeg12 = codec_id == AV_CODEC_ID_MPEG1VIDEO || codec_id == AV_CODEC_ID_MPEG2VIDEO;
 
-    picture.output_picture_number = f->parser->output_picture_number;
-    picture.picture_structure = f->parser->picture_structure;
+    picture.output_picture_number = parser->output_picture_number;
+    picture.picture_structure = parser->picture_structure;
 
-    if (f->parser->key_frame) {
+    if (parser->key_frame) {
         if (!isDataLineNull()) {
             reorderDataLineFlags();
             lines.push_back(line);
@@ -267,14 +303,14 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
         line.info = INFO_BIT11 | INFO_STARTS_NEW_GOP;
 
         // More evil shit for passing through "closed_gop". MPEG2 only.
-        if (f->parser->key_frame >> 16)
+        if (parser->key_frame >> 16)
             line.info |= INFO_CLOSED_GOP;
 
         int64_t colorspace;
-        if (av_opt_get_int(f->avctx, "colorspace", 0, &colorspace) < 0 ||
+        if (av_opt_get_int(avctx, "colorspace", 0, &colorspace) < 0 ||
             colorspace == AVCOL_SPC_UNSPECIFIED ||
             colorspace == AVCOL_SPC_RESERVED) {
-            if (f->parser->width > 720 || f->parser->height > 576)
+            if (parser->width > 720 || parser->height > 576)
                 colorspace = AVCOL_SPC_BT709;
             else
                 colorspace = AVCOL_SPC_BT470BG;
@@ -285,21 +321,20 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
 
         picture.flags = FLAGS_DECODABLE_WITHOUT_PREVIOUS_GOP;
 
-        if (progress_report)
-            progress_report(packet->pos, fake_file->getTotalSize(), progress_data);
+        reportReadingProgress(packet->pos);
     }
 
-    if (f->parser->pict_type == AV_PICTURE_TYPE_I) {
+    if (parser->pict_type == AV_PICTURE_TYPE_I) {
         picture.flags |= FLAGS_I_PICTURE;
 
         if (mpeg12)
             picture.flags |= FLAGS_DECODABLE_WITHOUT_PREVIOUS_GOP;
-    } else if (f->parser->pict_type == AV_PICTURE_TYPE_P) {
+    } else if (parser->pict_type == AV_PICTURE_TYPE_P) {
         picture.flags |= FLAGS_P_PICTURE;
 
         if (mpeg12)
             picture.flags |= FLAGS_DECODABLE_WITHOUT_PREVIOUS_GOP;
-    } else if (f->parser->pict_type == AV_PICTURE_TYPE_B) {
+    } else if (parser->pict_type == AV_PICTURE_TYPE_B) {
         picture.flags |= FLAGS_B_PICTURE;
 
         if (mpeg12) {
@@ -320,8 +355,8 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
             }
         }
     } else {
-        if (log_message)
-            log_message(std::string("Encountered unknown picture type ") + av_get_picture_type_char((AVPictureType)f->parser->pict_type) + " (" + std::to_string(f->parser->pict_type) + ").", log_data);
+        if (++stats.unknown_picture_types_skipped == 1 && log_message)
+            log_message(std::string("Encountered unknown picture type ") + av_get_picture_type_char((AVPictureType)parser->pict_type) + " (" + std::to_string(parser->pict_type) + ").", log_data);
 
         return true;
     }
@@ -329,26 +364,26 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
 
     if (mpeg12) {
         // Frame double or tripling can only happen in sequences marked progressive.
-        if (f->parser->repeat_pict == 3 || f->parser->repeat_pict == 5)
+        if (parser->repeat_pict == 3 || parser->repeat_pict == 5)
             line.info |= INFO_PROGRESSIVE_SEQUENCE;
 
         // Some evil shit done for the sake of passing through both "progressive_frame" and "top_field_first".
-        bool progressive_frame = (f->parser->field_order >> 16) == AV_FIELD_PROGRESSIVE;
-        f->parser->field_order = (AVFieldOrder)(f->parser->field_order & 0xff);
+        bool progressive_frame = (parser->field_order >> 16) == AV_FIELD_PROGRESSIVE;
+        parser->field_order = (AVFieldOrder)(parser->field_order & 0xff);
 
         if (progressive_frame)
             picture.flags |= FLAGS_PROGRESSIVE;
     }
 
-    if (f->parser->repeat_pict > 1)
+    if (parser->repeat_pict > 1)
         picture.flags |= FLAGS_RFF;
 
-    if (f->parser->picture_structure == AV_PICTURE_STRUCTURE_FRAME &&
-        (f->parser->field_order == AV_FIELD_TT || f->parser->repeat_pict == 5))
+    if (parser->picture_structure == AV_PICTURE_STRUCTURE_FRAME &&
+        (parser->field_order == AV_FIELD_TT || parser->repeat_pict == 5))
         picture.flags |= FLAGS_TFF;
 
-    if (f->parser->picture_structure == AV_PICTURE_STRUCTURE_FRAME &&
-        f->parser->field_order == AV_FIELD_PROGRESSIVE)
+    if (parser->picture_structure == AV_PICTURE_STRUCTURE_FRAME &&
+        parser->field_order == AV_FIELD_PROGRESSIVE)
         picture.flags |= FLAGS_PROGRESSIVE;
 
 
@@ -356,11 +391,11 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
         // Handle interlaced crap by pretending we have frames in the stream, not fields.
         Picture &previous_picture = line.pictures.back();
         if (line.pictures.size() &&
-            f->parser->picture_structure != AV_PICTURE_STRUCTURE_FRAME &&
+            parser->picture_structure != AV_PICTURE_STRUCTURE_FRAME &&
             previous_picture.picture_structure != AV_PICTURE_STRUCTURE_FRAME &&
-            previous_picture.output_picture_number == f->parser->output_picture_number - 1) {
+            previous_picture.output_picture_number == parser->output_picture_number - 1) {
 
-            if (f->parser->picture_structure == AV_PICTURE_STRUCTURE_TOP_FIELD)
+            if (parser->picture_structure == AV_PICTURE_STRUCTURE_TOP_FIELD)
                 previous_picture.flags &= ~FLAGS_TFF;
             else
                 previous_picture.flags |= FLAGS_TFF;
@@ -378,12 +413,12 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
     // Try to guess the frame rate from the pts. We use it if ffmpeg reports a nonsense frame rate.
     if (guessed_frame_rate.num == 0 || guessed_frame_rate.den == 0) {
         if (previous_pts == AV_NOPTS_VALUE) {
-            previous_pts = f->parser->pts;
+            previous_pts = parser->pts;
         } else {
-            AVRational duration = { (int)(f->parser->pts - previous_pts), 1 };
+            AVRational duration = { (int)(parser->pts - previous_pts), 1 };
 
             if (duration.num > 0) {
-                AVRational timebase = f->fctx->streams[packet->stream_index]->time_base;
+                AVRational timebase = video_stream->time_base;
 
                 AVRational frame_rate = av_inv_q(av_mul_q(duration, timebase));
 
@@ -397,82 +432,235 @@ bool D2V::handleVideoPacket(AVPacket *packet) {
     }
 
     line.pictures.push_back(picture);
+    frames_found++;
 
     return true;
 }
 
 
-bool D2V::handleAudioPacket(AVPacket *packet) {
-    // We need this per-stream state because many audio packets have pos of -1.
-    if (packet->pos >= first_video_keyframe_pos)
-        seen_audio_frame_from_these_streams_after_first_video_keyframe.insert(packet->stream_index);
+// How many packets from each LPCM stream are unpacked both ways and compared.
+#define LPCM_CHECKED_PACKETS 16
 
-    bool seen_audio_frame_from_this_stream_after_first_video_keyframe = seen_audio_frame_from_these_streams_after_first_video_keyframe.count(packet->stream_index);
 
-    if (!seen_audio_frame_from_this_stream_after_first_video_keyframe)
-        return true;
+bool D2V::decodeLPCMPacket(AVPacket *packet, const AVStream *stream, std::vector<uint8_t> &samples, std::string &audio_error) {
+    samples.clear();
 
+    AVCodecContext *codec = f->audio_ctx.at(packet->stream_index);
 
-    if (codecIDRequiresWave64(f->fctx->streams[packet->stream_index]->codecpar->codec_id)) {
-        AVFormatContext *w64_ctx = (AVFormatContext *)audio_files.at(packet->stream_index);
+    int ret = avcodec_send_packet(codec, packet);
+    if (ret < 0) {
+        char id[20] = { 0 };
+        snprintf(id, 19, "%x", stream->id);
+        audio_error = "Failed to submit audio packet for decoding from stream id ";
+        audio_error += id;
+        audio_error += ".";
 
-        AVCodecContext *codec = f->audio_ctx.at(packet->stream_index);
+        return false;
+    }
 
-        AVFrame *frame = av_frame_alloc();
+    AVFrame *frame = av_frame_alloc();
 
-        int ret = avcodec_send_packet(codec, packet);
+    while (ret >= 0) {
+        ret = avcodec_receive_frame(codec, frame);
         if (ret < 0) {
-            char id[20] = { 0 };
-            snprintf(id, 19, "%x", f->fctx->streams[packet->stream_index]->id);
-            error = "Failed to submit audio packet for decoding from stream id ";
-            error += id;
-            error += ".";
+            if (ret != AVERROR_EOF && ret != AVERROR(EAGAIN)) {
+                char id[20] = { 0 };
+                snprintf(id, 19, "%x", stream->id);
+                audio_error = "Failed to decode audio packet from stream id ";
+                audio_error += id;
+                audio_error += ".";
+
+                av_frame_free(&frame);
+                return false;
+            }
+            break;
+        }
 
-            return false;
+        int size = frame->nb_samples * frame->channels * av_get_bytes_per_sample((AVSampleFormat)frame->format);
+
+        samples.insert(samples.end(), frame->data[0], frame->data[0] + size);
+
+        av_frame_unref(frame);
+    };
+
+    av_frame_free(&frame);
+
+    return true;
+}
+
+
+bool D2V::writeAudioPacket(AVPacket *packet, AudioStream &audio, std::string &audio_error) {
+    const AVStream *stream = audio.stream;
+
+    int64_t start_position = audio.resume_position >= 0 ? audio.resume_position : first_video_keyframe_pos;
+
+    if (!audio.seen_packet_after_first_video_keyframe && packet->pos >= start_position) {
+        audio.seen_packet_after_first_video_keyframe = true;
+
+        if (packet->pts != AV_NOPTS_VALUE)
+            audio.first_pts = packet->pts * 1000 * stream->time_base.num / stream->time_base.den;
+    }
+
+    if (!audio.seen_packet_after_first_video_keyframe)
+        return true;
+
+
+    if (codecIDRequiresWave64(stream->codecpar->codec_id)) {
+        AVFormatContext *w64_ctx = (AVFormatContext *)audio_files.at(packet->stream_index);
+
+        LPCMStream &lpcm = lpcm_streams.at(packet->stream_index);
+
+        bool unpacked = !lpcm.use_lavc && lpcm.unpacker.unpack(packet->data, packet->size, lpcm.unpacked_samples);
+        if (!unpacked && !lpcm.use_lavc) {
+            // libavcodec hasn't seen the packets since the checked ones,
+            // so whatever it kept from them is stale.
+            if (lpcm.checked_packets >= LPCM_CHECKED_PACKETS)
+                avcodec_flush_buffers(f->audio_ctx.at(packet->stream_index));
+
+            lpcm.use_lavc = true;
         }
 
-        while (ret >= 0) {
-            ret = avcodec_receive_frame(codec, frame);
-            if (ret < 0) {
-                if (ret != AVERROR_EOF && ret != AVERROR(EAGAIN)) {
-                    char id[20] = { 0 };
-                    snprintf(id, 19, "%x", f->fctx->streams[packet->stream_index]->id);
-                    error = "Failed to decode audio packet from stream id ";
-                    error += id;
-                    error += ".";
+        const std::vector<uint8_t> *samples = &lpcm.unpacked_samples;
+
+        if (lpcm.use_lavc || lpcm.checked_packets < LPCM_CHECKED_PACKETS) {
+            if (!decodeLPCMPacket(packet, stream, lpcm.decoded_samples, audio_error))
+                return false;
 
-                    av_frame_unref(frame);
-                    return false;
+            if (unpacked && lpcm.unpacked_samples != lpcm.decoded_samples) {
+                lpcm.use_lavc = true;
+
+                if (log_message) {
+                    char id[20] = { 0 };
+                    snprintf(id, 19, "%x", stream->id);
+                    log_message(std::string("Unpacking the LPCM audio from stream id ") + id + " without libavcodec gave different results. Using libavcodec.", log_data);
                 }
-                break;
             }
 
-            AVPacket pkt_out;
-            av_init_packet(&pkt_out);
-            pkt_out.data = frame->data[0];
-            pkt_out.size = frame->nb_samples * frame->channels * av_get_bytes_per_sample((AVSampleFormat)frame->format);
-            pkt_out.stream_index = 0;
-            pkt_out.pts = 0;
-            pkt_out.dts = 0;
+            lpcm.checked_packets++;
 
-            av_write_frame(w64_ctx, &pkt_out);
-        };
+            samples = &lpcm.decoded_samples;
+        }
 
-        av_frame_unref(frame);
+        // Same as av_write_frame, without the timestamp checks.
+        avio_write(w64_ctx->pb, samples->data(), samples->size());
+
+        if (w64_ctx->pb->error) {
+            char id[20] = { 0 };
+            snprintf(id, 19, "%x", stream->id);
+            audio_error = "Failed to write audio packet from stream id ";
+            audio_error += id;
+            audio_error += ": avio_write() failed.";
+
+            return false;
+        }
     } else { // Not PCM, just dump it.
         FILE *file = (FILE *)audio_files.at(packet->stream_index);
 
+        // Many audio packets have pos of -1.
+        if (packet->pos >= 0) {
+            audio.last_packet_position = packet->pos;
+            audio.size_before_last_packet = audio.bytes_written;
+        }
+
+        audio.bytes_written += packet->size;
+
         if (fwrite(packet->data, 1, packet->size, file) < (size_t)packet->size) {
             char id[20] = { 0 };
-            snprintf(id, 19, "%x", f->fctx->streams[packet->stream_index]->id);
-            error = "Failed to write audio packet from stream id ";
-            error += id;
-            error += ": fwrite() failed.";
+            snprintf(id, 19, "%x", stream->id);
+            audio_error = "Failed to write audio packet from stream id ";
+            audio_error += id;
+            audio_error += ": fwrite() failed.";
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool D2V::handleAudioPacket(AVPacket *packet, std::string &audio_error) {
+    TRACE_SPAN("handleAudioPacket");
+
+    AudioStream &audio = audio_streams.at(packet->stream_index);
 
+    if (!first_video_keyframe_found.value) {
+        AVPacket *early_packet = av_packet_alloc();
+        if (!early_packet || av_packet_ref(early_packet, packet) < 0) {
+            av_packet_free(&early_packet);
+            audio_error = "Failed to allocate memory for an audio packet.";
             return false;
         }
+
+        audio.early_packets.push_back(early_packet);
+
+        return true;
+    }
+
+    if (!writeEarlyAudioPackets(audio, audio_error))
+        return false;
+
+    return writeAudioPacket(packet, audio, audio_error);
+}
+
+
+bool D2V::writeEarlyAudioPackets(AudioStream &audio, std::string &audio_error) {
+    bool okay = true;
+
+    for (size_t i = 0; i < audio.early_packets.size(); i++) {
+        if (okay)
+            okay = writeAudioPacket(audio.early_packets[i], audio, audio_error);
+
+        av_packet_free(&audio.early_packets[i]);
     }
 
+    audio.early_packets.clear();
+
+    return okay;
+}
+
+
+void D2V::freeEarlyAudioPackets() {
+    for (auto it = audio_streams.begin(); it != audio_streams.end(); it++) {
+        for (size_t i = 0; i < it->second.early_packets.size(); i++)
+            av_packet_free(&it->second.early_packets[i]);
+
+        it->second.early_packets.clear();
+    }
+}
+
+
+// Enough for several seconds of any audio before the first video keyframe.
+#define EARLY_AUDIO_BYTES_LIMIT (16 << 20)
+
+
+// Called by the reading thread for every audio packet. When too much audio
+// is held back, the first video keyframe and the audio delays are found
+// with calculateAudioDelays, which reads the beginning of the input again,
+// and the audio threads can write what they hold.
+bool D2V::limitEarlyAudio(const AVPacket *packet) {
+    if (!finding_audio_delays || first_video_keyframe_found.value)
+        return true;
+
+    early_audio_bytes += packet->size;
+    if (early_audio_bytes <= EARLY_AUDIO_BYTES_LIMIT)
+        return true;
+
+    // The video thread found the keyframe meanwhile.
+    if (first_video_keyframe_claimed.value.exchange(true))
+        return true;
+
+    int64_t keyframe_pos = -1;
+    AudioDelayMap delays;
+
+    if (!calculateAudioDelays(*fake_file, video_stream->id, delays, &keyframe_pos, error))
+        return false;
+
+    audio_delay_map = delays;
+    audio_delays_calculated = true;
+    first_video_keyframe_pos = keyframe_pos;
+    first_video_keyframe_found.value = true;
+
     return true;
 }
 
@@ -487,6 +675,10 @@ bool D2V::printStreamEnd() {
 }
 
 
+// Processing stops when this becomes true. Whoever notices it also clears it.
+std::atomic_bool stop_processing(false);
+
+
 D2V::D2V() {
 
 }
@@ -505,10 +697,55 @@ D2V::D2V(const std::string &_d2v_file_name, FILE *_d2v_file, const AudioFilesMap
     , progress_data(_progress_data)
     , log_message(_log_message)
     , log_data(_log_data)
+    , cancel_flag(&stop_processing)
     , previous_pts(AV_NOPTS_VALUE)
     , guessed_frame_rate({ 0, 0 })
     , first_video_keyframe_pos(_first_video_keyframe_pos)
-{ }
+    , finding_audio_delays(false)
+    , first_video_keyframe_found(true)
+    , first_video_keyframe_claimed(false)
+    , early_audio_bytes(0)
+    , audio_delays_calculated(false)
+    , first_video_pts(AV_NOPTS_VALUE)
+    , second_video_keyframe_found(false)
+    , resume_position(0)
+    , first_new_line(0)
+    , pipelined(false)
+    , audio_threads(true)
+    , audio_only(false)
+    , last_reported_position(0)
+    , phase(PhaseReading)
+    , frames_found(0)
+    , extra_videos{ }
+    , extra_video(false)
+{
+    for (auto it = audio_files.cbegin(); it != audio_files.cend(); it++) {
+        audio_streams.insert({ it->first, AudioStream(f->fctx->streams[it->first]) });
+
+        AVCodecID codec_id = f->fctx->streams[it->first]->codecpar->codec_id;
+        if (codecIDRequiresWave64(codec_id))
+            lpcm_streams.insert({ it->first, LPCMStream(codec_id) });
+    }
+}
+
+
+D2V::D2V(const D2V &other, FakeFile *_fake_file, FFMPEG *_f, AVStream *_video_stream, ProgressFunction _progress_report, void *_progress_data, LoggingFunction _log_message, void *_log_data)
+    : D2V(other)
+{
+    d2v_file = nullptr;
+    audio_files.clear();
+    audio_streams.clear();
+    lpcm_streams.clear();
+    extra_videos.clear();
+
+    fake_file = _fake_file;
+    f = _f;
+    video_stream = _video_stream;
+    progress_report = _progress_report;
+    progress_data = _progress_data;
+    log_message = _log_message;
+    log_data = _log_data;
+}
 
 
 const std::string &D2V::getD2VFileName() const {
@@ -526,172 +763,677 @@ const std::string &D2V::getError() const {
 }
 
 
-std::atomic_bool stop_processing(false);
+void D2V::setPipelined(bool enabled) {
+    pipelined = enabled;
+}
 
 
-void D2V::index() {
-    AVPacket packet;
-    av_init_packet(&packet);
+void D2V::setAudioThreads(bool enabled) {
+    audio_threads = enabled;
+}
 
-    while (av_read_frame(f->fctx, &packet) == 0) {
-        if (stop_processing) {
-            stop_processing = false;
-            result = ProcessingCancelled;
-            fclose(d2v_file);
-            closeAudioFiles(audio_files, f->fctx);
-            return;
-        }
 
-        // Apparently we might receive packets from streams with AVDISCARD_ALL set,
-        // and also from streams discovered late, probably.
-        if (packet.stream_index != video_stream->index &&
-            !audio_files.count(packet.stream_index)) {
-            av_packet_unref(&packet);
-            continue;
-        }
+void D2V::setCancelFlag(std::atomic_bool *flag) {
+    cancel_flag = flag;
+}
 
-        bool okay = true;
 
-        if (packet.stream_index == video_stream->index)
-            okay = handleVideoPacket(&packet);
-        else
-            okay = handleAudioPacket(&packet);
+void D2V::setFindAudioDelays(bool enabled) {
+    finding_audio_delays = enabled;
+    first_video_keyframe_found.value = !enabled;
 
-        if (!okay) {
-            av_packet_unref(&packet);
-            result = ProcessingError;
-            fclose(d2v_file);
-            closeAudioFiles(audio_files, f->fctx);
-            return;
-        }
+    if (enabled)
+        first_video_keyframe_pos = -1;
+}
 
-        av_packet_unref(&packet);
-    }
 
+const AudioDelayMap &D2V::getAudioDelays() const {
+    return audio_delay_map;
+}
 
-    // If the last picture in the stream is an orphan field, discard it. lavc would not like it.
-    if (line.pictures.size() &&
-        line.pictures.back().picture_structure != AV_PICTURE_STRUCTURE_FRAME)
-        line.pictures.pop_back();
 
+void D2V::addVideoStream(D2V *other) {
+    other->extra_video = true;
+    other->cancel_flag = cancel_flag;
 
-    // Handle the very last GOP, I guess.
-    if (!isDataLineNull()) {
-        reorderDataLineFlags();
-        lines.push_back(line);
-        clearDataLine();
-    }
+    extra_videos.push_back(other);
+}
 
 
-    // Collect stats.
-    for (size_t i = 0; i < lines.size(); i++) {
-        stats.video_frames += lines[i].pictures.size();
+D2V *D2V::findVideoD2V(int stream_index) {
+    if (stream_index == video_stream->index)
+        return this;
 
-        for (size_t j = 0; j < lines[i].pictures.size(); j++) {
-            const Picture &picture = lines[i].pictures[j];
+    for (size_t i = 0; i < extra_videos.size(); i++)
+        if (extra_videos[i]->video_stream->index == stream_index)
+            return extra_videos[i];
 
-            if (picture.flags & FLAGS_PROGRESSIVE)
-                stats.progressive_frames++;
-            if (picture.flags & FLAGS_TFF)
-                stats.tff_frames++;
-            if (picture.flags & FLAGS_RFF)
-                stats.rff_frames++;
-        }
-    }
+    return nullptr;
+}
 
 
-    if (!lines.size()) {
-        result = ProcessingFinished;
-        fclose(d2v_file);
-        closeAudioFiles(audio_files, f->fctx);
-        return;
+void D2V::abandonExtraVideos(size_t first, ProcessingResult abandoned_result) {
+    for (size_t i = first; i < extra_videos.size(); i++) {
+        extra_videos[i]->result = abandoned_result;
+        if (abandoned_result == ProcessingError)
+            extra_videos[i]->error = error;
+        fclose(extra_videos[i]->d2v_file);
     }
+}
 
 
-    // Here we must make sure d2vsource can actually obtain every keyframe.
-    // If it can't, we try to find a better location towards the previous keyframe.
-    // If somehow that fails, we move the offending line's frames to the previous line.
-    // At least h264 in mpegts requires this.
-    FakeFile::seek(fake_file, 0, SEEK_SET);
-    FFMPEG f2;
-    if (!f2.initFormat(*fake_file)) {
-        result = ProcessingError;
-        error = "Error while testing keyframe locations: " + f2.getError();
-        fclose(d2v_file);
-        closeAudioFiles(audio_files, f->fctx);
-        return;
+bool D2V::prepareAppend(const std::string &old_d2v_name, const AudioResumeMap &audio_resume_points) {
+    // The audio packets before these positions were already written to the audio files.
+    for (auto it = audio_streams.begin(); it != audio_streams.end(); it++) {
+        AudioStream &audio = it->second;
+
+        auto point = audio_resume_points.find(audio.stream->id);
+        if (point == audio_resume_points.cend()) {
+            char id[20] = { 0 };
+            snprintf(id, 19, "%x", audio.stream->id);
+            error = std::string("Don't know where to resume audio track ") + id + ".";
+            return false;
+        }
+
+        audio.resume_position = point->second.position;
+        audio.bytes_written = point->second.file_size;
+        audio.last_packet_position = point->second.position;
+        audio.size_before_last_packet = point->second.file_size;
     }
 
-    av_init_packet(&packet);
+    FILE *old_d2v_file = openFile(old_d2v_name.c_str(), "rb");
+    if (!old_d2v_file) {
+        error = "Failed to open d2v file '" + old_d2v_name + "' for reading: " + strerror(errno);
+        return false;
+    }
 
-    for (size_t i = 0; i < lines.size(); ) {
-        // Report progress because this takes a while. Especially with slow hard drives, probably.
-        if (progress_report)
-            progress_report((int64_t)i, (int64_t)lines.size(), progress_data);
+    std::vector<DataLine> old_lines;
 
-        // Same reason.
-        if (stop_processing) {
-            stop_processing = false;
-            result = ProcessingCancelled;
-            fclose(d2v_file);
-            closeAudioFiles(audio_files, f->fctx);
-            return;
+    std::string text;
+    int empty_lines = 0;
+
+    while (readLine(old_d2v_file, text)) {
+        // The header, the settings, and the data lines are separated by empty lines.
+        if (empty_lines < 2) {
+            if (text.empty())
+                empty_lines++;
+            continue;
         }
 
-        int64_t target = lines[i].position;
+        if (text.empty())
+            continue;
 
-        fake_file->setOffsetFromRealStart(target);
-        FakeFile::seek(fake_file, 0, SEEK_SET);
-        avformat_seek_file(f2.fctx, video_stream->index, INT64_MIN, 0, INT64_MAX, AVSEEK_FLAG_BYTE);
+        DataLine data_line;
+        int consumed = 0;
+
+        if (sscanf(text.c_str(), "%x %d %d %" SCNd64 " %d %d %d%n",
+                   &data_line.info,
+                   &data_line.matrix,
+                   &data_line.file,
+                   &data_line.position,
+                   &data_line.skip,
+                   &data_line.vob,
+                   &data_line.cell,
+                   &consumed) < 7) {
+            error = "Failed to parse d2v data line '" + text + "' from d2v file '" + old_d2v_name + "'.";
+            fclose(old_d2v_file);
+            return false;
+        }
 
+        const char *flags = text.c_str() + consumed;
+        unsigned picture_flags;
 
-        do {
-            av_packet_unref(&packet);
-            av_read_frame(f2.fctx, &packet);
-        } while (f2.fctx->streams[packet.stream_index]->id != video_stream->id);
+        while (sscanf(flags, " %x%n", &picture_flags, &consumed) == 1) {
+            flags += consumed;
 
-        int64_t position = packet.pos;
+            // End of stream.
+            if (picture_flags == 0xff)
+                break;
 
-        av_packet_unref(&packet);
+            data_line.pictures.push_back({ 0, AV_PICTURE_STRUCTURE_FRAME, (uint8_t)picture_flags });
+            frames_found++;
+        }
 
-        bool invalid_seek_point = position != 0;
+        // Convert positions in the real files into positions in the fake file.
+        data_line.position = fake_file->getPositionInFakeFile(data_line.position, data_line.file);
+        data_line.file = 0;
 
-        if (invalid_seek_point) {
-            int64_t previous_target = i ? lines[i - 1].position : -1;
+        old_lines.push_back(data_line);
+    }
 
-            // Binary search, yay.
-            int64_t minimum = previous_target;
-            int64_t maximum = target;
+    bool read_error = ferror(old_d2v_file);
 
-            while (maximum - minimum > 1) {
-                int64_t middle = minimum + (maximum - minimum) / 2;
+    fclose(old_d2v_file);
 
-                fake_file->setOffsetFromRealStart(middle);
-                FakeFile::seek(fake_file, 0, SEEK_SET);
-                avformat_seek_file(f2.fctx, video_stream->index, INT64_MIN, 0, INT64_MAX, AVSEEK_FLAG_BYTE);
+    if (read_error) {
+        error = "Failed to read d2v file '" + old_d2v_name + "'.";
+        return false;
+    }
 
+    if (!old_lines.size())
+        return true;
 
-                do {
-                    av_packet_unref(&packet);
-                    av_read_frame(f2.fctx, &packet);
-                } while (f2.fctx->streams[packet.stream_index]->id != video_stream->id);
+    // The last GOP may have been cut short when the d2v file was written,
+    // so it gets indexed again.
+    resume_position = old_lines.back().position;
+    old_lines.pop_back();
 
-                position = packet.pos;
+    lines = old_lines;
+    first_new_line = lines.size();
 
-                av_packet_unref(&packet);
+    return true;
+}
 
-                if (position == target - middle) { // middle is good
-                    if (log_message)
-                        log_message("Moving keyframe location " + std::to_string(fake_file->getPositionInRealFile(target)) + " to " + std::to_string(fake_file->getPositionInRealFile(middle)) + " (" + std::to_string(position) + " bytes).", log_data);
 
-                    lines[i].position = middle;
+AudioResumeMap D2V::getAudioResumePoints() const {
+    AudioResumeMap points;
 
-                    break;
-                } else if (position > target - middle) { // middle resulted in packet too far to the right
-                    maximum = middle;
-                } else { // middle resulted in packet too far to the left
-                    minimum = middle;
-                }
+    for (auto it = audio_streams.cbegin(); it != audio_streams.cend(); it++) {
+        const AudioStream &audio = it->second;
+
+        if (audio.last_packet_position >= 0 && !codecIDRequiresWave64(audio.stream->codecpar->codec_id))
+            points.insert({ audio.stream->id, { audio.last_packet_position, audio.size_before_last_packet } });
+    }
+
+    return points;
+}
+
+
+bool D2V::isWantedPacket(const AVPacket *packet) {
+    // Apparently we might receive packets from streams with AVDISCARD_ALL set,
+    // and also from streams discovered late, probably.
+    if (packet->stream_index != video_stream->index &&
+        !audio_files.count(packet->stream_index) &&
+        !findVideoD2V(packet->stream_index))
+        return false;
+
+    if (audio_only && packet->stream_index == video_stream->index)
+        return false;
+
+    // When appending, the video packets before the resume position were indexed already.
+    if (packet->stream_index == video_stream->index &&
+        packet->pos >= 0 &&
+        packet->pos < resume_position)
+        return false;
+
+    return true;
+}
+
+
+// Called for every keyframe, or for every packet when there is no video
+// parsing, so it only passes on every megabyte or so.
+void D2V::reportReadingProgress(int64_t position) {
+    if (!progress_report || position < last_reported_position + (1 << 20))
+        return;
+
+    progress_report(position, fake_file->getTotalSize(), progress_data);
+
+    last_reported_position = position;
+}
+
+
+bool D2V::readPackets() {
+    TRACE_SPAN("readPackets");
+
+    AVPacket packet;
+    av_init_packet(&packet);
+
+    while (av_read_frame(f->fctx, &packet) == 0) {
+        if (*cancel_flag) {
+            *cancel_flag = false;
+            av_packet_unref(&packet);
+            result = ProcessingCancelled;
+            return false;
+        }
+
+        if (!isWantedPacket(&packet)) {
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        if (audio_only)
+            reportReadingProgress(packet.pos);
+
+        bool okay = true;
+
+        D2V *video = findVideoD2V(packet.stream_index);
+        if (video)
+            okay = video->handleVideoPacket(&packet);
+        else
+            okay = limitEarlyAudio(&packet) && handleAudioPacket(&packet, error);
+
+        av_packet_unref(&packet);
+
+        if (!okay) {
+            // The other video streams keep their errors in their own D2V.
+            if (video && video != this)
+                error = video->getError();
+            result = ProcessingError;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+// Bounded, so that memory use doesn't grow when one stage is slower than the others.
+#define PACKET_QUEUE_SIZE 256
+
+typedef SPSCQueue<AVPacket *> PacketQueue;
+
+
+static void freeQueuedPackets(PacketQueue &queue) {
+    AVPacket *packet;
+    while (queue.tryPop(packet))
+        av_packet_free(&packet);
+}
+
+
+// The calling thread reads the packets and one thread per audio stream writes
+// the audio packets. The video packets are parsed in the calling thread too,
+// unless the pipelined mode is enabled, in which case another thread does it.
+// The output is the same as readPackets's.
+bool D2V::readPacketsThreaded() {
+    TRACE_SPAN("readPacketsThreaded");
+
+    // Set when any stage fails or when the user cancels.
+    std::atomic_bool stop_pipeline(false);
+
+    PacketQueue video_queue(PACKET_QUEUE_SIZE);
+
+    // Key: AVPacket::stream_index
+    std::unordered_map<int, std::unique_ptr<PacketQueue>> audio_queues;
+    std::unordered_map<int, std::string> audio_errors;
+
+    // All the elements must exist before the threads start.
+    for (auto it = audio_files.cbegin(); it != audio_files.cend(); it++) {
+        audio_queues.insert({ it->first, std::unique_ptr<PacketQueue>(new PacketQueue(PACKET_QUEUE_SIZE)) });
+        audio_errors.insert({ it->first, std::string() });
+    }
+
+    std::thread video_thread;
+    std::string video_error;
+
+    if (pipelined) {
+        video_thread = std::thread([this, &video_queue, &video_error, &stop_pipeline] () {
+            TRACE_THREAD_NAME("video parser");
+
+            AVPacket *packet;
+
+            // A null packet marks the end of the stream.
+            while (video_queue.pop(packet, stop_pipeline) && packet) {
+                D2V *video = findVideoD2V(packet->stream_index);
+
+                bool okay = video->handleVideoPacket(packet);
+
+                av_packet_free(&packet);
+
+                if (!okay) {
+                    video_error = video->getError();
+                    stop_pipeline = true;
+                    break;
+                }
+            }
+        });
+    }
+
+    std::vector<std::thread> audio_writers;
+
+    for (auto it = audio_queues.begin(); it != audio_queues.end(); it++) {
+        PacketQueue *queue = it->second.get();
+        std::string *audio_error = &audio_errors.at(it->first);
+
+        audio_writers.push_back(std::thread([this, queue, audio_error, &stop_pipeline] () {
+            TRACE_THREAD_NAME("audio writer");
+
+            AVPacket *packet;
+
+            while (queue->pop(packet, stop_pipeline) && packet) {
+                bool okay = handleAudioPacket(packet, *audio_error);
+
+                av_packet_free(&packet);
+
+                if (!okay) {
+                    stop_pipeline = true;
+                    break;
+                }
+            }
+        }));
+    }
+
+    bool cancelled = false;
+
+    AVPacket packet;
+    av_init_packet(&packet);
+
+    while (!stop_pipeline && av_read_frame(f->fctx, &packet) == 0) {
+        if (*cancel_flag) {
+            *cancel_flag = false;
+            av_packet_unref(&packet);
+            cancelled = true;
+            break;
+        }
+
+        if (!isWantedPacket(&packet)) {
+            av_packet_unref(&packet);
+            continue;
+        }
+
+        if (audio_only)
+            reportReadingProgress(packet.pos);
+
+        D2V *video = findVideoD2V(packet.stream_index);
+
+        if (!pipelined && video) {
+            bool okay = video->handleVideoPacket(&packet);
+            av_packet_unref(&packet);
+
+            if (!okay) {
+                video_error = video->getError();
+                stop_pipeline = true;
+                break;
+            }
+
+            continue;
+        }
+
+        if (!video && !limitEarlyAudio(&packet)) {
+            av_packet_unref(&packet);
+            stop_pipeline = true;
+            break;
+        }
+
+        AVPacket *queued_packet = av_packet_alloc();
+        if (!queued_packet || av_packet_ref(queued_packet, &packet) < 0) {
+            av_packet_free(&queued_packet);
+            av_packet_unref(&packet);
+            error = "Failed to allocate memory for a packet.";
+            stop_pipeline = true;
+            break;
+        }
+
+        av_packet_unref(&packet);
+
+        PacketQueue *queue = &video_queue;
+        if (!video)
+            queue = audio_queues.at(queued_packet->stream_index).get();
+
+        if (!queue->push(queued_packet, stop_pipeline)) {
+            av_packet_free(&queued_packet);
+            break;
+        }
+    }
+
+    if (cancelled) {
+        stop_pipeline = true;
+    } else {
+        if (pipelined)
+            video_queue.push(nullptr, stop_pipeline);
+        for (auto it = audio_queues.begin(); it != audio_queues.end(); it++)
+            it->second->push(nullptr, stop_pipeline);
+    }
+
+    if (pipelined)
+        video_thread.join();
+    for (size_t i = 0; i < audio_writers.size(); i++)
+        audio_writers[i].join();
+
+    freeQueuedPackets(video_queue);
+    for (auto it = audio_queues.begin(); it != audio_queues.end(); it++)
+        freeQueuedPackets(*it->second);
+
+    if (cancelled) {
+        result = ProcessingCancelled;
+        return false;
+    }
+
+    // An audio thread may also fail once the pipeline stops, but the
+    // error that stopped it is the one worth reporting.
+    if (error.empty())
+        error = video_error;
+    for (auto it = audio_errors.cbegin(); error.empty() && it != audio_errors.cend(); it++)
+        error = it->second;
+
+    if (stop_pipeline) {
+        result = ProcessingError;
+        return false;
+    }
+
+    return true;
+}
+
+
+void D2V::index() {
+    TRACE_SPAN("index");
+
+    phase = PhaseReading;
+
+    // The audio may resume a little before the video.
+    int64_t seek_position = resume_position;
+    for (auto it = audio_streams.cbegin(); it != audio_streams.cend(); it++) {
+        if (it->second.resume_position >= 0)
+            seek_position = std::min(seek_position, it->second.resume_position);
+    }
+
+    if (seek_position > 0 && !f->seek(seek_position)) {
+        result = ProcessingError;
+        error = f->getError();
+        fclose(d2v_file);
+        closeAudioFiles(audio_files, f->fctx);
+        abandonExtraVideos(0, result);
+        return;
+    }
+
+    bool okay;
+    if (pipelined || (audio_threads && audio_files.size()))
+        okay = readPacketsThreaded();
+    else
+        okay = readPackets();
+    if (!okay) {
+        freeEarlyAudioPackets();
+        fclose(d2v_file);
+        closeAudioFiles(audio_files, f->fctx);
+        abandonExtraVideos(0, result);
+        return;
+    }
+
+
+    // Write the audio packets still held back, and calculate the audio delays like calculateAudioDelays does.
+    if (finding_audio_delays) {
+        first_video_keyframe_found.value = true;
+
+        for (auto it = audio_streams.begin(); it != audio_streams.end(); it++) {
+            if (!writeEarlyAudioPackets(it->second, error)) {
+                freeEarlyAudioPackets();
+                result = ProcessingError;
+                fclose(d2v_file);
+                closeAudioFiles(audio_files, f->fctx);
+                abandonExtraVideos(0, result);
+                return;
+            }
+        }
+    }
+
+    // Unless limitEarlyAudio got them from calculateAudioDelays.
+    if (finding_audio_delays && !audio_delays_calculated) {
+        AVRational time_base = video_stream->time_base;
+
+        int64_t video_pts = 0;
+        if (first_video_pts != AV_NOPTS_VALUE)
+            video_pts = first_video_pts * 1000 * time_base.num / time_base.den;
+
+        for (auto it = audio_streams.cbegin(); it != audio_streams.cend(); it++) {
+            int64_t delay = AV_NOPTS_VALUE;
+            if (it->second.first_pts != AV_NOPTS_VALUE)
+                delay = it->second.first_pts - video_pts;
+
+            audio_delay_map[it->second.stream->id] = delay;
+        }
+    }
+
+
+    finishIndex();
+
+    // The other video streams were read together with this one. Each has
+    // its own keyframes to check and its own d2v file to write.
+    for (size_t i = 0; i < extra_videos.size(); i++) {
+        if (result == ProcessingCancelled) {
+            abandonExtraVideos(i, result);
+            break;
+        }
+
+        extra_videos[i]->finishIndex();
+
+        // Whoever notices the cancellation clears the flag, so the rest
+        // must be stopped from here.
+        if (extra_videos[i]->result == ProcessingCancelled) {
+            abandonExtraVideos(i + 1, ProcessingCancelled);
+            break;
+        }
+    }
+}
+
+
+void D2V::finishIndex() {
+    TRACE_SPAN("finishIndex");
+
+    // If the last picture in the stream is an orphan field, discard it. lavc would not like it.
+    if (line.pictures.size() &&
+        line.pictures.back().picture_structure != AV_PICTURE_STRUCTURE_FRAME) {
+        line.pictures.pop_back();
+        frames_found--;
+    }
+
+
+    // Handle the very last GOP, I guess.
+    if (!isDataLineNull()) {
+        reorderDataLineFlags();
+        lines.push_back(line);
+        clearDataLine();
+    }
+
+
+    // Collect stats.
+    for (size_t i = 0; i < lines.size(); i++) {
+        stats.video_frames += lines[i].pictures.size();
+
+        for (size_t j = 0; j < lines[i].pictures.size(); j++) {
+            const Picture &picture = lines[i].pictures[j];
+
+            if (picture.flags & FLAGS_PROGRESSIVE)
+                stats.progressive_frames++;
+            if (picture.flags & FLAGS_TFF)
+                stats.tff_frames++;
+            if (picture.flags & FLAGS_RFF)
+                stats.rff_frames++;
+        }
+    }
+
+
+    if (!lines.size()) {
+        result = ProcessingFinished;
+        fclose(d2v_file);
+        closeAudioFiles(audio_files, f->fctx);
+        return;
+    }
+
+
+    // Here we must make sure d2vsource can actually obtain every keyframe.
+    // If it can't, we try to find a better location towards the previous keyframe.
+    // If somehow that fails, we move the offending line's frames to the previous line.
+    // At least h264 in mpegts requires this.
+    FakeFile::seek(fake_file, 0, SEEK_SET);
+    FFMPEG f2;
+    if (!f2.initFormat(*fake_file)) {
+        result = ProcessingError;
+        error = "Error while testing keyframe locations: " + f2.getError();
+        fclose(d2v_file);
+        closeAudioFiles(audio_files, f->fctx);
+        return;
+    }
+
+    AVPacket packet;
+    av_init_packet(&packet);
+
+    phase = PhaseVerifying;
+
+    // About a thousand progress reports in total.
+    size_t report_interval = std::max<size_t>(1, lines.size() / 1000);
+
+    // The lines taken from an existing d2v file were tested already.
+    for (size_t i = first_new_line; i < lines.size(); ) {
+        TRACE_SPAN("verify keyframe");
+
+        // Report progress because this takes a while. Especially with slow hard drives, probably.
+        if (progress_report && (i - first_new_line) % report_interval == 0)
+            progress_report((int64_t)i, (int64_t)lines.size(), progress_data);
+
+        // Same reason.
+        if (*cancel_flag) {
+            *cancel_flag = false;
+            result = ProcessingCancelled;
+            fclose(d2v_file);
+            closeAudioFiles(audio_files, f->fctx);
+            return;
+        }
+
+        int64_t target = lines[i].position;
+
+        fake_file->setOffsetFromRealStart(target);
+        FakeFile::seek(fake_file, 0, SEEK_SET);
+        avformat_seek_file(f2.fctx, video_stream->index, INT64_MIN, 0, INT64_MAX, AVSEEK_FLAG_BYTE);
+
+
+        do {
+            av_packet_unref(&packet);
+            av_read_frame(f2.fctx, &packet);
+        } while (f2.fctx->streams[packet.stream_index]->id != video_stream->id);
+
+        int64_t position = packet.pos;
+
+        av_packet_unref(&packet);
+
+        bool invalid_seek_point = position != 0;
+
+        if (invalid_seek_point) {
+            TRACE_SPAN("keyframe binary search");
+
+            int64_t previous_target = i ? lines[i - 1].position : -1;
+
+            // Binary search, yay.
+            int64_t minimum = previous_target;
+            int64_t maximum = target;
+
+            while (maximum - minimum > 1) {
+                int64_t middle = minimum + (maximum - minimum) / 2;
+
+                fake_file->setOffsetFromRealStart(middle);
+                FakeFile::seek(fake_file, 0, SEEK_SET);
+                avformat_seek_file(f2.fctx, video_stream->index, INT64_MIN, 0, INT64_MAX, AVSEEK_FLAG_BYTE);
+
+
+                do {
+                    av_packet_unref(&packet);
+                    av_read_frame(f2.fctx, &packet);
+                } while (f2.fctx->streams[packet.stream_index]->id != video_stream->id);
+
+                position = packet.pos;
+
+                av_packet_unref(&packet);
+
+                if (position == target - middle) { // middle is good
+                    if (log_message)
+                        log_message("Moving keyframe location " + std::to_string(fake_file->getPositionInRealFile(target)) + " to " + std::to_string(fake_file->getPositionInRealFile(middle)) + " (" + std::to_string(position) + " bytes).", log_data);
+
+                    lines[i].position = middle;
+
+                    break;
+                } else if (position > target - middle) { // middle resulted in packet too far to the right
+                    maximum = middle;
+                } else { // middle resulted in packet too far to the left
+                    minimum = middle;
+                }
             }
         }
 
@@ -737,6 +1479,8 @@ void D2V::index() {
         }
     }
 
+    buildFrameTable();
+
 
     if (!printHeader()) {
         result = ProcessingError;
@@ -745,22 +1489,29 @@ void D2V::index() {
         return;
     }
 
-    if (!printSettings()) {
+    if (!printSettings(getStreamType(f->fctx->iformat->name))) {
         result = ProcessingError;
         fclose(d2v_file);
         closeAudioFiles(audio_files, f->fctx);
         return;
     }
 
+    phase = PhaseWriting;
+
+    report_interval = std::max<size_t>(1, lines.size() / 1000);
+
     for (size_t i = 0; i < lines.size(); i++) {
-        if (stop_processing) {
-            stop_processing = false;
+        if (*cancel_flag) {
+            *cancel_flag = false;
             result = ProcessingCancelled;
             fclose(d2v_file);
             closeAudioFiles(audio_files, f->fctx);
             return;
         }
 
+        if (progress_report && i % report_interval == 0)
+            progress_report((int64_t)i, (int64_t)lines.size(), progress_data);
+
         if (!printDataLine(lines[i])) {
             result = ProcessingError;
             fclose(d2v_file);
@@ -787,13 +1538,114 @@ void D2V::index() {
         message += "    Top field first: " + std::to_string(stats.tff_frames) + "\n";
         message += "    Repeat:          " + std::to_string(stats.rff_frames);
 
+        if (stats.invalid_dimensions_skipped)
+            message += "\nSkipped pictures with invalid dimensions: " + std::to_string(stats.invalid_dimensions_skipped);
+        if (stats.unknown_picture_types_skipped)
+            message += "\nSkipped pictures of unknown type: " + std::to_string(stats.unknown_picture_types_skipped);
+
         log_message(message, log_data);
     }
 }
 
 
-void D2V::demuxVideo(FILE *video_file, int64_t start_gop_position, int64_t end_gop_position) {
+// Big enough that the kernel sees few, large writes.
+#define DEMUX_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Elementary streams only: the packets are just consecutive slices of the
+// input, so the bytes can be copied without parsing them.
+void D2V::copyVideoRange(FILE *video_file, int64_t start_gop_position, int64_t end_gop_position) {
+    int64_t total_size = fake_file->getTotalSize();
+    if (end_gop_position > total_size)
+        end_gop_position = total_size;
+
+    int64_t position = start_gop_position;
+
+    while (position < end_gop_position) {
+        if (*cancel_flag) {
+            *cancel_flag = false;
+            result = ProcessingCancelled;
+            fclose(video_file);
+            return;
+        }
+
+        if (progress_report)
+            progress_report(position - start_gop_position, end_gop_position - start_gop_position, progress_data);
+
+        int file_index = fake_file->getFileIndex(position);
+        const RealFile &real_file = (*fake_file)[file_index];
+
+        int64_t position_in_real_file = fake_file->getPositionInRealFile(position);
+        int64_t size = std::min<int64_t>(real_file.size - position_in_real_file, end_gop_position - position);
+        size = std::min<int64_t>(size, 16 * DEMUX_BUFFER_SIZE);
+
+        if (!copyFileRange(real_file.stream, position_in_real_file, size, video_file)) {
+            error = "Failed to copy the video data from file '" + real_file.name + "' at position " + std::to_string(position_in_real_file) + ".";
+
+            result = ProcessingError;
+
+            fclose(video_file);
+
+            return;
+        }
+
+        position += size;
+    }
+
+    // copyFileRange moved the real files' positions behind libavformat's
+    // back, so put them where the fake file thinks they are.
+    FakeFile::seek(fake_file, 0, SEEK_CUR);
+
+    if (fclose(video_file)) {
+        error = "Failed to write the video file: fclose() failed.";
+        result = ProcessingError;
+    }
+}
+
+
+void D2V::demuxVideo(FILE *video_file, int64_t start_gop_position, int64_t end_gop_position, FILE *demuxed_d2v_file, const std::string &demuxed_d2v_name, const std::string &demuxed_video_name) {
+    TRACE_SPAN("demuxVideo");
+
     result = ProcessingFinished;
+    phase = PhaseDemuxing;
+
+    // The lines of the GOPs being demuxed, and where each one will be in the video file.
+    size_t first_line = lines.size();
+    size_t end_line = lines.size();
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        int64_t position = getLinePosition(i);
+
+        if (position >= start_gop_position && first_line == lines.size())
+            first_line = i;
+
+        if (position >= end_gop_position) {
+            end_line = i;
+            break;
+        }
+    }
+
+    if (first_line > end_line)
+        first_line = end_line;
+
+    std::vector<int64_t> demuxed_positions(end_line - first_line, -1);
+
+    if (getStreamType(f->fctx->iformat->name) == ELEMENTARY_STREAM) {
+        for (size_t i = 0; i < demuxed_positions.size(); i++)
+            demuxed_positions[i] = getLinePosition(first_line + i) - start_gop_position;
+
+        copyVideoRange(video_file, start_gop_position, end_gop_position);
+
+        if (result != ProcessingFinished) {
+            if (demuxed_d2v_file)
+                fclose(demuxed_d2v_file);
+            return;
+        }
+
+        if (demuxed_d2v_file)
+            writeDemuxedD2V(demuxed_d2v_file, demuxed_d2v_name, demuxed_video_name, first_line, demuxed_positions);
+
+        return;
+    }
 
     f->deselectAllStreams();
 
@@ -801,14 +1653,45 @@ void D2V::demuxVideo(FILE *video_file, int64_t start_gop_position, int64_t end_g
 
     f->seek(start_gop_position);
 
+    // Packets are small, so they are gathered here and written in big chunks.
+    std::vector<uint8_t> buffer;
+    buffer.reserve(DEMUX_BUFFER_SIZE);
+
+    int64_t bytes_demuxed = 0;
+    size_t next_line = 0;
+
+    auto flushBuffer = [&] () -> bool {
+        if (buffer.empty())
+            return true;
+
+        bool ok = fwrite(buffer.data(), 1, buffer.size(), video_file) == buffer.size();
+
+        buffer.clear();
+
+        if (!ok) {
+            char id[20] = { 0 };
+            snprintf(id, 19, "%x", video_stream->id);
+            error = "Failed to write video packets from stream id ";
+            error += id;
+            error += ": fwrite() failed.";
+
+            result = ProcessingError;
+        }
+
+        return ok;
+    };
+
     AVPacket packet;
     av_init_packet(&packet);
 
     while (av_read_frame(f->fctx, &packet) == 0) {
-        if (stop_processing) {
-            stop_processing = false;
+        if (*cancel_flag) {
+            *cancel_flag = false;
             result = ProcessingCancelled;
+            av_packet_unref(&packet);
             fclose(video_file);
+            if (demuxed_d2v_file)
+                fclose(demuxed_d2v_file);
             return;
         }
 
@@ -826,26 +1709,115 @@ void D2V::demuxVideo(FILE *video_file, int64_t start_gop_position, int64_t end_g
         if (progress_report)
             progress_report(packet.pos - start_gop_position, end_gop_position - start_gop_position, progress_data);
 
-        if (fwrite(packet.data, 1, packet.size, video_file) < (size_t)packet.size) {
-            char id[20] = { 0 };
-            snprintf(id, 19, "%x", video_stream->id);
-            error = "Failed to write video packet from stream id ";
-            error += id;
-            error += ": fwrite() failed.";
+        // A GOP starts in the first packet at or after the line's position.
+        while (next_line < demuxed_positions.size() && getLinePosition(first_line + next_line) <= packet.pos)
+            demuxed_positions[next_line++] = bytes_demuxed;
 
-            result = ProcessingError;
+        buffer.insert(buffer.end(), packet.data, packet.data + packet.size);
+        bytes_demuxed += packet.size;
 
-            av_packet_unref(&packet);
+        av_packet_unref(&packet);
 
+        if (buffer.size() >= DEMUX_BUFFER_SIZE && !flushBuffer()) {
             fclose(video_file);
-
+            if (demuxed_d2v_file)
+                fclose(demuxed_d2v_file);
             return;
         }
+    }
 
-        av_packet_unref(&packet);
+    if (!flushBuffer()) {
+        fclose(video_file);
+        if (demuxed_d2v_file)
+            fclose(demuxed_d2v_file);
+        return;
     }
 
-    fclose(video_file);
+    if (fclose(video_file)) {
+        error = "Failed to write the video file: fclose() failed.";
+        result = ProcessingError;
+        if (demuxed_d2v_file)
+            fclose(demuxed_d2v_file);
+        return;
+    }
+
+    if (demuxed_d2v_file)
+        writeDemuxedD2V(demuxed_d2v_file, demuxed_d2v_name, demuxed_video_name, first_line, demuxed_positions);
+}
+
+
+int64_t D2V::getLinePosition(size_t line_index) const {
+    return fake_file->getPositionInFakeFile(lines[line_index].position, lines[line_index].file);
+}
+
+
+// The demuxed video contains the same GOPs, so its d2v file is this one's
+// lines with the positions in the demuxed video. GOPs that didn't make it
+// into the video file (positions of -1) are left out.
+void D2V::writeDemuxedD2V(FILE *demuxed_d2v_file, const std::string &demuxed_d2v_name, const std::string &demuxed_video_name, size_t first_line, const std::vector<int64_t> &demuxed_positions) {
+    FakeFile demuxed_fake_file;
+    demuxed_fake_file.push_back(demuxed_video_name);
+
+    D2V demuxed;
+    demuxed.d2v_file_name = demuxed_d2v_name;
+    demuxed.d2v_file = demuxed_d2v_file;
+    demuxed.fake_file = &demuxed_fake_file;
+    demuxed.f = f;
+    demuxed.video_stream = video_stream;
+    demuxed.input_range = input_range;
+    demuxed.use_relative_paths = use_relative_paths;
+    demuxed.guessed_frame_rate = guessed_frame_rate;
+
+    for (size_t i = 0; i < demuxed_positions.size(); i++) {
+        if (demuxed_positions[i] < 0)
+            continue;
+
+        DataLine demuxed_line = lines[first_line + i];
+        demuxed_line.file = 0;
+        demuxed_line.position = demuxed_positions[i];
+
+        demuxed.lines.push_back(demuxed_line);
+    }
+
+    bool okay = demuxed.printHeader() &&
+                demuxed.printSettings(ELEMENTARY_STREAM);
+
+    for (size_t i = 0; okay && i < demuxed.lines.size(); i++)
+        okay = demuxed.printDataLine(demuxed.lines[i]);
+
+    okay = okay && demuxed.printStreamEnd();
+
+    if (fclose(demuxed_d2v_file) && okay) {
+        demuxed.error = "Failed to write the d2v file: fclose() failed.";
+        okay = false;
+    }
+
+    if (!okay) {
+        error = "Failed to write d2v file '" + demuxed_d2v_name + "': " + demuxed.error;
+        result = ProcessingError;
+    }
+}
+
+
+void D2V::demuxAudio() {
+    TRACE_SPAN("demuxAudio");
+
+    audio_only = true;
+    phase = PhaseReading;
+
+    video_stream->discard = AVDISCARD_ALL;
+
+    bool okay;
+    if (pipelined || audio_threads)
+        okay = readPacketsThreaded();
+    else
+        okay = readPackets();
+
+    if (okay)
+        result = ProcessingFinished;
+
+    freeEarlyAudioPackets();
+    closeAudioFiles(audio_files, f->fctx);
 }
 
 
@@ -854,88 +1826,131 @@ D2V::ProcessingResult D2V::getResult() const {
 }
 
 
-// Terribly inefficient but speed is not really important here.
-int D2V::getGOPStartFrame(int frame) const {
-    int total = 0;
+D2V::ProcessingPhase D2V::getPhase() const {
+    return phase;
+}
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        total += lines[i].pictures.size();
 
-        if (frame < total)
-            return total - lines[i].pictures.size();
-    }
+int D2V::getGOPsFound() const {
+    return (int)lines.size();
+}
 
-    return -1;
+
+int D2V::getFramesFound() const {
+    return frames_found;
 }
 
 
-int D2V::getNextGOPStartFrame(int frame) const {
+void D2V::buildFrameTable() {
+    line_start_frames.resize(lines.size() + 1);
+
     int total = 0;
 
     for (size_t i = 0; i < lines.size(); i++) {
+        line_start_frames[i] = total;
         total += lines[i].pictures.size();
-
-        if (frame < total)
-            return total;
     }
 
-    return -1;
+    line_start_frames[lines.size()] = total;
 }
 
 
-int64_t D2V::getGOPStartPosition(int frame) const {
-    int total = 0;
+// Returns -1 if the frame doesn't exist.
+int D2V::findLine(int frame) const {
+    if (frame < 0 || frame >= getNumFrames())
+        return -1;
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        total += lines[i].pictures.size();
+    // The last line starting at or before the frame. Lines without pictures are skipped this way.
+    auto it = std::upper_bound(line_start_frames.cbegin(), line_start_frames.cend(), frame);
 
-        if (frame < total)
-            return lines[i].position;
-    }
+    return it - line_start_frames.cbegin() - 1;
+}
+
+
+int D2V::getGOPStartFrame(int frame) const {
+    int i = findLine(frame);
+    if (i < 0)
+        return -1;
 
-    return -1;
+    return line_start_frames[i];
 }
 
 
-int64_t D2V::getNextGOPStartPosition(int frame) const {
-    int total = 0;
+int D2V::getNextGOPStartFrame(int frame) const {
+    int i = findLine(frame);
+    if (i < 0)
+        return -1;
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        total += lines[i].pictures.size();
+    return line_start_frames[i + 1];
+}
 
-        if (frame < total) {
-            if (i < lines.size() - 1)
-                return lines[i + 1].position;
-            else
-                return INT64_MAX;
-        }
-    }
 
-    return -1;
+int64_t D2V::getGOPStartPosition(int frame) const {
+    int i = findLine(frame);
+    if (i < 0)
+        return -1;
+
+    return getLinePosition(i);
 }
 
 
-bool D2V::isOpenGOP(int frame) const {
-    int total = 0;
+int64_t D2V::getNextGOPStartPosition(int frame) const {
+    int i = findLine(frame);
+    if (i < 0)
+        return -1;
+
+    if ((size_t)i < lines.size() - 1)
+        return getLinePosition(i + 1);
+    else
+        return INT64_MAX;
+}
 
-    for (size_t i = 0; i < lines.size(); i++) {
-        total += lines[i].pictures.size();
 
-        if (frame < total)
-            return !(lines[i].info & INFO_CLOSED_GOP);
-    }
+bool D2V::isOpenGOP(int frame) const {
+    int i = findLine(frame);
+    if (i < 0)
+        return false;
 
-    return false;
+    return !(lines[i].info & INFO_CLOSED_GOP);
 }
 
 
 int D2V::getNumFrames() const {
-    int total = 0;
+    if (line_start_frames.empty())
+        return 0;
 
-    for (size_t i = 0; i < lines.size(); i++)
-        total += lines[i].pictures.size();
+    return line_start_frames.back();
+}
+
+
+void D2V::getFrameTable(std::vector<FrameIndex::GOP> &gops, std::vector<uint8_t> &frame_flags) const {
+    gops.clear();
+    gops.reserve(lines.size());
+
+    frame_flags.clear();
+    frame_flags.reserve(getNumFrames());
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        FrameIndex::GOP gop;
+        gop.position = lines[i].position;
+        gop.first_frame = line_start_frames[i];
+        gop.file = lines[i].file;
+        gop.info = lines[i].info;
+        gops.push_back(gop);
+
+        for (size_t j = 0; j < lines[i].pictures.size(); j++)
+            frame_flags.push_back(lines[i].pictures[j].flags);
+    }
+}
 
-    return total;
+
+bool D2V::writeFrameIndex(const std::string &path) {
+    std::vector<FrameIndex::GOP> gops;
+    std::vector<uint8_t> frame_flags;
+
+    getFrameTable(gops, frame_flags);
+
+    return FrameIndex::write(path, gops, frame_flags, error);
 }
 
 
@@ -985,6 +2000,24 @@ std::string suggestD2VName(const std::string &video_name) {
 }
 
 
+std::string suggestVideoTrackD2VName(const std::string &d2v_name, const AVStream *stream) {
+    std::string suggestion = d2v_name;
+
+    size_t last_dot = suggestion.find_last_of('.');
+    if (last_dot != std::string::npos)
+        suggestion.erase(last_dot);
+
+    char id[20] = { 0 };
+    snprintf(id, 19, "%x", stream->id);
+
+    suggestion += " V";
+    suggestion += id;
+    suggestion += ".d2v";
+
+    return suggestion;
+}
+
+
 std::string suggestAudioTrackSuffix(const AVStream *stream, const AudioDelayMap &audio_delay_map) {
     std::string suggestion = " T";
 
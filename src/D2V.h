@@ -22,6 +22,7 @@ SOFTWARE.
 #define D2V_WITCH_D2V_H
 
 
+#include <atomic>
 #include <cstdint>
 #include <string>
 #include <unordered_map>
@@ -35,6 +36,8 @@ extern "C" {
 #include "Audio.h"
 #include "FakeFile.h"
 #include "FFMPEG.h"
+#include "FrameIndex.h"
+#include "LPCM.h"
 #include "MPEGParser.h"
 
 
@@ -60,6 +63,14 @@ public:
         ColourRangeFull
     };
 
+    // What the progress function is counting.
+    enum ProcessingPhase {
+        PhaseReading,   // Bytes of input, in index and demuxAudio.
+        PhaseVerifying, // Lines, while index tests the keyframe locations.
+        PhaseWriting,   // Lines, while index writes the d2v file.
+        PhaseDemuxing   // Bytes of the range, in demuxVideo.
+    };
+
 
     typedef void (*ProgressFunction)(int64_t current_position, int64_t total_size, void *progress_data);
     typedef void (*LoggingFunction)(const std::string &message, void *log_data);
@@ -70,11 +81,17 @@ public:
         int tff_frames;
         int rff_frames;
 
+        // Pictures that were left out. Only the first of each kind is logged.
+        int invalid_dimensions_skipped;
+        int unknown_picture_types_skipped;
+
         Stats()
             : video_frames(0)
             , progressive_frames(0)
             , tff_frames(0)
             , rff_frames(0)
+            , invalid_dimensions_skipped(0)
+            , unknown_picture_types_skipped(0)
         { }
     };
 
@@ -82,21 +99,74 @@ public:
 
     D2V(const std::string &_d2v_file_name, FILE *_d2v_file, const AudioFilesMap &_audio_files, FakeFile *_fake_file, FFMPEG *_f, AVStream *_video_stream, int64_t _first_video_keyframe_pos, ColourRange _input_range, bool _use_relative_paths, ProgressFunction _progress_report, void *_progress_data, LoggingFunction _log_message, void *_log_data);
 
+    // A copy of other without the d2v and audio files, which reads from
+    // another instance of the same input files. Several such copies can
+    // demux different ranges at the same time.
+    D2V(const D2V &other, FakeFile *_fake_file, FFMPEG *_f, AVStream *_video_stream, ProgressFunction _progress_report, void *_progress_data, LoggingFunction _log_message, void *_log_data);
+
     const std::string &getD2VFileName() const;
 
     const Stats &getStats() const;
 
     const std::string &getError() const;
 
+    // Read, parse, and write in separate threads.
+    void setPipelined(bool enabled);
+
+    // Write each audio track in its own thread. Enabled by default.
+    void setAudioThreads(bool enabled);
+
+    // Processing stops when *flag becomes true, and *flag is set back to
+    // false. The global stop_processing by default.
+    void setCancelFlag(std::atomic_bool *flag);
+
+    // Find the first video keyframe and the audio delays while indexing,
+    // instead of using _first_video_keyframe_pos. Only works when the
+    // indexing starts at the beginning of the file.
+    void setFindAudioDelays(bool enabled);
+
+    // Key: audio stream id. Only filled by setFindAudioDelays.
+    const AudioDelayMap &getAudioDelays() const;
+
+    // Also index the video stream of other while reading the input, so
+    // that several video streams need only one pass. other must read from
+    // the same input through the same FFMPEG object, with its parser set
+    // up by FFMPEG::initExtraVideoCodec, and it must have no audio files.
+    // index() finishes other after this object, so other's index() must
+    // not be called. Not for appending.
+    void addVideoStream(D2V *other);
+
+    // audio_resume_points comes from getAudioResumePoints of the run that
+    // wrote old_d2v_name, and must have every audio track. The audio files
+    // must have been cut back to those sizes.
+    bool prepareAppend(const std::string &old_d2v_name, const AudioResumeMap &audio_resume_points);
+
+    // For prepareAppend, when the input has grown. Wave64 files are left
+    // out, because they can't be extended.
+    AudioResumeMap getAudioResumePoints() const;
+
     void index();
 
-    void demuxVideo(FILE *video_file, int64_t start_gop_position, int64_t end_gop_position);
+    // If demuxed_d2v_file is not null, the d2v file for the demuxed video
+    // is written too, made from this object's lines, so the demuxed video
+    // doesn't have to be indexed again. The files are closed.
+    void demuxVideo(FILE *video_file, int64_t start_gop_position, int64_t end_gop_position, FILE *demuxed_d2v_file = nullptr, const std::string &demuxed_d2v_name = std::string(), const std::string &demuxed_video_name = std::string());
+
+    // Writes only the audio files. The video is not parsed and the d2v
+    // file is not touched, so _first_video_keyframe_pos must be correct.
+    void demuxAudio();
 
     ProcessingResult getResult() const;
 
+    // These three may be called from the progress function.
+    ProcessingPhase getPhase() const;
+    int getGOPsFound() const;
+    int getFramesFound() const;
+
     int getGOPStartFrame(int frame) const;
     int getNextGOPStartFrame(int frame) const;
 
+    // Positions in the fake file.
     int64_t getGOPStartPosition(int frame) const;
     int64_t getNextGOPStartPosition(int frame) const;
 
@@ -104,12 +174,16 @@ public:
 
     int getNumFrames() const;
 
+    // The lines and frames found, in the form written by writeFrameIndex.
+    void getFrameTable(std::vector<FrameIndex::GOP> &gops, std::vector<uint8_t> &frame_flags) const;
+
+    bool writeFrameIndex(const std::string &path);
+
     static int getStreamType(const char *name);
 
     static bool isSupportedVideoCodecID(AVCodecID id);
 
-private:
-    // 12 bits
+    // 12 bits. Also in the GOPs of getFrameTable.
     enum InfoField {
         INFO_BIT11 = (1 << 11),
         INFO_CLOSED_GOP = (1 << 10),
@@ -118,6 +192,9 @@ private:
         // The rest are reserved (0).
     };
 
+private:
+    // Times the private hot paths on their own. See bench/Benchmark.cpp.
+    friend class D2VBenchmark;
 
     // 8 bits
     enum FlagsField {
@@ -140,6 +217,82 @@ private:
     };
 
 
+    // D2V objects get copied, but std::atomic_bool can't be.
+    struct CopyableAtomicBool {
+        std::atomic_bool value;
+
+        CopyableAtomicBool(bool _value = false)
+            : value(_value)
+        { }
+
+        CopyableAtomicBool(const CopyableAtomicBool &other)
+            : value(other.value.load())
+        { }
+
+        CopyableAtomicBool &operator=(const CopyableAtomicBool &other) {
+            value = other.value.load();
+            return *this;
+        }
+    };
+
+
+    struct AudioStream {
+        // Not f->fctx->streams[i], because the demuxer may be adding
+        // streams in another thread.
+        const AVStream *stream;
+
+        // We need this per-stream state because many audio packets have pos of -1.
+        bool seen_packet_after_first_video_keyframe;
+
+        // Timestamp of the first packet written, in milliseconds.
+        int64_t first_pts;
+
+        // Received before the first video keyframe was found.
+        std::vector<AVPacket *> early_packets;
+
+        // When appending, the packets before this position are in the
+        // audio file already. -1 otherwise.
+        int64_t resume_position;
+
+        // For getAudioResumePoints. Not counted for Wave64 files.
+        int64_t bytes_written;
+        int64_t last_packet_position;
+        int64_t size_before_last_packet;
+
+        AudioStream(const AVStream *_stream)
+            : stream(_stream)
+            , seen_packet_after_first_video_keyframe(false)
+            , first_pts(AV_NOPTS_VALUE)
+            , early_packets{ }
+            , resume_position(-1)
+            , bytes_written(0)
+            , last_packet_position(-1)
+            , size_before_last_packet(0)
+        { }
+    };
+
+
+    struct LPCMStream {
+        LPCMUnpacker unpacker;
+
+        // The first packets are also decoded with libavcodec, and
+        // libavcodec is used from then on if the results differ.
+        int checked_packets;
+        bool use_lavc;
+
+        std::vector<uint8_t> unpacked_samples;
+        std::vector<uint8_t> decoded_samples;
+
+        LPCMStream(AVCodecID codec_id)
+            : unpacker(codec_id)
+            , checked_packets(0)
+            , use_lavc(false)
+            , unpacked_samples{ }
+            , decoded_samples{ }
+        { }
+    };
+
+
     struct DataLine {
         int info;
         int matrix;
@@ -174,6 +327,7 @@ private:
     void *progress_data;
     LoggingFunction log_message;
     void *log_data;
+    std::atomic_bool *cancel_flag;
 
     DataLine line;
 
@@ -187,8 +341,50 @@ private:
     // with pos2 < pos1.
     int64_t first_video_keyframe_pos;
 
+    // When finding the audio delays while indexing, audio packets are held
+    // back until the video thread finds the first video keyframe.
+    bool finding_audio_delays;
+    CopyableAtomicBool first_video_keyframe_found;
+
+    // Taken by whoever sets first_video_keyframe_pos: the video thread when
+    // it finds the keyframe, or the reading thread when too much audio was
+    // held back and it calls calculateAudioDelays instead.
+    CopyableAtomicBool first_video_keyframe_claimed;
+
+    // Passed on while waiting for the first video keyframe. Only used by
+    // the reading thread.
+    int64_t early_audio_bytes;
+
+    // Set when audio_delay_map came from calculateAudioDelays.
+    bool audio_delays_calculated;
+
+    // Smallest video timestamp found in between (in coded order) the first
+    // two keyframes. Like in calculateAudioDelays.
+    int64_t first_video_pts;
+    bool second_video_keyframe_found;
+
+    AudioDelayMap audio_delay_map;
+
+    // Key: AVPacket::stream_index
+    // All the keys are inserted in the constructor, so that the audio
+    // threads can each modify their own element without locking.
+    std::unordered_map<int, AudioStream> audio_streams;
+
     // Key: AVPacket::stream_index
-    std::unordered_set<int> seen_audio_frame_from_these_streams_after_first_video_keyframe;
+    std::unordered_map<int, LPCMStream> lpcm_streams;
+
+    // When appending to an existing d2v file, indexing starts again from
+    // the last GOP in the file, because it may have been incomplete. The
+    // lines before first_new_line come from the existing d2v file.
+    int64_t resume_position;
+    size_t first_new_line;
+
+    bool pipelined;
+    bool audio_threads;
+
+    // Set by demuxAudio.
+    bool audio_only;
+    int64_t last_reported_position;
 
     Stats stats;
 
@@ -196,8 +392,24 @@ private:
 
     ProcessingResult result;
 
+    ProcessingPhase phase;
+
+    // Pictures added to lines and line so far.
+    int frames_found;
+
     std::vector<DataLine> lines;
 
+    // Number of the first frame of each line, plus the total number of
+    // frames at the end. For finding a frame's line with a binary search.
+    std::vector<int> line_start_frames;
+
+    // Indexed in the same pass as this object's video stream.
+    std::vector<D2V *> extra_videos;
+
+    // Added to another object's extra_videos, so it uses the parser in
+    // f->extra_parsers.
+    bool extra_video;
+
 
     void clearDataLine();
 
@@ -207,19 +419,58 @@ private:
 
     bool printHeader();
 
-    bool printSettings();
+    bool printSettings(int stream_type);
 
     bool printDataLine(const DataLine &data_line);
 
     bool handleVideoPacket(AVPacket *packet);
 
-    bool handleAudioPacket(AVPacket *packet);
+    bool decodeLPCMPacket(AVPacket *packet, const AVStream *stream, std::vector<uint8_t> &samples, std::string &audio_error);
+
+    bool writeAudioPacket(AVPacket *packet, AudioStream &audio, std::string &audio_error);
+
+    bool handleAudioPacket(AVPacket *packet, std::string &audio_error);
+
+    bool writeEarlyAudioPackets(AudioStream &audio, std::string &audio_error);
+
+    void freeEarlyAudioPackets();
+
+    bool limitEarlyAudio(const AVPacket *packet);
+
+    bool isWantedPacket(const AVPacket *packet);
+
+    // This object or one of extra_videos, or null if the packet is not video.
+    D2V *findVideoD2V(int stream_index);
+
+    // Closes the d2v files of extra_videos from first on.
+    void abandonExtraVideos(size_t first, ProcessingResult abandoned_result);
+
+    void reportReadingProgress(int64_t position);
+
+    void copyVideoRange(FILE *video_file, int64_t start_gop_position, int64_t end_gop_position);
+
+    int64_t getLinePosition(size_t line_index) const;
+
+    void writeDemuxedD2V(FILE *demuxed_d2v_file, const std::string &demuxed_d2v_name, const std::string &demuxed_video_name, size_t first_line, const std::vector<int64_t> &demuxed_positions);
+
+    bool readPackets();
+
+    bool readPacketsThreaded();
 
     bool printStreamEnd();
+
+    // Everything index() does after reading the input.
+    void finishIndex();
+
+    void buildFrameTable();
+
+    int findLine(int frame) const;
 };
 
 
 std::string suggestD2VName(const std::string &video_name);
+// When several video tracks are indexed, each gets its own d2v file.
+std::string suggestVideoTrackD2VName(const std::string &d2v_name, const AVStream *stream);
 std::string suggestAudioTrackSuffix(const AVStream *stream, const AudioDelayMap &audio_delay_map);
 
 #endif // D2V_WITCH_D2V_H
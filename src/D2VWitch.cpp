@@ -18,7 +18,9 @@ SOFTWARE.
 */
 
 
+#include <algorithm>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -39,7 +41,6 @@ extern "C" {
 #endif
 
 #include <QApplication>
-#include <QDir>
 #include <QFileInfo>
 
 
@@ -58,9 +59,18 @@ Q_IMPORT_PLUGIN (QWindowsIntegrationPlugin);
 #include "Audio.h"
 #include "Bullshit.h"
 #include "D2V.h"
+#include "DemuxRanges.h"
 #include "FakeFile.h"
 #include "FFMPEG.h"
+#include "FrameIndex.h"
 #include "GUIWindow.h"
+#include "IndexJob.h"
+#include "IndexState.h"
+#include "JSONProgress.h"
+#include "Server.h"
+#include "Trace.h"
+#include "VOBSequence.h"
+#include "Watch.h"
 
 
 void printProgress(int64_t current_position, int64_t total_size, void *) {
@@ -73,6 +83,28 @@ void printWarnings(const std::string &message, void *) {
 }
 
 
+// Lets the JSON progress follow the phases of the D2V object that an
+// IndexJob makes.
+struct JSONIndexProgress {
+    JSONProgress *progress;
+    const IndexJob *index_job;
+
+    static void progressFunction(int64_t current_position, int64_t total_size, void *progress_data) {
+        JSONIndexProgress *json = (JSONIndexProgress *)progress_data;
+
+        json->progress->followD2V(json->index_job->getD2V());
+        json->progress->report(current_position, total_size);
+    }
+};
+
+
+void finishTrace() {
+    std::string error;
+    if (!traceFinish(error))
+        fprintf(stderr, "%s\n", error.c_str());
+}
+
+
 void printHelp() {
     const char usage[] = R"usage(
 D2V Witch indexes various streams and writes D2V files. These can
@@ -100,9 +132,30 @@ Options:
         Do not print progress information or warnings. Fatal errors are
         always printed.
 
+    --progress-format <text|json>
+        With "json", the progress and the warnings are printed to
+        standard error as one JSON object per line. Each object has an
+        "event" member: "phase" when a phase starts (probe,
+        audio-delays, index, verify, write, demux), "progress" with the
+        bytes or lines done and the total, the speed in MB/s, the
+        estimated seconds left, and the frames and GOPs found so far,
+        "log" for a warning, and "summary" with the result and the
+        statistics after indexing. Fatal errors are still printed as
+        plain text. The default is "text".
+
+    --trace <file name>
+        Record how long the various parts of the work take, in each
+        thread, and write it to the specified file in the Chrome trace
+        event format. The file can be opened with chrome://tracing or
+        https://ui.perfetto.dev. Builds configured without tracing
+        support reject this option.
+
     --output <d2v name>
         Specify the name of the D2V file. The special name "-" means
-        standard output. If not specified, the name of the D2V file is
+        standard output, and "fd:N" means the file descriptor N, which
+        must be open for writing already. In these two cases the names
+        of the other output files are deduced from the name of the
+        first input file. If not specified, the name of the D2V file is
         deduced from the name of the first input file.
 
     --audio-ids <id1,id2,...>
@@ -115,6 +168,18 @@ Options:
         Process the video track with this id. By default, the first
         video track found will be processed.
 
+    --video-ids <id1,id2,...>
+        Process the video tracks with the specified ids, or all the
+        video tracks with the special value "all", while reading the
+        input files only once. Each track gets its own D2V file, called
+        "<D2V name without extension> V<id>.d2v". The audio files are
+        named as if there was only one D2V file. With
+        --progress-format json, there is one "summary" event per D2V
+        file, in the order of the tracks. This option can't be used
+        together with --video-id, --append, --skip-if-current,
+        --audio-only, --demux-ranges, or --watch, or when the D2V file
+        is written to standard output or to a file descriptor.
+
     --input-range <range>
         Set the YUVRGB_Scale field in the d2v file according to the
         video's input colour range. Possible values are "limited" and
@@ -134,6 +199,129 @@ Options:
         stored in the program's configuration file. If no value is
         stored in the configuration file, then the default is 'no'.
 
+    --append
+        Extend an existing d2v file instead of indexing the input
+        file(s) from the beginning. This is meant for recordings that
+        are still growing. Only the data added since the d2v file was
+        written is indexed. The audio tracks are extended too, starting
+        again from their last packet, which the end of the input may have
+        cut short. The d2v file is replaced only after the new one is
+        complete.
+
+        This requires the file "<d2v name>.state", which is written
+        next to the d2v file whenever this option is used, and removed
+        when the d2v file is written without this option. If the
+        state file doesn't exist, or if the input files changed in any
+        other way than the last one growing, the input files are
+        indexed from the beginning. Audio tracks stored in Wave64
+        files can't be extended, so with those the input files are
+        always indexed from the beginning. If indexing fails, the audio
+        files are left without their last packet.
+
+    --skip-if-current
+        Do nothing if the d2v file and the audio files were already
+        produced from the same input files, with the same options. The
+        input files are compared by size, modification time, and the
+        MD5 of their first and last 64 KiB. The options compared are
+        the video id, the audio ids, the input range, the relative
+        paths setting, and whether a frame index is written.
+
+        This uses the same state file as --append. When this option is
+        used, the state file is written after indexing.
+
+    --frame-index
+        Also write the file "<d2v name>.idx", a binary index of the
+        frames and GOPs in the d2v file. It lets other programs find
+        the GOP of any frame without parsing the d2v file. The format
+        is described in src/FrameIndex.h.
+
+    --pipelined
+        Parse the video in a separate thread from the one reading the
+        input file(s). This is faster when the video parsing keeps one
+        CPU core busy. The output files are the same as without this
+        option.
+
+    --no-audio-threads
+        Write the audio tracks in the same thread that reads the input
+        file(s). By default each audio track is written by its own
+        thread, so that decoding and writing many LPCM tracks doesn't
+        slow down the video parsing.
+
+    --audio-only
+        Write only the audio tracks, without parsing the video or
+        writing the d2v file. The audio files get the same names as
+        they would without this option. The delays are still relative
+        to the first video keyframe. If --audio-ids is not used, all
+        the audio tracks are written. This option can't be used
+        together with --append, --skip-if-current, or --frame-index.
+
+    --demux-ranges <first-last,first-last,...>
+        After indexing, demux each range of frames from the video track
+        into its own file, called
+        "<d2v name without extension>.<first>-<last>.m2v". The ranges
+        are extended to whole GOPs, so the files may contain a few more
+        frames than requested. The frame numbers in the file names are
+        the ones actually demuxed. This option can't be used together
+        with --skip-if-current or --audio-only.
+
+    --demux-jobs <number>
+        Demux this many ranges at the same time. The default is the
+        number of CPU cores. Use a lower number when the input and
+        output files are on the same slow disk.
+
+    --demux-output <name>
+        Write the video demuxed because of --demux-ranges to this file
+        instead. The names "-" and "fd:N" work like they do with
+        --output, so the video can be piped straight into an encoder.
+        This option requires a single range.
+
+    --index-demuxed
+        Also write a d2v file for each file written because of
+        --demux-ranges. The d2v files are made from the input's index
+        while the video is demuxed, so the demuxed video is not read
+        again. They get the same names as the video files, with the
+        extension "d2v". This option can't be used when the video is
+        written to standard output or to a file descriptor.
+
+    --serve <socket name>
+        Don't index anything right away. Instead, listen on a Unix
+        socket for indexing jobs until asked to shut down. See the
+        readme for the requests and the replies. Recently used inputs
+        are kept open and probed, so indexing them again with other
+        options starts sooner. Not available on Windows.
+
+    --serve-workers <number>
+        With --serve, run this many jobs at the same time. The default
+        is the number of CPU cores.
+
+    --client <socket name>
+        Send the requests read from standard input, one per line, to
+        the server listening on the socket, and print its replies to
+        standard output. Exits when the server has answered every
+        request, with an error if any job didn't finish.
+
+    --watch <folder name>
+        Don't index anything right away. Instead, index every video
+        file that is written or moved into the folder from now on,
+        until interrupted, with the d2v and audio files written next to
+        it. The options that say how to index apply to every file.
+        Files called "VTS_xx_y.VOB" are indexed together with the rest
+        of their sequence, once none of its files changed for the time
+        given with --watch-settle. Only files with the usual extensions
+        of MPEG program, transport, and video elementary streams are
+        indexed. With --progress-format json, the events have a
+        "job" member with the name of the first file, and a "done"
+        event says how indexing it ended. Only available on Linux.
+
+    --watch-settle <seconds>
+        With --watch, a file is complete when the program writing it
+        closes it, or when its size doesn't change for this long. The
+        default is 10 seconds.
+
+    --watch-jobs <number>
+        With --watch, index this many files or sequences at the same
+        time. The default is 2.
+
     --single-input
         Index only the one file provided on the command line. Without
         this parameter, D2V Witch will detect sequences of files
@@ -264,6 +452,10 @@ struct CommandLine {
 
     bool stay_quiet;
 
+    bool json_progress;
+
+    std::string trace_path;
+
     std::string d2v_path;
 
     std::vector<int> audio_ids;
@@ -272,6 +464,9 @@ struct CommandLine {
     int video_id;
     bool have_video_id;
 
+    std::vector<int> video_ids;
+    bool video_ids_all;
+
     D2V::ColourRange input_range;
 
     int ffmpeg_log_level;
@@ -281,6 +476,38 @@ struct CommandLine {
 
     bool single_input;
 
+    bool append;
+
+    bool skip_if_current;
+
+    bool frame_index;
+
+    bool pipelined;
+
+    bool audio_threads;
+
+    bool audio_only;
+
+    std::vector<DemuxRange> demux_ranges;
+
+    std::string demux_output;
+
+    int demux_jobs;
+
+    bool index_demuxed;
+
+    std::string serve_socket;
+
+    int serve_workers;
+
+    std::string client_socket;
+
+    std::string watch_folder;
+
+    int watch_settle;
+
+    int watch_jobs;
+
     std::string error;
 
     CommandLine()
@@ -288,16 +515,36 @@ struct CommandLine {
         , version_wanted(false)
         , info_wanted(false)
         , stay_quiet(false)
+        , json_progress(false)
+        , trace_path{ }
         , d2v_path{ }
         , audio_ids{ }
         , audio_ids_all(false)
         , video_id(0)
         , have_video_id(false)
+        , video_ids{ }
+        , video_ids_all(false)
         , input_range(D2V::ColourRangeLimited)
         , ffmpeg_log_level(AV_LOG_PANIC)
         , relative_paths(KEY_DEFAULT_USE_RELATIVE_PATHS)
         , have_relative_paths(false)
         , single_input(false)
+        , append(false)
+        , skip_if_current(false)
+        , frame_index(false)
+        , pipelined(false)
+        , audio_threads(true)
+        , audio_only(false)
+        , demux_ranges{ }
+        , demux_output{ }
+        , demux_jobs(std::max(1u, std::thread::hardware_concurrency()))
+        , index_demuxed(false)
+        , serve_socket{ }
+        , serve_workers(std::max(1u, std::thread::hardware_concurrency()))
+        , client_socket{ }
+        , watch_folder{ }
+        , watch_settle(10)
+        , watch_jobs(2)
         , error{ }
     { }
 
@@ -305,6 +552,53 @@ struct CommandLine {
         return error;
     }
 
+    // The options that affect the contents of the d2v and audio files.
+    // Everything that changes what the d2v file, the frame index, and
+    // the audio files contain.
+    std::string getIndexingOptions() const {
+        std::string options;
+
+        options += "video=";
+        if (video_ids_all) {
+            options += "all";
+        } else if (video_ids.size()) {
+            for (size_t i = 0; i < video_ids.size(); i++) {
+                if (i)
+                    options += ",";
+                options += std::to_string(video_ids[i]);
+            }
+        } else {
+            options += have_video_id ? std::to_string(video_id) : "first";
+        }
+
+        options += " audio=";
+        if (audio_ids_all) {
+            options += "all";
+        } else if (audio_ids.size()) {
+            for (size_t i = 0; i < audio_ids.size(); i++) {
+                if (i)
+                    options += ",";
+                options += std::to_string(audio_ids[i]);
+            }
+        } else {
+            options += "none";
+        }
+
+        options += " range=";
+        options += input_range == D2V::ColourRangeFull ? "full" : "limited";
+
+        options += " relative=";
+        options += relative_paths ? "yes" : "no";
+
+        options += " frame-index=";
+        options += frame_index ? "yes" : "no";
+
+        options += " audio-only=";
+        options += audio_only ? "yes" : "no";
+
+        return options;
+    }
+
     // char** or std::vector<std::string>
     template<typename Args>
     bool parse(int argc, Args argv, FakeFile &fake_file) {
@@ -312,26 +606,64 @@ struct CommandLine {
         const char *opt_version = "--version";
         const char *opt_info = "--info";
         const char *opt_quiet = "--quiet";
+        const char *opt_progress_format = "--progress-format";
+        const char *opt_trace = "--trace";
         const char *opt_output = "--output";
         const char *opt_audio_ids = "--audio-ids";
         const char *opt_video_id = "--video-id";
+        const char *opt_video_ids = "--video-ids";
         const char *opt_input_range = "--input-range";
         const char *opt_ffmpeg_log_level = "--ffmpeg-log-level";
         const char *opt_relative_paths = "--relative-paths";
         const char *opt_single_input = "--single-input";
+        const char *opt_append = "--append";
+        const char *opt_skip_if_current = "--skip-if-current";
+        const char *opt_frame_index = "--frame-index";
+        const char *opt_pipelined = "--pipelined";
+        const char *opt_no_audio_threads = "--no-audio-threads";
+        const char *opt_audio_only = "--audio-only";
+        const char *opt_demux_ranges = "--demux-ranges";
+        const char *opt_demux_jobs = "--demux-jobs";
+        const char *opt_demux_output = "--demux-output";
+        const char *opt_index_demuxed = "--index-demuxed";
+        const char *opt_serve = "--serve";
+        const char *opt_serve_workers = "--serve-workers";
+        const char *opt_client = "--client";
+        const char *opt_watch = "--watch";
+        const char *opt_watch_settle = "--watch-settle";
+        const char *opt_watch_jobs = "--watch-jobs";
 
         std::unordered_set<std::string> valid_options = {
             opt_help,
             opt_version,
             opt_info,
             opt_quiet,
+            opt_progress_format,
+            opt_trace,
             opt_output,
             opt_audio_ids,
             opt_video_id,
+            opt_video_ids,
             opt_input_range,
             opt_ffmpeg_log_level,
             opt_relative_paths,
             opt_single_input,
+            opt_append,
+            opt_skip_if_current,
+            opt_frame_index,
+            opt_pipelined,
+            opt_no_audio_threads,
+            opt_audio_only,
+            opt_demux_ranges,
+            opt_demux_jobs,
+            opt_demux_output,
+            opt_index_demuxed,
+            opt_serve,
+            opt_serve_workers,
+            opt_client,
+            opt_watch,
+            opt_watch_settle,
+            opt_watch_jobs,
         };
 
         for (int i = 1; i < argc; i++) {
@@ -355,6 +687,34 @@ struct CommandLine {
                 info_wanted = true;
             } else if (arg == opt_quiet) {
                 stay_quiet = true;
+            } else if (arg == opt_progress_format) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_progress_format;
+                    error += " requires either 'text' or 'json'.";
+                    return false;
+                }
+
+                std::unordered_map<std::string, bool> format_map = {
+                    { "text", false },
+                    { "json", true }
+                };
+
+                try {
+                    json_progress = format_map.at(argv[i + 1]);
+                    i++;
+                } catch (std::out_of_range &) {
+                    error = std::string("Progress format '") + argv[i + 1] + "' is neither 'text' nor 'json'.";
+                    return false;
+                }
+            } else if (arg == opt_trace) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_trace;
+                    error += " requires a file name.";
+                    return false;
+                }
+
+                trace_path = argv[i + 1];
+                i++;
             } else if (arg == opt_output) {
                 if (i == argc - 1 || valid_options.count(argv[i + 1])) {
                     error = opt_output;
@@ -403,6 +763,57 @@ struct CommandLine {
                         id_start = id_end + 1;
                     } while (id_end != std::string::npos);
                 }
+            } else if (arg == opt_video_ids) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_video_ids;
+                    error += " requires a list of video track ids, or the special value 'all'.";
+                    return false;
+                }
+
+                std::string ids(argv[i + 1]);
+                i++;
+
+                if (ids == "all") {
+                    video_ids_all = true;
+                } else {
+                    size_t id_start = 0, id_end;
+
+                    do {
+                        id_end = ids.find(',', id_start);
+                        std::string id;
+                        if (id_end == std::string::npos)
+                            id = ids.substr(id_start);
+                        else
+                            id = ids.substr(id_start, id_end - id_start);
+
+                        size_t converted_chars;
+                        try {
+                            video_ids.push_back(std::stoi(id, &converted_chars, 16));
+                        } catch (...) {
+                            error = "Invalid video id '" + id + "'.";
+                            return false;
+                        }
+
+                        if (id.size() != converted_chars) {
+                            error = "Video id '" + id + "' is not a valid hexadecimal number.";
+                            return false;
+                        }
+
+                        id_start = id_end + 1;
+                    } while (id_end != std::string::npos);
+
+                    std::vector<int> sorted_ids = video_ids;
+                    std::sort(sorted_ids.begin(), sorted_ids.end());
+
+                    auto repeated = std::adjacent_find(sorted_ids.cbegin(), sorted_ids.cend());
+                    if (repeated != sorted_ids.cend()) {
+                        char id[20] = { 0 };
+                        snprintf(id, 19, "%x", *repeated);
+
+                        error = std::string("Video id '") + id + "' is given more than once.";
+                        return false;
+                    }
+                }
             } else if (arg == opt_video_id) {
                 if (i == argc - 1 || valid_options.count(argv[i + 1])) {
                     error = opt_video_id;
@@ -495,6 +906,174 @@ struct CommandLine {
                 have_relative_paths = true;
             } else if (arg == opt_single_input) {
                 single_input = true;
+            } else if (arg == opt_append) {
+                append = true;
+            } else if (arg == opt_skip_if_current) {
+                skip_if_current = true;
+            } else if (arg == opt_frame_index) {
+                frame_index = true;
+            } else if (arg == opt_pipelined) {
+                pipelined = true;
+            } else if (arg == opt_no_audio_threads) {
+                audio_threads = false;
+            } else if (arg == opt_audio_only) {
+                audio_only = true;
+            } else if (arg == opt_demux_ranges) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_demux_ranges;
+                    error += " requires a list of frame ranges.";
+                    return false;
+                }
+
+                if (!parseDemuxRanges(argv[i + 1], demux_ranges, error))
+                    return false;
+
+                i++;
+            } else if (arg == opt_demux_jobs) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_demux_jobs;
+                    error += " requires a number.";
+                    return false;
+                }
+
+                std::string jobs(argv[i + 1]);
+                i++;
+
+                size_t converted_chars;
+                try {
+                    demux_jobs = std::stoi(jobs, &converted_chars);
+                } catch (...) {
+                    error = "Invalid number of demuxing jobs '" + jobs + "'.";
+                    return false;
+                }
+
+                if (jobs.size() != converted_chars || demux_jobs < 1) {
+                    error = "The number of demuxing jobs must be a positive integer, not '" + jobs + "'.";
+                    return false;
+                }
+            } else if (arg == opt_demux_output) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_demux_output;
+                    error += " requires a file name.";
+                    return false;
+                }
+
+                demux_output = argv[i + 1];
+                i++;
+
+                if (!isStreamName(demux_output)) {
+                    std::string err;
+                    makeOutputPathAbsolute(demux_output, err);
+                    if (err.size()) {
+                        error = "Failed to turn '" + demux_output + "' into an absolute path: " + err;
+                        return false;
+                    }
+                }
+            } else if (arg == opt_index_demuxed) {
+                index_demuxed = true;
+            } else if (arg == opt_serve) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_serve;
+                    error += " requires a socket name.";
+                    return false;
+                }
+
+                serve_socket = argv[i + 1];
+                i++;
+            } else if (arg == opt_serve_workers) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_serve_workers;
+                    error += " requires a number.";
+                    return false;
+                }
+
+                std::string workers(argv[i + 1]);
+                i++;
+
+                size_t converted_chars;
+                try {
+                    serve_workers = std::stoi(workers, &converted_chars);
+                } catch (...) {
+                    error = "Invalid number of server workers '" + workers + "'.";
+                    return false;
+                }
+
+                if (workers.size() != converted_chars || serve_workers < 1) {
+                    error = "The number of server workers must be a positive integer, not '" + workers + "'.";
+                    return false;
+                }
+            } else if (arg == opt_client) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_client;
+                    error += " requires a socket name.";
+                    return false;
+                }
+
+                client_socket = argv[i + 1];
+                i++;
+            } else if (arg == opt_watch) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_watch;
+                    error += " requires a folder name.";
+                    return false;
+                }
+
+                watch_folder = argv[i + 1];
+                i++;
+
+                std::string err;
+                makeAbsolute(watch_folder, err);
+                if (err.size()) {
+                    error = "Failed to turn '" + watch_folder + "' into an absolute path: " + err;
+                    return false;
+                }
+
+                while (watch_folder.size() > 1 && watch_folder.back() == '/')
+                    watch_folder.pop_back();
+            } else if (arg == opt_watch_settle) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_watch_settle;
+                    error += " requires a number of seconds.";
+                    return false;
+                }
+
+                std::string seconds(argv[i + 1]);
+                i++;
+
+                size_t converted_chars;
+                try {
+                    watch_settle = std::stoi(seconds, &converted_chars);
+                } catch (...) {
+                    error = "Invalid number of seconds '" + seconds + "'.";
+                    return false;
+                }
+
+                if (seconds.size() != converted_chars || watch_settle < 1) {
+                    error = "The number of seconds to wait for files to settle must be a positive integer, not '" + seconds + "'.";
+                    return false;
+                }
+            } else if (arg == opt_watch_jobs) {
+                if (i == argc - 1 || valid_options.count(argv[i + 1])) {
+                    error = opt_watch_jobs;
+                    error += " requires a number.";
+                    return false;
+                }
+
+                std::string jobs(argv[i + 1]);
+                i++;
+
+                size_t converted_chars;
+                try {
+                    watch_jobs = std::stoi(jobs, &converted_chars);
+                } catch (...) {
+                    error = "Invalid number of watch jobs '" + jobs + "'.";
+                    return false;
+                }
+
+                if (jobs.size() != converted_chars || watch_jobs < 1) {
+                    error = "The number of watch jobs must be a positive integer, not '" + jobs + "'.";
+                    return false;
+                }
             } else { // Input files.
                 std::string err;
                 makeAbsolute(arg, err);
@@ -507,6 +1086,22 @@ struct CommandLine {
             }
         }
 
+        // The server and the client get their files from the requests,
+        // and --watch from the folder.
+        if (serve_socket.size() || client_socket.size() || watch_folder.size()) {
+            if (fake_file.size()) {
+                error = "Input files can't be given together with --serve, --client, or --watch.";
+                return false;
+            }
+
+            if (!serve_socket.empty() + !client_socket.empty() + !watch_folder.empty() > 1) {
+                error = "Only one of --serve, --client, and --watch can be used.";
+                return false;
+            }
+
+            return true;
+        }
+
         if (!fake_file.size()) {
             error = "No files given. Try '--help'.";
             return false;
@@ -611,9 +1206,81 @@ int main(int argc, char **_argv) {
     if (!cmd.have_relative_paths)
         cmd.relative_paths = settings.value(KEY_USE_RELATIVE_PATHS, KEY_DEFAULT_USE_RELATIVE_PATHS).toBool();
 
-    if (cmd.relative_paths && cmd.d2v_path == "-")
+    if (cmd.relative_paths && isStreamName(cmd.d2v_path))
         cmd.relative_paths = false;
 
+    if (cmd.append && isStreamName(cmd.d2v_path)) {
+        fprintf(stderr, "--append can't be used when the d2v file is written to standard output or to a file descriptor.\n");
+        return 1;
+    }
+
+    if (cmd.skip_if_current && isStreamName(cmd.d2v_path)) {
+        fprintf(stderr, "--skip-if-current can't be used when the d2v file is written to standard output or to a file descriptor.\n");
+        return 1;
+    }
+
+    if (cmd.audio_only && (cmd.append || cmd.skip_if_current || cmd.frame_index)) {
+        fprintf(stderr, "--audio-only can't be used together with --append, --skip-if-current, or --frame-index.\n");
+        return 1;
+    }
+
+    if (cmd.demux_ranges.size() && (cmd.skip_if_current || cmd.audio_only)) {
+        fprintf(stderr, "--demux-ranges can't be used together with --skip-if-current or --audio-only.\n");
+        return 1;
+    }
+
+    if (cmd.audio_only && !cmd.audio_ids.size())
+        cmd.audio_ids_all = true;
+
+    bool multiple_videos = cmd.video_ids.size() || cmd.video_ids_all;
+
+    if (multiple_videos && (cmd.have_video_id || cmd.append || cmd.skip_if_current || cmd.audio_only || cmd.demux_ranges.size() || cmd.watch_folder.size())) {
+        fprintf(stderr, "--video-ids can't be used together with --video-id, --append, --skip-if-current, --audio-only, --demux-ranges, or --watch.\n");
+        return 1;
+    }
+
+    if (multiple_videos && isStreamName(cmd.d2v_path)) {
+        fprintf(stderr, "--video-ids can't be used when the d2v file is written to standard output or to a file descriptor.\n");
+        return 1;
+    }
+
+    if (cmd.watch_folder.size() && (cmd.d2v_path.size() || cmd.append || cmd.skip_if_current || cmd.demux_ranges.size() || cmd.info_wanted)) {
+        fprintf(stderr, "--watch can't be used together with --output, --append, --skip-if-current, --demux-ranges, or --info.\n");
+        return 1;
+    }
+
+    if (cmd.trace_path.size() && cmd.trace_path == cmd.d2v_path) {
+        fprintf(stderr, "The d2v file and the trace can't both be written to '%s'.\n", cmd.trace_path.c_str());
+        return 1;
+    }
+
+    if (cmd.frame_index && isStreamName(cmd.d2v_path)) {
+        fprintf(stderr, "--frame-index can't be used when the d2v file is written to standard output or to a file descriptor.\n");
+        return 1;
+    }
+
+    if (cmd.demux_output.size()) {
+        if (cmd.demux_ranges.size() != 1) {
+            fprintf(stderr, "--demux-output requires exactly one range in --demux-ranges.\n");
+            return 1;
+        }
+
+        if (cmd.index_demuxed && isStreamName(cmd.demux_output)) {
+            fprintf(stderr, "--index-demuxed can't be used when the demuxed video is written to standard output or to a file descriptor.\n");
+            return 1;
+        }
+
+        if (cmd.demux_output == cmd.trace_path) {
+            fprintf(stderr, "The demuxed video and the trace can't both be written to '%s'.\n", cmd.demux_output.c_str());
+            return 1;
+        }
+
+        if (cmd.demux_output == cmd.d2v_path) {
+            fprintf(stderr, "The d2v file and the demuxed video can't both be written to '%s'.\n", cmd.demux_output.c_str());
+            return 1;
+        }
+    }
+
 
     if (cmd.help_wanted) {
         printHelp();
@@ -628,30 +1295,85 @@ int main(int argc, char **_argv) {
 
     // pick up the files in a VTS_xx_y.VOB sequence
     if (!cmd.single_input && fake_file.size() == 1) {
-        QFileInfo info(QString::fromStdString(fake_file[0].name));
+        std::vector<std::string> following = findFollowingVOBs(fake_file[0].name);
+
+        for (size_t i = 0; i < following.size(); i++)
+            fake_file.push_back(following[i]);
+    }
+
+
+    // ffmpeg init part 0
+    av_log_set_level(cmd.ffmpeg_log_level);
 
-        QDir input_dir = info.dir();
 
-        QStringList entries = input_dir.entryList(QStringList(QStringLiteral("vts_[0-9][0-9]_[0-9].vob")), QDir::Files, QDir::Name | QDir::IgnoreCase);
+    if (cmd.trace_path.size()) {
+        std::string error;
+        if (!traceStart(cmd.trace_path, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
 
-        if (entries.size()) {
-            QString name = info.fileName();
+        // Too many ways out of main to write the trace at each one.
+        atexit(finishTrace);
 
-            int index = entries.indexOf(name);
+        TRACE_THREAD_NAME("main");
+    }
 
-            if (index > -1) {
-                for (int i = index + 1; i < entries.size(); i++) {
-                    if (entries[i].midRef(4, 2) == name.midRef(4, 2))
-                        fake_file.push_back(input_dir.absoluteFilePath(entries[i]).toStdString());
-                }
-            }
+
+    if (cmd.serve_socket.size()) {
+        std::string error;
+        if (!serve(cmd.serve_socket, cmd.serve_workers, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
         }
 
+        return 0;
     }
 
+    if (cmd.client_socket.size()) {
+        std::string error;
+        if (!runClient(cmd.client_socket, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
 
-    // ffmpeg init part 0
-    av_log_set_level(cmd.ffmpeg_log_level);
+        return 0;
+    }
+
+    if (cmd.watch_folder.size()) {
+        WatchOptions options;
+        options.folder = cmd.watch_folder;
+        options.settle_seconds = cmd.watch_settle;
+        options.jobs = cmd.watch_jobs;
+        options.quiet = cmd.stay_quiet;
+        options.json_progress = cmd.json_progress;
+
+        options.job_options.video_id = cmd.video_id;
+        options.job_options.have_video_id = cmd.have_video_id;
+        options.job_options.audio_ids = cmd.audio_ids;
+        options.job_options.audio_ids_all = cmd.audio_ids_all;
+        options.job_options.input_range = cmd.input_range;
+        options.job_options.relative_paths = cmd.relative_paths;
+        options.job_options.pipelined = cmd.pipelined;
+        options.job_options.audio_threads = cmd.audio_threads;
+        options.job_options.frame_index = cmd.frame_index;
+        options.job_options.audio_only = cmd.audio_only;
+
+        std::string error;
+        if (!watchFolder(options, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+            return 1;
+        }
+
+        return 0;
+    }
+
+
+    JSONProgress json_progress(stderr);
+    bool reporting_json = cmd.json_progress && !cmd.stay_quiet;
+
+    if (reporting_json)
+        json_progress.startPhase("probe");
 
 
     // input opening
@@ -664,6 +1386,50 @@ int main(int argc, char **_argv) {
     }
 
 
+    // up-to-date check
+    IndexState current_state;
+    std::string index_state_path;
+
+    if ((cmd.append || cmd.skip_if_current) && !cmd.info_wanted) {
+        if (!cmd.d2v_path.size())
+            cmd.d2v_path = suggestD2VName(fake_file[0].name);
+
+        index_state_path = suggestIndexStateName(cmd.d2v_path);
+
+        current_state.options = cmd.getIndexingOptions();
+
+        std::string error;
+        if (!fingerprintInputs(fake_file, current_state.inputs, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
+
+            fake_file.close();
+
+            return 1;
+        }
+    }
+
+    if (cmd.skip_if_current && !cmd.info_wanted &&
+        QFileInfo::exists(QString::fromStdString(index_state_path))) {
+        IndexState indexed_state;
+        std::string error;
+
+        bool current = readIndexState(index_state_path, indexed_state, error) &&
+                       checkCurrent(indexed_state, current_state, error);
+
+        if (current) {
+            if (!cmd.stay_quiet)
+                fprintf(stderr, "D2V file '%s' is up to date.\n", cmd.d2v_path.c_str());
+
+            fake_file.close();
+
+            return 0;
+        }
+
+        if (!cmd.stay_quiet)
+            fprintf(stderr, "D2V file '%s' is not up to date: %s\n", cmd.d2v_path.c_str(), error.c_str());
+    }
+
+
     FFMPEG f;
 
     // ffmpeg init part 1
@@ -699,83 +1465,89 @@ int main(int argc, char **_argv) {
     }
 
 
-    // stream selection
-    f.deselectAllStreams();
-
-    AVStream *video_stream;
-    if (cmd.have_video_id) {
-        video_stream = f.selectVideoStreamById(cmd.video_id);
-        if (!video_stream) {
-            fprintf(stderr, "Couldn't find video track with id %x.\n", cmd.video_id);
-
-            f.cleanup();
-            fake_file.close();
+    // whether the d2v file can be extended
+    int64_t indexed_size = -1;
+    IndexState indexed_state;
 
-            return 1;
-        }
-    } else {
-        video_stream = f.selectFirstVideoStream();
-        if (!video_stream) {
-            fprintf(stderr, "Couldn't find any video tracks.\n");
+    if (cmd.append &&
+        QFileInfo::exists(QString::fromStdString(cmd.d2v_path)) &&
+        QFileInfo::exists(QString::fromStdString(index_state_path))) {
+        std::string error;
 
-            f.cleanup();
-            fake_file.close();
+        if (!readIndexState(index_state_path, indexed_state, error) ||
+            !checkAppendable(indexed_state, current_state, indexed_size, error)) {
+            indexed_size = -1;
 
-            return 1;
+            if (!cmd.stay_quiet)
+                fprintf(stderr, "Can't append to d2v file '%s', indexing from the beginning instead: %s\n", cmd.d2v_path.c_str(), error.c_str());
         }
     }
 
-    if (cmd.audio_ids.size()) {
-        std::vector<int> missing_audio_ids;
-
-        if (!f.selectAudioStreamsById(cmd.audio_ids, missing_audio_ids)) {
-            for (size_t i = 0; i < missing_audio_ids.size(); i++)
-                fprintf(stderr, "Couldn't find audio track with id %x.\n", missing_audio_ids[i]);
-
-            f.cleanup();
-            fake_file.close();
-
-            return 1;
-        }
-    } else if (cmd.audio_ids_all) {
-        if (!f.selectAllAudioStreams()) {
-            fprintf(stderr, "Couldn't find any audio tracks.\n");
 
-            f.cleanup();
-            fake_file.close();
+    // engage
+    D2V::ProgressFunction progress_func = printProgress;
+    D2V::LoggingFunction logging_func = printWarnings;
+    void *progress_data = nullptr;
+    if (cmd.json_progress) {
+        progress_func = JSONProgress::progressFunction;
+        logging_func = JSONProgress::logFunction;
+        progress_data = &json_progress;
+    }
+    if (cmd.stay_quiet) {
+        progress_func = nullptr;
+        logging_func = nullptr;
+    }
 
-            return 1;
-        }
+    IndexJobOptions job_options;
+    job_options.video_id = cmd.video_id;
+    job_options.have_video_id = cmd.have_video_id;
+    job_options.video_ids = cmd.video_ids;
+    job_options.video_ids_all = cmd.video_ids_all;
+    job_options.audio_ids = cmd.audio_ids;
+    job_options.audio_ids_all = cmd.audio_ids_all;
+    job_options.d2v_path = cmd.d2v_path;
+    job_options.input_range = cmd.input_range;
+    job_options.relative_paths = cmd.relative_paths;
+    job_options.pipelined = cmd.pipelined;
+    job_options.audio_threads = cmd.audio_threads;
+    job_options.frame_index = cmd.frame_index;
+    job_options.audio_only = cmd.audio_only;
+    job_options.append = cmd.append;
+    job_options.indexed_size = indexed_size;
+    job_options.audio_resume_points = indexed_state.audio_resume_points;
+    job_options.progress_report = progress_func;
+    job_options.progress_data = progress_data;
+    job_options.log_message = logging_func;
+    job_options.log_data = progress_data;
+
+    // The phases come from the D2V object the job makes.
+    JSONIndexProgress json_index_progress = { &json_progress, nullptr };
+
+    if (reporting_json) {
+        job_options.progress_report = JSONIndexProgress::progressFunction;
+        job_options.progress_data = &json_index_progress;
+        job_options.phase_report = JSONProgress::phaseFunction;
+        job_options.phase_data = &json_progress;
     }
 
+    IndexJob index_job(job_options);
 
-    if (!D2V::isSupportedVideoCodecID(video_stream->codecpar->codec_id)) {
-        const char *type = "unknown";
-        const AVCodecDescriptor *desc = avcodec_descriptor_get(video_stream->codecpar->codec_id);
-        if (desc)
-            type = desc->long_name ? desc->long_name : desc->name;
+    json_index_progress.index_job = &index_job;
 
-        fprintf(stderr, "Unsupported video codec: %s (id: %d)\n", type, video_stream->codecpar->codec_id);
+    index_job.run(fake_file, f);
 
-        f.cleanup();
-        fake_file.close();
+    json_progress.followD2V(nullptr);
 
-        return 1;
-    }
+    if (reporting_json && index_job.getD2V()) {
+        json_progress.summary(*index_job.getD2V());
 
-
-    // ffmpeg init part 2: audio and video decoders
-    if (!f.initAudioCodecs()) {
-        fprintf(stderr, "%s\n", f.getError().c_str());
-
-        f.cleanup();
-        fake_file.close();
-
-        return 1;
+        std::vector<const D2V *> extra_d2vs = index_job.getExtraD2Vs();
+        for (size_t i = 0; i < extra_d2vs.size(); i++)
+            json_progress.summary(*extra_d2vs[i]);
     }
 
-    if (!f.initVideoCodec(video_stream->index)) {
-        fprintf(stderr, "%s\n", f.getError().c_str());
+    if (index_job.getResult() != D2V::ProcessingFinished) {
+        fprintf(stderr, "%s\n", index_job.getError().c_str());
 
         f.cleanup();
         fake_file.close();
@@ -783,36 +1555,27 @@ int main(int argc, char **_argv) {
         return 1;
     }
 
+    const D2V &d2v = *index_job.getD2V();
 
-    // calculate the audio delays if needed
-    AudioDelayMap audio_delay_map;
-    int64_t first_video_keyframe_pos = -1;
-    if (cmd.audio_ids.size() || cmd.audio_ids_all) {
-        std::string error;
-
-        if (!calculateAudioDelays(fake_file, video_stream->id, audio_delay_map, &first_video_keyframe_pos, error)) {
-            fprintf(stderr, "%s\n", error.c_str());
-
-            f.cleanup();
-            fake_file.close();
 
-            return 1;
-        }
-    }
+    // remember what the output files were made from
+    if (cmd.append || cmd.skip_if_current) {
+        current_state.outputs.push_back(index_job.getD2VPath());
+        if (cmd.frame_index)
+            current_state.outputs.push_back(suggestFrameIndexName(index_job.getD2VPath()));
 
+        const std::unordered_map<int, std::string> &audio_paths = index_job.getAudioPaths();
+        for (auto it = audio_paths.cbegin(); it != audio_paths.cend(); it++)
+            current_state.outputs.push_back(it->second);
 
-    // d2v file opening
-    FILE *d2v_file;
-    if (cmd.d2v_path == "-") {
-        d2v_file = stdout;
-    } else {
-        if (!cmd.d2v_path.size())
-            cmd.d2v_path = suggestD2VName(fake_file[0].name);
+        current_state.audio_resume_points = index_job.getAudioResumePoints();
 
-        d2v_file = openFile(cmd.d2v_path.c_str(), "wb");
-        if (!d2v_file) {
-            fprintf(stderr, "Failed to open d2v file '%s' for writing: %s\n", cmd.d2v_path.c_str(), strerror(errno));
+        std::string error;
+        if (!writeIndexState(index_state_path, current_state, error)) {
+            fprintf(stderr, "%s\n", error.c_str());
 
+            // An old state file would make the next --append add the same data again.
+            removeFile(index_state_path.c_str());
             f.cleanup();
             fake_file.close();
 
@@ -821,75 +1584,56 @@ int main(int argc, char **_argv) {
     }
 
 
-    // audio files opening
-    AudioFilesMap audio_files;
-    for (unsigned i = 0; i < f.fctx->nb_streams; i++) {
-        if (f.fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO &&
-            f.fctx->streams[i]->discard != AVDISCARD_ALL) {
+    // the requested ranges get their own files
+    if (cmd.demux_ranges.size()) {
+        // Same as the audio files.
+        std::string video_path_base = isStreamName(index_job.getD2VPath()) ? suggestD2VName(fake_file[0].name) : index_job.getD2VPath();
 
-            std::string path = cmd.d2v_path;
+        size_t last_dot = video_path_base.find_last_of('.');
+        if (last_dot != std::string::npos)
+            video_path_base.erase(last_dot);
 
-            // chop off the extension if it exists
-            size_t last_dot = path.find_last_of('.');
-            if (last_dot != std::string::npos)
-                path.erase(last_dot);
+        for (size_t i = 0; i < cmd.demux_ranges.size(); i++) {
+            DemuxRange &range = cmd.demux_ranges[i];
 
-            path += suggestAudioTrackSuffix(f.fctx->streams[i], audio_delay_map);
+            if (range.last_frame >= d2v.getNumFrames()) {
+                fprintf(stderr, "Frame range %d-%d is outside the video, which has %d frames.\n", range.first_frame, range.last_frame, d2v.getNumFrames());
 
-            if (codecIDRequiresWave64(f.fctx->streams[i]->codecpar->codec_id)) {
-                std::string error;
+                f.cleanup();
+                fake_file.close();
 
-                AVFormatContext *w64_ctx = openWave64(path, f.fctx->streams[i]->codecpar, error);
-                if (!w64_ctx) {
-                    fprintf(stderr, "%s\n", error.c_str());
-
-                    fclose(d2v_file);
-                    closeAudioFiles(audio_files, f.fctx);
-                    f.cleanup();
-                    fake_file.close();
-
-                    return 1;
-                }
-
-                audio_files.insert({ f.fctx->streams[i]->index, w64_ctx });
-            } else {
-                FILE *file = openFile(path.c_str(), "wb");
-                if (!file) {
-                    fprintf(stderr, "Failed to open audio file '%s' for writing: %s\n", path.c_str(), strerror(errno));
+                return 1;
+            }
 
-                    fclose(d2v_file);
-                    closeAudioFiles(audio_files, f.fctx);
-                    f.cleanup();
-                    fake_file.close();
+            snapDemuxRange(d2v, range);
 
-                    return 1;
-                }
+            range.video_path = video_path_base + "." + std::to_string(range.start_gop_frame) + "-" + std::to_string(range.end_gop_frame - 1) + ".m2v";
+            if (cmd.demux_output.size())
+                range.video_path = cmd.demux_output;
 
-                audio_files.insert({ f.fctx->streams[i]->index, file });
-            }
+            if (cmd.index_demuxed)
+                range.d2v_path = suggestD2VName(range.video_path);
         }
-    }
 
+        if (reporting_json)
+            json_progress.startPhase("demux");
 
-    // engage
-    D2V::ProgressFunction progress_func = printProgress;
-    D2V::LoggingFunction logging_func = printWarnings;
-    if (cmd.stay_quiet) {
-        progress_func = nullptr;
-        logging_func = nullptr;
-    }
+        DemuxRangesOptions options;
+        options.jobs = cmd.demux_jobs;
+        options.progress_report = progress_func;
+        options.progress_data = progress_data;
+        options.log_message = logging_func;
+        options.log_data = progress_data;
 
-    D2V d2v(cmd.d2v_path, d2v_file, audio_files, &fake_file, &f, video_stream, first_video_keyframe_pos, cmd.input_range, cmd.relative_paths, progress_func, nullptr, logging_func, nullptr);
-
-    d2v.index();
-
-    if (d2v.getResult() == D2V::ProcessingError) {
-        fprintf(stderr, "%s\n", d2v.getError().c_str());
+        std::string error;
+        if (demuxVideoRanges(d2v, fake_file, index_job.getVideoId(), cmd.demux_ranges, options, error) != D2V::ProcessingFinished) {
+            fprintf(stderr, "%s\n", error.c_str());
 
-        f.cleanup();
-        fake_file.close();
+            f.cleanup();
+            fake_file.close();
 
-        return 1;
+            return 1;
+        }
     }
 
 
@@ -0,0 +1,289 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "Bullshit.h"
+#include "DemuxRanges.h"
+#include "FFMPEG.h"
+#include "Trace.h"
+
+
+void snapDemuxRange(const D2V &d2v, DemuxRange &range) {
+    range.start_gop_frame = d2v.getGOPStartFrame(range.first_frame);
+    if (range.start_gop_frame > 0 && d2v.isOpenGOP(range.start_gop_frame))
+        range.start_gop_frame = d2v.getGOPStartFrame(range.start_gop_frame - 1);
+
+    range.start_gop_position = d2v.getGOPStartPosition(range.start_gop_frame);
+
+    range.end_gop_frame = d2v.getNextGOPStartFrame(range.last_frame);
+
+    range.end_gop_position = d2v.getNextGOPStartPosition(range.last_frame);
+}
+
+
+bool parseDemuxRanges(const std::string &text, std::vector<DemuxRange> &ranges, std::string &error) {
+    size_t start = 0;
+
+    while (start <= text.size()) {
+        size_t comma = text.find(',', start);
+        if (comma == std::string::npos)
+            comma = text.size();
+
+        std::string range = text.substr(start, comma - start);
+
+        int first, last;
+        char trailing;
+        if (sscanf(range.c_str(), "%d-%d%c", &first, &last, &trailing) != 2 || first < 0 || last < first) {
+            error = "Invalid frame range '" + range + "'. Ranges must look like 'first-last', with first <= last.";
+            return false;
+        }
+
+        ranges.emplace_back(first, last);
+
+        start = comma + 1;
+    }
+
+    return true;
+}
+
+
+namespace {
+
+struct SharedState {
+    const D2V *d2v;
+    const FakeFile *fake_file;
+    int video_id;
+    std::vector<DemuxRange> *ranges;
+    const DemuxRangesOptions *options;
+
+    std::atomic_int next_range;
+
+    // Set when one of the jobs failed or was cancelled.
+    std::atomic_bool stopping;
+
+    // Given to every job's D2V. Either options->cancel_flag or own_cancel_flag.
+    std::atomic_bool *cancel_flag;
+    std::atomic_bool own_cancel_flag;
+
+    std::mutex mutex;
+    D2V::ProcessingResult result;
+    std::string error;
+
+    // One per range.
+    std::vector<int64_t> progress;
+    int64_t total_size;
+};
+
+
+struct JobReport {
+    SharedState *shared;
+    size_t slot;
+};
+
+
+void reportJobProgress(int64_t current_position, int64_t, void *data) {
+    JobReport *report = (JobReport *)data;
+    SharedState *shared = report->shared;
+
+    std::lock_guard<std::mutex> lock(shared->mutex);
+
+    shared->progress[report->slot] = current_position;
+
+    int64_t done = 0;
+    for (size_t i = 0; i < shared->progress.size(); i++)
+        done += shared->progress[i];
+
+    shared->options->progress_report(done, shared->total_size, shared->options->progress_data);
+}
+
+
+void logJobMessage(const std::string &message, void *data) {
+    SharedState *shared = (SharedState *)data;
+
+    std::lock_guard<std::mutex> lock(shared->mutex);
+
+    shared->options->log_message(message, shared->options->log_data);
+}
+
+
+void finishJob(SharedState *shared, D2V::ProcessingResult result, const std::string &error) {
+    if (result == D2V::ProcessingFinished)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+
+        // The first error is the interesting one. The other jobs were cancelled because of it.
+        if (shared->result == D2V::ProcessingFinished || (shared->result == D2V::ProcessingCancelled && result == D2V::ProcessingError)) {
+            shared->result = result;
+            shared->error = error;
+        }
+    }
+
+    // Whoever notices the cancel flag also clears it, so set it again
+    // for the jobs that are still running.
+    shared->stopping = true;
+    *shared->cancel_flag = true;
+}
+
+
+D2V::ProcessingResult demuxRange(SharedState *shared, DemuxRange &range, JobReport *report, std::string &error) {
+    const DemuxRangesOptions *options = shared->options;
+
+    D2V::ProgressFunction progress_func = options->progress_report ? reportJobProgress : nullptr;
+    D2V::LoggingFunction logging_func = options->log_message ? logJobMessage : nullptr;
+
+    FakeFile fake_file;
+    for (size_t i = 0; i < shared->fake_file->size(); i++)
+        fake_file.push_back((*shared->fake_file)[i].name);
+
+    if (!fake_file.open()) {
+        error = fake_file.getError();
+        fake_file.close();
+        return D2V::ProcessingError;
+    }
+
+    FFMPEG f;
+
+    if (!f.initFormat(fake_file)) {
+        error = f.getError();
+        f.cleanup();
+        fake_file.close();
+        return D2V::ProcessingError;
+    }
+
+    f.deselectAllStreams();
+
+    AVStream *video_stream = f.selectVideoStreamById(shared->video_id);
+    if (!video_stream) {
+        char id[20] = { 0 };
+        snprintf(id, 19, "%x", shared->video_id);
+        error = std::string("Couldn't find video track with id ") + id + ".";
+        f.cleanup();
+        fake_file.close();
+        return D2V::ProcessingError;
+    }
+
+    FILE *video_file = openOutputFile(range.video_path);
+    if (!video_file) {
+        error = "Failed to open video file '" + range.video_path + "' for writing: " + strerror(errno);
+        f.cleanup();
+        fake_file.close();
+        return D2V::ProcessingError;
+    }
+
+    FILE *d2v_file = nullptr;
+    if (range.d2v_path.size()) {
+        d2v_file = openOutputFile(range.d2v_path);
+        if (!d2v_file) {
+            error = "Failed to open d2v file '" + range.d2v_path + "' for writing: " + strerror(errno);
+            fclose(video_file);
+            f.cleanup();
+            fake_file.close();
+            return D2V::ProcessingError;
+        }
+    }
+
+    D2V d2v(*shared->d2v, &fake_file, &f, video_stream, progress_func, report, logging_func, shared);
+    d2v.setCancelFlag(shared->cancel_flag);
+
+    d2v.demuxVideo(video_file, range.start_gop_position, range.end_gop_position, d2v_file, range.d2v_path, range.video_path);
+
+    f.cleanup();
+    fake_file.close();
+
+    error = d2v.getError();
+
+    return d2v.getResult();
+}
+
+
+void runJobs(SharedState *shared) {
+    TRACE_THREAD_NAME("demux job");
+
+    std::vector<DemuxRange> &ranges = *shared->ranges;
+
+    while (!shared->stopping) {
+        int i = shared->next_range++;
+        if (i >= (int)ranges.size())
+            break;
+
+        TRACE_SPAN("demuxRange");
+
+        JobReport report = { shared, (size_t)i };
+
+        std::string error;
+
+        D2V::ProcessingResult result = demuxRange(shared, ranges[i], &report, error);
+
+        finishJob(shared, result, error);
+    }
+}
+
+} // namespace
+
+
+D2V::ProcessingResult demuxVideoRanges(const D2V &d2v, const FakeFile &fake_file, int video_id, std::vector<DemuxRange> &ranges, const DemuxRangesOptions &options, std::string &error) {
+    SharedState shared;
+    shared.d2v = &d2v;
+    shared.fake_file = &fake_file;
+    shared.video_id = video_id;
+    shared.ranges = &ranges;
+    shared.options = &options;
+    shared.next_range = 0;
+    shared.stopping = false;
+    shared.own_cancel_flag = false;
+    shared.cancel_flag = options.cancel_flag ? options.cancel_flag : &shared.own_cancel_flag;
+    shared.result = D2V::ProcessingFinished;
+    shared.progress.resize(ranges.size(), 0);
+    shared.total_size = 0;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        int64_t end = std::min(ranges[i].end_gop_position, fake_file.getTotalSize());
+
+        shared.total_size += end - ranges[i].start_gop_position;
+    }
+
+    if (shared.total_size <= 0)
+        shared.total_size = 1;
+
+    int jobs = std::max(1, std::min(options.jobs, (int)ranges.size()));
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < jobs; i++)
+        threads.push_back(std::thread(runJobs, &shared));
+
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    // Nobody is left to notice it.
+    *shared.cancel_flag = false;
+
+    error = shared.error;
+
+    return shared.result;
+}
@@ -0,0 +1,102 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_DEMUXRANGES_H
+#define D2V_WITCH_DEMUXRANGES_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "D2V.h"
+#include "FakeFile.h"
+
+
+struct DemuxRange {
+    // The frames requested, inclusive.
+    int first_frame;
+    int last_frame;
+
+    // Filled in by snapDemuxRange. The end is exclusive.
+    int start_gop_frame;
+    int end_gop_frame;
+    int64_t start_gop_position;
+    int64_t end_gop_position;
+
+    // Either can be "-" or "fd:N", like in openOutputFile.
+    std::string video_path;
+
+    // If not empty, the d2v file for the demuxed video is written here.
+    std::string d2v_path;
+
+    DemuxRange(int _first_frame, int _last_frame)
+        : first_frame(_first_frame)
+        , last_frame(_last_frame)
+        , start_gop_frame(0)
+        , end_gop_frame(0)
+        , start_gop_position(0)
+        , end_gop_position(0)
+    { }
+};
+
+
+struct DemuxRangesOptions {
+    // How many ranges are demuxed at the same time.
+    int jobs;
+
+    D2V::ProgressFunction progress_report;
+    void *progress_data;
+    D2V::LoggingFunction log_message;
+    void *log_data;
+
+    // Cancels every job when it becomes true, and is set back to false
+    // once they stopped. If null, the run has a flag of its own.
+    std::atomic_bool *cancel_flag;
+
+    DemuxRangesOptions()
+        : jobs(1)
+        , progress_report(nullptr)
+        , progress_data(nullptr)
+        , log_message(nullptr)
+        , log_data(nullptr)
+        , cancel_flag(nullptr)
+    { }
+};
+
+
+// Extends the range to whole GOPs. If the first GOP is open, the one
+// before it is included too, so that every requested frame can be decoded.
+void snapDemuxRange(const D2V &d2v, DemuxRange &range);
+
+// Parses "first-last,first-last,...". The frames are inclusive.
+bool parseDemuxRanges(const std::string &text, std::vector<DemuxRange> &ranges, std::string &error);
+
+// Demuxes the video track with the given id from each (snapped) range
+// into its own file. d2v must be the index of fake_file. Every job opens
+// the input files again, so the ranges don't wait for each other. The
+// progress and logging functions are never called by two jobs at the
+// same time.
+D2V::ProcessingResult demuxVideoRanges(const D2V &d2v, const FakeFile &fake_file, int video_id, std::vector<DemuxRange> &ranges, const DemuxRangesOptions &options, std::string &error);
+
+#endif // D2V_WITCH_DEMUXRANGES_H
@@ -20,6 +20,8 @@ SOFTWARE.
 
 #include "FFMPEG.h"
 
+#include "Trace.h"
+
 
 FFMPEG::FFMPEG()
     : io_buffer(nullptr)
@@ -40,7 +42,14 @@ const std::string &FFMPEG::getError() const {
 }
 
 
-bool FFMPEG::initFormat(FakeFile &fake_file) {
+static int interruptCallback(void *opaque) {
+    return *(const std::atomic_bool *)opaque;
+}
+
+
+bool FFMPEG::initFormat(FakeFile &fake_file, const std::atomic_bool *interrupt) {
+    TRACE_SPAN("FFMPEG::initFormat");
+
     fctx = avformat_alloc_context();
     if (!fctx) {
         error = "Couldn't allocate AVFormatContext.";
@@ -67,6 +76,8 @@ bool FFMPEG::initFormat(FakeFile &fake_file) {
     fctx->probesize = 10 * 1000 * 1000; // bytes
     fctx->max_analyze_duration = 20 * 1000 * 1000; // microseconds
 
+    setInterrupt(interrupt);
+
     int ret = avformat_open_input(&fctx, fake_file[0].name.c_str(), nullptr, nullptr);
     if (ret < 0) {
         error = "avformat_open_input() failed: ";
@@ -95,52 +106,78 @@ bool FFMPEG::initFormat(FakeFile &fake_file) {
 }
 
 
-bool FFMPEG::initVideoCodec(int stream_index) {
-    if (!fctx) {
-        error = "Must call initFormat before initVideoCodec.";
-        return false;
-    }
-
-    deinitVideoCodec();
-
-    AVCodecID video_codec_id = fctx->streams[stream_index]->codecpar->codec_id;
+// The decoder context and the parser that D2V needs for a video stream.
+static bool openVideoCodec(const AVStream *stream, const AVCodec **codec, AVCodecContext **codec_ctx, AVCodecParserContext **codec_parser, std::string &error) {
+    AVCodecID video_codec_id = stream->codecpar->codec_id;
 
-    avcodec = avcodec_find_decoder(video_codec_id);
-    if (!avcodec) {
+    *codec = avcodec_find_decoder(video_codec_id);
+    if (!*codec) {
         error = "Couldn't find decoder for ";
         error += avcodec_get_name(video_codec_id);
         return false;
     }
 
-    avctx = avcodec_alloc_context3(avcodec);
-    if (!avctx) {
+    *codec_ctx = avcodec_alloc_context3(*codec);
+    if (!*codec_ctx) {
         error = "Couldn't allocate AVCodecContext for the video decoder.";
         return false;
     }
 
-    if (avcodec_parameters_to_context(avctx, fctx->streams[stream_index]->codecpar) < 0) {
+    if (avcodec_parameters_to_context(*codec_ctx, stream->codecpar) < 0) {
         error = "Couldn't copy video codec parameters.";
         return false;
     }
 
-    if (avcodec_open2(avctx, avcodec, nullptr) < 0) {
+    if (avcodec_open2(*codec_ctx, *codec, nullptr) < 0) {
         error = "Couldn't open AVCodecContext for the video decoder.";
         return false;
     }
 
-    parser = av_parser_init(video_codec_id);
-    if (!parser) {
+    *codec_parser = av_parser_init(video_codec_id);
+    if (!*codec_parser) {
         error = "Couldn't initialise parser for ";
         error += avcodec_get_name(video_codec_id);
         return false;
     }
 
-    parser->flags = PARSER_FLAG_COMPLETE_FRAMES;
+    (*codec_parser)->flags = PARSER_FLAG_COMPLETE_FRAMES;
 
     return true;
 }
 
 
+bool FFMPEG::initVideoCodec(int stream_index) {
+    if (!fctx) {
+        error = "Must call initFormat before initVideoCodec.";
+        return false;
+    }
+
+    deinitVideoCodec();
+
+    return openVideoCodec(fctx->streams[stream_index], &avcodec, &avctx, &parser, error);
+}
+
+
+bool FFMPEG::initExtraVideoCodec(int stream_index) {
+    if (!fctx) {
+        error = "Must call initFormat before initExtraVideoCodec.";
+        return false;
+    }
+
+    const AVCodec *codec = nullptr;
+    AVCodecContext *codec_ctx = nullptr;
+    AVCodecParserContext *codec_parser = nullptr;
+
+    bool okay = openVideoCodec(fctx->streams[stream_index], &codec, &codec_ctx, &codec_parser, error);
+
+    // Stored even if opening failed halfway, so they get freed with the rest.
+    extra_video_ctx.insert({ stream_index, codec_ctx });
+    extra_parsers.insert({ stream_index, codec_parser });
+
+    return okay;
+}
+
+
 bool FFMPEG::initAudioCodec(int stream_index) {
     if (codecIDRequiresWave64(fctx->streams[stream_index]->codecpar->codec_id)) {
         AVCodecContext *ctx = avcodec_alloc_context3(nullptr);
@@ -194,6 +231,43 @@ void FFMPEG::deinitVideoCodec() {
         avcodec_close(avctx);
         avcodec_free_context(&avctx);
     }
+
+
+    for (auto it = extra_parsers.begin(); it != extra_parsers.end(); it++) {
+        if (it->second)
+            av_parser_close(it->second);
+    }
+
+    extra_parsers.clear();
+
+
+    for (auto it = extra_video_ctx.begin(); it != extra_video_ctx.end(); it++) {
+        if (it->second) {
+            avcodec_close(it->second);
+            avcodec_free_context(&it->second);
+        }
+    }
+
+    extra_video_ctx.clear();
+}
+
+
+void FFMPEG::setInterrupt(const std::atomic_bool *interrupt) {
+    fctx->interrupt_callback.callback = interrupt ? interruptCallback : nullptr;
+    fctx->interrupt_callback.opaque = (void *)interrupt;
+}
+
+
+void FFMPEG::deinitCodecs() {
+    deinitVideoCodec();
+
+
+    for (auto it = audio_ctx.begin(); it != audio_ctx.end(); it++) {
+        avcodec_close(it->second);
+        avcodec_free_context(&it->second);
+    }
+
+    audio_ctx.clear();
 }
 
 
@@ -274,6 +348,38 @@ bool FFMPEG::selectAllAudioStreams() {
 }
 
 
+bool FFMPEG::selectVideoStreamsById(const std::vector<int> &video_ids, std::vector<AVStream *> &video_streams, std::vector<int> &missing_video_ids) {
+    video_streams.clear();
+    missing_video_ids.clear();
+
+    for (size_t i = 0; i < video_ids.size(); i++) {
+        AVStream *stream = selectVideoStreamById(video_ids[i]);
+
+        if (stream)
+            video_streams.push_back(stream);
+        else
+            missing_video_ids.push_back(video_ids[i]);
+    }
+
+    return !missing_video_ids.size();
+}
+
+
+bool FFMPEG::selectAllVideoStreams(std::vector<AVStream *> &video_streams) {
+    video_streams.clear();
+
+    for (unsigned i = 0; i < fctx->nb_streams; i++) {
+        if (fctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+            fctx->streams[i]->discard = AVDISCARD_DEFAULT;
+
+            video_streams.push_back(fctx->streams[i]);
+        }
+    }
+
+    return video_streams.size();
+}
+
+
 void FFMPEG::deselectAllStreams() {
     for (unsigned i = 0; i < fctx->nb_streams; i++)
         fctx->streams[i]->discard = AVDISCARD_ALL;
@@ -22,8 +22,10 @@ SOFTWARE.
 #define D2V_WITCH_FFMPEG_H
 
 
+#include <atomic>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 extern "C" {
 #include <libavformat/avformat.h>
@@ -47,25 +49,47 @@ public:
     AVCodecParserContext *parser;
     std::unordered_map<int, AVCodecContext *> audio_ctx;
 
+    // For the other video streams indexed in the same pass.
+    // Key: stream index.
+    std::unordered_map<int, AVCodecContext *> extra_video_ctx;
+    std::unordered_map<int, AVCodecParserContext *> extra_parsers;
+
     FFMPEG();
     ~FFMPEG();
 
     const std::string &getError() const;
 
-    bool initFormat(FakeFile &fake_file);
+    // If interrupt is not null, probing gives up when it becomes true.
+    bool initFormat(FakeFile &fake_file, const std::atomic_bool *interrupt = nullptr);
 
     bool initVideoCodec(int stream_index);
 
+    // Like initVideoCodec, but for extra_video_ctx and extra_parsers. Must
+    // be called after initVideoCodec, which frees them.
+    bool initExtraVideoCodec(int stream_index);
+
     bool initAudioCodec(int stream_index);
 
     bool initAudioCodecs();
 
+    // Replaces the interrupt given to initFormat.
+    void setInterrupt(const std::atomic_bool *interrupt);
+
+    // Frees the decoders and the parser, but keeps the input open, so that
+    // it can be read again after seeking back to the start.
+    void deinitCodecs();
+
     void cleanup();
 
     AVStream *selectVideoStreamById(int id);
 
     AVStream *selectFirstVideoStream();
 
+    // In the order of the ids.
+    bool selectVideoStreamsById(const std::vector<int> &video_ids, std::vector<AVStream *> &video_streams, std::vector<int> &missing_video_ids);
+
+    bool selectAllVideoStreams(std::vector<AVStream *> &video_streams);
+
     bool selectAudioStreamsById(const std::vector<int> &audio_ids, std::vector<int> &missing_audio_ids);
 
     bool selectAllAudioStreams();
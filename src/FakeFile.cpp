@@ -18,6 +18,10 @@ SOFTWARE.
 */
 
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 extern "C" {
 #include <libavformat/avformat.h>
 }
@@ -25,6 +29,7 @@ extern "C" {
 #include "FakeFile.h"
 
 #include "Bullshit.h"
+#include "Trace.h"
 
 
 FakeFile::~FakeFile() {
@@ -32,46 +37,77 @@ FakeFile::~FakeFile() {
 }
 
 
-bool FakeFile::open() {
+// Returns an error message, or an empty string.
+static std::string openRealFile(RealFile &file) {
+    TRACE_SPAN("openRealFile");
+
+    std::string error;
+
+    file.stream = openFile(file.name.c_str(), "rb");
+    if (!file.stream) {
+        error += "fopen() failed: ";
+        error += strerror(errno);
+        return error;
+    }
+
+    if (fseeko(file.stream, 0, SEEK_END)) {
+        error += "fseeko(stream, 0, SEEK_END) failed: ";
+        error += strerror(errno);
+        return error;
+    }
+
+    file.size = ftello(file.stream);
+    if (file.size == -1) {
+        error += "ftello() failed: ";
+        error += strerror(errno);
+        return error;
+    }
+
+    if (fseeko(file.stream, 0, SEEK_SET)) {
+        error += "fseeko(stream, 0, SEEK_SET) failed: ";
+        error += strerror(errno);
+        return error;
+    }
+
+    return error;
+}
+
+
+// Opening many files one after another is slow when they are on a network
+// share, so up to jobs threads can open them at the same time.
+bool FakeFile::open(int jobs) {
+    TRACE_SPAN("FakeFile::open");
+
     total_size = 0;
     current_position = 0;
     offset_from_real_start = 0;
     current_file = cbegin();
 
-    auto it = begin();
-    for ( ; it != end(); it++) {
-        it->stream = openFile(it->name.c_str(), "rb");
-        if (!it->stream) {
-            error += "fopen() failed: ";
-            error += strerror(errno);
-            break;
-        }
+    std::vector<std::string> errors(size());
+    std::atomic<size_t> next_file(0);
 
-        if (fseeko(it->stream, 0, SEEK_END)) {
-            error += "fseeko(stream, 0, SEEK_END) failed: ";
-            error += strerror(errno);
-            break;
-        }
+    auto openFiles = [this, &errors, &next_file] () {
+        size_t i;
+        while ((i = next_file++) < size())
+            errors[i] = openRealFile(at(i));
+    };
 
-        it->size = ftello(it->stream);
-        if (it->size == -1) {
-            error += "ftello() failed: ";
-            error += strerror(errno);
-            break;
-        }
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min(jobs, (int)size()); i++)
+        threads.emplace_back(openFiles);
 
-        if (fseeko(it->stream, 0, SEEK_SET)) {
-            error += "fseeko(stream, 0, SEEK_SET) failed: ";
-            error += strerror(errno);
-            break;
-        }
+    openFiles();
 
-        total_size += it->size;
-    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    for (size_t i = 0; i < size(); i++) {
+        if (errors[i].size()) {
+            error = "Failed to open input file '" + at(i).name + "': " + errors[i];
+            return false;
+        }
 
-    if (error.size()) {
-        error = "Failed to open input file '" + it->name + "': " + error;
-        return false;
+        total_size += at(i).size;
     }
 
     return true;
@@ -57,7 +57,7 @@ class FakeFile : public std::vector<RealFile> {
 public:
     ~FakeFile();
 
-    bool open();
+    bool open(int jobs = 1);
 
     void close();
 
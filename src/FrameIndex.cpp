@@ -0,0 +1,310 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <cerrno>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "Bullshit.h"
+#include "FrameIndex.h"
+
+
+#define FRAME_INDEX_MAGIC "D2VWFIDX"
+#define FRAME_INDEX_VERSION 1
+
+#define HEADER_SIZE 24
+#define GOP_RECORD_SIZE 16
+
+
+static void putLE(std::vector<uint8_t> &buffer, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        buffer.push_back((value >> (i * 8)) & 0xff);
+}
+
+
+static uint64_t getLE(const uint8_t *buffer, int bytes) {
+    uint64_t value = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | buffer[i];
+
+    return value;
+}
+
+
+FrameIndex::FrameIndex()
+    : file(nullptr)
+    , data(nullptr)
+    , data_size(0)
+#ifdef _WIN32
+    , mapping(nullptr)
+#endif
+    , num_frames(0)
+    , num_gops(0)
+{ }
+
+
+FrameIndex::~FrameIndex() {
+    close();
+}
+
+
+bool FrameIndex::open(const std::string &path) {
+    close();
+
+    file = openFile(path.c_str(), "rb");
+    if (!file) {
+        error = "Failed to open frame index file '" + path + "': " + strerror(errno);
+        return false;
+    }
+
+#ifdef _WIN32
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size)) {
+        error = "Failed to obtain the size of frame index file '" + path + "'.";
+        close();
+        return false;
+    }
+    data_size = size.QuadPart;
+
+    if (data_size >= HEADER_SIZE) {
+        mapping = CreateFileMappingW(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+            data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+        if (!data) {
+            error = "Failed to map frame index file '" + path + "' into memory.";
+            close();
+            return false;
+        }
+    }
+#else
+    struct stat info;
+    if (fstat(fileno(file), &info)) {
+        error = "Failed to obtain the size of frame index file '" + path + "': " + strerror(errno);
+        close();
+        return false;
+    }
+    data_size = info.st_size;
+
+    if (data_size >= HEADER_SIZE) {
+        void *address = mmap(nullptr, data_size, PROT_READ, MAP_SHARED, fileno(file), 0);
+        if (address == MAP_FAILED) {
+            error = "Failed to map frame index file '" + path + "' into memory: " + strerror(errno);
+            close();
+            return false;
+        }
+
+        data = (const uint8_t *)address;
+    }
+#endif
+
+    if (data_size < HEADER_SIZE || memcmp(data, FRAME_INDEX_MAGIC, 8)) {
+        error = "File '" + path + "' is not a frame index file.";
+        close();
+        return false;
+    }
+
+    if (getLE(data + 8, 4) != FRAME_INDEX_VERSION) {
+        error = "Frame index file '" + path + "' has unsupported version " + std::to_string(getLE(data + 8, 4)) + ".";
+        close();
+        return false;
+    }
+
+    uint64_t frames = getLE(data + 12, 4);
+    uint64_t gops = getLE(data + 16, 4);
+
+    if (frames > INT32_MAX || gops > INT32_MAX ||
+        data_size != HEADER_SIZE + gops * GOP_RECORD_SIZE + frames * 5) {
+        error = "Frame index file '" + path + "' is corrupted.";
+        close();
+        return false;
+    }
+
+    // The lookups trust the GOP table and the GOP numbers, so they are
+    // checked once here: the GOPs must cover all the frames in order,
+    // and each frame must point to the GOP that contains it.
+    const uint8_t *gop_records = data + HEADER_SIZE;
+    const uint8_t *gop_numbers = gop_records + gops * GOP_RECORD_SIZE;
+
+    bool valid = (frames == 0) == (gops == 0);
+
+    for (uint64_t i = 0; valid && i < gops; i++) {
+        uint64_t first_frame = getLE(gop_records + i * GOP_RECORD_SIZE + 8, 4);
+
+        if (i == 0)
+            valid = first_frame == 0;
+        else
+            valid = first_frame > getLE(gop_records + (i - 1) * GOP_RECORD_SIZE + 8, 4) && first_frame < frames;
+    }
+
+    uint64_t gop = 0;
+
+    for (uint64_t i = 0; valid && i < frames; i++) {
+        if (gop + 1 < gops && i == getLE(gop_records + (gop + 1) * GOP_RECORD_SIZE + 8, 4))
+            gop++;
+
+        valid = getLE(gop_numbers + i * 4, 4) == gop;
+    }
+
+    if (!valid) {
+        error = "Frame index file '" + path + "' is corrupted.";
+        close();
+        return false;
+    }
+
+    num_frames = frames;
+    num_gops = gops;
+
+    return true;
+}
+
+
+void FrameIndex::close() {
+#ifdef _WIN32
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    mapping = nullptr;
+#else
+    if (data)
+        munmap((void *)data, data_size);
+#endif
+    data = nullptr;
+    data_size = 0;
+
+    if (file)
+        fclose(file);
+    file = nullptr;
+
+    num_frames = 0;
+    num_gops = 0;
+}
+
+
+int FrameIndex::getNumFrames() const {
+    return num_frames;
+}
+
+
+int FrameIndex::getNumGOPs() const {
+    return num_gops;
+}
+
+
+int FrameIndex::getGOPNumber(int frame) const {
+    if (frame < 0 || frame >= num_frames)
+        return -1;
+
+    return getLE(data + HEADER_SIZE + (size_t)num_gops * GOP_RECORD_SIZE + (size_t)frame * 4, 4);
+}
+
+
+FrameIndex::GOP FrameIndex::getGOP(int gop_number) const {
+    if (gop_number < 0 || gop_number >= num_gops)
+        return { -1, -1, -1, 0 };
+
+    const uint8_t *record = data + HEADER_SIZE + (size_t)gop_number * GOP_RECORD_SIZE;
+
+    GOP gop;
+    gop.position = getLE(record, 8);
+    gop.first_frame = getLE(record + 8, 4);
+    gop.file = getLE(record + 12, 2);
+    gop.info = getLE(record + 14, 2);
+
+    return gop;
+}
+
+
+uint8_t FrameIndex::getFrameFlags(int frame) const {
+    if (frame < 0 || frame >= num_frames)
+        return 0;
+
+    return data[HEADER_SIZE + (size_t)num_gops * GOP_RECORD_SIZE + (size_t)num_frames * 4 + frame];
+}
+
+
+const std::string &FrameIndex::getError() const {
+    return error;
+}
+
+
+bool FrameIndex::write(const std::string &path, const std::vector<GOP> &gops, const std::vector<uint8_t> &frame_flags, std::string &error) {
+    std::vector<uint8_t> buffer;
+    buffer.reserve(HEADER_SIZE + gops.size() * GOP_RECORD_SIZE + frame_flags.size() * 5);
+
+    buffer.insert(buffer.end(), FRAME_INDEX_MAGIC, FRAME_INDEX_MAGIC + 8);
+    putLE(buffer, FRAME_INDEX_VERSION, 4);
+    putLE(buffer, frame_flags.size(), 4);
+    putLE(buffer, gops.size(), 4);
+    putLE(buffer, 0, 4);
+
+    for (size_t i = 0; i < gops.size(); i++) {
+        putLE(buffer, gops[i].position, 8);
+        putLE(buffer, gops[i].first_frame, 4);
+        putLE(buffer, gops[i].file, 2);
+        putLE(buffer, gops[i].info, 2);
+    }
+
+    for (size_t i = 0; i < gops.size(); i++) {
+        size_t next_gop_first_frame = i < gops.size() - 1 ? gops[i + 1].first_frame : frame_flags.size();
+
+        for (size_t j = gops[i].first_frame; j < next_gop_first_frame; j++)
+            putLE(buffer, i, 4);
+    }
+
+    buffer.insert(buffer.end(), frame_flags.cbegin(), frame_flags.cend());
+
+    FILE *index_file = openFile(path.c_str(), "wb");
+    if (!index_file) {
+        error = "Failed to open frame index file '" + path + "' for writing: " + strerror(errno);
+        return false;
+    }
+
+    if (fwrite(buffer.data(), 1, buffer.size(), index_file) < buffer.size()) {
+        error = "Failed to write frame index file '" + path + "': fwrite() failed.";
+        fclose(index_file);
+        return false;
+    }
+
+    if (fclose(index_file)) {
+        error = "Failed to write frame index file '" + path + "': fclose() failed.";
+        return false;
+    }
+
+    return true;
+}
+
+
+std::string suggestFrameIndexName(const std::string &d2v_name) {
+    return d2v_name + ".idx";
+}
@@ -0,0 +1,108 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_FRAMEINDEX_H
+#define D2V_WITCH_FRAMEINDEX_H
+
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+
+// Binary companion of a d2v file, for looking up frames without parsing
+// the text. All numbers are little endian.
+//
+// Header (24 bytes):
+//     char     magic[8]        "D2VWFIDX"
+//     uint32_t version         1
+//     uint32_t frames          F
+//     uint32_t gops            G
+//     uint32_t reserved        0
+//
+// G GOP records (16 bytes each), in the same order as the d2v data lines:
+//     uint64_t position        Position of the GOP in its file
+//     uint32_t first_frame     Number of the first frame in the GOP
+//     uint16_t file            Index of the file in the d2v's file list
+//     uint16_t info            The d2v info field
+//
+// F uint32_t                   Number of the GOP of each frame
+//
+// F uint8_t                    The d2v flags field of each frame
+
+class FrameIndex {
+public:
+    struct GOP {
+        int64_t position;
+        int first_frame;
+        int file;
+        int info;
+    };
+
+    FrameIndex();
+
+    ~FrameIndex();
+
+    bool open(const std::string &path);
+
+    void close();
+
+    int getNumFrames() const;
+
+    int getNumGOPs() const;
+
+    // Returns -1 if the frame doesn't exist.
+    int getGOPNumber(int frame) const;
+
+    // Returns a GOP with position -1 if it doesn't exist.
+    GOP getGOP(int gop_number) const;
+
+    // Returns 0 if the frame doesn't exist.
+    uint8_t getFrameFlags(int frame) const;
+
+    const std::string &getError() const;
+
+    static bool write(const std::string &path, const std::vector<GOP> &gops, const std::vector<uint8_t> &frame_flags, std::string &error);
+
+private:
+    FILE *file;
+    const uint8_t *data;
+    size_t data_size;
+#ifdef _WIN32
+    void *mapping;
+#endif
+
+    int num_frames;
+    int num_gops;
+
+    std::string error;
+
+    // Disallow copying, because of the mapping.
+    FrameIndex(const FrameIndex &);
+    FrameIndex &operator=(const FrameIndex &);
+};
+
+
+std::string suggestFrameIndexName(const std::string &d2v_name);
+
+#endif // D2V_WITCH_FRAMEINDEX_H
@@ -0,0 +1,95 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+#include <QImage>
+#include <QPainter>
+
+#include "FrameWidget.h"
+
+
+FrameWidget::FrameWidget(QWidget *parent)
+    : QWidget(parent)
+    , vsapi(nullptr)
+    , frame(nullptr)
+{
+    // Everything is painted in paintEvent, so Qt needn't clear the background first.
+    setAttribute(Qt::WA_OpaquePaintEvent);
+}
+
+
+FrameWidget::~FrameWidget() {
+    if (frame)
+        vsapi->freeFrame(frame);
+}
+
+
+void FrameWidget::setFrame(const VSAPI *_vsapi, const VSFrameRef *_frame) {
+    QSize old_size = sizeHint();
+
+    if (frame)
+        vsapi->freeFrame(frame);
+
+    vsapi = _vsapi;
+    frame = _frame;
+
+    if (sizeHint() != old_size)
+        updateGeometry();
+
+    update();
+}
+
+
+QSize FrameWidget::sizeHint() const {
+    if (!frame)
+        return QSize(0, 0);
+
+    return QSize(vsapi->getFrameWidth(frame, 0), vsapi->getFrameHeight(frame, 0));
+}
+
+
+QSize FrameWidget::minimumSizeHint() const {
+    return sizeHint();
+}
+
+
+void FrameWidget::paintEvent(QPaintEvent *) {
+    QPainter painter(this);
+
+    if (!frame) {
+        painter.fillRect(rect(), palette().window());
+        return;
+    }
+
+    int width = vsapi->getFrameWidth(frame, 0);
+    int height = vsapi->getFrameHeight(frame, 0);
+
+    // The widget may be bigger than the frame.
+    if (size() != QSize(width, height))
+        painter.fillRect(rect(), palette().window());
+
+    // No copy. QImage only points to the frame's buffer, which lives as long as the frame.
+    QImage image(vsapi->getReadPtr(frame, 0), width, height, vsapi->getStride(frame, 0), QImage::Format_RGB32);
+
+    // Centred, and upside down.
+    painter.translate((this->width() - width) / 2, (this->height() + height) / 2);
+    painter.scale(1, -1);
+
+    painter.drawImage(0, 0, image);
+}
@@ -0,0 +1,52 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+#ifndef D2V_WITCH_FRAMEWIDGET_H
+#define D2V_WITCH_FRAMEWIDGET_H
+
+#include <QWidget>
+
+#include <VapourSynth.h>
+
+
+// Paints a packed BGR32 VapourSynth frame (pfCompatBGR32) straight from
+// the frame's buffer. The frame is stored bottom to top, so it is painted
+// with a flipped transform instead of being copied into a mirrored image.
+class FrameWidget : public QWidget {
+    Q_OBJECT
+
+public:
+    explicit FrameWidget(QWidget *parent = nullptr);
+    ~FrameWidget() override;
+
+    // Takes ownership of the frame reference. Null removes the frame.
+    void setFrame(const VSAPI *_vsapi, const VSFrameRef *_frame);
+
+    QSize sizeHint() const override;
+    QSize minimumSizeHint() const override;
+
+private:
+    void paintEvent(QPaintEvent *event) override;
+
+    const VSAPI *vsapi;
+    const VSFrameRef *frame;
+};
+
+#endif // D2V_WITCH_FRAMEWIDGET_H
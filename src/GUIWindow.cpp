@@ -18,7 +18,10 @@ SOFTWARE.
 */
 
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <thread>
 #include <unordered_set>
 
 extern "C" {
@@ -34,35 +37,63 @@ extern "C" {
 
 #include <QFileDialog>
 #include <QGroupBox>
+#include <QIcon>
 #include <QMenuBar>
 #include <QMessageBox>
+#include <QPixmap>
+#include <QScrollBar>
 #include <QStatusBar>
 #include <QHBoxLayout>
 #include <QVBoxLayout>
 
 #include "Bullshit.h"
+#include "DemuxRanges.h"
 #include "GUIWindow.h"
 #include "ScrollArea.h"
+#include "Thumbnails.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #endif
 
 
-// For QMetaObject::invokeMethod.
-Q_DECLARE_METATYPE(int64_t)
-
 // For connect.
 Q_DECLARE_METATYPE(D2V)
+Q_DECLARE_METATYPE(ProbeResult)
 
 
 enum DataRoles {
     FileNameSuffix = Qt::UserRole,
     StreamIndex,
-    DecoderOpened
+    DecoderOpened,
+    FrameNumber
 };
 
 
+// In KiB.
+#define FRAME_CACHE_SIZE (256 * 1024)
+
+// How many frames to request at once when nothing needs to be displayed.
+#define PREFETCH_REQUESTS 2
+
+// At most one thumbnail per GOP, and no more than this many in total.
+#define MAX_THUMBNAILS 400
+
+#define THUMBNAIL_HEIGHT 72
+
+#define MAX_THUMBNAIL_JOBS 4
+
+// How many input files are opened at the same time. Opening them is mostly
+// waiting, when they are on a network share.
+#define PROBING_JOBS 8
+
+// How often the workers' progress and log messages are shown, in milliseconds.
+#define WORKER_UPDATE_INTERVAL 100
+
+// Messages beyond this many are dropped until the GUI catches up.
+#define MAX_WORKER_LOG_MESSAGES 1000
+
+
 static QString removeExtension(const QString &file_name) {
     QString chopped = file_name;
 
@@ -77,19 +108,106 @@ static QString removeExtension(const QString &file_name) {
 static void updateProgress(int64_t current_position, int64_t total_size, void *data) {
     GUIWindow *window = (GUIWindow *)data;
 
-    QMetaObject::invokeMethod(window, "updateProgress", Qt::QueuedConnection, Q_ARG(int64_t, current_position), Q_ARG(int64_t, total_size));
+    window->setWorkerProgress(current_position, total_size);
 }
 
 
-void GUIWindow::updateProgress(int64_t current_position, int64_t total_size) {
-    progress_bar->setValue((int)(current_position * 10000 / total_size));
+// Only two stores, because it is called for every keyframe.
+void GUIWindow::setWorkerProgress(int64_t current_position, int64_t total_size) {
+    worker_progress_total.store(total_size, std::memory_order_relaxed);
+    worker_progress_position.store(current_position, std::memory_order_relaxed);
 }
 
 
 static void logMessage(const std::string &msg, void *data) {
     GUIWindow *window = (GUIWindow *)data;
 
-    QMetaObject::invokeMethod(window, "logMessage", Qt::QueuedConnection, Q_ARG(QString, QString::fromStdString(msg)));
+    window->addWorkerLogMessage(msg);
+}
+
+
+// The audio threads can log too, hence the mutex. A message that comes
+// again right after itself is only counted.
+void GUIWindow::addWorkerLogMessage(const std::string &msg) {
+    std::lock_guard<std::mutex> lock(worker_log_mutex);
+
+    if (worker_log.size() && worker_log.back().text == msg) {
+        worker_log.back().repeats++;
+        return;
+    }
+
+    if (worker_log.size() >= MAX_WORKER_LOG_MESSAGES) {
+        worker_log_dropped++;
+        return;
+    }
+
+    worker_log.push_back({ msg, 0 });
+}
+
+
+void GUIWindow::showWorkerUpdates() {
+    int64_t total = worker_progress_total.load(std::memory_order_relaxed);
+    int64_t position = worker_progress_position.load(std::memory_order_relaxed);
+
+    if (total > 0)
+        progress_bar->setValue((int)(std::min(position, total) * 10000 / total));
+
+    std::vector<WorkerLogMessage> messages;
+    int dropped;
+
+    {
+        std::lock_guard<std::mutex> lock(worker_log_mutex);
+
+        messages.swap(worker_log);
+        dropped = worker_log_dropped;
+        worker_log_dropped = 0;
+    }
+
+    for (size_t i = 0; i < messages.size(); i++) {
+        QString text = QString::fromStdString(messages[i].text);
+
+        if (messages[i].repeats)
+            text += QStringLiteral(" (repeated %1 times)").arg(messages[i].repeats);
+
+        logMessage(text);
+    }
+
+    if (dropped)
+        logMessage(QStringLiteral("%1 more messages were dropped.").arg(dropped));
+}
+
+
+struct FrameRequest {
+    GUIWindow *window;
+    int generation;
+    bool fast;
+};
+
+
+// Called by VapourSynth from one of its threads.
+static void VS_CC frameDone(void *data, const VSFrameRef *frame, int n, VSNodeRef *, const char *error_message) {
+    FrameRequest *request = (FrameRequest *)data;
+
+    request->window->frameFinished(n, frame, request->generation, request->fast, frame ? "" : error_message);
+
+    delete request;
+}
+
+
+struct ThumbnailRequest {
+    GUIWindow *window;
+    int generation;
+    int index;
+};
+
+
+// Called by VapourSynth from one of its threads.
+static void VS_CC thumbnailDone(void *data, const VSFrameRef *frame, int, VSNodeRef *, const char *error_message) {
+    ThumbnailRequest *request = (ThumbnailRequest *)data;
+
+    request->window->thumbnailFinished(request->index, frame, request->generation, frame ? "" : error_message);
+
+    delete request;
 }
 
 
@@ -110,7 +228,7 @@ void GUIWindow::clearUserInterface() {
 
 
 void GUIWindow::maybeEnableEngageButton() {
-    start_stop_button->setEnabled(container_okay && output_okay && video_okay);
+    start_stop_button->setEnabled(container_okay && output_okay && video_okay && !probing_thread);
 }
 
 
@@ -190,27 +308,61 @@ void GUIWindow::setAudioError(const std::vector<int> &failed_decoders) {
 }
 
 
+// The input files are the ones in input_list. They are probed in another
+// thread, because opening and probing files on a network share can take
+// a while.
 void GUIWindow::inputFilesUpdated() {
-    if (!fake_file.open()) {
-        errorPopup(fake_file.getError());
+    if (probing_thread) {
+        cancel_probing = true;
+        probe_pending = true;
+        return;
+    }
 
-        fake_file.close();
-        fake_file.clear();
-        input_list->clear();
+    f.cleanup();
+    fake_file.close();
+    fake_file.clear();
+
+    for (int i = 0; i < input_list->count(); i++)
+        fake_file.push_back(input_list->item(i)->text().toStdString());
 
+    if (!fake_file.size()) {
+        setContainerError(false);
         return;
     }
 
-    if (!f.initFormat(fake_file)) {
-        errorPopup(f.getError());
+    startProbing(-1);
+}
 
-        f.cleanup();
-        fake_file.close();
-        fake_file.clear();
-        input_list->clear();
 
+void GUIWindow::startProbing(int video_index) {
+    cancel_probing = false;
+
+    video_okay = false;
+
+    probing_thread = new QThread;
+    ProbingWorker *worker = new ProbingWorker(&fake_file, &f, video_index, &cancel_probing);
+    worker->moveToThread(probing_thread);
+
+    connect(probing_thread, &QThread::started, worker, &ProbingWorker::process);
+    connect(worker, &ProbingWorker::streamsFound, this, &GUIWindow::probingStreamsFound);
+    connect(worker, &ProbingWorker::finished, this, &GUIWindow::probingFinished);
+    // Direct, so that the destructor can wait for the thread.
+    connect(worker, &ProbingWorker::finished, probing_thread, &QThread::quit, Qt::DirectConnection);
+    connect(worker, &ProbingWorker::finished, worker, &ProbingWorker::deleteLater);
+    connect(probing_thread, &QThread::finished, probing_thread, &QThread::deleteLater);
+
+    maybeEnableEngageButton();
+
+    probing_thread->start();
+}
+
+
+// The tracks are listed while the audio decoders are checked and the
+// audio delays are calculated.
+void GUIWindow::probingStreamsFound() {
+    // The input files changed again.
+    if (cancel_probing)
         return;
-    }
 
     setContainerError(D2V::getStreamType(f.fctx->iformat->name) == D2V::UNSUPPORTED_STREAM);
 
@@ -244,7 +396,8 @@ void GUIWindow::inputFilesUpdated() {
             // The text and suffix are set whenever a video track is selected.
             QListWidgetItem *item = new QListWidgetItem();
             item->setData(StreamIndex, i);
-            item->setData(DecoderOpened, f.initAudioCodec(i));
+            // Until probingFinished knows better.
+            item->setData(DecoderOpened, true);
             item->setFlags(item->flags() | Qt::ItemIsUserCheckable);
             item->setCheckState(Qt::Unchecked);
             audio_list->addItem(item);
@@ -256,6 +409,77 @@ void GUIWindow::inputFilesUpdated() {
 }
 
 
+void GUIWindow::probingFinished(ProbeResult result) {
+    probing_thread = nullptr;
+
+    if (probe_pending) {
+        probe_pending = false;
+
+        inputFilesUpdated();
+
+        return;
+    }
+
+    if (result.error.size()) {
+        errorPopup(result.error);
+
+        f.cleanup();
+        fake_file.close();
+        fake_file.clear();
+        input_list->clear();
+
+        maybeEnableEngageButton();
+
+        return;
+    }
+
+    if (result.full_probe) {
+        for (int i = 0; i < audio_list->count(); i++) {
+            QListWidgetItem *item = audio_list->item(i);
+            int stream_index = item->data(StreamIndex).toInt();
+
+            bool opened = std::find(result.opened_audio_decoders.cbegin(), result.opened_audio_decoders.cend(), stream_index) != result.opened_audio_decoders.cend();
+            item->setData(DecoderOpened, opened);
+        }
+    }
+
+    // Another video track was selected in the meantime.
+    int video_index = video_group->checkedId();
+    if (video_index != result.video_index) {
+        startProbing(video_index);
+        return;
+    }
+
+    if (video_index != -1)
+        applyAudioDelays(result);
+
+    maybeEnableEngageButton();
+}
+
+
+void GUIWindow::applyAudioDelays(const ProbeResult &result) {
+    int id = result.video_index;
+
+    if (result.delay_error.size())
+        logMessage(QString::fromStdString(result.delay_error));
+
+    first_video_keyframe_pos = result.first_video_keyframe_pos;
+
+    QString path = removeExtension(d2v_edit->text());
+
+    for (int i = 0; i < audio_list->count(); i++) {
+        QListWidgetItem *item = audio_list->item(i);
+        QString suffix = QString::fromStdString(suggestAudioTrackSuffix(f.fctx->streams[item->data(StreamIndex).toInt()], result.audio_delay_map));
+        item->setText(path + suffix);
+        item->setData(FileNameSuffix, suffix);
+    }
+
+    video_okay = D2V::isSupportedVideoCodecID(f.fctx->streams[id]->codecpar->codec_id) && f.initVideoCodec(id);
+
+    setVideoError((QRadioButton *)video_group->button(id), !video_okay);
+}
+
+
 void GUIWindow::startIndexing() {
     QStringList existing_files;
 
@@ -368,15 +592,14 @@ void GUIWindow::startIndexing() {
 
 
 void GUIWindow::startDemuxing() {
-    int start_gop_frame = d2v.getGOPStartFrame(range_start);
-    if (start_gop_frame > 0 && d2v.isOpenGOP(start_gop_frame))
-        start_gop_frame = d2v.getGOPStartFrame(start_gop_frame - 1);
-
-    int64_t start_gop_position = d2v.getGOPStartPosition(start_gop_frame);
+    DemuxRange range(range_start, range_end);
+    snapDemuxRange(d2v, range);
 
-    int end_gop_frame = d2v.getNextGOPStartFrame(range_end);
+    int start_gop_frame = range.start_gop_frame;
+    int64_t start_gop_position = range.start_gop_position;
 
-    int64_t end_gop_position = d2v.getNextGOPStartPosition(range_end);
+    int end_gop_frame = range.end_gop_frame;
+    int64_t end_gop_position = range.end_gop_position;
 
     video_file_name = QStringLiteral("%1.%2-%3.m2v").arg(removeExtension(d2v_edit->text())).arg(start_gop_frame).arg(end_gop_frame - 1);
 
@@ -408,10 +631,21 @@ void GUIWindow::startDemuxing() {
         return;
     }
 
+    FILE *demuxed_d2v_file = openFile(demuxed_d2v.toUtf8().constData(), "wb");
+    if (!demuxed_d2v_file) {
+        errorPopup(QStringLiteral("Failed to open d2v file '%1' for writing: %2").arg(demuxed_d2v).arg(strerror(errno)));
+
+        fclose(video_file);
+
+        enableInterface(true);
+
+        return;
+    }
+
     logMessage(QStringLiteral("Started demuxing video range %1-%2 (%3 and %4 additional frames).").arg(start_gop_frame).arg(end_gop_frame - 1).arg(range_start - start_gop_frame).arg(end_gop_frame - 1 - range_end));
 
     QThread *worker_thread = new QThread;
-    DemuxingWorker *worker = new DemuxingWorker(d2v, video_file, start_gop_position, end_gop_position);
+    DemuxingWorker *worker = new DemuxingWorker(d2v, video_file, start_gop_position, end_gop_position, demuxed_d2v_file, demuxed_d2v.toStdString(), video_file_name.toStdString());
     worker->moveToThread(worker_thread);
 
     connect(worker_thread, &QThread::started, worker, &DemuxingWorker::process);
@@ -430,18 +664,40 @@ extern std::atomic_bool stop_processing;
 GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
     : QMainWindow(parent)
     , first_video_keyframe_pos(-1)
+    , worker_progress_position(0)
+    , worker_progress_total(0)
+    , worker_log_dropped(0)
     , container_okay(false)
     , output_okay(false)
     , video_okay(false)
     , audio_okay(false)
+    , probing_thread(nullptr)
+    , cancel_probing(false)
+    , probe_pending(false)
     , vsapi(nullptr)
     , vscore(nullptr)
+    , vssource(nullptr)
     , vsnode(nullptr)
-    , vsframe(nullptr)
+    , vsnode_fast(nullptr)
+    , frames_in_flight(0)
+    , frame_generation(0)
+    , wanted_frame(0)
+    , wanted_fast(false)
+    , display_request(-1)
+    , failed_frame(-1)
+    , thumbnails_in_flight(0)
+    , thumbnail_generation(0)
+    , thumbnails_done(0)
+    , thumbnail_failed(false)
     , settings(_settings)
 {
-    qRegisterMetaType<int64_t>("int64_t");
     qRegisterMetaType<D2V>();
+    qRegisterMetaType<ProbeResult>();
+    // The thumbnails are sent to thumbnailReady with a queued call.
+    qRegisterMetaType<QImage>();
+
+
+    frame_cache.setMaxCost(FRAME_CACHE_SIZE);
 
 
     setAcceptDrops(true);
@@ -480,15 +736,25 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
     indexing_page = new QWidget(this);
 
 
-    video_frame_label = new QLabel;
-    video_frame_label->setAlignment(Qt::AlignCenter);
+    video_frame_widget = new FrameWidget;
 
-    ScrollArea *video_frame_scroll = new ScrollArea;
+    video_frame_scroll = new ScrollArea;
     video_frame_scroll->setFrameShape(QFrame::NoFrame);
     video_frame_scroll->setFocusPolicy(Qt::NoFocus);
     video_frame_scroll->setAlignment(Qt::AlignCenter);
     video_frame_scroll->setWidgetResizable(true);
-    video_frame_scroll->setWidget(video_frame_label);
+    video_frame_scroll->setWidget(video_frame_widget);
+
+    thumbnail_list = new QListWidget(this);
+    thumbnail_list->setViewMode(QListView::IconMode);
+    thumbnail_list->setFlow(QListView::LeftToRight);
+    thumbnail_list->setWrapping(false);
+    thumbnail_list->setMovement(QListView::Static);
+    thumbnail_list->setUniformItemSizes(true);
+    thumbnail_list->setHorizontalScrollMode(QAbstractItemView::ScrollPerPixel);
+    thumbnail_list->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+    thumbnail_list->setHorizontalScrollBarPolicy(Qt::ScrollBarAlwaysOn);
+    thumbnail_list->setFixedHeight(THUMBNAIL_HEIGHT + thumbnail_list->fontMetrics().height() + thumbnail_list->horizontalScrollBar()->sizeHint().height() + 4 * thumbnail_list->frameWidth() + 16);
 
     QPushButton *range_start_button = new QPushButton(QStringLiteral("&["), this);
     QPushButton *range_end_button = new QPushButton(QStringLiteral("&]"), this);
@@ -500,6 +766,11 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
     video_frame_slider = new QSlider(Qt::Horizontal);
     video_frame_slider->setTracking(false);
 
+    // Rebuilding the resize node is not free, so wait until the size settles.
+    preview_resize_timer = new QTimer(this);
+    preview_resize_timer->setSingleShot(true);
+    preview_resize_timer->setInterval(100);
+
     demuxing_page = new QWidget(this);
 
 
@@ -507,6 +778,9 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
     log_edit->setReadOnly(true);
     log_edit->setFont(QFont(QStringLiteral("Monospace")));
 
+    worker_update_timer = new QTimer(this);
+    worker_update_timer->setInterval(WORKER_UPDATE_INTERVAL);
+
     progress_bar = new QProgressBar(this);
     progress_bar->setMaximum(10000);
     start_stop_button = new QPushButton("&Engage", this);
@@ -542,19 +816,14 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
         if (!file_names.size())
             return;
 
-        fake_file.close();
-
         if (container_widget->currentWidget() == demuxing_page) {
             input_list->clear();
-            fake_file.clear();
 
             container_widget->setCurrentWidget(indexing_page);
         }
 
-        for (int i = 0; i < file_names.size(); i++) {
+        for (int i = 0; i < file_names.size(); i++)
             input_list->addItem(file_names[i]);
-            fake_file.push_back(file_names[i].toStdString());
-        }
 
 
         clearUserInterface();
@@ -568,21 +837,12 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
         if (!selection.size())
             return;
 
-        fake_file.close();
-
-        for (int i = selection.size() - 1; i >= 0; i--) {
-            fake_file.erase(fake_file.begin() + input_list->row(selection[i]));
+        for (int i = selection.size() - 1; i >= 0; i--)
             delete selection[i];
-        }
 
 
         clearUserInterface();
 
-        if (!input_list->count()) {
-            setContainerError(false);
-            return;
-        }
-
         inputFilesUpdated();
     });
 
@@ -592,15 +852,12 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
         if (!selection.size())
             return;
 
-        fake_file.close();
-
         for (int i = 0; i < selection.size(); i++) {
             int row = input_list->row(selection[i]);
 
             if (row == 0)
                 return;
 
-            std::swap(fake_file[row], fake_file[row - 1]);
             input_list->insertItem(row, input_list->takeItem(row - 1));
         }
 
@@ -616,15 +873,12 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
         if (!selection.size())
             return;
 
-        fake_file.close();
-
         for (int i = selection.size() - 1; i >= 0; i--) {
             int row = input_list->row(selection[i]);
 
             if (row == input_list->count() - 1)
                 return;
 
-            std::swap(fake_file[row], fake_file[row + 1]);
             input_list->insertItem(row, input_list->takeItem(row + 1));
         }
 
@@ -660,26 +914,13 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
         // "int id" is the QButtonGroup id, not AVStream::id
 
         if (checked) {
-            AudioDelayMap audio_delay_map;
-            std::string error;
-
-            /// And if it fails somehow?
-            calculateAudioDelays(fake_file, f.fctx->streams[id]->id, audio_delay_map, &first_video_keyframe_pos, error);
-
-            QString path = removeExtension(d2v_edit->text());
-
-            for (int i = 0; i < audio_list->count(); i++) {
-                QListWidgetItem *item = audio_list->item(i);
-                QString suffix = QString::fromStdString(suggestAudioTrackSuffix(f.fctx->streams[item->data(StreamIndex).toInt()], audio_delay_map));
-                item->setText(path + suffix);
-                item->setData(FileNameSuffix, suffix);
-            }
-
-            video_okay = D2V::isSupportedVideoCodecID(f.fctx->streams[id]->codecpar->codec_id) && f.initVideoCodec(id);
-            maybeEnableEngageButton();
+            // The audio delays are calculated in another thread. If one is
+            // busy already, probingFinished notices the new selection.
+            if (!probing_thread)
+                startProbing(id);
+        } else {
+            setVideoError((QRadioButton *)video_group->button(id), false);
         }
-
-        setVideoError((QRadioButton *)video_group->button(id), !video_okay && checked);
     });
 
     connect(audio_list, &QListWidget::itemChanged, [this] (QListWidgetItem *) {
@@ -712,6 +953,24 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
 
     connect(video_frame_slider, &QSlider::valueChanged, this, &GUIWindow::displayFrame);
 
+    // Tracking is off, so valueChanged only comes after the slider is released.
+    // In between, the cheaper preview is shown.
+    connect(video_frame_slider, &QSlider::sliderMoved, this, &GUIWindow::displayFrame);
+
+    connect(video_frame_slider, &QSlider::sliderReleased, [this] () {
+        displayFrame(video_frame_slider->sliderPosition());
+    });
+
+    connect(thumbnail_list, &QListWidget::itemClicked, [this] (QListWidgetItem *item) {
+        displayFrame(item->data(FrameNumber).toInt());
+    });
+
+    connect(video_frame_scroll, &ScrollArea::resized, preview_resize_timer, static_cast<void (QTimer::*)()>(&QTimer::start));
+
+    connect(preview_resize_timer, &QTimer::timeout, this, &GUIWindow::resizePreview);
+
+    connect(worker_update_timer, &QTimer::timeout, this, &GUIWindow::showWorkerUpdates);
+
 
     connect(start_stop_button, &QPushButton::clicked, [this] () {
         bool working = !container_widget->isEnabled();
@@ -834,6 +1093,7 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
 
     vbox = new QVBoxLayout;
     vbox->addWidget(video_frame_scroll);
+    vbox->addWidget(thumbnail_list);
 
     hbox = new QHBoxLayout;
     hbox->addWidget(range_start_button);
@@ -889,6 +1149,12 @@ GUIWindow::GUIWindow(QSettings &_settings, QWidget *parent)
 
 
 GUIWindow::~GUIWindow() {
+    // The worker uses fake_file and f.
+    if (probing_thread) {
+        cancel_probing = true;
+        probing_thread->wait();
+    }
+
     freeVapourSynth();
 }
 
@@ -904,6 +1170,9 @@ void GUIWindow::errorPopup(const QString &msg) {
 
 
 void GUIWindow::indexingFinished(D2V new_d2v) {
+    // The worker's last messages come first.
+    showWorkerUpdates();
+
     audio_files.clear();
 
     if (!d2v.getNumFrames())
@@ -945,131 +1214,238 @@ void GUIWindow::indexingFinished(D2V new_d2v) {
 
 
 void GUIWindow::demuxingFinished(D2V new_d2v) {
+    showWorkerUpdates();
+
     D2V::ProcessingResult result = new_d2v.getResult();
 
     if (result == D2V::ProcessingFinished) {
-        logMessage(QStringLiteral("Finished writing video file %1.").arg(video_file_name));
+        // The d2v file was written together with the video, from the lines of the d2v file being edited.
+        logMessage(QStringLiteral("Finished writing video file %1 and d2v file %2.\n").arg(video_file_name).arg(QString::fromStdString(suggestD2VName(video_file_name.toStdString()))));
 
         progress_bar->setValue(progress_bar->maximum());
+    } else if (result == D2V::ProcessingError) {
+        errorPopup(new_d2v.getError());
+    } else if (result == D2V::ProcessingCancelled) {
+        logMessage(QStringLiteral("Video demuxing cancelled by user."));
+    }
 
-        demuxed_fake_file.close();
-        demuxed_fake_file.clear();
+    enableInterface(true);
 
-        demuxed_fake_file.push_back(video_file_name.toStdString());
+    if (!f.seek(0))
+        logMessage(QString::fromStdString(f.getError()));
+}
 
-        if (!demuxed_fake_file.open()) {
-            errorPopup(demuxed_fake_file.getError());
 
-            enableInterface(true);
+void GUIWindow::displayFrame(int n) {
+    video_frame_spin->blockSignals(true);
+    video_frame_spin->setValue(n);
+    video_frame_spin->blockSignals(false);
 
-            if (!f.seek(0))
-                logMessage(QString::fromStdString(f.getError()));
+    // While it's being dragged, the slider knows where it is.
+    bool fast = video_frame_slider->isSliderDown();
 
-            return;
-        }
+    if (!fast) {
+        video_frame_slider->blockSignals(true);
+        video_frame_slider->setValue(n);
+        video_frame_slider->blockSignals(false);
+    }
 
-        demuxed_f.cleanup();
+    updateCurrentThumbnail(n);
 
-        if (!demuxed_f.initFormat(demuxed_fake_file)) {
-            errorPopup(demuxed_f.getError());
+    if (!vsnode)
+        return;
 
-            enableInterface(true);
+    wanted_frame = n;
+    wanted_fast = fast;
 
-            if (!f.seek(0))
-                logMessage(QString::fromStdString(f.getError()));
+    // A frame from the cheaper preview is better than nothing while the proper one is made.
+    CachedFrame *cached = frame_cache.object(n);
+    if (cached)
+        video_frame_widget->setFrame(vsapi, vsapi->cloneFrameRef(cached->frame));
 
-            return;
-        }
+    if (!isWantedFrameCached() && display_request == -1)
+        requestFrame(n, fast);
+    // Otherwise framesReady requests it when the current request is done,
+    // so that scrubbing doesn't queue up every frame passed over.
 
-        AVStream *video_stream = demuxed_f.fctx->streams[0];
+    // Nobody knows where the slider will go next.
+    if (fast)
+        prefetch_frames.clear();
+    else
+        prefetchAround(n);
+}
 
-        if (!demuxed_f.initVideoCodec(video_stream->index)) {
-            errorPopup(demuxed_f.getError());
 
-            enableInterface(true);
+bool GUIWindow::isWantedFrameCached() {
+    CachedFrame *cached = frame_cache.object(wanted_frame);
 
-            if (!f.seek(0))
-                logMessage(QString::fromStdString(f.getError()));
+    return cached && (wanted_fast || !cached->fast);
+}
 
-            return;
-        }
 
-        QString new_d2v_name = QString::fromStdString(suggestD2VName(video_file_name.toStdString()));
-        FILE *new_d2v_file = openFile(new_d2v_name.toUtf8().constData(), "wb");
-        if (!new_d2v_file) {
-            errorPopup(QStringLiteral("Failed to open d2v file '%1' for writing: %2").arg(new_d2v_name).arg(strerror(errno)));
+static qint64 requestKey(int n, bool fast) {
+    return (qint64)n * 2 + fast;
+}
 
-            enableInterface(true);
 
-            if (!f.seek(0))
-                logMessage(QString::fromStdString(f.getError()));
+void GUIWindow::requestFrame(int n, bool fast) {
+    if (n == wanted_frame)
+        display_request = n;
 
-            return;
-        }
+    if (requested_frames.contains(requestKey(n, fast)))
+        return;
 
-        logMessage(QStringLiteral("Started indexing the demuxed video %1.").arg(video_file_name));
+    requested_frames.insert(requestKey(n, fast));
 
+    frames_in_flight++;
+
+    vsapi->getFrameAsync(n, fast ? vsnode_fast : vsnode, frameDone, new FrameRequest{ this, frame_generation, fast });
+}
 
-        QThread *worker_thread = new QThread;
-        IndexingWorker *worker = new IndexingWorker(new_d2v_name, new_d2v_file, AudioFilesMap(), &demuxed_fake_file, &demuxed_f, video_stream, first_video_keyframe_pos, (D2V::ColourRange)range_group->checkedId(), use_relative_paths_check->isChecked(), this);
-        worker->moveToThread(worker_thread);
 
-        connect(worker_thread, &QThread::started, worker, &IndexingWorker::process);
-        connect(worker, &IndexingWorker::finished, this, &GUIWindow::indexingFinished);
-        connect(worker, &IndexingWorker::finished, worker_thread, &QThread::quit);
-        connect(worker, &IndexingWorker::finished, worker, &IndexingWorker::deleteLater);
-        connect(worker_thread, &QThread::finished, worker_thread, &QThread::deleteLater);
+// The frames next to n, and the first frames of the nearby GOPs, because
+// d2vsource has to decode from the start of a GOP anyway.
+void GUIWindow::prefetchAround(int n) {
+    int num_frames = vsapi->getVideoInfo(vsnode)->numFrames;
+
+    int gop_start = d2v.getGOPStartFrame(n);
+    int next_gop_start = d2v.getNextGOPStartFrame(n);
+    int previous_gop_start = gop_start > 0 ? d2v.getGOPStartFrame(gop_start - 1) : -1;
+
+    int candidates[] = {
+        n + 1,
+        n - 1,
+        n + 2,
+        next_gop_start,
+        gop_start,
+        previous_gop_start,
+        n + 3,
+        n - 2,
+    };
 
-        worker_thread->start();
+    prefetch_frames.clear();
 
-        if (!f.seek(0))
-            logMessage(QString::fromStdString(f.getError()));
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        int frame = candidates[i];
 
+        if (frame >= 0 && frame < num_frames && !prefetch_frames.contains(frame))
+            prefetch_frames.push_back(frame);
+    }
+
+    requestPrefetchFrames();
+}
+
+
+void GUIWindow::requestPrefetchFrames() {
+    // The frame being displayed comes first.
+    if (display_request != -1)
         return;
-    } else if (result == D2V::ProcessingError) {
-        errorPopup(new_d2v.getError());
-    } else if (result == D2V::ProcessingCancelled) {
-        logMessage(QStringLiteral("Video demuxing cancelled by user."));
+
+    while (prefetch_frames.size() && requested_frames.size() < PREFETCH_REQUESTS) {
+        int frame = prefetch_frames.takeFirst();
+
+        CachedFrame *cached = frame_cache.object(frame);
+        if (!cached || cached->fast)
+            requestFrame(frame, false);
     }
+}
 
-    enableInterface(true);
 
-    if (!f.seek(0))
-        logMessage(QString::fromStdString(f.getError()));
+void GUIWindow::frameFinished(int n, const VSFrameRef *frame, int generation, bool fast, const std::string &error) {
+    {
+        std::lock_guard<std::mutex> lock(finished_frames_mutex);
+
+        finished_frames.push_back({ n, frame, generation, fast, error });
+    }
+
+    QMetaObject::invokeMethod(this, "framesReady", Qt::QueuedConnection);
+
+    frames_in_flight--;
 }
 
 
-void GUIWindow::displayFrame(int n) {
-    video_frame_spin->blockSignals(true);
-    video_frame_spin->setValue(n);
-    video_frame_spin->blockSignals(false);
+void GUIWindow::framesReady() {
+    std::vector<FinishedFrame> frames;
 
-    video_frame_slider->blockSignals(true);
-    video_frame_slider->setValue(n);
-    video_frame_slider->blockSignals(false);
+    {
+        std::lock_guard<std::mutex> lock(finished_frames_mutex);
 
-    if (!vsnode)
-        return;
+        frames.swap(finished_frames);
+    }
+
+    for (size_t i = 0; i < frames.size(); i++) {
+        const FinishedFrame &finished = frames[i];
+
+        if (finished.generation != frame_generation) {
+            if (finished.frame)
+                vsapi->freeFrame(finished.frame);
+            continue;
+        }
+
+        requested_frames.remove(requestKey(finished.n, finished.fast));
+
+        if (finished.n == display_request)
+            display_request = -1;
+
+        if (!finished.frame) {
+            if (finished.n == wanted_frame) {
+                // Don't ask for it again and again.
+                failed_frame = finished.n;
+
+                logMessage(QStringLiteral("Failed to retrieve frame number %1. Error message: %2").arg(finished.n).arg(QString::fromStdString(finished.error)));
+            }
+            continue;
+        }
+
+        // Never replace a proper frame with a cheap one.
+        CachedFrame *cached = frame_cache.object(finished.n);
+        if (finished.fast && cached && !cached->fast) {
+            vsapi->freeFrame(finished.frame);
+            continue;
+        }
+
+        if (finished.n == wanted_frame)
+            video_frame_widget->setFrame(vsapi, vsapi->cloneFrameRef(finished.frame));
 
-    std::vector<char> error(1024);
+        // The cost is in KiB.
+        int cost = vsapi->getStride(finished.frame, 0) * vsapi->getFrameHeight(finished.frame, 0) / 1024;
 
-    const VSFrameRef *frame = vsapi->getFrame(n, vsnode, error.data(), error.size());
+        frame_cache.insert(finished.n, new CachedFrame(vsapi, finished.frame, finished.fast), std::max(1, cost));
+    }
 
-    if (!frame) {
-        logMessage(QStringLiteral("Failed to retrieve frame number %1. Error message: %2").arg(n).arg(error.data()));
+    if (!isWantedFrameCached() && display_request == -1 && wanted_frame != failed_frame) {
+        requestFrame(wanted_frame, wanted_fast);
         return;
     }
 
-    const uint8_t *ptr = vsapi->getReadPtr(frame, 0);
-    int width = vsapi->getFrameWidth(frame, 0);
-    int height = vsapi->getFrameHeight(frame, 0);
-    int stride = vsapi->getStride(frame, 0);
-    QPixmap pixmap = QPixmap::fromImage(QImage(ptr, width, height, stride, QImage::Format_RGB32).mirrored(false, true));
+    requestPrefetchFrames();
+}
+
+
+// Must be called before the node goes away. getFrameAsync requests can't
+// be cancelled, so this waits for them.
+void GUIWindow::forgetFrames() {
+    while (frames_in_flight > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    {
+        std::lock_guard<std::mutex> lock(finished_frames_mutex);
+
+        for (size_t i = 0; i < finished_frames.size(); i++) {
+            if (finished_frames[i].frame)
+                vsapi->freeFrame(finished_frames[i].frame);
+        }
 
-    video_frame_label->setPixmap(pixmap);
-    // Must free the frame only after replacing the pixmap.
-    vsapi->freeFrame(vsframe);
-    vsframe = frame;
+        finished_frames.clear();
+    }
+
+    frame_generation++;
+
+    frame_cache.clear();
+    requested_frames.clear();
+    prefetch_frames.clear();
+    display_request = -1;
+    failed_frame = -1;
 }
 
 
@@ -1202,13 +1578,19 @@ void GUIWindow::freeVapourSynth() {
     if (!vsapi)
         return;
 
-    video_frame_label->setPixmap(QPixmap());
-    vsapi->freeFrame(vsframe);
-    vsframe = nullptr;
+    video_frame_widget->setFrame(nullptr, nullptr);
+    forgetFrames();
+    forgetThumbnails();
 
     vsapi->freeNode(vsnode);
     vsnode = nullptr;
 
+    vsapi->freeNode(vsnode_fast);
+    vsnode_fast = nullptr;
+
+    vsapi->freeNode(vssource);
+    vssource = nullptr;
+
     vsapi->freeCore(vscore);
     vscore = nullptr;
 
@@ -1220,13 +1602,28 @@ void GUIWindow::createVapourSynthFilterChain() {
     if (!vsapi)
         return;
 
-    VSPlugin *d2vsource_plugin = vsapi->getPluginById(D2VSOURCE_ID, vscore);
-    VSPlugin *resize_plugin = vsapi->getPluginById(RESIZE_ID, vscore);
-    VSPlugin *std_plugin = vsapi->getPluginById(STD_ID, vscore);
+    forgetFrames();
+
+    VSNodeRef *source = createSourceNode();
+    if (!source)
+        return;
+
+    vsapi->freeNode(vssource);
+    vssource = source;
+
+    // Force the resize nodes to be created.
+    preview_size = QSize();
+
+    wanted_frame = 0;
+
+    resizePreview();
+
+    createThumbnails();
+}
 
-#undef D2VSOURCE_ID
-#undef RESIZE_ID
-#undef STD_ID
+
+VSNodeRef *GUIWindow::createSourceNode() {
+    VSPlugin *d2vsource_plugin = vsapi->getPluginById(D2VSOURCE_ID, vscore);
 
     VSMap *args = vsapi->createMap();
 
@@ -1241,54 +1638,294 @@ void GUIWindow::createVapourSynthFilterChain() {
         vsapi->freeMap(ret);
         vsapi->freeMap(args);
 
-        return;
+        return nullptr;
     }
-    vsnode = vsapi->propGetNode(ret, "clip", 0, nullptr);
+    VSNodeRef *node = vsapi->propGetNode(ret, "clip", 0, nullptr);
     vsapi->freeMap(ret);
-    vsapi->clearMap(args);
+    vsapi->freeMap(args);
 
-    vsapi->propSetNode(args, "clip", vsnode, paReplace);
-    vsapi->freeNode(vsnode);
+    return node;
+}
+
+
+// Converts to packed RGB and scales in one go.
+VSNodeRef *GUIWindow::createResizeNode(VSNodeRef *source, const char *kernel, int width, int height) {
+    VSPlugin *resize_plugin = vsapi->getPluginById(RESIZE_ID, vscore);
+
+    VSMap *args = vsapi->createMap();
+
+    vsapi->propSetNode(args, "clip", source, paReplace);
+    vsapi->propSetInt(args, "width", width, paReplace);
+    vsapi->propSetInt(args, "height", height, paReplace);
     vsapi->propSetInt(args, "format", pfCompatBGR32, paReplace);
     vsapi->propSetData(args, "matrix_in_s", "709", -1, paReplace);
     vsapi->propSetInt(args, "prefer_props", 1, paReplace);
 
-    ret = vsapi->invoke(resize_plugin, "Bicubic", args);
+    VSMap *ret = vsapi->invoke(resize_plugin, kernel, args);
     if (vsapi->getError(ret)) {
-        logMessage(QStringLiteral("Failed to invoke resize.Bicubic" THEREFORE " Error message: %1").arg(vsapi->getError(ret)));
+        logMessage(QStringLiteral("Failed to invoke resize.%1" THEREFORE " Error message: %2").arg(kernel).arg(vsapi->getError(ret)));
 
         vsapi->freeMap(ret);
         vsapi->freeMap(args);
 
-        return;
+        return nullptr;
     }
-    vsnode = vsapi->propGetNode(ret, "clip", 0, nullptr);
+    VSNodeRef *node = vsapi->propGetNode(ret, "clip", 0, nullptr);
     vsapi->freeMap(ret);
-    vsapi->clearMap(args);
+    vsapi->freeMap(args);
 
-    vsapi->propSetNode(args, "clip", vsnode, paReplace);
-    vsapi->freeNode(vsnode);
+    return node;
+}
+
+
+// The source is converted to RGB and scaled to fit the viewport in one
+// resize call, instead of converting it at full size and letting Qt scale it.
+VSNodeRef *GUIWindow::createPreviewNode(const char *kernel, int width, int height) {
+    VSPlugin *std_plugin = vsapi->getPluginById(STD_ID, vscore);
+
+    VSNodeRef *node = createResizeNode(vssource, kernel, width, height);
+    if (!node)
+        return nullptr;
 
-    ret = vsapi->invoke(std_plugin, "Cache", args);
+    VSMap *args = vsapi->createMap();
+
+    vsapi->propSetNode(args, "clip", node, paReplace);
+    vsapi->freeNode(node);
+
+    VSMap *ret = vsapi->invoke(std_plugin, "Cache", args);
     if (vsapi->getError(ret)) {
         logMessage(QStringLiteral("Failed to invoke std.Cache" THEREFORE " Error message: %1").arg(vsapi->getError(ret)));
 
         vsapi->freeMap(ret);
         vsapi->freeMap(args);
 
-        return;
+        return nullptr;
     }
-    vsnode = vsapi->propGetNode(ret, "clip", 0, nullptr);
+    node = vsapi->propGetNode(ret, "clip", 0, nullptr);
     vsapi->freeMap(ret);
     vsapi->freeMap(args);
 
+    return node;
+}
 
-    displayFrame(0);
 
-#undef THEREFORE
+// Only the resize nodes are rebuilt. The source node stays.
+void GUIWindow::resizePreview() {
+    if (!vsapi || !vssource)
+        return;
+
+    const VSVideoInfo *vi = vsapi->getVideoInfo(vssource);
+    if (vi->width <= 0 || vi->height <= 0)
+        return;
+
+    // Fit the frame in the viewport, but don't make it bigger than it is.
+    QSize viewport = video_frame_scroll->viewport()->size();
+    QSize size(vi->width, vi->height);
+    if (size.width() > viewport.width() || size.height() > viewport.height())
+        size.scale(viewport, Qt::KeepAspectRatio);
+
+    // Even sizes, and not absurdly small.
+    size.setWidth(std::max(16, size.width() & ~1));
+    size.setHeight(std::max(16, size.height() & ~1));
+
+    if (size == preview_size && vsnode)
+        return;
+
+    forgetFrames();
+
+    vsapi->freeNode(vsnode);
+    vsapi->freeNode(vsnode_fast);
+
+    // Bilinear while the slider is being dragged, Bicubic when it stops.
+    vsnode = createPreviewNode("Bicubic", size.width(), size.height());
+    vsnode_fast = vsnode ? createPreviewNode("Bilinear", size.width(), size.height()) : nullptr;
+
+    if (!vsnode_fast) {
+        vsapi->freeNode(vsnode);
+        vsnode = nullptr;
+        return;
+    }
+
+    preview_size = size;
+
+    displayFrame(wanted_frame);
+}
+
+
+// One thumbnail every few GOPs. d2vsource decodes one GOP at a time, so
+// the thumbnails are shared between several source nodes, which decode
+// them in parallel. The finished strip is saved next to the d2v file.
+void GUIWindow::createThumbnails() {
+    forgetThumbnails();
+
+    thumbnail_list->clear();
+    thumbnail_frames.clear();
+    thumbnails.clear();
+    thumbnails_done = 0;
+    thumbnail_failed = false;
+
+    if (!vsapi || !vssource)
+        return;
+
+    const VSVideoInfo *vi = vsapi->getVideoInfo(vssource);
+    if (vi->width <= 0 || vi->height <= 0)
+        return;
+
+    QVector<int> gop_starts;
+    for (int frame = 0; frame >= 0 && frame < d2v.getNumFrames(); frame = d2v.getNextGOPStartFrame(frame))
+        gop_starts.push_back(frame);
+
+    if (!gop_starts.size())
+        return;
+
+    int step = (gop_starts.size() + MAX_THUMBNAILS - 1) / MAX_THUMBNAILS;
+    for (int i = 0; i < gop_starts.size(); i += step)
+        thumbnail_frames.push_back(gop_starts[i]);
+
+    int height = std::min(THUMBNAIL_HEIGHT, vi->height) & ~1;
+    int width = std::max(2, (int)((int64_t)vi->width * height / vi->height) & ~1);
+
+    thumbnail_list->setIconSize(QSize(width, height));
+
+    QPixmap placeholder(width, height);
+    placeholder.fill(Qt::black);
+    QIcon placeholder_icon(placeholder);
+
+    for (int i = 0; i < thumbnail_frames.size(); i++) {
+        QListWidgetItem *item = new QListWidgetItem(placeholder_icon, QString::number(thumbnail_frames[i]), thumbnail_list);
+        item->setData(FrameNumber, thumbnail_frames[i]);
+    }
+
+    updateCurrentThumbnail(wanted_frame);
+
+    if (loadThumbnails(d2v_edit->text(), thumbnail_frames, height, thumbnails)) {
+        for (int i = 0; i < thumbnails.size(); i++)
+            if (!thumbnails[i].isNull())
+                thumbnail_list->item(i)->setIcon(QIcon(QPixmap::fromImage(thumbnails[i])));
+
+        thumbnails_done = thumbnails.size();
+        return;
+    }
+
+    thumbnails.resize(thumbnail_frames.size());
+
+    int jobs = std::min(thumbnail_frames.size(), std::max(1, std::min(MAX_THUMBNAIL_JOBS, QThread::idealThreadCount())));
+
+    for (int i = 0; i < jobs; i++) {
+        VSNodeRef *source = createSourceNode();
+        if (!source) {
+            forgetThumbnails();
+            return;
+        }
+
+        VSNodeRef *node = createResizeNode(source, "Bilinear", width, height);
+        vsapi->freeNode(source);
+        if (!node) {
+            forgetThumbnails();
+            return;
+        }
+
+        thumbnail_nodes.push_back(node);
+    }
+
+    for (int i = 0; i < jobs; i++)
+        requestThumbnail(i);
+}
+
+
+void GUIWindow::requestThumbnail(int index) {
+    thumbnails_in_flight++;
+
+    VSNodeRef *node = thumbnail_nodes[index % thumbnail_nodes.size()];
+
+    vsapi->getFrameAsync(thumbnail_frames[index], node, thumbnailDone, new ThumbnailRequest{ this, thumbnail_generation, index });
+}
+
+
+void GUIWindow::thumbnailFinished(int index, const VSFrameRef *frame, int generation, const std::string &error) {
+    QImage image;
+
+    if (frame) {
+        QImage wrapped(vsapi->getReadPtr(frame, 0), vsapi->getFrameWidth(frame, 0), vsapi->getFrameHeight(frame, 0), vsapi->getStride(frame, 0), QImage::Format_RGB32);
+
+        // The frame is stored bottom to top. This also makes a copy.
+        image = wrapped.mirrored();
+
+        vsapi->freeFrame(frame);
+    }
+
+    QMetaObject::invokeMethod(this, "thumbnailReady", Qt::QueuedConnection, Q_ARG(int, generation), Q_ARG(int, index), Q_ARG(QImage, image), Q_ARG(QString, QString::fromStdString(error)));
+
+    thumbnails_in_flight--;
+}
+
+
+void GUIWindow::thumbnailReady(int generation, int index, const QImage &image, const QString &error) {
+    if (generation != thumbnail_generation)
+        return;
+
+    if (image.isNull()) {
+        if (!thumbnail_failed)
+            logMessage(QStringLiteral("Failed to retrieve the thumbnail of frame number %1. Error message: %2").arg(thumbnail_frames[index]).arg(error));
+
+        thumbnail_failed = true;
+    } else {
+        thumbnails[index] = image;
+        thumbnail_list->item(index)->setIcon(QIcon(QPixmap::fromImage(image)));
+    }
+
+    thumbnails_done++;
+
+    // The same node decodes the next one.
+    int next = index + (int)thumbnail_nodes.size();
+    if (next < thumbnail_frames.size())
+        requestThumbnail(next);
+
+    if (thumbnails_done < thumbnail_frames.size())
+        return;
+
+    forgetThumbnails();
+
+    // Only a complete strip is worth keeping.
+    if (!thumbnail_failed) {
+        std::string save_error;
+        if (!saveThumbnails(d2v_edit->text(), thumbnail_frames, thumbnail_list->iconSize().height(), thumbnails, save_error))
+            logMessage(QString::fromStdString(save_error));
+    }
 }
 
 
+// Must be called before the core goes away. Like in forgetFrames, the
+// requests can't be cancelled, but there are only a few of them.
+void GUIWindow::forgetThumbnails() {
+    while (thumbnails_in_flight > 0)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    thumbnail_generation++;
+
+    for (size_t i = 0; i < thumbnail_nodes.size(); i++)
+        vsapi->freeNode(thumbnail_nodes[i]);
+    thumbnail_nodes.clear();
+}
+
+
+void GUIWindow::updateCurrentThumbnail(int n) {
+    // The last thumbnail at or before frame n.
+    int row = std::upper_bound(thumbnail_frames.cbegin(), thumbnail_frames.cend(), n) - thumbnail_frames.cbegin() - 1;
+    if (row < 0)
+        return;
+
+    thumbnail_list->setCurrentRow(row);
+    thumbnail_list->scrollToItem(thumbnail_list->item(row));
+}
+
+#undef D2VSOURCE_ID
+#undef RESIZE_ID
+#undef STD_ID
+
+#undef THEREFORE
+
+
 void GUIWindow::dragEnterEvent(QDragEnterEvent *event) {
     if (event->mimeData()->hasUrls())
         event->acceptProposedAction();
@@ -1310,12 +1947,8 @@ void GUIWindow::dropEvent(QDropEvent *event) {
 
     paths.sort();
 
-    fake_file.close();
-
-    for (int i = 0; i < paths.size(); i++) {
+    for (int i = 0; i < paths.size(); i++)
         input_list->addItem(paths[i]);
-        fake_file.push_back(paths[i].toStdString());
-    }
 
 
     clearUserInterface();
@@ -1327,6 +1960,15 @@ void GUIWindow::dropEvent(QDropEvent *event) {
 
 
 void GUIWindow::enableInterface(bool enable) {
+    // The workers only run while the interface is disabled.
+    if (enable) {
+        worker_update_timer->stop();
+    } else {
+        worker_progress_position = 0;
+        worker_progress_total = 0;
+        worker_update_timer->start();
+    }
+
     container_widget->setEnabled(enable);
     menuBar()->setEnabled(enable);
     start_stop_button->setText(enable ? "&Engage" : "Canc&el");
@@ -1340,6 +1982,70 @@ void GUIWindow::closeEvent(QCloseEvent *event) {
 }
 
 
+ProbingWorker::ProbingWorker(FakeFile *_fake_file, FFMPEG *_f, int _video_index, const std::atomic_bool *_cancel)
+    : fake_file(_fake_file)
+    , f(_f)
+    , video_index(_video_index)
+    , cancel(_cancel)
+{
+
+}
+
+
+void ProbingWorker::process() {
+    ProbeResult result;
+    result.full_probe = video_index == -1;
+
+    int index = video_index;
+
+    if (result.full_probe) {
+        if (!fake_file->open(PROBING_JOBS)) {
+            result.error = fake_file->getError();
+
+            emit finished(result);
+            return;
+        }
+
+        if (!f->initFormat(*fake_file, cancel)) {
+            if (*cancel)
+                result.cancelled = true;
+            else
+                result.error = f->getError();
+
+            emit finished(result);
+            return;
+        }
+
+        emit streamsFound();
+
+        for (unsigned i = 0; i < f->fctx->nb_streams; i++) {
+            AVMediaType type = f->fctx->streams[i]->codecpar->codec_type;
+
+            if (type == AVMEDIA_TYPE_VIDEO && index == -1)
+                index = i;
+            else if (type == AVMEDIA_TYPE_AUDIO && f->initAudioCodec(i))
+                result.opened_audio_decoders.push_back(i);
+        }
+    }
+
+    if (*cancel) {
+        result.cancelled = true;
+
+        emit finished(result);
+        return;
+    }
+
+    if (index != -1) {
+        result.video_index = index;
+
+        if (!calculateAudioDelays(*fake_file, f->fctx->streams[index]->id, result.audio_delay_map, &result.first_video_keyframe_pos, result.delay_error))
+            result.audio_delay_map.clear();
+    }
+
+    emit finished(result);
+}
+
+
 IndexingWorker::IndexingWorker(const QString &_d2v_file_name, FILE *_d2v_file, const AudioFilesMap &_audio_files, FakeFile *_fake_file, FFMPEG *_f, AVStream *_video_stream, int64_t _first_video_keyframe_pos, D2V::ColourRange _input_range, bool _use_relative_paths, GUIWindow *_window)
     : d2v(_d2v_file_name.toStdString(), _d2v_file, _audio_files, _fake_file, _f, _video_stream, _first_video_keyframe_pos, _input_range, _use_relative_paths, ::updateProgress, _window, ::logMessage, _window)
 {
@@ -1354,18 +2060,21 @@ void IndexingWorker::process() {
 }
 
 
-DemuxingWorker::DemuxingWorker(const D2V &_d2v, FILE *_video_file, int64_t _start_gop_position, int64_t _end_gop_position)
+DemuxingWorker::DemuxingWorker(const D2V &_d2v, FILE *_video_file, int64_t _start_gop_position, int64_t _end_gop_position, FILE *_d2v_file, const std::string &_d2v_name, const std::string &_video_name)
     : d2v(_d2v)
     , video_file(_video_file)
     , start_gop_position(_start_gop_position)
     , end_gop_position(_end_gop_position)
+    , d2v_file(_d2v_file)
+    , d2v_name(_d2v_name)
+    , video_name(_video_name)
 {
 
 }
 
 
 void DemuxingWorker::process() {
-    d2v.demuxVideo(video_file, start_gop_position, end_gop_position);
+    d2v.demuxVideo(video_file, start_gop_position, end_gop_position, d2v_file, d2v_name, video_name);
 
     emit finished(d2v);
 }
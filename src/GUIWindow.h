@@ -21,17 +21,29 @@ SOFTWARE.
 #ifndef D2V_WITCH_GUIWINDOW_H
 #define D2V_WITCH_GUIWINDOW_H
 
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include <QButtonGroup>
+#include <QCache>
 #include <QCheckBox>
+#include <QImage>
 #include <QLabel>
 #include <QLineEdit>
+#include <QListWidget>
 #include <QMainWindow>
 #include <QPlainTextEdit>
 #include <QProgressBar>
 #include <QPushButton>
 #include <QRadioButton>
+#include <QSet>
 #include <QSpinBox>
 #include <QStackedWidget>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
 
 #include <QSettings>
 
@@ -41,7 +53,9 @@ SOFTWARE.
 #include "D2V.h"
 #include "FakeFile.h"
 #include "FFMPEG.h"
+#include "FrameWidget.h"
 #include "ListWidget.h"
+#include "ScrollArea.h"
 
 
 // To avoid duplicating the string literals passed to QSettings
@@ -53,6 +67,69 @@ SOFTWARE.
 #define KEY_DEFAULT_USE_RELATIVE_PATHS                  false
 
 
+// A frame reference owned by the preview cache.
+struct CachedFrame {
+    const VSAPI *vsapi;
+    const VSFrameRef *frame;
+    bool fast; // From the cheaper preview.
+
+    CachedFrame(const VSAPI *_vsapi, const VSFrameRef *_frame, bool _fast)
+        : vsapi(_vsapi)
+        , frame(_frame)
+        , fast(_fast)
+    { }
+
+    ~CachedFrame() {
+        vsapi->freeFrame(frame);
+    }
+};
+
+
+// A log message from a worker thread, with the number of times it came
+// again right after itself.
+struct WorkerLogMessage {
+    std::string text;
+    int repeats;
+};
+
+
+struct FinishedFrame {
+    int n;
+    const VSFrameRef *frame; // Null if there was an error.
+    int generation;
+    bool fast;
+    std::string error;
+};
+
+
+// What ProbingWorker found out.
+struct ProbeResult {
+    // True if the input files were opened and probed, false if only the
+    // audio delays were calculated.
+    bool full_probe;
+    bool cancelled;
+
+    // If not empty, the input files could not be opened or probed.
+    std::string error;
+
+    // Stream indices of the audio tracks whose decoders could be opened.
+    std::vector<int> opened_audio_decoders;
+
+    // The audio delays relative to this video track, or -1.
+    int video_index;
+    AudioDelayMap audio_delay_map;
+    int64_t first_video_keyframe_pos;
+    std::string delay_error;
+
+    ProbeResult()
+        : full_probe(false)
+        , cancelled(false)
+        , video_index(-1)
+        , first_video_keyframe_pos(-1)
+    { }
+};
+
+
 class GUIWindow : public QMainWindow {
     Q_OBJECT
 
@@ -63,21 +140,61 @@ class GUIWindow : public QMainWindow {
 
     QString video_file_name;
     FILE *video_file;
-    FakeFile demuxed_fake_file;
-    FFMPEG demuxed_f;
 
     int64_t first_video_keyframe_pos;
 
+    // The workers' progress and log messages are picked up by
+    // worker_update_timer, instead of being sent to the GUI thread one by
+    // one.
+    std::atomic<int64_t> worker_progress_position;
+    std::atomic<int64_t> worker_progress_total;
+    std::mutex worker_log_mutex;
+    std::vector<WorkerLogMessage> worker_log;
+    int worker_log_dropped;
+
 
     bool container_okay;
     bool output_okay;
     bool video_okay;
     bool audio_okay;
 
+    // Only one ProbingWorker runs at a time. If the input files change in
+    // the meantime, it is cancelled and a new one starts when it's done.
+    QThread *probing_thread;
+    std::atomic_bool cancel_probing;
+    bool probe_pending;
+
     const VSAPI *vsapi;
     VSCore *vscore;
-    VSNodeRef *vsnode;
-    const VSFrameRef *vsframe;
+    VSNodeRef *vssource;
+    VSNodeRef *vsnode; // Resized with Bicubic.
+    VSNodeRef *vsnode_fast; // Resized with Bilinear, for scrubbing.
+    QSize preview_size;
+
+    // The preview frames are requested with getFrameAsync, and kept as
+    // VapourSynth frames until they fall out of the cache. Results from an
+    // older filter chain (an older generation) are thrown away.
+    QCache<int, CachedFrame> frame_cache;
+    std::mutex finished_frames_mutex;
+    std::vector<FinishedFrame> finished_frames;
+    QSet<qint64> requested_frames; // Frame number * 2 + fast.
+    QList<int> prefetch_frames;
+    std::atomic_int frames_in_flight;
+    int frame_generation;
+    int wanted_frame;
+    bool wanted_fast;
+    int display_request; // -1 if none.
+    int failed_frame; // -1 if none.
+
+    // The thumbnails are decoded by several d2v.Source nodes at the same
+    // time, each one taking every thumbnail_nodes.size()th thumbnail.
+    std::vector<VSNodeRef *> thumbnail_nodes;
+    QVector<int> thumbnail_frames;
+    QVector<QImage> thumbnails;
+    std::atomic_int thumbnails_in_flight;
+    int thumbnail_generation;
+    int thumbnails_done;
+    bool thumbnail_failed;
 
     int range_start;
     int range_end;
@@ -96,11 +213,15 @@ class GUIWindow : public QMainWindow {
     QCheckBox *video_demux_check;
     QButtonGroup *range_group;
     QListWidget *audio_list;
-    QLabel *video_frame_label;
+    FrameWidget *video_frame_widget;
+    ScrollArea *video_frame_scroll;
+    QTimer *preview_resize_timer;
+    QListWidget *thumbnail_list;
     QSpinBox *video_frame_spin;
     QLabel *range_label;
     QSlider *video_frame_slider;
     QPlainTextEdit *log_edit;
+    QTimer *worker_update_timer;
     QProgressBar *progress_bar;
     QPushButton *start_stop_button;
     QWidget *indexing_page;
@@ -117,6 +238,10 @@ class GUIWindow : public QMainWindow {
     void setVideoError(QRadioButton *button, bool error);
     void setAudioError(const std::vector<int> &failed_decoders);
     void inputFilesUpdated();
+    void startProbing(int video_index);
+    void probingStreamsFound();
+    void probingFinished(ProbeResult result);
+    void applyAudioDelays(const ProbeResult &result);
     void startIndexing();
     void startDemuxing();
     void errorPopup(const std::string &msg);
@@ -124,10 +249,23 @@ class GUIWindow : public QMainWindow {
     void indexingFinished(D2V new_d2v);
     void demuxingFinished(D2V new_d2v);
     void displayFrame(int n);
+    bool isWantedFrameCached();
+    void requestFrame(int n, bool fast);
+    void prefetchAround(int n);
+    void requestPrefetchFrames();
+    void forgetFrames();
     void updateRangeLabel();
     void initialiseVapourSynth();
     void freeVapourSynth();
     void createVapourSynthFilterChain();
+    VSNodeRef *createSourceNode();
+    VSNodeRef *createResizeNode(VSNodeRef *source, const char *kernel, int width, int height);
+    VSNodeRef *createPreviewNode(const char *kernel, int width, int height);
+    void resizePreview();
+    void createThumbnails();
+    void requestThumbnail(int index);
+    void forgetThumbnails();
+    void updateCurrentThumbnail(int n);
     void dragEnterEvent(QDragEnterEvent *event) override;
     void dropEvent(QDropEvent *event) override;
     void enableInterface(bool enable);
@@ -138,8 +276,47 @@ public:
     ~GUIWindow() override;
 
 public slots:
-    void updateProgress(int64_t current_position, int64_t total_size);
     void logMessage(const QString &msg);
+    void showWorkerUpdates();
+    void framesReady();
+
+private slots:
+    void thumbnailReady(int generation, int index, const QImage &image, const QString &error);
+
+public:
+    // Called by the workers' threads.
+    void setWorkerProgress(int64_t current_position, int64_t total_size);
+    void addWorkerLogMessage(const std::string &msg);
+
+    // Called by VapourSynth's threads.
+    void frameFinished(int n, const VSFrameRef *frame, int generation, bool fast, const std::string &error);
+    void thumbnailFinished(int index, const VSFrameRef *frame, int generation, const std::string &error);
+};
+
+
+// Opens and probes the input files, checks the audio decoders, and
+// calculates the audio delays relative to the first video track. With a
+// video_index other than -1, it only calculates the audio delays relative
+// to that track. The GUI doesn't touch fake_file and f in the meantime.
+class ProbingWorker : public QObject {
+    Q_OBJECT
+
+public:
+    ProbingWorker(FakeFile *_fake_file, FFMPEG *_f, int _video_index, const std::atomic_bool *_cancel);
+
+public slots:
+    void process();
+
+signals:
+    // The streams in f->fctx can be listed now.
+    void streamsFound();
+    void finished(ProbeResult result);
+
+private:
+    FakeFile *fake_file;
+    FFMPEG *f;
+    int video_index;
+    const std::atomic_bool *cancel;
 };
 
 
@@ -164,7 +341,7 @@ class DemuxingWorker : public QObject {
     Q_OBJECT
 
 public:
-    DemuxingWorker(const D2V &_d2v, FILE *_video_file, int64_t _start_gop_position, int64_t _end_gop_position);
+    DemuxingWorker(const D2V &_d2v, FILE *_video_file, int64_t _start_gop_position, int64_t _end_gop_position, FILE *_d2v_file, const std::string &_d2v_name, const std::string &_video_name);
 
 public slots:
     void process();
@@ -177,6 +354,9 @@ private:
     FILE *video_file;
     int64_t start_gop_position;
     int64_t end_gop_position;
+    FILE *d2v_file;
+    std::string d2v_name;
+    std::string video_name;
 };
 
 #endif // D2V_WITCH_GUIWINDOW_H
@@ -0,0 +1,567 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <cerrno>
+#include <cstring>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "Bullshit.h"
+#include "IndexJob.h"
+#include "IndexState.h"
+
+
+static std::string hexadecimal(int number) {
+    char buffer[20] = { 0 };
+    snprintf(buffer, 19, "%x", number);
+    return buffer;
+}
+
+
+IndexJob::IndexJob(const IndexJobOptions &_options)
+    : options(_options)
+    , d2v{ }
+    , extra_d2vs{ }
+    , result(D2V::ProcessingError)
+    , error{ }
+    , video_id(-1)
+    , d2v_path{ }
+    , extra_d2v_paths{ }
+    , stats{ }
+    , gops{ }
+    , frame_flags{ }
+    , audio_paths{ }
+    , audio_delays{ }
+    , audio_resume_points{ }
+    , removable_paths{ }
+    , old_audio_sizes{ }
+{ }
+
+
+void IndexJob::fail(const std::string &message) {
+    result = D2V::ProcessingError;
+    error = message;
+}
+
+
+void IndexJob::undoOutputs() {
+    for (size_t i = 0; i < removable_paths.size(); i++)
+        removeFile(removable_paths[i].c_str());
+
+    for (auto it = old_audio_sizes.cbegin(); it != old_audio_sizes.cend(); it++)
+        truncateFile(it->first.c_str(), it->second);
+
+    removable_paths.clear();
+    old_audio_sizes.clear();
+}
+
+
+void IndexJob::run(FakeFile &fake_file, FFMPEG &f) {
+    result = D2V::ProcessingError;
+    error.clear();
+    d2v.reset();
+    extra_d2vs.clear();
+    video_id = -1;
+    d2v_path.clear();
+    extra_d2v_paths.clear();
+    stats = D2V::Stats();
+    gops.clear();
+    frame_flags.clear();
+    audio_paths.clear();
+    audio_delays.clear();
+    audio_resume_points.clear();
+    removable_paths.clear();
+    old_audio_sizes.clear();
+
+    bool multiple_videos = options.video_ids.size() || options.video_ids_all;
+
+    if (multiple_videos && (options.have_video_id || options.audio_only || options.append)) {
+        fail("Several video tracks can't be indexed together with a single video track, in audio only mode, or when appending.");
+        return;
+    }
+
+    // There is no d2v file to extend, and nothing to say where the audio ends.
+    if (options.append && options.audio_only) {
+        fail("Audio files can't be extended in audio only mode.");
+        return;
+    }
+
+
+    // stream selection
+    f.deselectAllStreams();
+
+    // With several video tracks, the first one is indexed by the D2V
+    // object that reads the input, and the rest are indexed along with it.
+    std::vector<AVStream *> video_streams;
+
+    if (multiple_videos) {
+        if (options.video_ids_all) {
+            if (!f.selectAllVideoStreams(video_streams)) {
+                fail("Couldn't find any video tracks.");
+                return;
+            }
+
+            // Rather than refusing to index anything.
+            for (size_t i = video_streams.size(); i-- > 0; ) {
+                if (!D2V::isSupportedVideoCodecID(video_streams[i]->codecpar->codec_id)) {
+                    if (options.log_message)
+                        options.log_message("Skipping video track " + hexadecimal(video_streams[i]->id) + ", whose codec is not supported.", options.log_data);
+
+                    video_streams[i]->discard = AVDISCARD_ALL;
+                    video_streams.erase(video_streams.begin() + i);
+                }
+            }
+
+            if (!video_streams.size()) {
+                fail("Couldn't find any video tracks with a supported codec.");
+                return;
+            }
+        } else {
+            std::vector<int> missing_video_ids;
+
+            if (!f.selectVideoStreamsById(options.video_ids, video_streams, missing_video_ids)) {
+                fail("Couldn't find video track with id " + hexadecimal(missing_video_ids[0]) + ".");
+                return;
+            }
+        }
+    } else if (options.have_video_id) {
+        AVStream *stream = f.selectVideoStreamById(options.video_id);
+        if (!stream) {
+            fail("Couldn't find video track with id " + hexadecimal(options.video_id) + ".");
+            return;
+        }
+
+        video_streams.push_back(stream);
+    } else {
+        AVStream *stream = f.selectFirstVideoStream();
+        if (!stream) {
+            fail("Couldn't find any video tracks.");
+            return;
+        }
+
+        video_streams.push_back(stream);
+    }
+
+    AVStream *video_stream = video_streams[0];
+    video_id = video_stream->id;
+
+    if (options.audio_ids.size()) {
+        std::vector<int> missing_audio_ids;
+
+        if (!f.selectAudioStreamsById(options.audio_ids, missing_audio_ids)) {
+            fail("Couldn't find audio track with id " + hexadecimal(missing_audio_ids[0]) + ".");
+            return;
+        }
+    } else if (options.audio_ids_all || options.audio_only) {
+        if (!f.selectAllAudioStreams()) {
+            fail("Couldn't find any audio tracks.");
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < video_streams.size(); i++) {
+        if (!D2V::isSupportedVideoCodecID(video_streams[i]->codecpar->codec_id)) {
+            fail(std::string("Unsupported video codec: ") + avcodec_get_name(video_streams[i]->codecpar->codec_id));
+            return;
+        }
+    }
+
+    if (!f.initAudioCodecs() || !f.initVideoCodec(video_stream->index)) {
+        fail(f.getError());
+        return;
+    }
+
+    for (size_t i = 1; i < video_streams.size(); i++) {
+        if (!f.initExtraVideoCodec(video_streams[i]->index)) {
+            fail(f.getError());
+            return;
+        }
+    }
+
+
+    // d2v file opening
+    std::string requested_d2v_path = options.d2v_path.size() ? options.d2v_path : suggestD2VName(fake_file[0].name);
+
+    bool d2v_path_is_stream = isStreamName(requested_d2v_path);
+
+    if (options.frame_index && (d2v_path_is_stream || options.audio_only)) {
+        fail("The frame index can't be written without a d2v file.");
+        return;
+    }
+
+    if (d2v_path_is_stream && (multiple_videos || options.append)) {
+        fail("Several video tracks can't be indexed, and d2v files can't be extended, when the d2v file is written to standard output or to a file descriptor.");
+        return;
+    }
+
+    bool appending = options.append && options.indexed_size >= 0;
+
+    // The size of a Wave64 file is in its header, so it can't just grow.
+    // The other audio files can only grow from where their last packet
+    // started.
+    for (unsigned i = 0; appending && i < f.fctx->nb_streams; i++) {
+        const AVStream *stream = f.fctx->streams[i];
+
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || stream->discard == AVDISCARD_ALL)
+            continue;
+
+        std::string reason;
+        if (codecIDRequiresWave64(stream->codecpar->codec_id))
+            reason = "audio track " + hexadecimal(stream->id) + " is written to a Wave64 file, which can't be extended.";
+        else if (!options.audio_resume_points.count(stream->id))
+            reason = "it's not known where audio track " + hexadecimal(stream->id) + " ends.";
+
+        if (reason.size()) {
+            appending = false;
+
+            if (options.log_message)
+                options.log_message("Can't append to d2v file '" + requested_d2v_path + "', indexing from the beginning instead: " + reason, options.log_data);
+        }
+    }
+
+    // The files described by the index state are about to be replaced, so
+    // the next --append must not trust it. d2vwitch writes a new one if
+    // it needs it.
+    if (!appending) {
+        std::string state_path = suggestIndexStateName(d2v_path_is_stream ? suggestD2VName(fake_file[0].name) : requested_d2v_path);
+
+        removeFile(state_path.c_str());
+    }
+
+    // Each video track gets its own d2v file. The audio files are still
+    // named after requested_d2v_path.
+    d2v_path = multiple_videos ? suggestVideoTrackD2VName(requested_d2v_path, video_stream) : requested_d2v_path;
+
+    // The existing d2v file gets replaced only after the new one is complete.
+    std::string written_d2v_path = options.append ? d2v_path + ".tmp" : d2v_path;
+
+    FILE *d2v_file = nullptr;
+    if (!options.audio_only) {
+        d2v_file = openOutputFile(written_d2v_path);
+        if (!d2v_file) {
+            fail("Failed to open d2v file '" + written_d2v_path + "' for writing: " + strerror(errno));
+            return;
+        }
+
+        if (!d2v_path_is_stream)
+            removable_paths.push_back(written_d2v_path);
+    }
+
+
+    // calculate the audio delays if needed
+    // Normally they are found while indexing, but when appending the
+    // indexing doesn't start at the beginning of the file, and in audio
+    // only mode there is no indexing.
+    int64_t first_video_keyframe_pos = -1;
+    bool audio_delays_known = appending || options.audio_only;
+    bool audio_wanted = options.audio_ids.size() || options.audio_ids_all || options.audio_only;
+
+    if (audio_wanted && audio_delays_known) {
+        if (options.phase_report)
+            options.phase_report("audio-delays", options.phase_data);
+
+        if (!calculateAudioDelays(fake_file, video_stream->id, audio_delays, &first_video_keyframe_pos, error)) {
+            result = D2V::ProcessingError;
+
+            if (d2v_file)
+                fclose(d2v_file);
+            undoOutputs();
+
+            return;
+        }
+    }
+
+
+    // audio files opening
+    std::string audio_path_base = d2v_path_is_stream ? suggestD2VName(fake_file[0].name) : requested_d2v_path;
+
+    size_t last_dot = audio_path_base.find_last_of('.');
+    if (last_dot != std::string::npos)
+        audio_path_base.erase(last_dot);
+
+    // Key: stream index. Temporary names, unless the delays are known already.
+    std::unordered_map<int, std::string> written_audio_paths;
+
+    AudioFilesMap audio_files;
+    for (unsigned i = 0; i < f.fctx->nb_streams; i++) {
+        const AVStream *stream = f.fctx->streams[i];
+
+        if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || stream->discard == AVDISCARD_ALL)
+            continue;
+
+        std::string path = audio_path_base;
+        if (audio_delays_known)
+            path += suggestAudioTrackSuffix(stream, audio_delays);
+        else
+            path += " T" + hexadecimal(stream->id) + ".tmp";
+
+        // When appending, the last packet written may have been cut short
+        // by the end of the input, so it's written again.
+        int64_t resume_size = appending ? options.audio_resume_points.at(stream->id).file_size : 0;
+
+        if (!appending)
+            removable_paths.push_back(path);
+
+        void *file = nullptr;
+        if (appending && (getFileSize(path.c_str()) < resume_size || !truncateFile(path.c_str(), resume_size)))
+            error = "Failed to cut audio file '" + path + "' back to " + std::to_string(resume_size) + " bytes.";
+        else if (codecIDRequiresWave64(stream->codecpar->codec_id))
+            file = openWave64(path, stream->codecpar, error);
+        else
+            file = openFile(path.c_str(), appending ? "ab" : "wb");
+
+        if (appending && file)
+            old_audio_sizes.insert({ path, resume_size });
+
+        if (!file) {
+            if (!error.size())
+                error = "Failed to open audio file '" + path + "' for writing: " + strerror(errno);
+            result = D2V::ProcessingError;
+
+            if (d2v_file)
+                fclose(d2v_file);
+            closeAudioFiles(audio_files, f.fctx);
+            undoOutputs();
+
+            return;
+        }
+
+        audio_files.insert({ stream->index, file });
+        written_audio_paths.insert({ stream->index, path });
+    }
+
+
+    // the other video tracks' d2v files
+    std::vector<FILE *> extra_d2v_files;
+
+    for (size_t i = 1; i < video_streams.size(); i++) {
+        std::string path = suggestVideoTrackD2VName(requested_d2v_path, video_streams[i]);
+
+        FILE *file = openFile(path.c_str(), "wb");
+        if (!file) {
+            fail("Failed to open d2v file '" + path + "' for writing: " + strerror(errno));
+
+            if (d2v_file)
+                fclose(d2v_file);
+            for (size_t j = 0; j < extra_d2v_files.size(); j++)
+                fclose(extra_d2v_files[j]);
+            closeAudioFiles(audio_files, f.fctx);
+            undoOutputs();
+
+            return;
+        }
+
+        extra_d2v_paths.push_back(path);
+        extra_d2v_files.push_back(file);
+        removable_paths.push_back(path);
+    }
+
+
+    // engage
+    d2v.reset(new D2V(d2v_path, d2v_file, audio_files, &fake_file, &f, video_stream, first_video_keyframe_pos, options.input_range, options.relative_paths && !d2v_path_is_stream, options.progress_report, options.progress_data, options.log_message, options.log_data));
+
+    // Before addVideoStream, which shares the flag.
+    if (options.cancel_flag)
+        d2v->setCancelFlag(options.cancel_flag);
+    d2v->setPipelined(options.pipelined);
+    d2v->setAudioThreads(options.audio_threads);
+    d2v->setFindAudioDelays(!audio_delays_known && audio_files.size() > 0);
+
+    // Only d2v reports the progress, because it reads the input for all of them.
+    for (size_t i = 0; i < extra_d2v_files.size(); i++) {
+        extra_d2vs.emplace_back(new D2V(extra_d2v_paths[i], extra_d2v_files[i], AudioFilesMap(), &fake_file, &f, video_streams[i + 1], first_video_keyframe_pos, options.input_range, options.relative_paths, nullptr, nullptr, options.log_message, options.log_data));
+
+        d2v->addVideoStream(extra_d2vs.back().get());
+    }
+
+    if (appending && !d2v->prepareAppend(d2v_path, options.audio_resume_points)) {
+        fail(d2v->getError());
+
+        if (d2v_file)
+            fclose(d2v_file);
+        closeAudioFiles(audio_files, f.fctx);
+        undoOutputs();
+
+        return;
+    }
+
+    if (options.audio_only)
+        d2v->demuxAudio();
+    else
+        d2v->index();
+
+    result = d2v->getResult();
+    stats = d2v->getStats();
+
+    if (result != D2V::ProcessingFinished) {
+        error = result == D2V::ProcessingCancelled ? "Cancelled." : d2v->getError();
+
+        undoOutputs();
+
+        return;
+    }
+
+    for (size_t i = 0; i < extra_d2vs.size(); i++) {
+        if (extra_d2vs[i]->getResult() != D2V::ProcessingFinished) {
+            result = extra_d2vs[i]->getResult();
+            error = result == D2V::ProcessingCancelled ? "Cancelled." : extra_d2vs[i]->getError();
+
+            undoOutputs();
+
+            return;
+        }
+    }
+
+
+    // the frame index, before the d2v file is replaced, so that a failure
+    // leaves the old d2v file and the old audio files matching each other
+    if (options.frame_index) {
+        if (!d2v->writeFrameIndex(suggestFrameIndexName(d2v_path))) {
+            fail(d2v->getError());
+            undoOutputs();
+            return;
+        }
+
+        for (size_t i = 0; i < extra_d2vs.size(); i++) {
+            if (!extra_d2vs[i]->writeFrameIndex(suggestFrameIndexName(extra_d2v_paths[i]))) {
+                fail(extra_d2vs[i]->getError());
+                undoOutputs();
+                return;
+            }
+        }
+    }
+
+
+    // the new d2v file replaces the old one only now
+    if (options.append && !options.audio_only) {
+        if (!replaceFile(written_d2v_path.c_str(), d2v_path.c_str())) {
+            fail("Failed to replace d2v file '" + d2v_path + "' with '" + written_d2v_path + "'.");
+            undoOutputs();
+            return;
+        }
+    }
+
+
+    // the audio files get their final names
+    if (!audio_delays_known)
+        audio_delays = d2v->getAudioDelays();
+
+    for (auto it = written_audio_paths.cbegin(); it != written_audio_paths.cend(); it++) {
+        const AVStream *stream = f.fctx->streams[it->first];
+
+        std::string path = it->second;
+
+        if (!audio_delays_known) {
+            path = audio_path_base + suggestAudioTrackSuffix(stream, audio_delays);
+
+            if (!replaceFile(it->second.c_str(), path.c_str())) {
+                fail("Failed to rename audio file '" + it->second + "' to '" + path + "'.");
+                undoOutputs();
+                return;
+            }
+
+            removable_paths.push_back(path);
+        }
+
+        audio_paths.insert({ stream->id, path });
+    }
+
+    removable_paths.clear();
+    old_audio_sizes.clear();
+
+    audio_resume_points = d2v->getAudioResumePoints();
+
+    d2v->getFrameTable(gops, frame_flags);
+}
+
+
+const D2V *IndexJob::getD2V() const {
+    return d2v.get();
+}
+
+
+std::vector<const D2V *> IndexJob::getExtraD2Vs() const {
+    std::vector<const D2V *> objects;
+
+    for (size_t i = 0; i < extra_d2vs.size(); i++)
+        objects.push_back(extra_d2vs[i].get());
+
+    return objects;
+}
+
+
+D2V::ProcessingResult IndexJob::getResult() const {
+    return result;
+}
+
+
+const std::string &IndexJob::getError() const {
+    return error;
+}
+
+
+int IndexJob::getVideoId() const {
+    return video_id;
+}
+
+
+const std::string &IndexJob::getD2VPath() const {
+    return d2v_path;
+}
+
+
+const std::vector<std::string> &IndexJob::getExtraD2VPaths() const {
+    return extra_d2v_paths;
+}
+
+
+const D2V::Stats &IndexJob::getStats() const {
+    return stats;
+}
+
+
+const std::vector<FrameIndex::GOP> &IndexJob::getGOPs() const {
+    return gops;
+}
+
+
+const std::vector<uint8_t> &IndexJob::getFrameFlags() const {
+    return frame_flags;
+}
+
+
+const std::unordered_map<int, std::string> &IndexJob::getAudioPaths() const {
+    return audio_paths;
+}
+
+
+const AudioDelayMap &IndexJob::getAudioDelays() const {
+    return audio_delays;
+}
+
+
+const AudioResumeMap &IndexJob::getAudioResumePoints() const {
+    return audio_resume_points;
+}
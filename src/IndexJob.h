@@ -0,0 +1,206 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_INDEXJOB_H
+#define D2V_WITCH_INDEXJOB_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Audio.h"
+#include "D2V.h"
+#include "FakeFile.h"
+#include "FFMPEG.h"
+#include "FrameIndex.h"
+
+
+struct IndexJobOptions {
+    typedef void (*PhaseFunction)(const std::string &name, void *phase_data);
+
+    int video_id;
+    bool have_video_id;
+
+    // Index several video tracks in one pass, like --video-ids. Each one
+    // gets its own d2v file, named by suggestVideoTrackD2VName.
+    std::vector<int> video_ids;
+    bool video_ids_all;
+
+    std::vector<int> audio_ids;
+    bool audio_ids_all;
+
+    // "-" and "fd:N" work like in openOutputFile. If empty, the name is
+    // deduced from the name of the first input file.
+    std::string d2v_path;
+
+    D2V::ColourRange input_range;
+    bool relative_paths;
+    bool pipelined;
+    bool audio_threads;
+    bool frame_index;
+
+    // Write only the audio files, like D2V::demuxAudio. If no audio ids
+    // are given, all the audio tracks are written.
+    bool audio_only;
+
+    // Like --append: the new d2v file is written with a temporary name
+    // and replaces d2v_path only once it's complete. If indexed_size is
+    // not -1, the existing d2v file covers that many bytes of the input,
+    // and only the rest is indexed, with the audio files extended in
+    // place. Wave64 audio files can't be extended, so with those the
+    // input is indexed from the beginning anyway, and so it is without
+    // a resume point for every audio track.
+    bool append;
+    int64_t indexed_size;
+
+    // From getAudioResumePoints of the job that wrote d2v_path.
+    AudioResumeMap audio_resume_points;
+
+    D2V::ProgressFunction progress_report;
+    void *progress_data;
+    D2V::LoggingFunction log_message;
+    void *log_data;
+
+    // For the phases outside of D2V, i.e. "audio-delays".
+    PhaseFunction phase_report;
+    void *phase_data;
+
+    // Replaces stop_processing, if not null.
+    std::atomic_bool *cancel_flag;
+
+    IndexJobOptions()
+        : video_id(0)
+        , have_video_id(false)
+        , video_ids{ }
+        , video_ids_all(false)
+        , audio_ids{ }
+        , audio_ids_all(false)
+        , d2v_path{ }
+        , input_range(D2V::ColourRangeLimited)
+        , relative_paths(false)
+        , pipelined(false)
+        , audio_threads(true)
+        , frame_index(false)
+        , audio_only(false)
+        , append(false)
+        , indexed_size(-1)
+        , audio_resume_points{ }
+        , progress_report(nullptr)
+        , progress_data(nullptr)
+        , log_message(nullptr)
+        , log_data(nullptr)
+        , phase_report(nullptr)
+        , phase_data(nullptr)
+        , cancel_flag(nullptr)
+    { }
+};
+
+
+// Makes the d2v file and the audio files of one set of input files. The
+// audio files are written with temporary names and renamed once the
+// delays are known, unless they are known before indexing. Used by the
+// d2vwitch program, libd2vwitch, and the server. The outputs are removed
+// if the job fails or is cancelled, and the audio files extended by
+// IndexJobOptions::append are cut back to their old sizes. Unless it
+// appends, the job removes the index state file of the outputs it
+// replaces.
+class IndexJob {
+    IndexJobOptions options;
+
+    std::unique_ptr<D2V> d2v;
+    std::vector<std::unique_ptr<D2V>> extra_d2vs;
+
+    D2V::ProcessingResult result;
+    std::string error;
+
+    int video_id;
+    std::string d2v_path;
+    std::vector<std::string> extra_d2v_paths;
+    D2V::Stats stats;
+    std::vector<FrameIndex::GOP> gops;
+    std::vector<uint8_t> frame_flags;
+
+    // Key: audio stream id.
+    std::unordered_map<int, std::string> audio_paths;
+    AudioDelayMap audio_delays;
+    AudioResumeMap audio_resume_points;
+
+    // Files made by the current run, removed if it fails.
+    std::vector<std::string> removable_paths;
+
+    // Key: path. The sizes the audio files were cut back to before
+    // appending.
+    std::unordered_map<std::string, int64_t> old_audio_sizes;
+
+    void fail(const std::string &message);
+
+    void undoOutputs();
+
+public:
+    explicit IndexJob(const IndexJobOptions &_options);
+
+    // fake_file and f must be open already, with the streams probed. They
+    // are not closed.
+    void run(FakeFile &fake_file, FFMPEG &f);
+
+    // The object reading the input, e.g. for asking the phase from the
+    // progress function. Null until run makes it. It stays after run
+    // returns, with the lines found, for demuxing and for the statistics.
+    const D2V *getD2V() const;
+
+    // The objects indexing the other video tracks of
+    // IndexJobOptions::video_ids, in the same order as getExtraD2VPaths.
+    std::vector<const D2V *> getExtraD2Vs() const;
+
+    D2V::ProcessingResult getResult() const;
+
+    const std::string &getError() const;
+
+    // The rest are only filled in if the job finished.
+
+    // The id of the video track in the first d2v file.
+    int getVideoId() const;
+
+    const std::string &getD2VPath() const;
+
+    const std::vector<std::string> &getExtraD2VPaths() const;
+
+    const D2V::Stats &getStats() const;
+
+    // In the form written by D2V::writeFrameIndex.
+    const std::vector<FrameIndex::GOP> &getGOPs() const;
+    const std::vector<uint8_t> &getFrameFlags() const;
+
+    const std::unordered_map<int, std::string> &getAudioPaths() const;
+
+    // Key: audio stream id.
+    const AudioDelayMap &getAudioDelays() const;
+
+    // For IndexJobOptions::audio_resume_points, the next time.
+    const AudioResumeMap &getAudioResumePoints() const;
+};
+
+#endif // D2V_WITCH_INDEXJOB_H
@@ -0,0 +1,364 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+extern "C" {
+#include <libavutil/md5.h>
+}
+
+#include "Bullshit.h"
+#include "IndexState.h"
+
+
+#define INDEX_STATE_MAGIC "D2VWitchIndexState1"
+
+#define KEY_OPTIONS "Options="
+#define KEY_INPUT   "Input="
+#define KEY_OUTPUT  "Output="
+#define KEY_AUDIO   "Audio="
+
+// How much of the beginning and of the end of each input is hashed.
+#define HASHED_SIZE (64 * 1024)
+
+
+std::string suggestIndexStateName(const std::string &d2v_name) {
+    return d2v_name + ".state";
+}
+
+
+static bool hashFileRange(FILE *file, int64_t start, int64_t size, std::string &hash) {
+    std::vector<uint8_t> buffer(size);
+
+    if (fseeko(file, start, SEEK_SET))
+        return false;
+
+    if (fread(buffer.data(), 1, size, file) < (size_t)size)
+        return false;
+
+    uint8_t md5[16];
+    av_md5_sum(md5, buffer.data(), buffer.size());
+
+    hash.clear();
+    for (int i = 0; i < 16; i++) {
+        char hex[3] = { 0 };
+        snprintf(hex, 3, "%02x", md5[i]);
+        hash += hex;
+    }
+
+    return true;
+}
+
+
+bool fingerprintInputs(const FakeFile &fake_file, std::vector<IndexedInput> &inputs, std::string &error) {
+    inputs.clear();
+
+    for (auto it = fake_file.cbegin(); it != fake_file.cend(); it++) {
+        IndexedInput input;
+        input.name = it->name;
+        input.size = it->size;
+
+        input.modification_time = getModificationTime(it->name.c_str());
+        if (input.modification_time == -1) {
+            error = "Failed to obtain the modification time of input file '" + it->name + "': " + strerror(errno);
+            return false;
+        }
+
+        // Separate stream because the one in fake_file may be in use by ffmpeg.
+        FILE *file = openFile(it->name.c_str(), "rb");
+        if (!file) {
+            error = "Failed to open input file '" + it->name + "' for fingerprinting: " + strerror(errno);
+            return false;
+        }
+
+        int64_t hashed_size = std::min<int64_t>(HASHED_SIZE, input.size);
+
+        if (!hashFileRange(file, 0, hashed_size, input.head_hash) ||
+            !hashFileRange(file, input.size - hashed_size, hashed_size, input.tail_hash)) {
+            error = "Failed to read input file '" + it->name + "' for fingerprinting.";
+            fclose(file);
+            return false;
+        }
+
+        fclose(file);
+
+        inputs.push_back(input);
+    }
+
+    return true;
+}
+
+
+bool writeIndexState(const std::string &path, const IndexState &state, std::string &error) {
+    std::string text;
+
+    text += INDEX_STATE_MAGIC "\n";
+
+    text += KEY_OPTIONS + state.options + "\n";
+
+    for (auto it = state.inputs.cbegin(); it != state.inputs.cend(); it++) {
+        text += KEY_INPUT;
+        text += std::to_string(it->size) + " ";
+        text += std::to_string(it->modification_time) + " ";
+        text += it->head_hash + " ";
+        text += it->tail_hash + " ";
+        text += it->name + "\n";
+    }
+
+    for (auto it = state.outputs.cbegin(); it != state.outputs.cend(); it++)
+        text += KEY_OUTPUT + *it + "\n";
+
+    for (auto it = state.audio_resume_points.cbegin(); it != state.audio_resume_points.cend(); it++) {
+        text += KEY_AUDIO;
+        text += std::to_string(it->first) + " ";
+        text += std::to_string(it->second.position) + " ";
+        text += std::to_string(it->second.file_size) + "\n";
+    }
+
+    FILE *file = openFile(path.c_str(), "wb");
+    if (!file) {
+        error = "Failed to open index state file '" + path + "' for writing: " + strerror(errno);
+        return false;
+    }
+
+    if (fprintf(file, "%s", text.c_str()) < 0) {
+        error = "Failed to write index state file '" + path + "': fprintf() failed.";
+        fclose(file);
+        return false;
+    }
+
+    if (fclose(file)) {
+        error = "Failed to write index state file '" + path + "': fclose() failed.";
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool startsWith(const std::string &text, const char *prefix) {
+    return !text.compare(0, strlen(prefix), prefix);
+}
+
+
+static bool parseIndexedInput(const std::string &text, IndexedInput &input) {
+    const char *start = text.c_str();
+    char *end;
+
+    input.size = strtoll(start, &end, 10);
+    if (end == start || *end != ' ' || input.size < 0)
+        return false;
+
+    start = end + 1;
+    input.modification_time = strtoll(start, &end, 10);
+    if (end == start || *end != ' ')
+        return false;
+
+    std::string rest(end + 1);
+
+    size_t space = rest.find(' ');
+    if (space == std::string::npos)
+        return false;
+    input.head_hash = rest.substr(0, space);
+    rest.erase(0, space + 1);
+
+    space = rest.find(' ');
+    if (space == std::string::npos)
+        return false;
+    input.tail_hash = rest.substr(0, space);
+    input.name = rest.substr(space + 1);
+
+    return input.name.size() > 0;
+}
+
+
+// Stream id, position in the input, size of the audio file.
+static bool parseAudioResumePoint(const std::string &text, int &id, AudioResumePoint &point) {
+    const char *start = text.c_str();
+    char *end;
+
+    id = strtol(start, &end, 10);
+    if (end == start || *end != ' ')
+        return false;
+
+    start = end + 1;
+    point.position = strtoll(start, &end, 10);
+    if (end == start || *end != ' ' || point.position < 0)
+        return false;
+
+    start = end + 1;
+    point.file_size = strtoll(start, &end, 10);
+    if (end == start || *end != '\0' || point.file_size < 0)
+        return false;
+
+    return true;
+}
+
+
+bool readIndexState(const std::string &path, IndexState &state, std::string &error) {
+    FILE *file = openFile(path.c_str(), "rb");
+    if (!file) {
+        error = "Failed to open index state file '" + path + "' for reading: " + strerror(errno);
+        return false;
+    }
+
+    state = IndexState();
+
+    std::string text;
+    bool magic_found = false;
+
+    while (readLine(file, text)) {
+        if (!magic_found) {
+            if (text != INDEX_STATE_MAGIC)
+                break;
+
+            magic_found = true;
+            continue;
+        }
+
+        if (startsWith(text, KEY_OPTIONS)) {
+            state.options = text.substr(strlen(KEY_OPTIONS));
+        } else if (startsWith(text, KEY_INPUT)) {
+            IndexedInput input;
+
+            if (!parseIndexedInput(text.substr(strlen(KEY_INPUT)), input)) {
+                error = "Index state file '" + path + "' contains an invalid line: '" + text + "'.";
+                fclose(file);
+                return false;
+            }
+
+            state.inputs.push_back(input);
+        } else if (startsWith(text, KEY_OUTPUT)) {
+            state.outputs.push_back(text.substr(strlen(KEY_OUTPUT)));
+        } else if (startsWith(text, KEY_AUDIO)) {
+            int id;
+            AudioResumePoint point;
+
+            if (!parseAudioResumePoint(text.substr(strlen(KEY_AUDIO)), id, point)) {
+                error = "Index state file '" + path + "' contains an invalid line: '" + text + "'.";
+                fclose(file);
+                return false;
+            }
+
+            state.audio_resume_points.insert({ id, point });
+        }
+    }
+
+    fclose(file);
+
+    if (!magic_found) {
+        error = "File '" + path + "' is not an index state file.";
+        return false;
+    }
+
+    return true;
+}
+
+
+bool checkAppendable(const IndexState &indexed_state, const IndexState &current_state, int64_t &indexed_size, std::string &error) {
+    if (indexed_state.options != current_state.options) {
+        error = "The options changed from '" + indexed_state.options + "' to '" + current_state.options + "'.";
+        return false;
+    }
+
+    const std::vector<IndexedInput> &old_inputs = indexed_state.inputs;
+    const std::vector<IndexedInput> &new_inputs = current_state.inputs;
+
+    if (old_inputs.size() != new_inputs.size()) {
+        error = "The number of input files changed from " + std::to_string(old_inputs.size()) + " to " + std::to_string(new_inputs.size()) + ".";
+        return false;
+    }
+
+    indexed_size = 0;
+
+    for (size_t i = 0; i < new_inputs.size(); i++) {
+        const IndexedInput &old_input = old_inputs[i];
+        const IndexedInput &new_input = new_inputs[i];
+
+        if (old_input.name != new_input.name) {
+            error = "Input file number " + std::to_string(i + 1) + " changed from '" + old_input.name + "' to '" + new_input.name + "'.";
+            return false;
+        }
+
+        bool last_input = i == new_inputs.size() - 1;
+
+        if (new_input.size < old_input.size || (!last_input && new_input.size != old_input.size)) {
+            error = "Input file '" + new_input.name + "' changed size from " + std::to_string(old_input.size) + " to " + std::to_string(new_input.size) + " bytes.";
+            if (!last_input)
+                error += " Only the last input file is allowed to grow.";
+            return false;
+        }
+
+        // A growing file keeps its beginning. Only small files could have their head hash change this way.
+        if (old_input.head_hash != new_input.head_hash && old_input.size >= HASHED_SIZE) {
+            error = "The beginning of input file '" + new_input.name + "' changed.";
+            return false;
+        }
+
+        indexed_size += old_input.size;
+    }
+
+    return true;
+}
+
+
+bool checkCurrent(const IndexState &indexed_state, const IndexState &current_state, std::string &reason) {
+    if (indexed_state.options != current_state.options) {
+        reason = "The options changed from '" + indexed_state.options + "' to '" + current_state.options + "'.";
+        return false;
+    }
+
+    const std::vector<IndexedInput> &old_inputs = indexed_state.inputs;
+    const std::vector<IndexedInput> &new_inputs = current_state.inputs;
+
+    if (old_inputs.size() != new_inputs.size()) {
+        reason = "The number of input files changed from " + std::to_string(old_inputs.size()) + " to " + std::to_string(new_inputs.size()) + ".";
+        return false;
+    }
+
+    for (size_t i = 0; i < new_inputs.size(); i++) {
+        const IndexedInput &old_input = old_inputs[i];
+        const IndexedInput &new_input = new_inputs[i];
+
+        if (old_input.name != new_input.name ||
+            old_input.size != new_input.size ||
+            old_input.modification_time != new_input.modification_time ||
+            old_input.head_hash != new_input.head_hash ||
+            old_input.tail_hash != new_input.tail_hash) {
+            reason = "Input file '" + new_input.name + "' changed.";
+            return false;
+        }
+    }
+
+    for (auto it = indexed_state.outputs.cbegin(); it != indexed_state.outputs.cend(); it++) {
+        if (getModificationTime(it->c_str()) == -1) {
+            reason = "Output file '" + *it + "' is missing.";
+            return false;
+        }
+    }
+
+    return true;
+}
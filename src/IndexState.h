@@ -0,0 +1,72 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_INDEXSTATE_H
+#define D2V_WITCH_INDEXSTATE_H
+
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "Audio.h"
+#include "FakeFile.h"
+
+
+// The index state is a small text file written next to the d2v file. It
+// remembers which inputs and options the d2v file was made from, so that
+// the d2v file can be extended later if the inputs grow, and so that
+// indexing can be skipped entirely if nothing changed.
+
+struct IndexedInput {
+    std::string name;
+    int64_t size;
+    int64_t modification_time;
+    std::string head_hash; // Of the first few kilobytes.
+    std::string tail_hash; // Of the last few kilobytes.
+};
+
+
+struct IndexState {
+    std::string options;
+    std::vector<IndexedInput> inputs;
+    std::vector<std::string> outputs;
+    AudioResumeMap audio_resume_points; // For appending.
+};
+
+
+std::string suggestIndexStateName(const std::string &d2v_name);
+
+bool fingerprintInputs(const FakeFile &fake_file, std::vector<IndexedInput> &inputs, std::string &error);
+
+bool writeIndexState(const std::string &path, const IndexState &state, std::string &error);
+
+bool readIndexState(const std::string &path, IndexState &state, std::string &error);
+
+// Returns true if the current inputs are the indexed inputs, with only the last one possibly bigger.
+// indexed_size receives the total size of the inputs at the time they were indexed.
+bool checkAppendable(const IndexState &indexed_state, const IndexState &current_state, int64_t &indexed_size, std::string &error);
+
+// Returns true if the inputs and options didn't change and the outputs still exist.
+bool checkCurrent(const IndexState &indexed_state, const IndexState &current_state, std::string &reason);
+
+#endif // D2V_WITCH_INDEXSTATE_H
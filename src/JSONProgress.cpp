@@ -0,0 +1,236 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <cmath>
+
+#include "JSONProgress.h"
+
+
+// At most this many progress events per second and phase.
+#define PROGRESS_EVENT_INTERVAL std::chrono::milliseconds(100)
+
+
+std::string jsonString(const std::string &text) {
+    std::string quoted = "\"";
+
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = text[i];
+
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        } else if (c == '\n') {
+            quoted += "\\n";
+        } else if (c == '\r') {
+            quoted += "\\r";
+        } else if (c == '\t') {
+            quoted += "\\t";
+        } else if (c < 0x20) {
+            char escaped[7] = { 0 };
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+
+    quoted += '"';
+
+    return quoted;
+}
+
+
+// Three decimals. Not printf, because Qt may have set a locale with a
+// decimal comma.
+static std::string jsonNumber(double value) {
+    if (!(value > 0))
+        return "0";
+
+    int64_t thousandths = llround(value * 1000);
+
+    std::string fraction = std::to_string(thousandths % 1000);
+    fraction.insert(0, 3 - fraction.size(), '0');
+
+    return std::to_string(thousandths / 1000) + "." + fraction;
+}
+
+
+static double secondsBetween(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+    return std::chrono::duration<double>(end - start).count();
+}
+
+
+JSONProgress::JSONProgress(FILE *_stream)
+    : stream(_stream)
+    , write_function(nullptr)
+    , write_data(nullptr)
+    , job{ }
+    , d2v(nullptr)
+    , phase_start_position(0)
+    , phase_started(false)
+    , last_position(0)
+    , start(Clock::now())
+{ }
+
+
+JSONProgress::JSONProgress(WriteFunction _write_function, void *_write_data, const std::string &_job)
+    : stream(nullptr)
+    , write_function(_write_function)
+    , write_data(_write_data)
+    , job(_job)
+    , d2v(nullptr)
+    , phase_start_position(0)
+    , phase_started(false)
+    , last_position(0)
+    , start(Clock::now())
+{ }
+
+
+void JSONProgress::writeLine(const std::string &line) {
+    if (write_function) {
+        write_function("{\"job\":" + jsonString(job) + "," + line.substr(1), write_data);
+        return;
+    }
+
+    fprintf(stream, "%s\n", line.c_str());
+    fflush(stream);
+}
+
+
+void JSONProgress::startPhase(const std::string &name) {
+    phase = name;
+    phase_start = Clock::now();
+    phase_started = false;
+
+    writeLine("{\"event\":\"phase\",\"phase\":" + jsonString(phase) + "}");
+}
+
+
+void JSONProgress::followD2V(const D2V *_d2v) {
+    d2v = _d2v;
+}
+
+
+void JSONProgress::report(int64_t position, int64_t total) {
+    if (d2v) {
+        const char *names[] = { "index", "verify", "write", "demux" };
+
+        std::string name = names[d2v->getPhase()];
+        if (name != phase)
+            startPhase(name);
+    }
+
+    Clock::time_point now = Clock::now();
+
+    bool first = !phase_started;
+    if (first) {
+        // When appending, indexing doesn't start at 0.
+        phase_started = true;
+        phase_start_position = position;
+        last_event = phase_start;
+        last_position = position;
+    }
+
+    if (!first && position < total && now - last_event < PROGRESS_EVENT_INTERVAL)
+        return;
+
+    bool bytes = phase != "verify" && phase != "write";
+
+    std::string line = "{\"event\":\"progress\",\"phase\":" + jsonString(phase);
+    line += ",\"done\":" + std::to_string(position);
+    line += ",\"total\":" + std::to_string(total);
+    line += bytes ? ",\"unit\":\"bytes\"" : ",\"unit\":\"lines\"";
+
+    if (bytes) {
+        double seconds = secondsBetween(last_event, now);
+        double elapsed = secondsBetween(phase_start, now);
+
+        double speed = seconds > 0 ? (position - last_position) / seconds : 0;
+        double average_speed = elapsed > 0 ? (position - phase_start_position) / elapsed : 0;
+
+        line += ",\"mbps\":" + jsonNumber(speed / 1000000);
+        line += ",\"average_mbps\":" + jsonNumber(average_speed / 1000000);
+
+        if (average_speed > 0)
+            line += ",\"eta\":" + jsonNumber((total - position) / average_speed);
+        else
+            line += ",\"eta\":null";
+    }
+
+    if (d2v && d2v->getPhase() == D2V::PhaseReading) {
+        line += ",\"frames\":" + std::to_string(d2v->getFramesFound());
+        line += ",\"gops\":" + std::to_string(d2v->getGOPsFound());
+    }
+
+    line += "}";
+
+    writeLine(line);
+
+    last_event = now;
+    last_position = position;
+}
+
+
+void JSONProgress::log(const std::string &message) {
+    writeLine("{\"event\":\"log\",\"message\":" + jsonString(message) + "}");
+}
+
+
+void JSONProgress::summary(const D2V &finished_d2v) {
+    const char *results[] = { "finished", "cancelled", "error" };
+
+    const D2V::Stats &stats = finished_d2v.getStats();
+
+    std::string line = "{\"event\":\"summary\",\"result\":";
+    line += jsonString(results[finished_d2v.getResult()]);
+
+    if (finished_d2v.getResult() == D2V::ProcessingError)
+        line += ",\"error\":" + jsonString(finished_d2v.getError());
+
+    line += ",\"elapsed\":" + jsonNumber(secondsBetween(start, Clock::now()));
+    line += ",\"frames\":" + std::to_string(finished_d2v.getFramesFound());
+    line += ",\"gops\":" + std::to_string(finished_d2v.getGOPsFound());
+    line += ",\"video_frames\":" + std::to_string(stats.video_frames);
+    line += ",\"progressive_frames\":" + std::to_string(stats.progressive_frames);
+    line += ",\"tff_frames\":" + std::to_string(stats.tff_frames);
+    line += ",\"rff_frames\":" + std::to_string(stats.rff_frames);
+    line += ",\"invalid_dimensions_skipped\":" + std::to_string(stats.invalid_dimensions_skipped);
+    line += ",\"unknown_picture_types_skipped\":" + std::to_string(stats.unknown_picture_types_skipped);
+    line += "}";
+
+    writeLine(line);
+}
+
+
+void JSONProgress::progressFunction(int64_t current_position, int64_t total_size, void *progress_data) {
+    ((JSONProgress *)progress_data)->report(current_position, total_size);
+}
+
+
+void JSONProgress::logFunction(const std::string &message, void *log_data) {
+    ((JSONProgress *)log_data)->log(message);
+}
+
+
+void JSONProgress::phaseFunction(const std::string &name, void *phase_data) {
+    ((JSONProgress *)phase_data)->startPhase(name);
+}
@@ -0,0 +1,108 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_JSONPROGRESS_H
+#define D2V_WITCH_JSONPROGRESS_H
+
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+#include "D2V.h"
+
+
+// Writes the progress as newline-delimited JSON objects, for programs
+// that run d2vwitch. Every object has an "event" member:
+//
+//   "phase"     A new phase started: probe, audio-delays, index, verify,
+//               write, or demux.
+//   "progress"  "done" out of "total" "unit"s (bytes or lines). With
+//               bytes, also the speed since the previous event and since
+//               the start of the phase, in MB/s, and "eta" in seconds.
+//               While indexing, also the "frames" and "gops" found.
+//   "log"       A warning, in "message".
+//   "summary"   The result and D2V::Stats, after indexing.
+//
+// Progress events are written at most ten times per second per phase.
+//
+// The server and --watch run several jobs at once, so their events also
+// have a "job" member saying which job they're about.
+class JSONProgress {
+public:
+    typedef void (*WriteFunction)(const std::string &line, void *write_data);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    FILE *stream;
+
+    WriteFunction write_function;
+    void *write_data;
+    std::string job;
+
+    // If not null, the phase comes from here.
+    const D2V *d2v;
+
+    std::string phase;
+    Clock::time_point phase_start;
+    int64_t phase_start_position;
+    bool phase_started;
+
+    Clock::time_point last_event;
+    int64_t last_position;
+
+    Clock::time_point start;
+
+    void writeLine(const std::string &line);
+
+public:
+    explicit JSONProgress(FILE *_stream);
+
+    // Each line is passed to _write_function, without the line terminator.
+    JSONProgress(WriteFunction _write_function, void *_write_data, const std::string &_job);
+
+    // A phase outside of D2V.
+    void startPhase(const std::string &name);
+
+    // Follow the phases of this D2V object from now on, or stop if null.
+    void followD2V(const D2V *_d2v);
+
+    void report(int64_t position, int64_t total);
+
+    void log(const std::string &message);
+
+    void summary(const D2V &finished_d2v);
+
+    static void progressFunction(int64_t current_position, int64_t total_size, void *progress_data);
+
+    static void logFunction(const std::string &message, void *log_data);
+
+    static void phaseFunction(const std::string &name, void *phase_data);
+};
+
+
+// Escapes and quotes text for JSON.
+std::string jsonString(const std::string &text);
+
+#endif // D2V_WITCH_JSONPROGRESS_H
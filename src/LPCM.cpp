@@ -0,0 +1,263 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "LPCM.h"
+
+
+// Big endian to native endian, like libavcodec's output.
+static void unpack16(const uint8_t *src, uint8_t *dst, size_t count) {
+    size_t i = 0;
+
+#ifdef __SSE2__
+    // Only x86 has SSE2, so native endian is little endian here.
+    for ( ; i + 8 <= count; i += 8) {
+        __m128i words = _mm_loadu_si128((const __m128i *)(src + i * 2));
+        words = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), words);
+    }
+#endif
+
+    for ( ; i < count; i++) {
+        uint16_t sample = (src[i * 2] << 8) | src[i * 2 + 1];
+        memcpy(dst + i * 2, &sample, 2);
+    }
+}
+
+
+// Big endian 24 bit to native endian 32 bit, in the top 24 bits.
+static void unpack24(const uint8_t *src, uint8_t *dst, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        uint32_t sample = ((uint32_t)src[i * 3] << 24) | (src[i * 3 + 1] << 16) | (src[i * 3 + 2] << 8);
+        memcpy(dst + i * 4, &sample, 4);
+    }
+}
+
+
+// DVD 20 and 24 bit samples come in groups of 4 (2 in mono). First the
+// top 16 bits of every sample in the group, big endian, then the rest of
+// the bits: one byte per sample, or one nibble per sample.
+static void unpackDVDGroups(const uint8_t *src, uint8_t *dst, size_t groups, int group_samples, int bits) {
+    int group_size = group_samples * bits / 8;
+
+    for (size_t i = 0; i < groups; i++) {
+        const uint8_t *low = src + group_samples * 2;
+
+        for (int j = 0; j < group_samples; j++) {
+            uint32_t sample = ((uint32_t)src[j * 2] << 24) | (src[j * 2 + 1] << 16);
+
+            if (bits == 24)
+                sample |= low[j] << 8;
+            else if (j & 1)
+                sample |= (low[j / 2] & 0x0f) << 12;
+            else
+                sample |= (low[j / 2] & 0xf0) << 8;
+
+            memcpy(dst, &sample, 4);
+            dst += 4;
+        }
+
+        src += group_size;
+    }
+}
+
+
+LPCMUnpacker::LPCMUnpacker()
+    : codec_id(AV_CODEC_ID_NONE)
+    , leftover{ }
+    , last_block_size(0)
+{ }
+
+
+LPCMUnpacker::LPCMUnpacker(AVCodecID _codec_id)
+    : codec_id(_codec_id)
+    , leftover{ }
+    , last_block_size(0)
+{ }
+
+
+bool LPCMUnpacker::unpack(const uint8_t *data, int size, std::vector<uint8_t> &samples) {
+    samples.clear();
+
+    if (codec_id == AV_CODEC_ID_PCM_DVD)
+        return unpackDVD(data, size, samples);
+    else if (codec_id == AV_CODEC_ID_PCM_BLURAY)
+        return unpackBluray(data, size, samples);
+
+    return false;
+}
+
+
+// Mirrors pcm_dvd_decode_frame.
+bool LPCMUnpacker::unpackDVD(const uint8_t *data, int size, std::vector<uint8_t> &samples) {
+    if (size < 3)
+        return false;
+
+    int bits = 16 + (data[1] >> 6 & 3) * 4;
+    if (bits == 28)
+        return false;
+
+    int channels = 1 + (data[1] & 7);
+
+    int block_size;
+    if (bits == 16)
+        block_size = channels * 2;
+    else if (channels == 1 || channels == 2 || channels == 4)
+        block_size = 4 * bits / 8;
+    else if (channels == 8)
+        block_size = 8 * bits / 8;
+    else
+        block_size = 4 * channels * bits / 8;
+
+    // Samples are 16 bit or 32 bit after unpacking.
+    int unpacked_block_size = block_size * (bits == 16 ? 16 : 32) / bits;
+
+    int group_samples = channels == 1 ? 2 : 4;
+
+    if (last_block_size && last_block_size != block_size)
+        leftover.clear();
+    last_block_size = block_size;
+
+    data += 3;
+    size -= 3;
+
+    size_t blocks = (size + leftover.size()) / block_size;
+
+    samples.resize(blocks * unpacked_block_size);
+
+    uint8_t *dst = samples.data();
+
+    auto unpackBlocks = [&] (const uint8_t *src, size_t count) {
+        if (bits == 16)
+            unpack16(src, dst, count * block_size / 2);
+        else
+            unpackDVDGroups(src, dst, count * block_size * 8 / bits / group_samples, group_samples, bits);
+
+        dst += count * unpacked_block_size;
+    };
+
+    if (leftover.size()) {
+        size_t missing = block_size - leftover.size();
+
+        if ((size_t)size < missing) {
+            leftover.insert(leftover.end(), data, data + size);
+            return true;
+        }
+
+        leftover.insert(leftover.end(), data, data + missing);
+        unpackBlocks(leftover.data(), 1);
+        leftover.clear();
+
+        data += missing;
+        size -= missing;
+        blocks--;
+    }
+
+    unpackBlocks(data, blocks);
+
+    leftover.assign(data + blocks * block_size, data + size);
+
+    return true;
+}
+
+
+// Mirrors pcm_bluray_decode_frame.
+bool LPCMUnpacker::unpackBluray(const uint8_t *data, int size, std::vector<uint8_t> &samples) {
+    if (size < 4)
+        return false;
+
+    static const int layout_channels[16] = { 0, 1, 0, 2, 3, 3, 4, 4, 5, 6, 7, 8, 0, 0, 0, 0 };
+
+    // libavcodec reorders the channels of 5.1, 7.0, and 7.1. This is where
+    // each channel of the packet goes. -1 is the padding channel of 7.0.
+    static const int channel_maps[3][8] = {
+        { 0, 1, 2, 4, 5, 3 },
+        { 0, 1, 2, 5, 3, 4, 6, -1 },
+        { 0, 1, 2, 6, 4, 5, 7, 3 },
+    };
+
+    int layout = data[2] >> 4;
+
+    int channels = layout_channels[layout];
+    if (!channels)
+        return false;
+
+    const int *channel_map = layout >= 9 ? channel_maps[layout - 9] : nullptr;
+
+    int bits_index = data[3] >> 6;
+    if (!bits_index)
+        return false;
+
+    // There's always an even number of channels in the packet. 20 bit samples take 24 bits.
+    int source_channels = (channels + 1) & ~1;
+    int source_sample_size = bits_index == 1 ? 2 : 3;
+    int sample_size = bits_index == 1 ? 2 : 4;
+
+    data += 4;
+    size -= 4;
+
+    size_t frames = size / (source_channels * source_sample_size);
+
+    samples.resize(frames * channels * sample_size);
+
+    uint8_t *dst = samples.data();
+
+    if (channel_map) {
+        for (size_t i = 0; i < frames; i++) {
+            for (int j = 0; j < source_channels; j++) {
+                if (channel_map[j] < 0)
+                    continue;
+
+                if (sample_size == 2)
+                    unpack16(data + j * source_sample_size, dst + channel_map[j] * sample_size, 1);
+                else
+                    unpack24(data + j * source_sample_size, dst + channel_map[j] * sample_size, 1);
+            }
+
+            data += source_channels * source_sample_size;
+            dst += channels * sample_size;
+        }
+    } else if (channels == source_channels) {
+        if (sample_size == 2)
+            unpack16(data, dst, frames * channels);
+        else
+            unpack24(data, dst, frames * channels);
+    } else {
+        // Skip the padding channel.
+        for (size_t i = 0; i < frames; i++) {
+            if (sample_size == 2)
+                unpack16(data, dst, channels);
+            else
+                unpack24(data, dst, channels);
+
+            data += source_channels * source_sample_size;
+            dst += channels * sample_size;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,59 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_LPCM_H
+#define D2V_WITCH_LPCM_H
+
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+
+// Turns the LPCM packets found in DVDs (PCM_DVD) and Blu-rays (PCM_BLURAY)
+// into the same samples libavcodec's decoders output, without the decoders.
+class LPCMUnpacker {
+    AVCodecID codec_id;
+
+    // PCM_DVD only. Like in libavcodec, the bytes at the end of a packet
+    // that don't make a whole block are kept for the next packet.
+    std::vector<uint8_t> leftover;
+    int last_block_size;
+
+    bool unpackDVD(const uint8_t *data, int size, std::vector<uint8_t> &samples);
+
+    bool unpackBluray(const uint8_t *data, int size, std::vector<uint8_t> &samples);
+
+public:
+    LPCMUnpacker();
+
+    LPCMUnpacker(AVCodecID _codec_id);
+
+    // Returns false if the packet is invalid. samples is overwritten.
+    bool unpack(const uint8_t *data, int size, std::vector<uint8_t> &samples);
+};
+
+
+#endif // D2V_WITCH_LPCM_H
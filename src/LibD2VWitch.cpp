@@ -0,0 +1,459 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+// The C interface described in d2vwitch.h, built on the same classes as
+// the d2vwitch program.
+
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+#include "Audio.h"
+#include "Bullshit.h"
+#include "D2V.h"
+#include "FakeFile.h"
+#include "FFMPEG.h"
+#include "FrameIndex.h"
+#include "IndexJob.h"
+
+#include "d2vwitch.h"
+
+
+struct D2VWitchJob {
+    FakeFile fake_file;
+    FFMPEG f;
+
+    bool opened;
+    bool indexed;
+
+    // One per stream, for D2VWitchStreamInfo.
+    std::vector<std::string> codec_names;
+
+    IndexJobOptions options;
+
+    D2VWitchProgressCallback progress;
+    D2VWitchLogCallback log;
+    void *user_data;
+
+    std::atomic_bool cancel_requested;
+
+    // Only set while indexing, for the phase.
+    const IndexJob *index_job;
+
+    std::string d2v_path;
+    std::vector<FrameIndex::GOP> gops;
+    std::vector<uint8_t> frame_flags;
+
+    // Key: audio stream id.
+    std::unordered_map<int, std::string> audio_paths;
+    AudioDelayMap audio_delays;
+
+    // The getters are const, but they can fail too.
+    mutable std::string error;
+
+    D2VWitchJob()
+        : opened(false)
+        , indexed(false)
+        , codec_names{ }
+        , options{ }
+        , progress(nullptr)
+        , log(nullptr)
+        , user_data(nullptr)
+        , cancel_requested(false)
+        , index_job(nullptr)
+        , d2v_path{ }
+        , gops{ }
+        , frame_flags{ }
+        , audio_paths{ }
+        , audio_delays{ }
+        , error{ }
+    { }
+};
+
+
+static std::string hexadecimal(int number) {
+    char buffer[20] = { 0 };
+    snprintf(buffer, 19, "%x", number);
+    return buffer;
+}
+
+
+static void progressFunction(int64_t current_position, int64_t total_size, void *progress_data) {
+    D2VWitchJob *job = (D2VWitchJob *)progress_data;
+
+    // D2VWitchPhase has the same numbers as D2V::ProcessingPhase.
+    job->progress((int)job->index_job->getD2V()->getPhase(), current_position, total_size, job->user_data);
+}
+
+
+static void logFunction(const std::string &message, void *log_data) {
+    D2VWitchJob *job = (D2VWitchJob *)log_data;
+
+    job->log(message.c_str(), job->user_data);
+}
+
+
+// The input files are closed when the job can't go any further.
+static int closeInputs(D2VWitchJob *job, int status) {
+    job->f.cleanup();
+    job->fake_file.close();
+
+    return status;
+}
+
+
+static bool checkSettable(D2VWitchJob *job) {
+    if (job->indexed) {
+        job->error = "The job was already indexed.";
+        return false;
+    }
+
+    return true;
+}
+
+
+int d2vwitch_get_api_version(void) {
+    return D2VWITCH_API_VERSION;
+}
+
+
+D2VWitchJob *d2vwitch_job_new(void) {
+    return new D2VWitchJob;
+}
+
+
+void d2vwitch_job_free(D2VWitchJob *job) {
+    if (!job)
+        return;
+
+    job->f.cleanup();
+    job->fake_file.close();
+
+    delete job;
+}
+
+
+const char *d2vwitch_job_get_error(const D2VWitchJob *job) {
+    return job->error.c_str();
+}
+
+
+int d2vwitch_job_add_input(D2VWitchJob *job, const char *path) {
+    if (job->opened) {
+        job->error = "Inputs can't be added after the job was opened.";
+        return D2VWITCH_ERROR;
+    }
+
+    std::string absolute_path = path;
+    std::string err;
+    makeAbsolute(absolute_path, err);
+    if (err.size()) {
+        job->error = "Failed to turn '" + absolute_path + "' into an absolute path: " + err;
+        return D2VWITCH_ERROR;
+    }
+
+    job->fake_file.push_back(absolute_path);
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_open(D2VWitchJob *job) {
+    if (job->opened) {
+        job->error = "The job was already opened.";
+        return D2VWITCH_ERROR;
+    }
+
+    if (!job->fake_file.size()) {
+        job->error = "No input files were added.";
+        return D2VWITCH_ERROR;
+    }
+
+    if (!job->fake_file.open()) {
+        job->error = job->fake_file.getError();
+        return closeInputs(job, D2VWITCH_ERROR);
+    }
+
+    if (!job->f.initFormat(job->fake_file, &job->cancel_requested)) {
+        if (job->cancel_requested) {
+            job->cancel_requested = false;
+            job->error = "Cancelled.";
+            return closeInputs(job, D2VWITCH_CANCELLED);
+        }
+
+        job->error = job->f.getError();
+        return closeInputs(job, D2VWITCH_ERROR);
+    }
+
+    const AVFormatContext *fctx = job->f.fctx;
+
+    if (D2V::getStreamType(fctx->iformat->name) == D2V::UNSUPPORTED_STREAM) {
+        job->error = std::string("Unsupported container type '") + (fctx->iformat->long_name ? fctx->iformat->long_name : fctx->iformat->name) + "'.";
+        return closeInputs(job, D2VWITCH_ERROR);
+    }
+
+    for (unsigned i = 0; i < fctx->nb_streams; i++)
+        job->codec_names.push_back(avcodec_get_name(fctx->streams[i]->codecpar->codec_id));
+
+    job->opened = true;
+    job->error.clear();
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_get_num_streams(const D2VWitchJob *job) {
+    return (int)job->codec_names.size();
+}
+
+
+int d2vwitch_job_get_stream(const D2VWitchJob *job, int index, D2VWitchStreamInfo *info) {
+    if (index < 0 || index >= (int)job->codec_names.size()) {
+        job->error = "There is no stream number " + std::to_string(index) + ".";
+        return D2VWITCH_ERROR;
+    }
+
+    const AVStream *stream = job->f.fctx->streams[index];
+
+    info->id = stream->id;
+
+    if (stream->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        info->type = D2VWITCH_STREAM_VIDEO;
+    else if (stream->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+        info->type = D2VWITCH_STREAM_AUDIO;
+    else
+        info->type = D2VWITCH_STREAM_OTHER;
+
+    info->codec = job->codec_names[index].c_str();
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_set_video_id(D2VWitchJob *job, int id) {
+    if (!checkSettable(job))
+        return D2VWITCH_ERROR;
+
+    job->options.have_video_id = true;
+    job->options.video_id = id;
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_set_audio_ids(D2VWitchJob *job, const int *ids, int count) {
+    if (!checkSettable(job))
+        return D2VWITCH_ERROR;
+
+    job->options.audio_ids.clear();
+    job->options.audio_ids_all = count < 0;
+
+    if (count > 0)
+        job->options.audio_ids.assign(ids, ids + count);
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_set_output(D2VWitchJob *job, const char *d2v_path) {
+    if (!checkSettable(job))
+        return D2VWITCH_ERROR;
+
+    job->options.d2v_path = d2v_path ? d2v_path : "";
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_set_option(D2VWitchJob *job, int option, int value) {
+    if (!checkSettable(job))
+        return D2VWITCH_ERROR;
+
+    if (value != 0 && value != 1) {
+        job->error = "Invalid value " + std::to_string(value) + " for option " + std::to_string(option) + ".";
+        return D2VWITCH_ERROR;
+    }
+
+    switch (option) {
+        case D2VWITCH_OPTION_INPUT_RANGE:
+            job->options.input_range = value ? D2V::ColourRangeFull : D2V::ColourRangeLimited;
+            break;
+        case D2VWITCH_OPTION_RELATIVE_PATHS:
+            job->options.relative_paths = value;
+            break;
+        case D2VWITCH_OPTION_PIPELINED:
+            job->options.pipelined = value;
+            break;
+        case D2VWITCH_OPTION_AUDIO_THREADS:
+            job->options.audio_threads = value;
+            break;
+        case D2VWITCH_OPTION_FRAME_INDEX:
+            job->options.frame_index = value;
+            break;
+        default:
+            job->error = "Unknown option " + std::to_string(option) + ".";
+            return D2VWITCH_ERROR;
+    }
+
+    return D2VWITCH_OK;
+}
+
+
+void d2vwitch_job_set_callbacks(D2VWitchJob *job, D2VWitchProgressCallback progress, D2VWitchLogCallback log, void *user_data) {
+    job->progress = progress;
+    job->log = log;
+    job->user_data = user_data;
+}
+
+
+int d2vwitch_job_index(D2VWitchJob *job) {
+    if (!job->opened) {
+        job->error = "The job must be opened before indexing.";
+        return D2VWITCH_ERROR;
+    }
+
+    if (!checkSettable(job))
+        return D2VWITCH_ERROR;
+
+    job->indexed = true;
+    job->error.clear();
+
+    IndexJobOptions options = job->options;
+    options.progress_report = job->progress ? progressFunction : nullptr;
+    options.progress_data = job;
+    options.log_message = job->log ? logFunction : nullptr;
+    options.log_data = job;
+    options.cancel_flag = &job->cancel_requested;
+
+    IndexJob index_job(options);
+
+    job->index_job = &index_job;
+    index_job.run(job->fake_file, job->f);
+    job->index_job = nullptr;
+
+    job->cancel_requested = false;
+
+    if (index_job.getResult() != D2V::ProcessingFinished) {
+        job->error = index_job.getError();
+        return closeInputs(job, index_job.getResult() == D2V::ProcessingCancelled ? D2VWITCH_CANCELLED : D2VWITCH_ERROR);
+    }
+
+    job->d2v_path = index_job.getD2VPath();
+    job->gops = index_job.getGOPs();
+    job->frame_flags = index_job.getFrameFlags();
+    job->audio_paths = index_job.getAudioPaths();
+    job->audio_delays = index_job.getAudioDelays();
+
+    return closeInputs(job, D2VWITCH_OK);
+}
+
+
+void d2vwitch_job_cancel(D2VWitchJob *job) {
+    job->cancel_requested = true;
+}
+
+
+const char *d2vwitch_job_get_output(const D2VWitchJob *job) {
+    return job->d2v_path.c_str();
+}
+
+
+int d2vwitch_job_get_num_frames(const D2VWitchJob *job) {
+    return (int)job->frame_flags.size();
+}
+
+
+int d2vwitch_job_get_num_gops(const D2VWitchJob *job) {
+    return (int)job->gops.size();
+}
+
+
+int d2vwitch_job_get_gop(const D2VWitchJob *job, int gop, D2VWitchGOP *info) {
+    if (gop < 0 || gop >= (int)job->gops.size()) {
+        job->error = "There is no GOP number " + std::to_string(gop) + ".";
+        return D2VWITCH_ERROR;
+    }
+
+    const FrameIndex::GOP &g = job->gops[gop];
+
+    int next_first_frame = (size_t)gop + 1 < job->gops.size() ? job->gops[gop + 1].first_frame : (int)job->frame_flags.size();
+
+    info->position = g.position;
+    info->first_frame = g.first_frame;
+    info->num_frames = next_first_frame - g.first_frame;
+    info->file = g.file;
+    info->closed = !!(g.info & D2V::INFO_CLOSED_GOP);
+    info->info = g.info;
+
+    return D2VWITCH_OK;
+}
+
+
+int d2vwitch_job_get_frame_gop(const D2VWitchJob *job, int frame) {
+    if (frame < 0 || frame >= (int)job->frame_flags.size())
+        return -1;
+
+    // The last GOP starting at or before the frame. GOPs without frames are skipped this way.
+    auto it = std::upper_bound(job->gops.cbegin(), job->gops.cend(), frame, [] (int value, const FrameIndex::GOP &g) -> bool {
+        return value < g.first_frame;
+    });
+
+    return (int)(it - job->gops.cbegin()) - 1;
+}
+
+
+int d2vwitch_job_get_frame_flags(const D2VWitchJob *job, int frame) {
+    if (frame < 0 || frame >= (int)job->frame_flags.size())
+        return -1;
+
+    return job->frame_flags[frame];
+}
+
+
+const char *d2vwitch_job_get_audio_path(const D2VWitchJob *job, int id) {
+    auto it = job->audio_paths.find(id);
+    if (it == job->audio_paths.cend())
+        return nullptr;
+
+    return it->second.c_str();
+}
+
+
+int d2vwitch_job_get_audio_delay(const D2VWitchJob *job, int id, int64_t *delay) {
+    auto it = job->audio_delays.find(id);
+    if (it == job->audio_delays.cend()) {
+        job->error = "No delay was found for the audio track with id " + hexadecimal(id) + ".";
+        return D2VWITCH_ERROR;
+    }
+
+    *delay = it->second;
+
+    return D2VWITCH_OK;
+}
@@ -88,8 +88,8 @@ void d2vWitchParseMPEG12Data(AVCodecParserContext *parser, AVCodecContext *avctx
     parser->picture_structure = AV_PICTURE_STRUCTURE_FRAME;
 
     // Maybe not the best idea, but it's really the only thing that needs to be remembered between calls
-    // and not stored in parser or avctx.
-    static int progressive_sequence = 0;
+    // and not stored in parser or avctx. Each thread parses its own video.
+    static thread_local int progressive_sequence = 0;
 
     int sequence_header = 0;
     int group_of_pictures_header = 0;
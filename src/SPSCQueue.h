@@ -0,0 +1,123 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_SPSCQUEUE_H
+#define D2V_WITCH_SPSCQUEUE_H
+
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+
+// Bounded lock-free queue for exactly one producer thread and one consumer thread.
+template <typename T>
+class SPSCQueue {
+    // One slot is always left empty, to tell a full queue from an empty one.
+    std::vector<T> slots;
+
+    // Only the consumer writes head, only the producer writes tail.
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+
+
+    static void wait(int &attempts) {
+        attempts++;
+
+        if (attempts < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+
+    SPSCQueue(const SPSCQueue &);
+    SPSCQueue &operator=(const SPSCQueue &);
+
+public:
+    explicit SPSCQueue(size_t capacity)
+        : slots(capacity + 1)
+        , head(0)
+        , tail(0)
+    { }
+
+
+    bool tryPush(const T &item) {
+        size_t current_tail = tail.load(std::memory_order_relaxed);
+        size_t next_tail = (current_tail + 1) % slots.size();
+
+        if (next_tail == head.load(std::memory_order_acquire))
+            return false;
+
+        slots[current_tail] = item;
+        tail.store(next_tail, std::memory_order_release);
+
+        return true;
+    }
+
+
+    bool tryPop(T &item) {
+        size_t current_head = head.load(std::memory_order_relaxed);
+
+        if (current_head == tail.load(std::memory_order_acquire))
+            return false;
+
+        item = slots[current_head];
+        head.store((current_head + 1) % slots.size(), std::memory_order_release);
+
+        return true;
+    }
+
+
+    // Waits until there is room in the queue. Returns false if stop became true first.
+    bool push(const T &item, const std::atomic_bool &stop) {
+        int attempts = 0;
+
+        while (!tryPush(item)) {
+            if (stop)
+                return false;
+
+            wait(attempts);
+        }
+
+        return true;
+    }
+
+
+    // Waits until the queue is not empty. Returns false if stop became true first.
+    bool pop(T &item, const std::atomic_bool &stop) {
+        int attempts = 0;
+
+        while (!tryPop(item)) {
+            if (stop)
+                return false;
+
+            wait(attempts);
+        }
+
+        return true;
+    }
+};
+
+
+#endif // D2V_WITCH_SPSCQUEUE_H
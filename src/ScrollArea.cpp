@@ -48,3 +48,10 @@ void ScrollArea::mouseMoveEvent(QMouseEvent *e) {
         QScrollArea::mouseMoveEvent(e);
     }
 }
+
+
+void ScrollArea::resizeEvent(QResizeEvent *e) {
+    QScrollArea::resizeEvent(e);
+
+    emit resized();
+}
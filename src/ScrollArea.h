@@ -30,9 +30,13 @@ class ScrollArea : public QScrollArea {
 public:
     using QScrollArea::QScrollArea;
 
+signals:
+    void resized();
+
 private:
     void mousePressEvent(QMouseEvent *e);
     void mouseMoveEvent(QMouseEvent *e);
+    void resizeEvent(QResizeEvent *e);
 
     QPoint old_mouse_position;
 };
@@ -0,0 +1,1069 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef _WIN32
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include "Audio.h"
+#include "Bullshit.h"
+#include "D2V.h"
+#include "FakeFile.h"
+#include "FFMPEG.h"
+#include "FrameIndex.h"
+#include "IndexJob.h"
+#include "JSONProgress.h"
+#include "Server.h"
+#include "Trace.h"
+
+
+#ifdef _WIN32
+
+bool serve(const std::string &, int, std::string &error) {
+    error = "The server is not available on Windows.";
+    return false;
+}
+
+
+bool runClient(const std::string &, std::string &error) {
+    error = "The client is not available on Windows.";
+    return false;
+}
+
+#else
+
+// How many inputs are kept open after their jobs finish.
+#define CACHED_INPUTS 8
+
+// Longer lines from a client are an error.
+#define MAX_REQUEST_SIZE (1 << 20)
+
+
+static std::string hexadecimal(int number) {
+    char buffer[20] = { 0 };
+    snprintf(buffer, 19, "%x", number);
+    return buffer;
+}
+
+
+static std::string toLine(const QJsonObject &object) {
+    return QJsonDocument(object).toJson(QJsonDocument::Compact).toStdString();
+}
+
+
+// The server has its own current folder, so the client makes the file
+// names in a request absolute. Lines that aren't requests are sent as
+// they are, for the server to complain about.
+static std::string makeRequestPathsAbsolute(const std::string &line) {
+    QJsonDocument document = QJsonDocument::fromJson(QByteArray(line.c_str(), (int)line.size()));
+    if (!document.isObject())
+        return line;
+
+    QJsonObject request = document.object();
+
+    std::string error;
+
+    if (request.contains("inputs") && request["inputs"].isArray()) {
+        QJsonArray inputs = request["inputs"].toArray();
+
+        for (int i = 0; i < inputs.size(); i++) {
+            if (!inputs[i].isString())
+                continue;
+
+            std::string name = inputs[i].toString().toStdString();
+            makeOutputPathAbsolute(name, error);
+            if (!error.size())
+                inputs[i] = QString::fromStdString(name);
+        }
+
+        request["inputs"] = inputs;
+    }
+
+    if (request.contains("output") && request["output"].isString()) {
+        std::string name = request["output"].toString().toStdString();
+
+        if (name.size() && !isStreamName(name)) {
+            makeOutputPathAbsolute(name, error);
+            if (!error.size())
+                request["output"] = QString::fromStdString(name);
+        }
+    }
+
+    return toLine(request);
+}
+
+
+// Returns false if the connection is gone.
+static bool sendAll(int fd, const std::string &data) {
+    size_t sent = 0;
+
+    while (sent < data.size()) {
+        ssize_t ret = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+
+        sent += ret;
+    }
+
+    return true;
+}
+
+
+static bool makeSocketAddress(const std::string &socket_path, sockaddr_un &address, std::string &error) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        error = "The socket path '" + socket_path + "' is too long.";
+        return false;
+    }
+
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+
+    return true;
+}
+
+
+// Returns -1 and sets errno if it fails.
+static int connectTo(const sockaddr_un &address) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (const sockaddr *)&address, sizeof(address))) {
+        int connect_errno = errno;
+        close(fd);
+        errno = connect_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+
+struct Connection {
+    int fd;
+
+    std::mutex write_mutex;
+
+    // Writing failed, so the client is gone.
+    bool broken;
+
+    // The rest are protected by Server::mutex. The socket is closed when
+    // the client stopped sending and all its jobs are done.
+    int pending_jobs;
+    bool reading_done;
+    bool closed;
+
+    explicit Connection(int _fd)
+        : fd(_fd)
+        , broken(false)
+        , pending_jobs(0)
+        , reading_done(false)
+        , closed(false)
+    { }
+
+    void writeLine(const std::string &line) {
+        std::lock_guard<std::mutex> lock(write_mutex);
+
+        if (!broken && !sendAll(fd, line + "\n"))
+            broken = true;
+    }
+
+    bool isBroken() {
+        std::lock_guard<std::mutex> lock(write_mutex);
+
+        return broken;
+    }
+
+    static void writeFunction(const std::string &line, void *write_data) {
+        ((Connection *)write_data)->writeLine(line);
+    }
+};
+
+
+// Input files kept open after a job, with the streams probed.
+struct CachedInput {
+    std::vector<std::string> names;
+
+    // At the time of probing. If they change, the input is probed again.
+    std::vector<int64_t> sizes;
+    std::vector<int64_t> modification_times;
+
+    // f reads from fake_file, so it must be destroyed first.
+    FakeFile fake_file;
+    FFMPEG f;
+
+    unsigned probed_streams;
+
+    // Read since probing, so it must be rewound first.
+    bool used;
+
+    CachedInput()
+        : probed_streams(0)
+        , used(false)
+    { }
+
+    bool isUnchanged() const {
+        for (size_t i = 0; i < names.size(); i++) {
+            if (getFileSize(names[i].c_str()) != sizes[i] ||
+                getModificationTime(names[i].c_str()) != modification_times[i])
+                return false;
+        }
+
+        // Streams discovered while reading would change the meaning of
+        // "all the audio tracks".
+        return f.fctx->nb_streams == probed_streams;
+    }
+};
+
+
+class InputCache {
+    std::mutex mutex;
+
+    // Most recently used first.
+    std::list<std::unique_ptr<CachedInput>> inputs;
+
+public:
+    // The input is removed from the cache until it's given back, so only
+    // one job uses it at a time. If interrupt becomes true, probing stops.
+    std::unique_ptr<CachedInput> take(const std::vector<std::string> &names, const std::atomic_bool *interrupt, std::string &error) {
+        std::unique_ptr<CachedInput> input;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            for (auto it = inputs.begin(); it != inputs.end(); it++) {
+                if ((*it)->names == names) {
+                    input = std::move(*it);
+                    inputs.erase(it);
+                    break;
+                }
+            }
+        }
+
+        if (input && input->isUnchanged()) {
+            input->f.setInterrupt(interrupt);
+
+            if (!input->used || input->f.seek(0))
+                return input;
+        }
+
+        input.reset(new CachedInput);
+        input->names = names;
+
+        for (size_t i = 0; i < names.size(); i++) {
+            input->fake_file.push_back(names[i]);
+            input->sizes.push_back(getFileSize(names[i].c_str()));
+            input->modification_times.push_back(getModificationTime(names[i].c_str()));
+        }
+
+        if (!input->fake_file.open()) {
+            error = input->fake_file.getError();
+            return nullptr;
+        }
+
+        if (!input->f.initFormat(input->fake_file, interrupt)) {
+            error = input->f.getError();
+            return nullptr;
+        }
+
+        input->probed_streams = input->f.fctx->nb_streams;
+
+        return input;
+    }
+
+    void give(std::unique_ptr<CachedInput> input) {
+        input->f.deinitCodecs();
+        input->f.setInterrupt(nullptr);
+        input->fake_file.setOffsetFromRealStart(0);
+        input->used = true;
+
+        std::unique_ptr<CachedInput> evicted;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        inputs.push_front(std::move(input));
+
+        if (inputs.size() > CACHED_INPUTS) {
+            evicted = std::move(inputs.back());
+            inputs.pop_back();
+        }
+    }
+};
+
+
+struct ServerJob {
+    std::string id;
+
+    // "index", "demux", or "info".
+    std::string command;
+
+    QJsonObject request;
+
+    std::shared_ptr<Connection> connection;
+
+    std::atomic_bool cancel_requested;
+
+    JSONProgress progress;
+
+    // While indexing, for the phase.
+    const IndexJob *index_job;
+
+    ServerJob(const std::string &_id, const std::string &_command, const QJsonObject &_request, const std::shared_ptr<Connection> &_connection)
+        : id(_id)
+        , command(_command)
+        , request(_request)
+        , connection(_connection)
+        , cancel_requested(false)
+        , progress(Connection::writeFunction, _connection.get(), _id)
+        , index_job(nullptr)
+    { }
+
+    void writeEvent(const char *event, QJsonObject members) {
+        members["job"] = QString::fromStdString(id);
+        members["event"] = event;
+
+        connection->writeLine(toLine(members));
+    }
+
+    void finish(const char *result, const std::string &error, QJsonObject members = QJsonObject()) {
+        members["result"] = result;
+        if (error.size())
+            members["error"] = QString::fromStdString(error);
+
+        writeEvent("done", members);
+    }
+
+    static void progressFunction(int64_t current_position, int64_t total_size, void *progress_data) {
+        ServerJob *job = (ServerJob *)progress_data;
+
+        job->progress.followD2V(job->index_job->getD2V());
+        job->progress.report(current_position, total_size);
+
+        // No one is listening anymore.
+        if (job->connection->isBroken())
+            job->cancel_requested = true;
+    }
+
+    static void logFunction(const std::string &message, void *log_data) {
+        ((ServerJob *)log_data)->progress.log(message);
+    }
+};
+
+
+class Server {
+    std::string socket_path;
+    int listen_fd;
+    int wake_pipe[2];
+
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+    std::condition_variable readers_changed;
+
+    std::deque<std::shared_ptr<ServerJob>> queue;
+
+    // Queued and running jobs, by id.
+    std::unordered_map<std::string, std::shared_ptr<ServerJob>> jobs;
+
+    std::unordered_set<std::shared_ptr<Connection>> connections;
+    int readers;
+
+    bool stopping;
+    int next_job_number;
+
+    std::vector<std::thread> workers;
+
+    InputCache cache;
+
+    // Must be called with mutex locked.
+    void releaseConnection(const std::shared_ptr<Connection> &connection) {
+        if (connection->closed || !connection->reading_done || connection->pending_jobs)
+            return;
+
+        connection->closed = true;
+        close(connection->fd);
+        connections.erase(connection);
+    }
+
+    void handleRequest(const std::shared_ptr<Connection> &connection, const std::string &line);
+
+    void readRequests(std::shared_ptr<Connection> connection);
+
+    void runJob(ServerJob &job);
+
+    void runInfoJob(ServerJob &job, CachedInput &input);
+
+    void runIndexJob(ServerJob &job, CachedInput &input);
+
+    void work();
+
+public:
+    Server()
+        : listen_fd(-1)
+        , readers(0)
+        , stopping(false)
+        , next_job_number(0)
+    {
+        wake_pipe[0] = wake_pipe[1] = -1;
+    }
+
+    bool listen(const std::string &_socket_path, std::string &error);
+
+    void run(int num_workers);
+};
+
+
+bool Server::listen(const std::string &_socket_path, std::string &error) {
+    socket_path = _socket_path;
+
+    sockaddr_un address;
+    if (!makeSocketAddress(socket_path, address, error))
+        return false;
+
+    // A socket left behind by a server that didn't shut down properly is
+    // replaced, but not one that's still in use, or some other file.
+    struct stat info;
+    if (!stat(socket_path.c_str(), &info)) {
+        if (!S_ISSOCK(info.st_mode)) {
+            error = "'" + socket_path + "' exists and is not a socket.";
+            return false;
+        }
+
+        int fd = connectTo(address);
+        if (fd >= 0) {
+            close(fd);
+            error = "Another server is already listening on '" + socket_path + "'.";
+            return false;
+        }
+
+        unlink(socket_path.c_str());
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        error = std::string("Failed to create the socket: ") + strerror(errno);
+        return false;
+    }
+
+    if (bind(listen_fd, (const sockaddr *)&address, sizeof(address))) {
+        error = "Failed to bind the socket to '" + socket_path + "': " + strerror(errno);
+        close(listen_fd);
+        return false;
+    }
+
+    // The jobs write files as this user, so only this user gets to send them.
+    chmod(socket_path.c_str(), S_IRUSR | S_IWUSR);
+
+    if (::listen(listen_fd, 16)) {
+        error = std::string("Failed to listen on the socket: ") + strerror(errno);
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        return false;
+    }
+
+    if (pipe(wake_pipe)) {
+        error = std::string("Failed to create a pipe: ") + strerror(errno);
+        close(listen_fd);
+        unlink(socket_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+void Server::run(int num_workers) {
+    // A client that goes away shouldn't take the server with it.
+    signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < num_workers; i++)
+        workers.push_back(std::thread(&Server::work, this));
+
+    while (true) {
+        pollfd fds[2] = {
+            { listen_fd, POLLIN, 0 },
+            { wake_pipe[0], POLLIN, 0 }
+        };
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // Shutdown requested.
+        if (fds[1].revents)
+            break;
+
+        if (!fds[0].revents)
+            continue;
+
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd < 0)
+            continue;
+
+        std::shared_ptr<Connection> connection(new Connection(fd));
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        connections.insert(connection);
+        readers++;
+
+        std::thread(&Server::readRequests, this, connection).detach();
+    }
+
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        stopping = true;
+
+        for (auto it = jobs.begin(); it != jobs.end(); it++)
+            it->second->cancel_requested = true;
+
+        queue_changed.notify_all();
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // Wake up the readers.
+        for (auto it = connections.begin(); it != connections.end(); it++)
+            shutdown((*it)->fd, SHUT_RDWR);
+
+        readers_changed.wait(lock, [this] () -> bool { return readers == 0; });
+    }
+
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
+
+
+void Server::readRequests(std::shared_ptr<Connection> connection) {
+    TRACE_THREAD_NAME("server connection");
+
+    std::string buffer;
+    char chunk[4096];
+
+    while (true) {
+        ssize_t received = recv(connection->fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            break;
+
+        buffer.append(chunk, received);
+
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            std::string line = buffer.substr(start, end - start);
+            start = end + 1;
+
+            if (line.find_first_not_of(" \t\r") != std::string::npos)
+                handleRequest(connection, line);
+        }
+
+        buffer.erase(0, start);
+
+        if (buffer.size() > MAX_REQUEST_SIZE) {
+            QJsonObject event;
+            event["event"] = "error";
+            event["error"] = "The request is too long.";
+            connection->writeLine(toLine(event));
+            break;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    connection->reading_done = true;
+    releaseConnection(connection);
+
+    readers--;
+    readers_changed.notify_all();
+}
+
+
+void Server::handleRequest(const std::shared_ptr<Connection> &connection, const std::string &line) {
+    QJsonParseError parse_error;
+    QJsonDocument document = QJsonDocument::fromJson(QByteArray(line.data(), (int)line.size()), &parse_error);
+
+    QJsonObject event;
+    event["event"] = "error";
+
+    if (!document.isObject()) {
+        event["error"] = "The request is not a JSON object: " + (parse_error.error != QJsonParseError::NoError ? parse_error.errorString() : QStringLiteral("not an object")) + ".";
+        connection->writeLine(toLine(event));
+        return;
+    }
+
+    // Not const would add missing members when reading them.
+    const QJsonObject request = document.object();
+
+    std::string command = request["command"].toString().toStdString();
+    std::string id = request["job"].toString().toStdString();
+
+    if (request.contains("job"))
+        event["job"] = request["job"];
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    if (command == "cancel") {
+        auto it = jobs.find(id);
+        if (it == jobs.end()) {
+            event["error"] = "There is no job '" + request["job"].toString() + "' to cancel.";
+            connection->writeLine(toLine(event));
+            return;
+        }
+
+        it->second->cancel_requested = true;
+    } else if (command == "shutdown") {
+        if (write(wake_pipe[1], "", 1) < 0) {
+            event["error"] = QString("Failed to shut down: ") + strerror(errno);
+            connection->writeLine(toLine(event));
+        }
+    } else if (command == "index" || command == "demux" || command == "info") {
+        if (stopping) {
+            event["error"] = "The server is shutting down.";
+            connection->writeLine(toLine(event));
+            return;
+        }
+
+        if (!id.size())
+            id = "job" + std::to_string(++next_job_number);
+
+        if (jobs.count(id)) {
+            event["error"] = "There is already a job called '" + QString::fromStdString(id) + "'.";
+            connection->writeLine(toLine(event));
+            return;
+        }
+
+        std::shared_ptr<ServerJob> job(new ServerJob(id, command, request, connection));
+
+        jobs.insert({ id, job });
+        connection->pending_jobs++;
+
+        // Before any events from a worker.
+        job->writeEvent("queued", QJsonObject());
+
+        queue.push_back(job);
+        queue_changed.notify_one();
+    } else {
+        event["error"] = "Unknown command '" + request["command"].toString() + "'.";
+        connection->writeLine(toLine(event));
+    }
+}
+
+
+void Server::work() {
+    TRACE_THREAD_NAME("server worker");
+
+    while (true) {
+        std::shared_ptr<ServerJob> job;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            queue_changed.wait(lock, [this] () -> bool { return stopping || queue.size(); });
+
+            if (!queue.size())
+                return;
+
+            job = queue.front();
+            queue.pop_front();
+        }
+
+        runJob(*job);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        jobs.erase(job->id);
+
+        job->connection->pending_jobs--;
+        releaseConnection(job->connection);
+    }
+}
+
+
+void Server::runJob(ServerJob &job) {
+    TRACE_SPAN("server job");
+
+    if (job.cancel_requested) {
+        job.finish("cancelled", "Cancelled.");
+        return;
+    }
+
+    const QJsonObject &request = job.request;
+
+    QJsonValue inputs_value = request["inputs"];
+    QJsonArray inputs_array = inputs_value.toArray();
+
+    if (!inputs_value.isArray() || !inputs_array.size()) {
+        job.finish("error", "The request needs \"inputs\", a list of file names.");
+        return;
+    }
+
+    std::vector<std::string> names;
+
+    for (int i = 0; i < inputs_array.size(); i++) {
+        if (!inputs_array[i].isString()) {
+            job.finish("error", "The input file names must be strings.");
+            return;
+        }
+
+        std::string name = inputs_array[i].toString().toStdString();
+
+        // A relative name would be resolved against the server's current folder.
+        if (!name.size() || name[0] != '/') {
+            job.finish("error", "The input file names must be absolute paths.");
+            return;
+        }
+
+        std::string error;
+        makeAbsolute(name, error);
+        if (error.size()) {
+            job.finish("error", "Failed to turn '" + name + "' into an absolute path: " + error);
+            return;
+        }
+
+        names.push_back(name);
+    }
+
+    job.progress.startPhase("probe");
+
+    std::string error;
+    std::unique_ptr<CachedInput> input = cache.take(names, &job.cancel_requested, error);
+    if (!input) {
+        if (job.cancel_requested)
+            job.finish("cancelled", "Cancelled.");
+        else
+            job.finish("error", error);
+        return;
+    }
+
+    if (D2V::getStreamType(input->f.fctx->iformat->name) == D2V::UNSUPPORTED_STREAM) {
+        const AVInputFormat *format = input->f.fctx->iformat;
+        job.finish("error", std::string("Unsupported container type '") + (format->long_name ? format->long_name : format->name) + "'.");
+        cache.give(std::move(input));
+        return;
+    }
+
+    if (job.command == "info")
+        runInfoJob(job, *input);
+    else
+        runIndexJob(job, *input);
+
+    cache.give(std::move(input));
+}
+
+
+void Server::runInfoJob(ServerJob &job, CachedInput &input) {
+    const AVFormatContext *fctx = input.f.fctx;
+
+    QJsonObject result;
+
+    QJsonArray inputs;
+    for (size_t i = 0; i < input.fake_file.size(); i++)
+        inputs.append(QString::fromStdString(input.fake_file[i].name));
+
+    result["inputs"] = inputs;
+    result["format"] = fctx->iformat->long_name ? fctx->iformat->long_name : fctx->iformat->name;
+    result["size"] = (double)input.fake_file.getTotalSize();
+
+    QJsonArray streams;
+
+    for (unsigned i = 0; i < fctx->nb_streams; i++) {
+        const AVCodecParameters *par = fctx->streams[i]->codecpar;
+
+        QJsonObject stream;
+        stream["id"] = QString::fromStdString(hexadecimal(fctx->streams[i]->id));
+        stream["codec"] = avcodec_get_name(par->codec_id);
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            stream["type"] = "video";
+            stream["width"] = par->width;
+            stream["height"] = par->height;
+
+            const char *pixel_format = av_get_pix_fmt_name(static_cast<AVPixelFormat>(par->format));
+            stream["pixel_format"] = pixel_format ? pixel_format : "unknown";
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            char channels[512] = { 0 };
+            av_get_channel_layout_string(channels, 512, 0, getChannelLayout(fctx->streams[i]->codecpar));
+
+            stream["type"] = "audio";
+            stream["bit_rate"] = (double)par->bit_rate;
+            stream["channels"] = channels;
+            stream["sample_rate"] = par->sample_rate;
+        } else {
+            continue;
+        }
+
+        streams.append(stream);
+    }
+
+    result["streams"] = streams;
+
+    job.finish("finished", std::string(), result);
+}
+
+
+void Server::runIndexJob(ServerJob &job, CachedInput &input) {
+    const QJsonObject &request = job.request;
+
+    IndexJobOptions options;
+
+    if (request.contains("output")) {
+        options.d2v_path = request["output"].toString().toStdString();
+
+        if (!options.d2v_path.size() || isStreamName(options.d2v_path)) {
+            job.finish("error", "\"output\" must be the name of a file.");
+            return;
+        }
+
+        if (options.d2v_path[0] != '/') {
+            job.finish("error", "\"output\" must be an absolute path.");
+            return;
+        }
+    }
+
+    // The ids are hexadecimal strings, like on the command line.
+    try {
+        if (request.contains("video_id")) {
+            options.video_id = std::stoi(request["video_id"].toString().toStdString(), nullptr, 16);
+            options.have_video_id = true;
+        }
+
+        if (request.contains("audio_ids")) {
+            std::string ids = request["audio_ids"].toString().toStdString();
+
+            if (ids == "all") {
+                options.audio_ids_all = true;
+            } else {
+                size_t start = 0;
+                while (start <= ids.size()) {
+                    size_t end = ids.find(',', start);
+                    if (end == std::string::npos)
+                        end = ids.size();
+
+                    options.audio_ids.push_back(std::stoi(ids.substr(start, end - start), nullptr, 16));
+
+                    start = end + 1;
+                }
+            }
+        }
+    } catch (...) {
+        job.finish("error", "Invalid \"video_id\" or \"audio_ids\".");
+        return;
+    }
+
+    if (request.contains("input_range")) {
+        QString range = request["input_range"].toString();
+
+        if (range == "full") {
+            options.input_range = D2V::ColourRangeFull;
+        } else if (range != "limited") {
+            job.finish("error", "\"input_range\" must be \"limited\" or \"full\".");
+            return;
+        }
+    }
+
+    options.relative_paths = request["relative_paths"].toBool(false);
+    options.pipelined = request["pipelined"].toBool(false);
+    options.audio_threads = request["audio_threads"].toBool(true);
+    options.frame_index = request["frame_index"].toBool(false);
+    options.audio_only = job.command == "demux";
+
+    options.progress_report = ServerJob::progressFunction;
+    options.progress_data = &job;
+    options.log_message = ServerJob::logFunction;
+    options.log_data = &job;
+    options.cancel_flag = &job.cancel_requested;
+
+    IndexJob index_job(options);
+
+    job.index_job = &index_job;
+    index_job.run(input.fake_file, input.f);
+    job.index_job = nullptr;
+
+    job.progress.followD2V(nullptr);
+
+    if (index_job.getResult() != D2V::ProcessingFinished) {
+        job.finish(index_job.getResult() == D2V::ProcessingCancelled ? "cancelled" : "error", index_job.getError());
+        return;
+    }
+
+    QJsonObject result;
+
+    if (!options.audio_only) {
+        result["d2v"] = QString::fromStdString(index_job.getD2VPath());
+
+        if (options.frame_index)
+            result["frame_index"] = QString::fromStdString(suggestFrameIndexName(index_job.getD2VPath()));
+
+        const D2V::Stats &stats = index_job.getStats();
+
+        result["frames"] = (int)index_job.getFrameFlags().size();
+        result["gops"] = (int)index_job.getGOPs().size();
+        result["video_frames"] = stats.video_frames;
+        result["progressive_frames"] = stats.progressive_frames;
+        result["tff_frames"] = stats.tff_frames;
+        result["rff_frames"] = stats.rff_frames;
+        result["invalid_dimensions_skipped"] = stats.invalid_dimensions_skipped;
+        result["unknown_picture_types_skipped"] = stats.unknown_picture_types_skipped;
+    }
+
+    QJsonArray audio;
+
+    const std::unordered_map<int, std::string> &audio_paths = index_job.getAudioPaths();
+    const AudioDelayMap &audio_delays = index_job.getAudioDelays();
+
+    for (auto it = audio_paths.cbegin(); it != audio_paths.cend(); it++) {
+        QJsonObject track;
+        track["id"] = QString::fromStdString(hexadecimal(it->first));
+        track["path"] = QString::fromStdString(it->second);
+
+        auto delay = audio_delays.find(it->first);
+        if (delay != audio_delays.cend())
+            track["delay"] = (double)delay->second;
+
+        audio.append(track);
+    }
+
+    result["audio"] = audio;
+
+    job.finish("finished", std::string(), result);
+}
+
+
+bool serve(const std::string &socket_path, int workers, std::string &error) {
+    Server server;
+
+    if (!server.listen(socket_path, error))
+        return false;
+
+    server.run(workers);
+
+    return true;
+}
+
+
+bool runClient(const std::string &socket_path, std::string &error) {
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    if (!makeSocketAddress(socket_path, address, error))
+        return false;
+
+    int fd = connectTo(address);
+    if (fd < 0) {
+        error = "Failed to connect to '" + socket_path + "': " + strerror(errno);
+        return false;
+    }
+
+    // The server closes the connection once it has answered every job,
+    // so stop sending at the end of the input.
+    std::thread sender([fd] () {
+        std::string line;
+        while (readLine(stdin, line)) {
+            if (!sendAll(fd, makeRequestPathsAbsolute(line) + "\n"))
+                break;
+        }
+
+        shutdown(fd, SHUT_WR);
+    });
+
+    // The sender may be waiting for standard input when the server goes away.
+    sender.detach();
+
+    bool all_finished = true;
+
+    std::string buffer;
+    char chunk[4096];
+
+    while (true) {
+        ssize_t received = recv(fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            break;
+
+        fwrite(chunk, 1, received, stdout);
+        fflush(stdout);
+
+        buffer.append(chunk, received);
+
+        size_t start = 0, end;
+        while ((end = buffer.find('\n', start)) != std::string::npos) {
+            QJsonObject event = QJsonDocument::fromJson(QByteArray(buffer.data() + start, (int)(end - start))).object();
+            start = end + 1;
+
+            if (event["event"] == "error" ||
+                (event["event"] == "done" && event["result"] != "finished"))
+                all_finished = false;
+        }
+
+        buffer.erase(0, start);
+    }
+
+    if (!all_finished)
+        error = "Some jobs didn't finish.";
+
+    return all_finished;
+}
+
+#endif // _WIN32
@@ -0,0 +1,47 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_SERVER_H
+#define D2V_WITCH_SERVER_H
+
+
+#include <string>
+
+
+// Listens on a Unix domain socket and runs the jobs sent by clients, at
+// most workers at a time. Each client sends one JSON object per line and
+// receives one JSON object per line: the progress of its jobs and their
+// results. The protocol is described in the readme.
+//
+// Recently used inputs are kept open, with their streams already probed,
+// so indexing them again or asking for their tracks starts right away.
+//
+// Returns false if the server couldn't start. Otherwise it returns once a
+// client asks it to shut down.
+bool serve(const std::string &socket_path, int workers, std::string &error);
+
+// Sends the lines read from standard input to the server and prints the
+// lines received to standard output, until the server has answered every
+// job. Returns false if the connection failed or if any job didn't finish.
+bool runClient(const std::string &socket_path, std::string &error);
+
+#endif // D2V_WITCH_SERVER_H
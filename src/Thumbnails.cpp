@@ -0,0 +1,121 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QSaveFile>
+
+#include "Thumbnails.h"
+
+
+#define THUMBNAIL_CACHE_MAGIC 0x44325654 // "D2VT"
+#define THUMBNAIL_CACHE_VERSION 1
+
+
+// Indexing the same files again writes the same d2v file, so the contents
+// are compared, not the modification time.
+static QByteArray hashD2VFile(const QString &d2v_name) {
+    QFile file(d2v_name);
+    if (!file.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    if (!hash.addData(&file))
+        return QByteArray();
+
+    return hash.result();
+}
+
+
+QString thumbnailCacheName(const QString &d2v_name) {
+    return d2v_name + QStringLiteral(".thumbnails");
+}
+
+
+bool loadThumbnails(const QString &d2v_name, const QVector<int> &frames, int height, QVector<QImage> &thumbnails) {
+    QFile file(thumbnailCacheName(d2v_name));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic, version;
+    QByteArray d2v_hash;
+    qint32 thumbnail_height;
+    QVector<int> thumbnail_frames;
+
+    stream >> magic >> version;
+    if (magic != THUMBNAIL_CACHE_MAGIC || version != THUMBNAIL_CACHE_VERSION)
+        return false;
+
+    stream >> d2v_hash >> thumbnail_height >> thumbnail_frames;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+
+    if (thumbnail_height != height || thumbnail_frames != frames)
+        return false;
+
+    if (d2v_hash.isEmpty() || d2v_hash != hashD2VFile(d2v_name))
+        return false;
+
+    QVector<QImage> images;
+    stream >> images;
+    if (stream.status() != QDataStream::Ok || images.size() != frames.size())
+        return false;
+
+    thumbnails = images;
+
+    return true;
+}
+
+
+bool saveThumbnails(const QString &d2v_name, const QVector<int> &frames, int height, const QVector<QImage> &thumbnails, std::string &error) {
+    QByteArray d2v_hash = hashD2VFile(d2v_name);
+    if (d2v_hash.isEmpty()) {
+        error = "Failed to read d2v file '" + d2v_name.toStdString() + "' for the thumbnail file.";
+        return false;
+    }
+
+    // Either the whole file gets written, or nothing.
+    QSaveFile file(thumbnailCacheName(d2v_name));
+    if (!file.open(QIODevice::WriteOnly)) {
+        error = "Failed to open thumbnail file '" + file.fileName().toStdString() + "' for writing: " + file.errorString().toStdString();
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_0);
+
+    stream << (quint32)THUMBNAIL_CACHE_MAGIC << (quint32)THUMBNAIL_CACHE_VERSION;
+    stream << d2v_hash;
+    stream << (qint32)height << frames;
+    stream << thumbnails;
+
+    if (stream.status() != QDataStream::Ok || !file.commit()) {
+        error = "Failed to write thumbnail file '" + file.fileName().toStdString() + "': " + file.errorString().toStdString();
+        return false;
+    }
+
+    return true;
+}
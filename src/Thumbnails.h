@@ -0,0 +1,45 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_THUMBNAILS_H
+#define D2V_WITCH_THUMBNAILS_H
+
+
+#include <string>
+
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+
+// The thumbnails shown above the demuxing controls are kept in a file next
+// to the d2v file, so that they are only decoded once. The file is only
+// used if the d2v file has the same contents as when the thumbnails were
+// saved, and if it has thumbnails of the same height for the same frames.
+
+QString thumbnailCacheName(const QString &d2v_name);
+
+bool loadThumbnails(const QString &d2v_name, const QVector<int> &frames, int height, QVector<QImage> &thumbnails);
+
+bool saveThumbnails(const QString &d2v_name, const QVector<int> &frames, int height, const QVector<QImage> &thumbnails, std::string &error);
+
+#endif // D2V_WITCH_THUMBNAILS_H
@@ -0,0 +1,280 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+
+
+#include <cinttypes>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+#include "Trace.h"
+
+#include "Bullshit.h"
+#include "JSONProgress.h"
+
+
+std::atomic_bool trace_enabled(false);
+
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    int64_t start;
+    int64_t end;
+};
+
+
+// Only the thread itself adds events, so recording a span doesn't lock
+// anything until the buffer is full.
+struct TraceThread {
+    int id;
+    std::string name;
+    bool name_written;
+    std::vector<TraceEvent> events;
+};
+
+
+// Per thread. The events are written out when this many were recorded,
+// so long runs and the server don't keep them all in memory.
+const size_t TRACE_BUFFER_EVENTS = 4096;
+
+
+std::mutex trace_mutex;
+
+// The threads that recorded something and didn't end yet.
+std::unordered_set<TraceThread *> trace_threads;
+
+int trace_thread_count = 0;
+
+FILE *trace_file = nullptr;
+std::string trace_path;
+
+// Nothing is written after the first error.
+bool trace_failed = false;
+
+bool trace_first_event = true;
+
+int64_t trace_origin = 0;
+
+
+// Microseconds with three decimals, which is what the format wants.
+std::string traceMicroseconds(int64_t nanoseconds) {
+    if (nanoseconds < 0)
+        nanoseconds = 0;
+
+    char buffer[64] = { 0 };
+    snprintf(buffer, sizeof(buffer), "%" PRId64 ".%03d", nanoseconds / 1000, (int)(nanoseconds % 1000));
+
+    return buffer;
+}
+
+// With trace_mutex locked.
+void traceWrite(const std::string &text) {
+    if (trace_failed)
+        return;
+
+    if (fwrite(text.c_str(), 1, text.size(), trace_file) != text.size()) {
+        trace_failed = true;
+        trace_enabled = false;
+    }
+}
+
+
+// With trace_mutex locked.
+void traceAppendEvent(std::string &text, const std::string &event) {
+    if (!trace_first_event)
+        text += ",\n";
+    trace_first_event = false;
+
+    text += event;
+}
+
+
+// With trace_mutex locked. Empties the thread's buffer.
+void flushThread(TraceThread *thread) {
+    if (!trace_file || trace_failed) {
+        thread->events.clear();
+        return;
+    }
+
+    std::string tid = std::to_string(thread->id);
+
+    std::string text;
+
+    if (thread->name.size() && !thread->name_written) {
+        traceAppendEvent(text, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + tid + ",\"args\":{\"name\":" + jsonString(thread->name) + "}}");
+        thread->name_written = true;
+    }
+
+    for (size_t i = 0; i < thread->events.size(); i++) {
+        const TraceEvent &event = thread->events[i];
+
+        traceAppendEvent(text, "{\"name\":" + jsonString(event.name) + ",\"ph\":\"X\",\"pid\":1,\"tid\":" + tid +
+                               ",\"ts\":" + traceMicroseconds(event.start - trace_origin) +
+                               ",\"dur\":" + traceMicroseconds(event.end - event.start) + "}");
+    }
+
+    thread->events.clear();
+
+    traceWrite(text);
+}
+
+
+// Writes out and frees the thread's events when the thread ends.
+struct TraceThreadHolder {
+    TraceThread *thread;
+
+    TraceThreadHolder()
+        : thread(nullptr)
+    { }
+
+    ~TraceThreadHolder() {
+        if (!thread)
+            return;
+
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        flushThread(thread);
+
+        trace_threads.erase(thread);
+        delete thread;
+    }
+};
+
+
+thread_local TraceThreadHolder current_thread;
+
+
+TraceThread *getCurrentThread() {
+    if (!current_thread.thread) {
+        TraceThread *thread = new TraceThread;
+        thread->name_written = false;
+        thread->events.reserve(TRACE_BUFFER_EVENTS);
+
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        thread->id = ++trace_thread_count;
+        trace_threads.insert(thread);
+
+        current_thread.thread = thread;
+    }
+
+    return current_thread.thread;
+}
+
+} // namespace
+
+
+int64_t traceNow() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void traceRecord(const char *name, int64_t start, int64_t end) {
+    if (!trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    TraceThread *thread = getCurrentThread();
+
+    thread->events.push_back({ name, start, end });
+
+    if (thread->events.size() >= TRACE_BUFFER_EVENTS) {
+        std::lock_guard<std::mutex> lock(trace_mutex);
+
+        flushThread(thread);
+    }
+}
+
+
+void traceThreadName(const char *name) {
+    if (!trace_enabled.load(std::memory_order_relaxed))
+        return;
+
+    getCurrentThread()->name = name;
+}
+
+
+bool traceStart(const std::string &path, std::string &error) {
+#ifdef D2VWITCH_TRACING
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file) {
+        error = "Tracing was started already.";
+        return false;
+    }
+
+    trace_file = openOutputFile(path);
+    if (!trace_file) {
+        error = "Failed to open trace file '" + path + "': " + strerror(errno);
+        return false;
+    }
+
+    trace_path = path;
+    trace_origin = traceNow();
+    trace_failed = false;
+    trace_first_event = true;
+
+    traceWrite("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    trace_enabled = !trace_failed;
+
+    return true;
+#else
+    (void)path;
+
+    error = "This build of D2V Witch doesn't support tracing.";
+    return false;
+#endif
+}
+
+
+bool traceFinish(std::string &error) {
+    trace_enabled = false;
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (!trace_file)
+        return true;
+
+    // The threads that ended wrote theirs already.
+    for (auto it = trace_threads.begin(); it != trace_threads.end(); it++)
+        flushThread(*it);
+
+    traceWrite("\n]}\n");
+
+    bool okay = !trace_failed && !ferror(trace_file);
+
+    if (fclose(trace_file))
+        okay = false;
+    trace_file = nullptr;
+
+    if (!okay) {
+        error = "Failed to write trace file '" + trace_path + "'.";
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,101 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+
+
+#ifndef D2V_WITCH_TRACE_H
+#define D2V_WITCH_TRACE_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+
+// Records spans of time, per thread, and writes them as Chrome trace
+// events, which chrome://tracing and Perfetto can display.
+//
+// Use the macros below instead of the functions, so that a build without
+// D2VWITCH_TRACING doesn't contain any tracing code in the hot paths.
+
+
+// Opens the trace file and starts recording. Each thread writes its spans
+// to the file every few thousand spans, and when it ends.
+bool traceStart(const std::string &path, std::string &error);
+
+// Stops recording, writes the spans not written yet, and closes the file.
+// The threads that recorded them must not be running anymore. Fails if
+// any write failed, in which case the rest of the trace was dropped.
+bool traceFinish(std::string &error);
+
+// Names the calling thread in the trace.
+void traceThreadName(const char *name);
+
+// Nanoseconds.
+int64_t traceNow();
+
+void traceRecord(const char *name, int64_t start, int64_t end);
+
+
+extern std::atomic_bool trace_enabled;
+
+
+// The name must be a string literal, or at least outlive the trace.
+class TraceSpan {
+    const char *name;
+    int64_t start;
+
+public:
+    explicit TraceSpan(const char *_name)
+        : name(_name)
+        , start(trace_enabled.load(std::memory_order_relaxed) ? traceNow() : -1)
+    { }
+
+    ~TraceSpan() {
+        if (start >= 0)
+            traceRecord(name, start, traceNow());
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+
+#ifdef D2VWITCH_TRACING
+
+#define TRACE_CONCATENATE_(a, b) a##b
+#define TRACE_CONCATENATE(a, b) TRACE_CONCATENATE_(a, b)
+
+// Records the time from here until the end of the enclosing scope.
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCATENATE(trace_span_, __LINE__)(name)
+
+#define TRACE_THREAD_NAME(name) traceThreadName(name)
+
+#else
+
+#define TRACE_SPAN(name) do { } while (0)
+
+#define TRACE_THREAD_NAME(name) do { } while (0)
+
+#endif // D2VWITCH_TRACING
+
+#endif // D2V_WITCH_TRACE_H
@@ -0,0 +1,92 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#include <QDir>
+#include <QFileInfo>
+#include <QRegExp>
+
+#include "VOBSequence.h"
+
+
+#define VOB_SEQUENCE_PATTERN "vts_[0-9][0-9]_[1-9].vob"
+
+
+static QStringList listVOBSequence(const QDir &folder, const QString &name) {
+    QStringList entries = folder.entryList(QStringList(QStringLiteral(VOB_SEQUENCE_PATTERN)), QDir::Files, QDir::Name | QDir::IgnoreCase);
+
+    QStringList sequence;
+
+    for (int i = 0; i < entries.size(); i++) {
+        if (entries[i].midRef(4, 2) == name.midRef(4, 2))
+            sequence.push_back(entries[i]);
+    }
+
+    return sequence;
+}
+
+
+bool isVOBSequenceName(const std::string &path) {
+    QRegExp pattern(QStringLiteral(VOB_SEQUENCE_PATTERN), Qt::CaseInsensitive, QRegExp::Wildcard);
+
+    return pattern.exactMatch(QFileInfo(QString::fromStdString(path)).fileName());
+}
+
+
+std::vector<std::string> findFollowingVOBs(const std::string &path) {
+    QFileInfo info(QString::fromStdString(path));
+
+    QDir input_dir = info.dir();
+
+    QString name = info.fileName();
+
+    QStringList entries = listVOBSequence(input_dir, name);
+
+    std::vector<std::string> following;
+
+    int index = entries.indexOf(name);
+
+    if (index > -1) {
+        for (int i = index + 1; i < entries.size(); i++)
+            following.push_back(input_dir.absoluteFilePath(entries[i]).toStdString());
+    }
+
+    return following;
+}
+
+
+std::vector<std::string> findVOBSequence(const std::string &path) {
+    std::vector<std::string> sequence;
+
+    if (!isVOBSequenceName(path))
+        return sequence;
+
+    QFileInfo info(QString::fromStdString(path));
+
+    QDir input_dir = info.dir();
+
+    QStringList entries = listVOBSequence(input_dir, info.fileName());
+
+    for (int i = 0; i < entries.size(); i++)
+        sequence.push_back(input_dir.absoluteFilePath(entries[i]).toStdString());
+
+    return sequence;
+}
@@ -0,0 +1,45 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_VOBSEQUENCE_H
+#define D2V_WITCH_VOBSEQUENCE_H
+
+
+#include <string>
+#include <vector>
+
+
+// DVDs split each title set into files called "VTS_xx_y.VOB", which are
+// meant to be indexed together. The names are compared case-insensitively.
+
+// Returns true if the name of the file follows the pattern.
+bool isVOBSequenceName(const std::string &path);
+
+// Returns the files of the same title set that come after path, sorted by
+// name, with absolute paths.
+std::vector<std::string> findFollowingVOBs(const std::string &path);
+
+// Returns all the files of the same title set as path, sorted by name,
+// with absolute paths. Empty if the name doesn't follow the pattern.
+std::vector<std::string> findVOBSequence(const std::string &path);
+
+#endif // D2V_WITCH_VOBSEQUENCE_H
@@ -0,0 +1,634 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+}
+
+#include "Bullshit.h"
+#include "D2V.h"
+#include "FakeFile.h"
+#include "FFMPEG.h"
+#include "IndexJob.h"
+#include "JSONProgress.h"
+#include "Trace.h"
+#include "VOBSequence.h"
+#include "Watch.h"
+
+
+#ifndef __linux__
+
+bool watchFolder(const WatchOptions &, std::string &error) {
+    error = "Watching a folder is only possible on Linux.";
+    return false;
+}
+
+#else
+
+// Anything else written to the folder is ignored, including the files
+// written by the jobs.
+static const char *video_extensions[] = {
+    "m1v", "m2p", "m2t", "m2ts", "m2v", "mpeg", "mpg", "mpv", "mts",
+    "ps", "tp", "trp", "ts", "vob"
+};
+
+
+static bool isVideoFileName(const std::string &name) {
+    size_t last_dot = name.find_last_of('.');
+    if (last_dot == std::string::npos)
+        return false;
+
+    std::string extension = name.substr(last_dot + 1);
+    for (size_t i = 0; i < extension.size(); i++)
+        extension[i] = std::tolower((unsigned char)extension[i]);
+
+    for (size_t i = 0; i < sizeof(video_extensions) / sizeof(video_extensions[0]); i++)
+        if (extension == video_extensions[i])
+            return true;
+
+    return false;
+}
+
+
+static volatile sig_atomic_t stop_watching = 0;
+
+
+static void stopWatching(int) {
+    stop_watching = 1;
+}
+
+
+typedef std::chrono::steady_clock Clock;
+
+
+// A file that was created or modified and not closed yet.
+struct WrittenFile {
+    int64_t size;
+    Clock::time_point last_change;
+};
+
+
+// A VOB sequence waiting for its next file.
+struct SettlingSequence {
+    std::string path;
+    Clock::time_point ready;
+};
+
+
+class FolderWatcher;
+
+
+struct WatchJob {
+    // The first one is also the job's name.
+    std::vector<std::string> inputs;
+
+    FolderWatcher *watcher;
+
+    std::atomic_bool cancel_requested;
+
+    JSONProgress progress;
+
+    // While indexing, for the phase.
+    const IndexJob *index_job;
+
+    WatchJob(const std::vector<std::string> &_inputs, FolderWatcher *_watcher);
+
+    static void progressFunction(int64_t current_position, int64_t total_size, void *progress_data);
+
+    static void logFunction(const std::string &message, void *log_data);
+};
+
+
+class FolderWatcher {
+    const WatchOptions &options;
+
+    // Protects everything below, and standard error.
+    std::mutex mutex;
+    std::condition_variable queue_changed;
+
+    std::deque<std::vector<std::string>> queue;
+
+    // Jobs are known by their first input. The same files are never
+    // indexed twice at the same time.
+    std::unordered_set<std::string> queued;
+    std::unordered_set<std::string> running;
+
+    std::unordered_set<WatchJob *> running_jobs;
+
+    bool stopping;
+
+    std::vector<std::thread> workers;
+
+    void runJob(WatchJob &job);
+
+    void work();
+
+public:
+    explicit FolderWatcher(const WatchOptions &_options)
+        : options(_options)
+        , stopping(false)
+    { }
+
+    void start();
+
+    void enqueue(const std::vector<std::string> &inputs);
+
+    // Cancels the running jobs and waits for them.
+    void stop();
+
+    // With the mutex locked.
+    void writeError(const std::string &line) {
+        fprintf(stderr, "%s\n", line.c_str());
+        fflush(stderr);
+    }
+
+    void writeMessage(const std::string &line) {
+        if (options.quiet)
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        writeError(line);
+    }
+
+    bool isReportingJSON() const {
+        return options.json_progress && !options.quiet;
+    }
+
+    static void writeFunction(const std::string &line, void *write_data) {
+        FolderWatcher *watcher = (FolderWatcher *)write_data;
+
+        std::lock_guard<std::mutex> lock(watcher->mutex);
+
+        watcher->writeError(line);
+    }
+};
+
+
+WatchJob::WatchJob(const std::vector<std::string> &_inputs, FolderWatcher *_watcher)
+    : inputs(_inputs)
+    , watcher(_watcher)
+    , cancel_requested(false)
+    , progress(FolderWatcher::writeFunction, _watcher, _inputs[0])
+    , index_job(nullptr)
+{ }
+
+
+void WatchJob::progressFunction(int64_t current_position, int64_t total_size, void *progress_data) {
+    WatchJob *job = (WatchJob *)progress_data;
+
+    job->progress.followD2V(job->index_job->getD2V());
+    job->progress.report(current_position, total_size);
+}
+
+
+void WatchJob::logFunction(const std::string &message, void *log_data) {
+    WatchJob *job = (WatchJob *)log_data;
+
+    if (job->watcher->isReportingJSON())
+        job->progress.log(message);
+    else
+        job->watcher->writeMessage("'" + job->inputs[0] + "': " + message);
+}
+
+
+void FolderWatcher::start() {
+    for (int i = 0; i < options.jobs; i++)
+        workers.push_back(std::thread(&FolderWatcher::work, this));
+}
+
+
+void FolderWatcher::enqueue(const std::vector<std::string> &inputs) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (queued.count(inputs[0]))
+        return;
+
+    queued.insert(inputs[0]);
+    queue.push_back(inputs);
+
+    queue_changed.notify_all();
+}
+
+
+void FolderWatcher::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        stopping = true;
+
+        for (auto it = running_jobs.begin(); it != running_jobs.end(); it++)
+            (*it)->cancel_requested = true;
+
+        queue_changed.notify_all();
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+
+void FolderWatcher::work() {
+    TRACE_THREAD_NAME("watch worker");
+
+    while (true) {
+        std::vector<std::string> inputs;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+
+            // The first job whose files aren't being indexed already.
+            auto next = queue.end();
+
+            queue_changed.wait(lock, [this, &next] () -> bool {
+                if (stopping)
+                    return true;
+
+                next = std::find_if(queue.begin(), queue.end(), [this] (const std::vector<std::string> &job_inputs) -> bool {
+                    return !running.count(job_inputs[0]);
+                });
+
+                return next != queue.end();
+            });
+
+            if (stopping)
+                return;
+
+            inputs = *next;
+            queue.erase(next);
+
+            queued.erase(inputs[0]);
+            running.insert(inputs[0]);
+        }
+
+        WatchJob job(inputs, this);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            running_jobs.insert(&job);
+            if (stopping)
+                job.cancel_requested = true;
+        }
+
+        runJob(job);
+
+        std::lock_guard<std::mutex> lock(mutex);
+
+        running_jobs.erase(&job);
+        running.erase(inputs[0]);
+
+        // Another worker may be waiting for these files.
+        queue_changed.notify_all();
+    }
+}
+
+
+void FolderWatcher::runJob(WatchJob &job) {
+    TRACE_SPAN("watch job");
+
+    const std::string &name = job.inputs[0];
+
+    bool reporting_json = isReportingJSON();
+
+    if (reporting_json)
+        job.progress.startPhase("probe");
+    else if (job.inputs.size() > 1)
+        writeMessage("Indexing '" + name + "' and the " + std::to_string(job.inputs.size() - 1) + " files after it.");
+    else
+        writeMessage("Indexing '" + name + "'.");
+
+    std::string error;
+    std::string d2v_path;
+
+    FakeFile fake_file;
+    for (size_t i = 0; i < job.inputs.size(); i++)
+        fake_file.push_back(job.inputs[i]);
+
+    // f reads from fake_file, so it must be destroyed first.
+    FFMPEG f;
+
+    IndexJobOptions job_options = options.job_options;
+    job_options.d2v_path.clear();
+    job_options.progress_report = reporting_json ? WatchJob::progressFunction : nullptr;
+    job_options.progress_data = &job;
+    job_options.log_message = WatchJob::logFunction;
+    job_options.log_data = &job;
+    job_options.cancel_flag = &job.cancel_requested;
+
+    IndexJob index_job(job_options);
+
+    if (!fake_file.open()) {
+        error = fake_file.getError();
+    } else if (!f.initFormat(fake_file, &job.cancel_requested)) {
+        error = f.getError();
+    } else if (D2V::getStreamType(f.fctx->iformat->name) == D2V::UNSUPPORTED_STREAM) {
+        error = std::string("Unsupported container type '") + (f.fctx->iformat->long_name ? f.fctx->iformat->long_name : f.fctx->iformat->name) + "'.";
+    } else {
+        job.index_job = &index_job;
+        index_job.run(fake_file, f);
+        job.index_job = nullptr;
+
+        job.progress.followD2V(nullptr);
+
+        if (index_job.getResult() != D2V::ProcessingFinished)
+            error = index_job.getError();
+        else if (!job_options.audio_only)
+            d2v_path = index_job.getD2VPath();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Jobs are only cancelled when stopping.
+        if (stopping)
+            return;
+    }
+
+    if (reporting_json) {
+        std::string line = "{\"job\":" + jsonString(name) + ",\"event\":\"done\",\"result\":";
+
+        if (error.size())
+            line += "\"error\",\"error\":" + jsonString(error);
+        else
+            line += "\"finished\"";
+
+        if (d2v_path.size())
+            line += ",\"d2v\":" + jsonString(d2v_path);
+
+        line += "}";
+
+        writeFunction(line, this);
+    } else if (error.size()) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Errors are printed even with --quiet.
+        writeError("Failed to index '" + name + "': " + error);
+    } else if (d2v_path.size()) {
+        writeMessage("Wrote '" + d2v_path + "'.");
+    } else {
+        writeMessage("Wrote the audio files of '" + name + "'.");
+    }
+}
+
+
+// VOB sequences are waited for under one name, whichever file completes.
+static std::string getSequenceKey(const std::string &path) {
+    size_t last_separator = path.find_last_of('/');
+
+    // "vts_xx"
+    std::string key = path.substr(0, last_separator + 7);
+
+    for (size_t i = last_separator + 1; i < key.size(); i++)
+        key[i] = std::tolower((unsigned char)key[i]);
+
+    return key;
+}
+
+
+// When inotify drops events, the video files modified since the last
+// events that were read are treated as if they were being written.
+static void rescanFolder(const std::string &folder, int64_t since, std::unordered_map<std::string, WrittenFile> &written_files) {
+    DIR *dir = opendir(folder.c_str());
+    if (!dir)
+        return;
+
+    Clock::time_point now = Clock::now();
+
+    dirent *entry;
+    while ((entry = readdir(dir))) {
+        std::string path = folder + "/" + entry->d_name;
+
+        if (!isVideoFileName(path) || written_files.count(path))
+            continue;
+
+        struct stat info;
+        if (stat(path.c_str(), &info) || !S_ISREG(info.st_mode) || info.st_mtime < since)
+            continue;
+
+        WrittenFile &file = written_files[path];
+        file.size = info.st_size;
+        file.last_change = now;
+    }
+
+    closedir(dir);
+}
+
+
+bool watchFolder(const WatchOptions &options, std::string &error) {
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        error = std::string("Failed to start watching: ") + strerror(errno);
+        return false;
+    }
+
+    // Created, written, closed after writing, or moved in. The rest are
+    // only to stop waiting for files that went away.
+    uint32_t mask = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+    if (inotify_add_watch(inotify_fd, options.folder.c_str(), mask) < 0) {
+        error = "Failed to watch '" + options.folder + "': " + strerror(errno);
+        close(inotify_fd);
+        return false;
+    }
+
+    signal(SIGINT, stopWatching);
+    signal(SIGTERM, stopWatching);
+
+    FolderWatcher watcher(options);
+    watcher.start();
+
+    watcher.writeMessage("Watching '" + options.folder + "'.");
+
+    std::chrono::seconds settle_time(options.settle_seconds);
+
+    std::unordered_map<std::string, WrittenFile> written_files;
+    std::unordered_map<std::string, SettlingSequence> settling_sequences;
+
+    // Aligned like the events inside it.
+    union {
+        inotify_event event;
+        char bytes[64 * 1024];
+    } buffer;
+
+    // In seconds since the epoch, like the modification times.
+    int64_t previous_read_time = time(nullptr);
+
+    while (!stop_watching) {
+        pollfd fds = { inotify_fd, POLLIN, 0 };
+
+        // Wakes up every second to check the files being written.
+        if (poll(&fds, 1, 1000) < 0 && errno != EINTR) {
+            error = std::string("Failed to wait for changes: ") + strerror(errno);
+            break;
+        }
+
+        std::vector<std::string> completed_files;
+
+        int64_t read_time = time(nullptr);
+        bool overflowed = false;
+
+        ssize_t length;
+        while ((length = read(inotify_fd, buffer.bytes, sizeof(buffer.bytes))) > 0) {
+            for (char *position = buffer.bytes; position < buffer.bytes + length; ) {
+                const inotify_event *event = (const inotify_event *)position;
+                position += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW) {
+                    overflowed = true;
+                    continue;
+                }
+
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    error = "The folder '" + options.folder + "' went away.";
+                    stop_watching = 1;
+                    break;
+                }
+
+                if (!event->len)
+                    continue;
+
+                std::string path = options.folder + "/" + event->name;
+
+                if ((event->mask & IN_ISDIR) || !isVideoFileName(path))
+                    continue;
+
+                if (event->mask & (IN_CREATE | IN_MODIFY)) {
+                    WrittenFile &file = written_files[path];
+                    file.size = getFileSize(path.c_str());
+                    file.last_change = Clock::now();
+                } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    written_files.erase(path);
+                    completed_files.push_back(path);
+                } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                    written_files.erase(path);
+                }
+            }
+        }
+
+        // The modification times only have a resolution of one second.
+        if (overflowed) {
+            watcher.writeMessage("Too many changes in '" + options.folder + "', looking for the files that were written.");
+            rescanFolder(options.folder, previous_read_time - 1, written_files);
+        }
+
+        previous_read_time = read_time;
+
+        Clock::time_point now = Clock::now();
+
+        // The writer may have stopped without closing the file, or the
+        // changes may come from another machine, which inotify doesn't see.
+        for (auto it = written_files.begin(); it != written_files.end(); ) {
+            int64_t size = getFileSize(it->first.c_str());
+
+            if (size != it->second.size) {
+                it->second.size = size;
+                it->second.last_change = now;
+                it++;
+            } else if (now - it->second.last_change >= settle_time) {
+                completed_files.push_back(it->first);
+                it = written_files.erase(it);
+            } else {
+                it++;
+            }
+        }
+
+        for (size_t i = 0; i < completed_files.size(); i++) {
+            const std::string &path = completed_files[i];
+
+            if (getFileSize(path.c_str()) <= 0)
+                continue;
+
+            if (isVOBSequenceName(path)) {
+                SettlingSequence &sequence = settling_sequences[getSequenceKey(path)];
+                sequence.path = path;
+                sequence.ready = now + settle_time;
+            } else {
+                watcher.enqueue({ path });
+            }
+        }
+
+        // Indexed once no file of the sequence was written for a while.
+        for (auto it = settling_sequences.begin(); it != settling_sequences.end(); ) {
+            if (now < it->second.ready) {
+                it++;
+                continue;
+            }
+
+            std::vector<std::string> sequence = findVOBSequence(it->second.path);
+
+            // Deleted meanwhile.
+            if (sequence.empty()) {
+                it = settling_sequences.erase(it);
+                continue;
+            }
+
+            bool still_written = false;
+            for (size_t i = 0; i < sequence.size(); i++)
+                if (written_files.count(sequence[i]))
+                    still_written = true;
+
+            if (still_written) {
+                it->second.ready = now + settle_time;
+                it++;
+            } else {
+                watcher.enqueue(sequence);
+                it = settling_sequences.erase(it);
+            }
+        }
+    }
+
+    watcher.stop();
+
+    close(inotify_fd);
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    return error.empty();
+}
+
+#endif // __linux__
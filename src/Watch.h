@@ -0,0 +1,70 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+#ifndef D2V_WITCH_WATCH_H
+#define D2V_WITCH_WATCH_H
+
+
+#include <string>
+
+#include "IndexJob.h"
+
+
+struct WatchOptions {
+    std::string folder;
+
+    // A file that is still open for writing counts as complete once its
+    // size stops changing for this long. VOB sequences also wait this long
+    // for the next file to appear.
+    int settle_seconds;
+
+    // Index at most this many files or sequences at the same time.
+    int jobs;
+
+    bool quiet;
+    bool json_progress;
+
+    // How to index every file. The output names, the callbacks, and the
+    // cancellation flag are filled in for each job.
+    IndexJobOptions job_options;
+
+    WatchOptions()
+        : folder{ }
+        , settle_seconds(10)
+        , jobs(2)
+        , quiet(false)
+        , json_progress(false)
+        , job_options{ }
+    { }
+};
+
+
+// Indexes the video files that are written or moved into the folder, with
+// the outputs next to them. Files called "VTS_xx_y.VOB" are indexed
+// together with the rest of their sequence. Files that were already in
+// the folder are left alone.
+//
+// Returns false if the folder can't be watched. Otherwise it returns after
+// SIGINT or SIGTERM, once the running jobs are cancelled.
+bool watchFolder(const WatchOptions &options, std::string &error);
+
+#endif // D2V_WITCH_WATCH_H
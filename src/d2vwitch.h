@@ -0,0 +1,220 @@
+/*
+
+Copyright (c) 2016, John Smith
+
+Permission to use, copy, modify, and/or distribute this software for
+any purpose with or without fee is hereby granted, provided that the
+above copyright notice and this permission notice appear in all copies.
+
+THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR
+BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES
+OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS,
+WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS
+SOFTWARE.
+
+*/
+
+
+
+
+// The C interface of libd2vwitch. One job indexes one set of input files
+// into one d2v file, and optionally demuxes some audio tracks, the same way
+// the d2vwitch program does.
+//
+// A job is used like this:
+//
+//     d2vwitch_job_new
+//     d2vwitch_job_add_input, once for each input file, in order
+//     d2vwitch_job_open
+//     d2vwitch_job_get_num_streams and d2vwitch_job_get_stream, optionally
+//     d2vwitch_job_set_*, optionally
+//     d2vwitch_job_index
+//     d2vwitch_job_get_num_frames, d2vwitch_job_get_gop, etc.
+//     d2vwitch_job_free
+//
+// The functions that return int return D2VWITCH_OK on success. After an
+// error d2vwitch_job_get_error describes what went wrong. Different jobs
+// may be used from different threads at the same time, but each job must
+// only be used by one thread at a time, except for d2vwitch_job_cancel.
+//
+// Stream ids are the ids of the tracks in the container, e.g. the PIDs in
+// a transport stream, as printed by "d2vwitch --info".
+
+
+#ifndef D2VWITCH_H
+#define D2VWITCH_H
+
+#include <stdint.h>
+
+
+#if defined(_WIN32) && !defined(D2VWITCH_STATIC)
+#ifdef D2VWITCH_BUILDING
+#define D2VWITCH_API __declspec(dllexport)
+#else
+#define D2VWITCH_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define D2VWITCH_API __attribute__((visibility("default")))
+#else
+#define D2VWITCH_API
+#endif
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+// Incremented whenever something in this file changes.
+#define D2VWITCH_API_VERSION 1
+
+
+typedef struct D2VWitchJob D2VWitchJob;
+
+
+enum D2VWitchStatus {
+    D2VWITCH_OK = 0,
+    D2VWITCH_ERROR = 1,
+    D2VWITCH_CANCELLED = 2
+};
+
+
+// What the progress callback is counting.
+enum D2VWitchPhase {
+    D2VWITCH_PHASE_READING = 0,     // Bytes of input.
+    D2VWITCH_PHASE_VERIFYING = 1,   // GOPs, while testing the keyframe locations.
+    D2VWITCH_PHASE_WRITING = 2      // GOPs, while writing the d2v file.
+};
+
+
+enum D2VWitchOption {
+    // 0: limited (the default), 1: full.
+    D2VWITCH_OPTION_INPUT_RANGE = 0,
+
+    // 0: absolute paths in the d2v file (the default), 1: relative to the d2v file.
+    D2VWITCH_OPTION_RELATIVE_PATHS = 1,
+
+    // 0: read and parse in one thread (the default), 1: in separate threads.
+    D2VWITCH_OPTION_PIPELINED = 2,
+
+    // 0: write the audio files in the reading thread, 1: one thread per
+    // audio track (the default).
+    D2VWITCH_OPTION_AUDIO_THREADS = 3,
+
+    // 0: no frame index (the default), 1: also write the binary frame
+    // index next to the d2v file.
+    D2VWITCH_OPTION_FRAME_INDEX = 4
+};
+
+
+enum D2VWitchStreamType {
+    D2VWITCH_STREAM_OTHER = 0,
+    D2VWITCH_STREAM_VIDEO = 1,
+    D2VWITCH_STREAM_AUDIO = 2
+};
+
+
+typedef struct D2VWitchStreamInfo {
+    int id;
+    int type;               // D2VWitchStreamType
+    const char *codec;      // libavcodec's name. Valid until the job is freed.
+} D2VWitchStreamInfo;
+
+
+typedef struct D2VWitchGOP {
+    int64_t position;       // Position of the GOP in its file.
+    int first_frame;
+    int num_frames;
+    int file;               // Index of the file in the order they were added.
+    int closed;             // Non-zero if the GOP is closed.
+    int info;               // The d2v info field.
+} D2VWitchGOP;
+
+
+// current and total are counted as described in D2VWitchPhase.
+typedef void (*D2VWitchProgressCallback)(int phase, int64_t current, int64_t total, void *user_data);
+
+// Warnings and other messages about the input.
+typedef void (*D2VWitchLogCallback)(const char *message, void *user_data);
+
+
+// Returns D2VWITCH_API_VERSION as it was when the library was compiled.
+D2VWITCH_API int d2vwitch_get_api_version(void);
+
+D2VWITCH_API D2VWitchJob *d2vwitch_job_new(void);
+
+D2VWITCH_API void d2vwitch_job_free(D2VWitchJob *job);
+
+// Empty if there was no error.
+D2VWITCH_API const char *d2vwitch_job_get_error(const D2VWitchJob *job);
+
+// Only before d2vwitch_job_open.
+D2VWITCH_API int d2vwitch_job_add_input(D2VWitchJob *job, const char *path);
+
+// Opens the input files and probes the streams.
+D2VWITCH_API int d2vwitch_job_open(D2VWitchJob *job);
+
+D2VWITCH_API int d2vwitch_job_get_num_streams(const D2VWitchJob *job);
+
+D2VWITCH_API int d2vwitch_job_get_stream(const D2VWitchJob *job, int index, D2VWitchStreamInfo *info);
+
+// By default the first video stream is indexed.
+D2VWITCH_API int d2vwitch_job_set_video_id(D2VWitchJob *job, int id);
+
+// By default no audio is demuxed. If count is negative all audio tracks
+// are demuxed and ids is ignored.
+D2VWITCH_API int d2vwitch_job_set_audio_ids(D2VWitchJob *job, const int *ids, int count);
+
+// By default the d2v file is named after the first input file. The audio
+// files are named after the d2v file.
+D2VWITCH_API int d2vwitch_job_set_output(D2VWitchJob *job, const char *d2v_path);
+
+D2VWITCH_API int d2vwitch_job_set_option(D2VWitchJob *job, int option, int value);
+
+// Either may be NULL. The callbacks are called during d2vwitch_job_index,
+// but not always from the thread that called it: with
+// D2VWITCH_OPTION_PIPELINED, progress and log messages come from the
+// parsing thread, and with D2VWITCH_OPTION_AUDIO_THREADS, log messages
+// also come from the audio threads. Calls may overlap, so the callbacks
+// must be thread-safe.
+D2VWITCH_API void d2vwitch_job_set_callbacks(D2VWitchJob *job, D2VWitchProgressCallback progress, D2VWitchLogCallback log, void *user_data);
+
+// Writes the d2v file and the audio files. Only once per job. Returns
+// D2VWITCH_CANCELLED if d2vwitch_job_cancel was called. The input files
+// are closed afterwards, whatever the result.
+D2VWITCH_API int d2vwitch_job_index(D2VWitchJob *job);
+
+// May be called from any thread, e.g. from a progress callback.
+D2VWITCH_API void d2vwitch_job_cancel(D2VWitchJob *job);
+
+// The rest are only useful after d2vwitch_job_index succeeded.
+
+D2VWITCH_API const char *d2vwitch_job_get_output(const D2VWitchJob *job);
+
+D2VWITCH_API int d2vwitch_job_get_num_frames(const D2VWitchJob *job);
+
+D2VWITCH_API int d2vwitch_job_get_num_gops(const D2VWitchJob *job);
+
+D2VWITCH_API int d2vwitch_job_get_gop(const D2VWitchJob *job, int gop, D2VWitchGOP *info);
+
+// Returns -1 if the frame doesn't exist.
+D2VWITCH_API int d2vwitch_job_get_frame_gop(const D2VWitchJob *job, int frame);
+
+// The d2v flags field of the frame, or -1 if the frame doesn't exist.
+D2VWITCH_API int d2vwitch_job_get_frame_flags(const D2VWitchJob *job, int frame);
+
+// Returns NULL if the audio track with this id wasn't demuxed.
+D2VWITCH_API const char *d2vwitch_job_get_audio_path(const D2VWitchJob *job, int id);
+
+// In milliseconds.
+D2VWITCH_API int d2vwitch_job_get_audio_delay(const D2VWitchJob *job, int id, int64_t *delay);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // D2VWITCH_H